@@ -39,6 +39,15 @@ void  getNonce4Amal( int which , Nonce_t  value )
 	}
 }
 	
+//-----------------------------------------------------------------------------
+static uint64_t nowNs( void )
+{
+    struct timespec ts ;
+
+    clock_gettime( CLOCK_MONOTONIC , &ts ) ;
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec ;
+}
+
 //*************************************
 // The Main Loop
 //*************************************
@@ -62,20 +71,33 @@ int main ( int argc , char * argv[] )
     fd_B2A    = atoi(argv[3]);  // Read from Basim  File Descriptor
     fd_A2B    = atoi(argv[4]);  // Send to   Basim  File Descriptor
 
-    log = fopen("amal/logAmal.txt" , "w" );
+    // All parties must agree on how MSG2 .. MSG5 are encrypted
+    // ( AES-CBC unless the dispatcher exported CIPHER_MODE=gcm )
+    setCipherModeFromEnv() ;
+
+    // Log levels below LOG_LEVEL=... are skipped ( those below -DLOG_LEVEL are not even built )
+    setLogLevelFromEnv() ;
+
+    // Latency histograms, when built with -DMYCRYPTO_STATS ( also dumped on SIGUSR1 )
+    stats_install( "amal/statsAmal.txt" ) ;
+
+    log = logOpen( "amal/logAmal.txt" );
     if( ! log )
     {
         fprintf( stderr , "\nAmal's  %s. Could not create my log file\n" , developerName  ) ;
         exit(-1) ;
     }
 
-    BANNER( log ) ;
-    fprintf( log , "Starting Amal\n" ) ;
-    BANNER( log ) ;
+    if ( LOG_ON( LOG_INFO ) )
+    {
+        BANNER( log ) ;
+        fprintf( log , "Starting Amal\n" ) ;
+        BANNER( log ) ;
 
-    fprintf( log , "\n<readFr. KDC> FD=%d , <sendTo KDC> FD=%d , "
-                   "<readFr. Basim> FD=%d , <sendTo Basim> FD=%d\n" , 
-                   fd_K2A , fd_A2K , fd_B2A , fd_A2B );
+        fprintf( log , "\n<readFr. KDC> FD=%d , <sendTo KDC> FD=%d , "
+                       "<readFr. Basim> FD=%d , <sendTo Basim> FD=%d\n" , 
+                       fd_K2A , fd_A2K , fd_B2A , fd_A2B );
+    }
 
     // Get Amal's master key with the KDC
     myKey_t  Ka ;  // Amal's master key with the KDC
@@ -92,196 +114,317 @@ int main ( int argc , char * argv[] )
         fprintf(log, "\nCould not get Amal's Masker key & IV.\n");
         exit(-1);
     }
-    fprintf( log , "\n" );
-	// BIO_dump the IV indented 4 spaces to the right
-    fprintf( log , "Amal has this Master Ka { key , IV }\n" );
-    BIO_dump_indent_fp(log, (const char *)Ka.key, SYMMETRIC_KEY_LEN, 4);
-    fprintf( log , "\n" );
-    BIO_dump_indent_fp(log, (const char *)Ka.iv, INITVECTOR_LEN, 4);
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log , "\n" );
+        // BIO_dump the IV indented 4 spaces to the right
+        fprintf( log , "Amal has this Master Ka { key , IV }\n" );
+        logDump(log, (const char *)Ka.key, SYMMETRIC_KEY_LEN, 4);
+        fprintf( log , "\n" );
+        logDump(log, (const char *)Ka.iv, INITVECTOR_LEN, 4);
+    }
     
 
     // Get Amal's pre-created Nonces: Na and Na2
 	Nonce_t   Na , Na2; 
-    fprintf( log , "\nAmal will use these Nonces:  Na  and Na2\n"  ) ;
 	// Use getNonce4Amal () to get Amal's 1st and second nonces into Na and Na2, respectively
     getNonce4Amal(1, Na);
     getNonce4Amal(2, Na2);
     
-	// BIO_dump Na indented 4 spaces to the right
-    BIO_dump_indent_fp(log, (const char *)Na, NONCELEN, 4);
-    fprintf( log , "\n" );
-	// BIO_dump Na2 indented 4 spaces to the right
-    BIO_dump_indent_fp(log, (const char *)Na2, NONCELEN, 4);
-    fprintf( log , "\n") ; 
-
-    fflush( log ) ;
-
-    //*************************************
-    // Construct & Send    Message 1
-    //*************************************
-    BANNER( log ) ;
-    fprintf( log , "         MSG1 New\n");
-    BANNER( log ) ;
-
-    char *IDa = "Amal is Hope", *IDb = "Basim is Smily" ;
-    unsigned  LenMsg1 ;
-    uint8_t  *msg1 ;
-    LenMsg1 = MSG1_new( log , &msg1 , IDa , IDb , Na ) ;
-    
-    // Send MSG1 to KDC via the appropriate pipe
-    if (write(fd_A2K, msg1, LenMsg1) != LenMsg1)
+    if ( LOG_ON( LOG_DEBUG ) )
     {
-        fprintf(stderr, "\nCould not write MSG1 to KDC.\n");
-        fprintf(log, "\nCould not write MSG1 to KDC.\n");
-        exit(-1);
+        fprintf( log , "\nAmal will use these Nonces:  Na  and Na2\n"  ) ;
+        // BIO_dump Na indented 4 spaces to the right
+        logDump(log, (const char *)Na, NONCELEN, 4);
+        fprintf( log , "\n" );
+        // BIO_dump Na2 indented 4 spaces to the right
+        logDump(log, (const char *)Na2, NONCELEN, 4);
+        fprintf( log , "\n") ; 
     }
 
-   fprintf( log , "Amal sent message 1 ( %d bytes ) to the KDC with:\n    "
-                   "IDa ='%s'\n    "
-                   "IDb = '%s'\n" , LenMsg1 , IDa , IDb ) ;
-    fprintf( log , "    Na ( %lu Bytes ) is:\n" , NONCELEN ) ;
-    // BIO_dump the nonce Na
-    BIO_dump_indent_fp(log, (const char *)Na, NONCELEN, 4);
-    fprintf( log , "\n") ; 
-    fflush( log ) ;
-
-    // Deallocate any memory allocated for msg1
-    free(msg1);
-
-    //*************************************
-    // Receive   &   Process Message 2
-    //*************************************
-	// PA-04 Part Two
-    BANNER ( log ) ;
-    fprintf( log , "         MSG2 Receive\n");
-    BANNER ( log ) ;
-    fflush ( log ) ;
-
-    // Get MSG2 from KDC
-    myKey_t  Ks ;
+    LOG_FLUSH( log ) ;
 
-    unsigned LenTktCiph = 0;
-    uint8_t *tktCipher ;
+    // Benchmark mode ( "dispatcher -b K" ): K more handshakes after this first 
+    // one, unlogged, with the latency of every step recorded
+    unsigned  nTimed = handshakesFromEnv() ;
+    uint64_t *latMsg2 = NULL , *latMsg4 = NULL , *latMsg5 = NULL , *latAll = NULL ;
+    uint64_t  tStart = 0 ;
+    FILE     *realLog = log ;
 
-    MSG2_receive( log , fd_K2A, &Ka, &Ks, &IDb, &Na, &LenTktCiph, &tktCipher ) ;
-
-    // Print the message 2 components
-    fprintf(log, "Amal received the following in message 2 from the KDC\n") ;
-    fflush(log) ;
-
-    // Dump Ks
-    fprintf(log, "    Ks { Key , IV } (%lu Bytes ) is:\n" , sizeof(myKey_t) ) ;
-    BIO_dump_indent_fp(log, &Ks, sizeof(myKey_t), 4);
-    fflush(log) ;
-
-    // Dump IDb
-    fprintf(log, "\n    IDb (%lu Bytes):   ..... MATCH\n" ,  strlen(IDb) + 1) ;
-    BIO_dump_indent_fp(log, IDb, strlen(IDb) + 1, 4); fprintf( log , "\n" );
-    fflush(log) ;
-
-    // Dump nonce
-    fprintf(log, "    Received Copy of Na (%lu bytes):    >>>> VALID\n" , NONCELEN ) ;
-    BIO_dump_indent_fp(log, Na, NONCELEN, 4); fprintf( log , "\n" );
-    fflush(log) ;
-
-    // Dump encrypted ticket
-    fprintf(log, "    Encrypted Ticket (%u bytes):\n" , LenTktCiph ) ;
-    BIO_dump_indent_fp(log, tktCipher, LenTktCiph, 4); fprintf( log , "\n" );
-    fflush(log) ;
-
-    //*************************************
-    // Construct & Send    Message 3
-    //*************************************
-	// PA-04 Part Two
-    BANNER( log ) ;
-    fprintf( log , "         MSG3 New\n");
-    BANNER( log ) ;
-
-    // Print info to the log
-    fprintf(log, "Amal is sending this nonce Na2 in Message 3:\n");
-    BIO_dump_indent_fp (log, &Na2, NONCELEN, 4);
-
-    // Create MSG3: Encrypted Ticket + Nonce2
-    uint8_t *msg3;
-
-    unsigned msg3Len = MSG3_new(log, &msg3, LenTktCiph, tktCipher, &Na2);
-
-    if (write(fd_A2B, msg3, msg3Len) != msg3Len)
+    if ( nTimed > 0 )
     {
-        fprintf(stderr, "\nCould not write MSG3 to Basim.\n");
-        fprintf(log, "\nCould not write MSG3 to Basim.\n");
-        exit(-1);
-    } 
-
-    fprintf(log, "Amal Sent the above Message 3 ( %u bytes ) to Basim\n", msg3Len) ;
-    fprintf(log, "\n"); fflush(log) ;
-
-    free(msg3) ;
-
-    //*************************************
-    // Receive   & Process Message 4
-    //*************************************
-	// PA-04 Part Two
-    BANNER( log ) ;
-    fprintf( log , "         MSG4 Receive\n");
-    BANNER( log ) ;
-
-    Nonce_t fNa2;
-    fNonce(fNa2, Na2);
-
-
-    // Get MSG4 from Basim
-    Nonce_t Nb;
-    MSG4_receive(log, fd_B2A, &Ks, &fNa2, &Nb);
-
-
-    //*************************************
-    // Construct & Send    Message 5
-    //*************************************
-	// PA-04 Part Two
-    BANNER( log ) ;
-    fprintf( log , "         MSG5 New\n");
-    BANNER( log ) ;
-
-    Nonce_t fNb;
-    fNonce(fNb, Nb) ;
+        latMsg2 = (uint64_t *) malloc( nTimed * sizeof( uint64_t ) ) ;
+        latMsg4 = (uint64_t *) malloc( nTimed * sizeof( uint64_t ) ) ;
+        latMsg5 = (uint64_t *) malloc( nTimed * sizeof( uint64_t ) ) ;
+        latAll  = (uint64_t *) malloc( nTimed * sizeof( uint64_t ) ) ;
+        if ( ! latMsg2 || ! latMsg4 || ! latMsg5 || ! latAll )
+        {
+            fprintf( stderr , "\nAmal could not allocate the latency arrays\n" ) ;
+            exit(-1) ;
+        }
+    }
 
-    fprintf(log, "Amal is sending this f( Nb ) in MSG5:\n");
-    BIO_dump_indent_fp(log, &fNb, NONCELEN, 4);
-    fprintf(log, "\n"); fflush(log) ;
+    for ( unsigned hs = 0 ; hs <= nTimed ; hs++ )
+    {
+        if ( hs == 1 )
+        {
+            // Only the first handshake is logged, unless the log is a 
+            // binary trace: those are cheap enough to keep in full
+            if ( ! logTracing() )
+                log = logOpen( "/dev/null" ) ;
+            if ( ! log )
+            {
+                fprintf( stderr , "\nAmal could not open /dev/null\n" ) ;
+                exit(-1) ;
+            }
+            tStart = nowNs() ;
+        }
+
+        //*************************************
+        // Construct & Send    Message 1
+        //*************************************
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG1 New\n");
+            BANNER( log ) ;
+        }
+
+        char *IDa = "Amal is Hope", *IDb = "Basim is Smily" ;
+        uint64_t  t0 = nowNs() ;
+        unsigned  LenMsg1 ;
+        uint8_t  *msg1 ;
+        LenMsg1 = MSG1_new( log , &msg1 , IDa , IDb , Na ) ;
+    
+        // Send MSG1 to KDC via the appropriate pipe
+        if (statWrite(fd_A2K, msg1, LenMsg1) != LenMsg1)
+        {
+            fprintf(stderr, "\nCould not write MSG1 to KDC.\n");
+            fprintf(log, "\nCould not write MSG1 to KDC.\n");
+            exit(-1);
+        }
+
+        LOGF( LOG_INFO , log , "Amal sent message 1 ( %d bytes ) to the KDC with:\n" , LenMsg1 ) ;
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            fprintf( log , "    IDa ='%s'\n    "
+                           "IDb = '%s'\n" , IDa , IDb ) ;
+            fprintf( log , "    Na ( %lu Bytes ) is:\n" , NONCELEN ) ;
+            // BIO_dump the nonce Na
+            logDump(log, (const char *)Na, NONCELEN, 4);
+            fprintf( log , "\n") ; 
+        }
+        LOG_FLUSH( log ) ;
+
+        // Deallocate any memory allocated for msg1
+        free(msg1);
+
+        //*************************************
+        // Receive   &   Process Message 2
+        //*************************************
+    	// PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER ( log ) ;
+            fprintf( log , "         MSG2 Receive\n");
+            BANNER ( log ) ;
+        }
+        LOG_FLUSH( log ) ;
+
+        // Get MSG2 from KDC
+        myKey_t  Ks ;
+
+        unsigned LenTktCiph = 0;
+        uint8_t *tktCipher ;
+
+        MSG2_receive( log , fd_K2A, &Ka, &Ks, &IDb, &Na, &LenTktCiph, &tktCipher ) ;
+        uint64_t  t1 = nowNs() ;
+
+        // Print the message 2 components
+        LOGF( LOG_INFO , log , "Amal received the following in message 2 from the KDC\n") ;
+        LOG_FLUSH(log) ;
+
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            // Dump Ks
+            fprintf(log, "    Ks { Key , IV } (%lu Bytes ) is:\n" , sizeof(myKey_t) ) ;
+            logDump(log, &Ks, sizeof(myKey_t), 4);
+
+            // Dump IDb
+            fprintf(log, "\n    IDb (%lu Bytes):   ..... MATCH\n" ,  strlen(IDb) + 1) ;
+            logDump(log, IDb, strlen(IDb) + 1, 4); fprintf( log , "\n" );
+
+            // Dump nonce
+            fprintf(log, "    Received Copy of Na (%lu bytes):    >>>> VALID\n" , NONCELEN ) ;
+            logDump(log, Na, NONCELEN, 4); fprintf( log , "\n" );
+        }
+
+        if ( LOG_ON( LOG_TRACE ) )
+        {
+            // Dump encrypted ticket
+            fprintf(log, "    Encrypted Ticket (%u bytes):\n" , LenTktCiph ) ;
+            logDump(log, tktCipher, LenTktCiph, 4); fprintf( log , "\n" );
+        }
+        LOG_FLUSH(log) ;
+
+        //*************************************
+        // Construct & Send    Message 3
+        //*************************************
+    	// PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG3 New\n");
+            BANNER( log ) ;
+        }
+
+        // Print info to the log
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            fprintf(log, "Amal is sending this nonce Na2 in Message 3:\n");
+            logDump (log, &Na2, NONCELEN, 4);
+        }
+
+        // Create MSG3: Encrypted Ticket + Nonce2
+        uint64_t  t2 = nowNs() ;
+        uint8_t *msg3;
+
+        unsigned msg3Len = MSG3_new(log, &msg3, LenTktCiph, tktCipher, &Na2);
+
+        if (statWrite(fd_A2B, msg3, msg3Len) != msg3Len)
+        {
+            fprintf(stderr, "\nCould not write MSG3 to Basim.\n");
+            fprintf(log, "\nCould not write MSG3 to Basim.\n");
+            exit(-1);
+        } 
+
+        LOGF( LOG_INFO , log , "Amal Sent the above Message 3 ( %u bytes ) to Basim\n", msg3Len) ;
+        LOGF( LOG_INFO , log , "\n"); LOG_FLUSH(log) ;
+
+        free(msg3) ;
+
+        //*************************************
+        // Receive   & Process Message 4
+        //*************************************
+    	// PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG4 Receive\n");
+            BANNER( log ) ;
+        }
+
+        Nonce_t fNa2;
+        fNonce(fNa2, Na2);
+
+
+        // Get MSG4 from Basim
+        Nonce_t Nb;
+        MSG4_receive(log, fd_B2A, &Ks, &fNa2, &Nb);
+        uint64_t  t3 = nowNs() ;
+
+
+        //*************************************
+        // Construct & Send    Message 5
+        //*************************************
+    	// PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG5 New\n");
+            BANNER( log ) ;
+        }
+
+        Nonce_t fNb;
+        fNonce(fNb, Nb) ;
+
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            fprintf(log, "Amal is sending this f( Nb ) in MSG5:\n");
+            logDump(log, &fNb, NONCELEN, 4);
+            fprintf(log, "\n");
+        }
+        LOG_FLUSH(log) ;
+
+        // Create MSG5: f( Nb )
+        uint64_t  t4 = nowNs() ;
+        uint8_t *msg5;
+        unsigned msg5Len = MSG5_new(log, &msg5, &Ks, &fNb);
+
+        // Concat MSG5's length to the message
+        uint8_t *newMSG5ptr = (uint8_t *) malloc(msg5Len + LENSIZE) ;
+        uint8_t *m = newMSG5ptr ;
+
+        memcpy(m, &msg5Len, LENSIZE);
+        m += LENSIZE ;
+
+        memcpy(m, msg5, msg5Len) ;
+        m += msg5Len;
+
+        if (statWrite(fd_A2B, newMSG5ptr, (msg5Len + LENSIZE)) != (msg5Len + LENSIZE))
+        {
+            fprintf(stderr, "Amal could not send MSG5 to Basim\n");
+            fprintf(log, "Amal could not send MSG5 to Basim\n");
+            exit(-1);
+        }
+
+        LOGF( LOG_INFO , log , "Amal sent the above Message 5 ( %u bytes ) to Basim\n", msg5Len) ;
+        LOG_FLUSH(log) ;
+
+        free(msg5) ;
+        free(newMSG5ptr) ;
+
+        // In benchmark mode MSG5 is done once Basim has verified it
+        if ( nTimed > 0 )
+        {
+            uint8_t ack ;
+            if ( statRead( fd_B2A , &ack , 1 ) != 1 || ack != HANDSHAKE_ACK )
+            {
+                fprintf(stderr, "Amal did not get Basim's MSG5 acknowledgement\n");
+                fprintf(log, "Amal did not get Basim's MSG5 acknowledgement\n");
+                exit(-1);
+            }
+        }
+        uint64_t  t5 = nowNs() ;
+
+        free(IDb) ;
+        free(tktCipher) ;
+
+        if ( hs > 0 )
+        {
+            latMsg2[ hs - 1 ] = t1 - t0 ;
+            latMsg4[ hs - 1 ] = t3 - t2 ;
+            latMsg5[ hs - 1 ] = t5 - t4 ;
+            latAll [ hs - 1 ] = t5 - t0 ;
+        }
 
-    // Create MSG5: f( Nb )
-    uint8_t *msg5;
-    unsigned msg5Len = MSG5_new(log, &msg5, &Ks, &fNb);
+    }
 
-    // Concat MSG5's length to the message
-    uint8_t *newMSG5ptr = (uint8_t *) malloc(msg5Len + LENSIZE) ;
-    uint8_t *m = newMSG5ptr ;
+    if ( nTimed > 0 )
+    {
+        double secs = ( nowNs() - tStart ) / 1e9 ;
 
-    memcpy(m, &msg5Len, LENSIZE);
-    m += LENSIZE ;
+        if ( log != realLog )
+            fclose( log ) ;
+        log = realLog ;
 
-    memcpy(m, msg5, msg5Len) ;
-    m += msg5Len;
+        printf( "\nAmal timed %u handshakes in %.3f s:  %.1f handshakes/s\n" , 
+                nTimed , secs , nTimed / secs ) ;
+        latencyReport( stdout , "MSG1->MSG2" , latMsg2 , nTimed ) ;
+        latencyReport( stdout , "MSG3->MSG4" , latMsg4 , nTimed ) ;
+        latencyReport( stdout , "MSG5"       , latMsg5 , nTimed ) ;
+        latencyReport( stdout , "handshake"  , latAll  , nTimed ) ;
+        fflush( stdout ) ;
 
-    if (write(fd_A2B, newMSG5ptr, (msg5Len + LENSIZE)) != (msg5Len + LENSIZE))
-    {
-        fprintf(stderr, "Amal could not send MSG5 to Basim\n");
-        fprintf(log, "Amal could not send MSG5 to Basim\n");
-        exit(-1);
+        free( latMsg2 ) ;  free( latMsg4 ) ;  free( latMsg5 ) ;  free( latAll ) ;
     }
 
-    fprintf(log, "Amal sent the above Message 5 ( %u bytes ) to Basim\n", msg5Len) ;
-    fflush(log) ;
-
-    free(msg5) ;
-
     //*************************************   
     // Final Clean-Up
     //*************************************
    
-    fprintf( log , "\nAmal has terminated normally. Goodbye\n" ) ;  
-    fflush( log ) ;
+    LOGF( LOG_INFO , log , "\nAmal has terminated normally. Goodbye\n" ) ;  
+    LOG_FLUSH( log ) ;
     fclose( log ) ;
     return 0 ;
 }
@@ -57,18 +57,31 @@ int main ( int argc , char * argv[] )
     fd_A2B    = atoi(argv[1]);  // Read from Amal   File Descriptor
     fd_B2A    = atoi(argv[2]);  // Send to   Amal   File Descriptor
 
-    log = fopen("basim/logBasim.txt" , "w" );
+    // All parties must agree on how MSG2 .. MSG5 are encrypted
+    // ( AES-CBC unless the dispatcher exported CIPHER_MODE=gcm )
+    setCipherModeFromEnv() ;
+
+    // Log levels below LOG_LEVEL=... are skipped ( those below -DLOG_LEVEL are not even built )
+    setLogLevelFromEnv() ;
+
+    // Latency histograms, when built with -DMYCRYPTO_STATS ( also dumped on SIGUSR1 )
+    stats_install( "basim/statsBasim.txt" ) ;
+
+    log = logOpen( "basim/logBasim.txt" );
     if( ! log )
     {
         fprintf( stderr , "Basim's %s. Could not create log file\n" , developerName ) ;
         exit(-1) ;
     }
 
-    BANNER( log ) ;
-    fprintf( log , "Starting Basim\n"  ) ;
-    BANNER( log ) ;
+    if ( LOG_ON( LOG_INFO ) )
+    {
+        BANNER( log ) ;
+        fprintf( log , "Starting Basim\n"  ) ;
+        BANNER( log ) ;
 
-    fprintf( log , "\n<readFr. Amal> FD=%d , <sendTo Amal> FD=%d\n\n" , fd_A2B , fd_B2A );
+        fprintf( log , "\n<readFr. Amal> FD=%d , <sendTo Amal> FD=%d\n\n" , fd_A2B , fd_B2A );
+    }
 
     // Get Basim's master keys with the KDC
     myKey_t   Kb ;    // Basim's master key with the KDC    
@@ -86,114 +99,173 @@ int main ( int argc , char * argv[] )
     }
     // fprintf( log , "\n" );
 	// BIO_dump the IV indented 4 spaces to the right
-    fprintf( log , "Basim has this Master Kb { key , IV }\n" );
-    BIO_dump_indent_fp(log, (const char *)Kb.key, SYMMETRIC_KEY_LEN, 4);
-    fprintf( log , "\n" );
-    BIO_dump_indent_fp(log, (const char *)Kb.iv, INITVECTOR_LEN, 4);
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log , "Basim has this Master Kb { key , IV }\n" );
+        logDump(log, (const char *)Kb.key, SYMMETRIC_KEY_LEN, 4);
+        fprintf( log , "\n" );
+        logDump(log, (const char *)Kb.iv, INITVECTOR_LEN, 4);
+    }
 
     // Get Basim's pre-created Nonces: Nb
 	Nonce_t   Nb;  
 
 	// Use getNonce4Basim () to get Basim's 1st and only nonce into Nb
     getNonce4Basim(1, Nb);
-    fprintf( log , "\nBasim will use this Nonce:  Nb\n"  ) ;
-	// BIO_dump Nb indented 4 spaces to the right
-    BIO_dump_indent_fp(log, (const char *) Nb, NONCELEN, 4);
-    fprintf( log , "\n" );
-
-    fflush( log ) ;
-
-    //*************************************
-    // Receive  & Process   Message 3
-    //*************************************
-    // PA-04 Part Two
-    BANNER( log ) ;
-    fprintf( log , "         MSG3 Receive\n");
-    BANNER( log ) ;
-
-    myKey_t Ks;
-    char   *IDa;
-    Nonce_t Na2;
-
-    // Get the message 3
-    MSG3_receive(log, fd_A2B, &Kb, &Ks, &IDa, &Na2);
-
-    // Print the message components
-    fprintf(log, "Basim received Message 3 from Amal with the following:\n") ;
-    fflush(log) ;
-
-    fprintf(log, "    Ks { Key , IV } (%lu Bytes ) is:\n", sizeof(myKey_t));
-    BIO_dump_indent_fp(log, &Ks, sizeof(myKey_t), 4); fprintf(log, "\n") ;
-    fflush(log) ;
-
-    fprintf(log, "    IDa = '%s'", IDa) ;
-    fflush(log) ;
-
-    fprintf(log, "\n    Na2 ( %lu Bytes ) is:\n", NONCELEN) ;
-    BIO_dump_indent_fp(log, &Na2, NONCELEN, 4); fprintf(log, "\n");
-
-    fflush(log) ;
-
-
-    //*************************************
-    // Construct & Send    Message 4
-    //*************************************
-    // PA-04 Part Two
-    BANNER( log ) ;
-    fprintf( log , "         MSG4 New\n");
-    BANNER( log ) ;
-
-    unsigned  LenMsg4 ;
-    uint8_t  *msg4 ;
-
-    LenMsg4 = MSG4_new( log , &msg4 , &Ks , &Na2 , &Nb ) ;
-
-    // Concat MSG4's length to the message
-    uint8_t *newMSG4ptr = (uint8_t *) malloc(LenMsg4 + LENSIZE) ;
-    uint8_t *m = newMSG4ptr ;
-
-    memcpy(m, &LenMsg4, LENSIZE);
-    m += LENSIZE ;
-
-    memcpy(m, msg4, LenMsg4) ;
-    m += LenMsg4 ;
-
-    if (write(fd_B2A, newMSG4ptr, (LenMsg4 + LENSIZE)) != (LenMsg4 + LENSIZE))
+    if ( LOG_ON( LOG_DEBUG ) )
     {
-        fprintf(stderr, "Basim could not send MSG4 to Amal\n");
-        fprintf(log, "Basim could not send MSG4 to Amal\n");
-        exit(-1);
+        fprintf( log , "\nBasim will use this Nonce:  Nb\n"  ) ;
+        // BIO_dump Nb indented 4 spaces to the right
+        logDump(log, (const char *) Nb, NONCELEN, 4);
+        fprintf( log , "\n" );
     }
 
-    fprintf(log, "Basim Sent the above MSG4 to Amal\n") ;
-    fprintf(log, "\n");
-    fflush(log) ;
-
-    free(msg4) ;
+    LOG_FLUSH( log ) ;
 
-    //*************************************
-    // Receive   & Process Message 5
-    //*************************************
-    // PA-04 Part Two
-    BANNER( log ) ;
-    fprintf( log , "         MSG5 Receive\n");
-    BANNER( log ) ;
+    // Benchmark mode ( "dispatcher -b K" ): K more handshakes after this 
+    // first one, logged only to a binary trace
+    unsigned  nTimed = handshakesFromEnv() ;
+    FILE     *realLog = log ;
 
-    Nonce_t fNb;
+    for ( unsigned hs = 0 ; hs <= nTimed ; hs++ )
+    {
+        if ( hs == 1 && ! logTracing() )
+        {
+            log = logOpen( "/dev/null" ) ;
+            if ( ! log )
+            {
+                fprintf( stderr , "\nBasim could not open /dev/null\n" ) ;
+                exit(-1) ;
+            }
+        }
+
+        //*************************************
+        // Receive  & Process   Message 3
+        //*************************************
+        // PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG3 Receive\n");
+            BANNER( log ) ;
+        }
+
+        myKey_t Ks;
+        char   *IDa;
+        Nonce_t Na2;
+
+        // Get the message 3
+        MSG3_receive(log, fd_A2B, &Kb, &Ks, &IDa, &Na2);
+
+        // Print the message components
+        LOGF( LOG_INFO , log , "Basim received Message 3 from Amal with the following:\n") ;
+        LOG_FLUSH(log) ;
+
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            fprintf(log, "    Ks { Key , IV } (%lu Bytes ) is:\n", sizeof(myKey_t));
+            logDump(log, &Ks, sizeof(myKey_t), 4); fprintf(log, "\n") ;
+
+            fprintf(log, "    IDa = '%s'", IDa) ;
+
+            fprintf(log, "\n    Na2 ( %lu Bytes ) is:\n", NONCELEN) ;
+            logDump(log, &Na2, NONCELEN, 4); fprintf(log, "\n");
+        }
+
+        LOG_FLUSH(log) ;
+
+
+        //*************************************
+        // Construct & Send    Message 4
+        //*************************************
+        // PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG4 New\n");
+            BANNER( log ) ;
+        }
+
+        unsigned  LenMsg4 ;
+        uint8_t  *msg4 ;
+
+        LenMsg4 = MSG4_new( log , &msg4 , &Ks , &Na2 , &Nb ) ;
+
+        // Concat MSG4's length to the message
+        uint8_t *newMSG4ptr = (uint8_t *) malloc(LenMsg4 + LENSIZE) ;
+        uint8_t *m = newMSG4ptr ;
+
+        memcpy(m, &LenMsg4, LENSIZE);
+        m += LENSIZE ;
+
+        memcpy(m, msg4, LenMsg4) ;
+        m += LenMsg4 ;
+
+        if (statWrite(fd_B2A, newMSG4ptr, (LenMsg4 + LENSIZE)) != (LenMsg4 + LENSIZE))
+        {
+            fprintf(stderr, "Basim could not send MSG4 to Amal\n");
+            fprintf(log, "Basim could not send MSG4 to Amal\n");
+            exit(-1);
+        }
+
+        LOGF( LOG_INFO , log , "Basim Sent the above MSG4 to Amal\n") ;
+        LOGF( LOG_INFO , log , "\n");
+        LOG_FLUSH(log) ;
+
+        free(msg4) ;
+        free(newMSG4ptr) ;
+
+        //*************************************
+        // Receive   & Process Message 5
+        //*************************************
+        // PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG5 Receive\n");
+            BANNER( log ) ;
+        }
+
+        Nonce_t fNb;
+
+        // Get MSG5 from Amal
+        MSG5_receive(log, fd_A2B, &Ks, &fNb);
+
+        LOGF( LOG_INFO , log , "Basim received Message 5 from Amal with this f( Nb ): >>>> VALID\n") ;
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            logDump(log, &fNb, NONCELEN, 4); fprintf(log, "\n");
+        }
+        LOG_FLUSH(log) ;
+
+        // Tell Amal that MSG5 checked out, so that it can time the whole exchange
+        if ( nTimed > 0 )
+        {
+            uint8_t ack = HANDSHAKE_ACK ;
+            if ( statWrite( fd_B2A , &ack , 1 ) != 1 )
+            {
+                fprintf(stderr, "Basim could not acknowledge MSG5\n");
+                fprintf(log, "Basim could not acknowledge MSG5\n");
+                exit(-1);
+            }
+        }
+
+        free(IDa) ;
 
-    // Get MSG5 from Amal
-    MSG5_receive(log, fd_A2B, &Ks, &fNb);
+    }
 
-    fprintf(log, "Basim received Message 5 from Amal with this f( Nb ): >>>> VALID\n") ;
-    BIO_dump_indent_fp(log, &fNb, NONCELEN, 4); fprintf(log, "\n");
-    fflush(log) ;
+    if ( log != realLog )
+    {
+        fclose( log ) ;
+        log = realLog ;
+    }
 
     //*************************************   
     // Final Clean-Up
     //*************************************
 
-    fprintf( log , "\nBasim has terminated normally. Goodbye\n" ) ;
-    fflush( log ) ;
+    LOGF( LOG_INFO , log , "\nBasim has terminated normally. Goodbye\n" ) ;
+    LOG_FLUSH( log ) ;
     fclose( log ) ;  
 
     return 0 ;
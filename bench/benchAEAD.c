@@ -0,0 +1,78 @@
+/*----------------------------------------------------------------------------
+AES-256-GCM against AES-256-CBC followed by a separate HMAC-SHA256 pass
+
+FILE:   benchAEAD.c
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#include <openssl/hmac.h>
+
+#define ITERATIONS   100000
+
+int main( int argc , char *argv[] )
+{
+    static unsigned sizes[] = { 8 , 64 , 256 , 1024 , PLAINTEXT_LEN_MAX - AEAD_OVERHEAD } ;
+    myKey_t   K ;
+    uint8_t   macKey[ SYMMETRIC_KEY_LEN ] , mac[ EVP_MAX_MD_SIZE ] ;
+    uint8_t   plain[ PLAINTEXT_LEN_MAX ] , cipher[ CIPHER_LEN_MAX ] , decr[ DECRYPTED_LEN_MAX ] ;
+    unsigned  lenCipher = 0 , macLen = 0 ;
+    uint64_t  t0 ;
+    char      name[ 64 ] ;
+
+    RAND_bytes( (uint8_t *) &K , KEYSIZE ) ;
+    RAND_bytes( macKey , sizeof(macKey) ) ;
+    RAND_bytes( plain , sizeof(plain) ) ;
+
+    // A flipped bit anywhere must be caught, not decrypted into garbage
+    lenCipher = encryptAEAD( plain , 64 , K.key , K.iv , cipher ) ;
+    cipher[ AEAD_NONCE_LEN + 3 ] ^= 0x01 ;
+    if ( decryptAEAD( cipher , lenCipher , K.key , K.iv , decr ) != -1 )
+        exitError( "benchAEAD: a tampered message was accepted" ) ;
+
+    for ( unsigned s = 0 ; s < sizeof(sizes) / sizeof(sizes[0]) ; s++ )
+    {
+        unsigned n = sizes[ s ] ;
+        fprintf( stdout , "\n%u-byte messages\n" , n ) ;
+
+        // Encrypt-then-MAC with CBC, as the protocol would need without AEAD
+        t0 = nowNs() ;
+        for ( int i = 0 ; i < ITERATIONS ; i++ )
+        {
+            lenCipher = encrypt( plain , n , K.key , K.iv , cipher ) ;
+            HMAC( EVP_sha256() , macKey , sizeof(macKey) , cipher , lenCipher , mac , &macLen ) ;
+        }
+        snprintf( name , sizeof(name) , "  seal  CBC + HMAC-SHA256" ) ;
+        benchReport( name , nowNs() - t0 , ITERATIONS ) ;
+
+        t0 = nowNs() ;
+        for ( int i = 0 ; i < ITERATIONS ; i++ )
+        {
+            HMAC( EVP_sha256() , macKey , sizeof(macKey) , cipher , lenCipher , mac , &macLen ) ;
+            decrypt( cipher , lenCipher , K.key , K.iv , decr ) ;
+        }
+        snprintf( name , sizeof(name) , "  open  CBC + HMAC-SHA256" ) ;
+        benchReport( name , nowNs() - t0 , ITERATIONS ) ;
+
+        t0 = nowNs() ;
+        for ( int i = 0 ; i < ITERATIONS ; i++ )
+            lenCipher = encryptAEAD( plain , n , K.key , K.iv , cipher ) ;
+        snprintf( name , sizeof(name) , "  seal  GCM" ) ;
+        benchReport( name , nowNs() - t0 , ITERATIONS ) ;
+
+        t0 = nowNs() ;
+        for ( int i = 0 ; i < ITERATIONS ; i++ )
+            if ( decryptAEAD( cipher , lenCipher , K.key , K.iv , decr ) != (int) n )
+                exitError( "benchAEAD: GCM round trip failed" ) ;
+        snprintf( name , sizeof(name) , "  open  GCM" ) ;
+        benchReport( name , nowNs() - t0 , ITERATIONS ) ;
+    }
+
+    keyCache_flush() ;
+    return 0 ;
+}
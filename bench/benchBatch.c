@@ -0,0 +1,94 @@
+/*----------------------------------------------------------------------------
+Throughput of MSG2_newBatch() against one MSG2_new() call per session
+
+FILE:   benchBatch.c
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define SESSIONS     1024
+#define ROUNDS       200
+
+int main( int argc , char *argv[] )
+{
+    static myKey_t      Ka[ SESSIONS ] , Kb[ SESSIONS ] , Ks[ SESSIONS ] ;
+    static Nonce_t      Na[ SESSIONS ] ;
+    static myMSG2Job_t  jobs[ SESSIONS ] ;
+    static myCipherJob_t cj[ SESSIONS ] ;
+    static uint8_t      plain[ SESSIONS ][ 96 ] , cipher[ SESSIONS ][ 96 + INITVECTOR_LEN ] ;
+    char     *IDa = "Amal is Hope" , *IDb = "Basim is Smily" ;
+    uint8_t  *msg2 , ref[ CIPHER_LEN_MAX ] ;
+    uint64_t  t0 ;
+
+    // Every session has its own principals, as it would on a busy KDC
+    RAND_bytes( (uint8_t *) Ka , sizeof(Ka) ) ;
+    RAND_bytes( (uint8_t *) Kb , sizeof(Kb) ) ;
+    RAND_bytes( (uint8_t *) Ks , sizeof(Ks) ) ;
+    RAND_bytes( (uint8_t *) Na , sizeof(Na) ) ;
+    RAND_bytes( (uint8_t *) plain , sizeof(plain) ) ;
+
+    FILE *devNull = fopen( "/dev/null" , "w" ) ;
+    if ( devNull == NULL )
+        exitError( "benchBatch: could not open /dev/null" ) ;
+
+    for ( unsigned i = 0 ; i < SESSIONS ; i++ )
+    {
+        jobs[ i ] = (myMSG2Job_t) { &Ka[ i ] , &Kb[ i ] , &Ks[ i ] , IDa , IDb , &Na[ i ] , NULL , 0 } ;
+        cj[ i ]   = (myCipherJob_t) { plain[ i ] , 48 + i % 48 , Ka[ i ].key , Ka[ i ].iv , cipher[ i ] , 0 } ;
+    }
+
+    // The batch must produce exactly what the one-at-a-time path does
+    MSG2_newBatch( NULL , jobs , SESSIONS ) ;
+    encryptBatch( cj , SESSIONS ) ;
+    for ( unsigned i = 0 ; i < SESSIONS ; i++ )
+    {
+        unsigned len = MSG2_new( devNull , &msg2 , &Ka[ i ] , &Kb[ i ] , &Ks[ i ] , IDa , IDb , &Na[ i ] ) ;
+        if ( len != jobs[ i ].lenMsg2 || memcmp( msg2 , jobs[ i ].msg2 , len ) != 0 )
+            exitError( "benchBatch: MSG2_newBatch() does not match MSG2_new()" ) ;
+        free( msg2 ) ;  free( jobs[ i ].msg2 ) ;
+
+        len = encrypt( cj[ i ].pPlainText , cj[ i ].plainText_len , cj[ i ].key , cj[ i ].iv , ref ) ;
+        if ( len != cj[ i ].cipherText_len || memcmp( ref , cj[ i ].pCipherText , len ) != 0 )
+            exitError( "benchBatch: encryptBatch() does not match encrypt()" ) ;
+    }
+
+    fprintf( stdout , "%d sessions with distinct keys, %d rounds\n\n" , SESSIONS , ROUNDS ) ;
+
+    t0 = nowNs() ;
+    for ( int r = 0 ; r < ROUNDS ; r++ )
+        for ( unsigned i = 0 ; i < SESSIONS ; i++ )
+            encrypt( cj[ i ].pPlainText , cj[ i ].plainText_len , cj[ i ].key , cj[ i ].iv , ref ) ;
+    benchReport( "encrypt()      one call per stream" , nowNs() - t0 , (unsigned long) ROUNDS * SESSIONS ) ;
+
+    t0 = nowNs() ;
+    for ( int r = 0 ; r < ROUNDS ; r++ )
+        encryptBatch( cj , SESSIONS ) ;
+    benchReport( "encryptBatch() interleaved streams" , nowNs() - t0 , (unsigned long) ROUNDS * SESSIONS ) ;
+
+    t0 = nowNs() ;
+    for ( int r = 0 ; r < ROUNDS / 10 ; r++ )
+        for ( unsigned i = 0 ; i < SESSIONS ; i++ )
+        {
+            MSG2_new( devNull , &msg2 , &Ka[ i ] , &Kb[ i ] , &Ks[ i ] , IDa , IDb , &Na[ i ] ) ;
+            free( msg2 ) ;
+        }
+    benchReport( "MSG2_new()      messages" , nowNs() - t0 , (unsigned long) ROUNDS / 10 * SESSIONS ) ;
+
+    t0 = nowNs() ;
+    for ( int r = 0 ; r < ROUNDS ; r++ )
+    {
+        MSG2_newBatch( NULL , jobs , SESSIONS ) ;
+        for ( unsigned i = 0 ; i < SESSIONS ; i++ )
+            free( jobs[ i ].msg2 ) ;
+    }
+    benchReport( "MSG2_newBatch() messages" , nowNs() - t0 , (unsigned long) ROUNDS * SESSIONS ) ;
+
+    fclose( devNull ) ;
+    keyCache_flush() ;
+    return 0 ;
+}
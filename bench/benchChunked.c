@@ -0,0 +1,93 @@
+/*----------------------------------------------------------------------------
+Throughput of encryptFileChunked() as worker threads are added, against the
+single-stream encryptFile()
+
+FILE:   benchChunked.c
+
+Usage:  benchChunked [ size in MB ]      ( default 256 MB )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+//-----------------------------------------------------------------------------
+// A scratch file that is unlinked right away, so nothing is left behind
+
+static int tempFile( void )
+{
+    char name[] = "/tmp/benchChunkedXXXXXX" ;
+    int  fd = mkstemp( name ) ;
+    if ( fd < 0 )
+        exitError( "benchChunked: could not create a temporary file" ) ;
+    unlink( name ) ;
+    return fd ;
+}
+
+static void rewindFd( int fd )
+{
+    lseek( fd , 0 , SEEK_SET ) ;
+}
+
+static void reportMBs( const char *name , uint64_t elapsedNs , size_t bytes )
+{
+    fprintf( stdout , "%-40s %10.1f ms %10.1f MB/s\n" , name , elapsedNs / 1e6 , 
+             bytes / 1e6 / ( elapsedNs / 1e9 ) ) ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t    sizeMB = argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 256 ;
+    size_t    size   = sizeMB << 20 ;
+    long      nCPU   = sysconf( _SC_NPROCESSORS_ONLN ) ;
+    myKey_t   K ;
+    uint8_t   buf[ 1 << 16 ] , mdPlain[ EVP_MAX_MD_SIZE ] , mdRound[ EVP_MAX_MD_SIZE ] ;
+    char      name[ 64 ] ;
+    uint64_t  t0 ;
+
+    RAND_bytes( (uint8_t *) &K , KEYSIZE ) ;
+
+    int fdPlain = tempFile() , fdCipher = tempFile() , fdRound = tempFile() ;
+    for ( size_t done = 0 ; done < size ; done += sizeof(buf) )
+    {
+        RAND_bytes( buf , sizeof(buf) ) ;
+        write( fdPlain , buf , sizeof(buf) ) ;
+    }
+    rewindFd( fdPlain ) ;
+    unsigned mdLen = fileDigest( fdPlain , -1 , mdPlain ) ;
+
+    fprintf( stdout , "%zu MB file, %ld online CPUs\n\n" , sizeMB , nCPU ) ;
+
+    rewindFd( fdPlain ) ;  ftruncate( fdCipher , 0 ) ;  rewindFd( fdCipher ) ;
+    t0 = nowNs() ;
+    encryptFile( fdPlain , fdCipher , K.key , K.iv ) ;
+    reportMBs( "encryptFile()          single stream" , nowNs() - t0 , size ) ;
+
+    for ( unsigned threads = 1 ; threads <= ( nCPU > 4 ? nCPU : 4 ) ; threads *= 2 )
+    {
+        rewindFd( fdPlain ) ;  ftruncate( fdCipher , 0 ) ;  rewindFd( fdCipher ) ;
+        t0 = nowNs() ;
+        encryptFileChunked( fdPlain , fdCipher , K.key , K.iv , threads ) ;
+        snprintf( name , sizeof(name) , "encryptFileChunked()   %2u threads" , threads ) ;
+        reportMBs( name , nowNs() - t0 , size ) ;
+
+        rewindFd( fdCipher ) ;  ftruncate( fdRound , 0 ) ;  rewindFd( fdRound ) ;
+        t0 = nowNs() ;
+        if ( decryptFileChunked( fdCipher , fdRound , K.key , K.iv , threads ) != (ssize_t) size )
+            exitError( "benchChunked: decryptFileChunked() failed" ) ;
+        snprintf( name , sizeof(name) , "decryptFileChunked()   %2u threads" , threads ) ;
+        reportMBs( name , nowNs() - t0 , size ) ;
+
+        rewindFd( fdRound ) ;
+        fileDigest( fdRound , -1 , mdRound ) ;
+        if ( memcmp( mdPlain , mdRound , mdLen ) != 0 )
+            exitError( "benchChunked: round trip does not match the original" ) ;
+    }
+
+    close( fdPlain ) ;  close( fdCipher ) ;  close( fdRound ) ;
+    return 0 ;
+}
@@ -0,0 +1,84 @@
+/*----------------------------------------------------------------------------
+fileDigest() one file at a time against fileDigestBatch() on many small files
+
+FILE:   benchDigestBatch.c
+
+Usage:  benchDigestBatch [ number of files ] [ file size in bytes ]
+        ( default 20000 files of 4096 bytes )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t    nFiles = argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 20000 ,
+              size   = argc > 2 ? strtoul( argv[2] , NULL , 10 ) : 4096 ;
+    char      dir[]  = "/tmp/benchDigestBatchXXXXXX" ;
+    uint8_t  *buf    = (uint8_t *) malloc( size ? size : 1 ) ;
+    long      nCPU   = sysconf( _SC_NPROCESSORS_ONLN ) ;
+
+    myDigestJob_t *jobs  = calloc( nFiles , sizeof(myDigestJob_t) ) ;
+    char         **paths = calloc( nFiles , sizeof(char *) ) ;
+    if ( buf == NULL || jobs == NULL || paths == NULL || mkdtemp( dir ) == NULL )
+        exitError( "benchDigestBatch: setup failed" ) ;
+
+    for ( size_t i = 0 ; i < nFiles ; i++ )
+    {
+        paths[ i ] = malloc( sizeof(dir) + 16 ) ;
+        sprintf( paths[ i ] , "%s/%zu" , dir , i ) ;
+        RAND_bytes( buf , size ) ;
+
+        int fd = open( paths[ i ] , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+        write( fd , buf , size ) ;
+        close( fd ) ;
+    }
+
+    fprintf( stdout , "%zu files of %zu bytes ( page cache warm ), %ld CPUs\n\n" , nFiles , size , nCPU ) ;
+
+    // One file at a time: open, fileDigest(), close
+    uint8_t   md[ EVP_MAX_MD_SIZE ] ;
+    uint64_t  t0 = nowNs() ;
+    for ( size_t i = 0 ; i < nFiles ; i++ )
+    {
+        int fd = open( paths[ i ] , O_RDONLY ) ;
+        fileDigest( fd , -1 , md ) ;
+        close( fd ) ;
+    }
+    uint64_t ns = nowNs() - t0 ;
+    fprintf( stdout , "fileDigest() loop         %10.0f files/s %8.1f MB/s\n" , 
+             nFiles / ( ns / 1e9 ) , nFiles * size / 1e6 / ( ns / 1e9 ) ) ;
+
+    // The last file doubles as a check that both paths agree
+    for ( unsigned nThreads = 1 ; nThreads <= 4 * (unsigned) nCPU ; nThreads *= 2 )
+    {
+        myDigestStats_t  st ;
+
+        for ( size_t i = 0 ; i < nFiles ; i++ )
+        {
+            jobs[ i ].path = paths[ i ] ;
+            jobs[ i ].fd   = -1 ;
+        }
+        if ( fileDigestBatch( jobs , nFiles , nThreads , &st ) != 0 )
+            exitError( "benchDigestBatch: some files failed" ) ;
+        if ( nFiles && memcmp( jobs[ nFiles - 1 ].digest , md , SHA256_DIGEST_LENGTH ) != 0 )
+            exitError( "benchDigestBatch: fileDigestBatch() disagrees with fileDigest()" ) ;
+
+        fprintf( stdout , "fileDigestBatch() %3u thr %10.0f files/s %8.1f MB/s   ( x%.2f )\n" , 
+                 nThreads , st.filesPerSec , st.mbPerSec , (double) ns / st.elapsedNs ) ;
+    }
+
+    for ( size_t i = 0 ; i < nFiles ; i++ )
+    {
+        unlink( paths[ i ] ) ;
+        free( paths[ i ] ) ;
+    }
+    rmdir( dir ) ;
+    free( paths ) ;  free( jobs ) ;  free( buf ) ;
+    return 0 ;
+}
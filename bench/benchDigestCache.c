@@ -0,0 +1,84 @@
+/*----------------------------------------------------------------------------
+fileDigestBatch() over an unchanged tree with and without the digest cache
+
+FILE:   benchDigestCache.c
+
+Usage:  benchDigestCache [ number of files ] [ file size in bytes ]
+        ( default 20000 files of 65536 bytes )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+static void sweep( const char *what , myDigestJob_t *jobs , char **paths , size_t nFiles )
+{
+    myDigestStats_t       st ;
+    myDigestCacheStats_t  before , after ;
+
+    for ( size_t i = 0 ; i < nFiles ; i++ )
+    {
+        jobs[ i ].path = paths[ i ] ;
+        jobs[ i ].fd   = -1 ;
+    }
+
+    digestCache_stats( &before , NULL ) ;
+    if ( fileDigestBatch( jobs , nFiles , 0 , &st ) != 0 )
+        exitError( "benchDigestCache: some files failed" ) ;
+    digestCache_stats( &after , NULL ) ;
+
+    fprintf( stdout , "%-22s %10.1f ms %10.0f files/s %8.1f MB read   %6lu hits %6lu misses\n" , what , 
+             st.elapsedNs / 1e6 , st.filesPerSec , st.bytes / 1e6 , 
+             (unsigned long) ( after.hits - before.hits ) , (unsigned long) ( after.misses - before.misses ) ) ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t    nFiles = argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 20000 ,
+              size   = argc > 2 ? strtoul( argv[2] , NULL , 10 ) : 65536 ;
+    char      dir[]  = "/tmp/benchDigestCacheXXXXXX" , cache[ sizeof(dir) + 16 ] ;
+    uint8_t  *buf    = (uint8_t *) malloc( size ? size : 1 ) ;
+
+    myDigestJob_t *jobs  = calloc( nFiles , sizeof(myDigestJob_t) ) ;
+    char         **paths = calloc( nFiles , sizeof(char *) ) ;
+    if ( buf == NULL || jobs == NULL || paths == NULL || mkdtemp( dir ) == NULL )
+        exitError( "benchDigestCache: setup failed" ) ;
+
+    for ( size_t i = 0 ; i < nFiles ; i++ )
+    {
+        paths[ i ] = malloc( sizeof(dir) + 16 ) ;
+        sprintf( paths[ i ] , "%s/%zu" , dir , i ) ;
+        RAND_bytes( buf , size ) ;
+
+        int fd = open( paths[ i ] , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+        write( fd , buf , size ) ;
+        close( fd ) ;
+    }
+
+    // Files younger than DIGEST_CACHE_RACY_NS are never cached
+    sleep( 2 ) ;
+    fprintf( stdout , "%zu files of %zu bytes ( page cache warm )\n\n" , nFiles , size ) ;
+
+    sweep( "no cache" , jobs , paths , nFiles ) ;
+
+    sprintf( cache , "%s/cache" , dir ) ;
+    if ( digestCache_open( cache , 2 * nFiles ) != 0 )
+        exitError( "benchDigestCache: could not open the cache" ) ;
+    sweep( "cache, first sweep" , jobs , paths , nFiles ) ;
+    sweep( "cache, nothing changed" , jobs , paths , nFiles ) ;
+    digestCache_close() ;
+
+    unlink( cache ) ;
+    for ( size_t i = 0 ; i < nFiles ; i++ )
+    {
+        unlink( paths[ i ] ) ;
+        free( paths[ i ] ) ;
+    }
+    rmdir( dir ) ;
+    free( paths ) ;  free( jobs ) ;  free( buf ) ;
+    return 0 ;
+}
@@ -0,0 +1,92 @@
+/*----------------------------------------------------------------------------
+Envelope encryption for N recipients against N separate encryptFile() passes
+
+FILE:   benchEnvelope.c
+
+Usage:  benchEnvelope [ size in MB ]      ( default 128 MB )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define MAX_RECIPIENTS   16
+
+static char  plainName[]  = "/tmp/benchEnvPlainXXXXXX" ,
+             cipherName[] = "/tmp/benchEnvCipherXXXXXX" ;
+
+// A public-only copy of 'rsa', as getRSAfromFile( path , 1 ) would return
+static RSA *publicHalf( RSA *rsa )
+{
+    uint8_t       *der = NULL ;
+    int            len = i2d_RSA_PUBKEY( rsa , &der ) ;
+    const uint8_t *p   = der ;
+    RSA           *pub = d2i_RSA_PUBKEY( NULL , &p , len ) ;
+
+    OPENSSL_free( der ) ;
+    return pub ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t    size = ( argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 128 ) << 20 ;
+    uint8_t   buf[ 1 << 16 ] ;
+    RSA      *pub[ MAX_RECIPIENTS ] ;
+    BIGNUM   *e = BN_new() ;
+    myKey_t   K ;
+
+    BN_set_word( e , RSA_F4 ) ;
+    for ( int r = 0 ; r < MAX_RECIPIENTS ; r++ )
+    {
+        RSA *rsa = RSA_new() ;
+        if ( RSA_generate_key_ex( rsa , 2048 , e , NULL ) != 1 )
+            exitError( "benchEnvelope: could not generate a key" ) ;
+        pub[ r ] = publicHalf( rsa ) ;
+        RSA_free( rsa ) ;
+    }
+    BN_free( e ) ;
+
+    int fd = mkstemp( plainName ) ;
+    close( mkstemp( cipherName ) ) ;
+    for ( size_t done = 0 ; done < size ; done += sizeof(buf) )
+    {
+        RAND_bytes( buf , sizeof(buf) ) ;
+        write( fd , buf , sizeof(buf) ) ;
+    }
+    close( fd ) ;
+
+    fprintf( stdout , "%zu MB file ( page cache warm ), 2048-bit recipients\n\n" , size >> 20 ) ;
+
+    for ( unsigned n = 1 ; n <= MAX_RECIPIENTS ; n *= 2 )
+    {
+        // One encryptFile() pass per recipient, each with its own key
+        uint64_t t0 = nowNs() ;
+        for ( unsigned r = 0 ; r < n ; r++ )
+        {
+            RAND_bytes( (uint8_t *) &K , KEYSIZE ) ;
+            int fd_in = open( plainName , O_RDONLY ) , fd_out = open( cipherName , O_RDWR | O_TRUNC ) ;
+            encryptFile( fd_in , fd_out , K.key , K.iv ) ;
+            close( fd_in ) ;  close( fd_out ) ;
+        }
+        uint64_t perCopy = nowNs() - t0 ;
+
+        t0 = nowNs() ;
+        int fd_in = open( plainName , O_RDONLY ) , fd_out = open( cipherName , O_RDWR | O_TRUNC ) ;
+        if ( envelopeEncryptFile( fd_in , fd_out , pub , n ) < 0 )
+            exitError( "benchEnvelope: envelopeEncryptFile failed" ) ;
+        close( fd_in ) ;  close( fd_out ) ;
+        uint64_t envelope = nowNs() - t0 ;
+
+        fprintf( stdout , "%2u recipients   %u x encryptFile() %9.1f ms   envelope %9.1f ms   ( x%.2f )\n" , 
+                 n , n , perCopy / 1e6 , envelope / 1e6 , (double) perCopy / envelope ) ;
+    }
+
+    for ( int r = 0 ; r < MAX_RECIPIENTS ; r++ )
+        RSA_free( pub[ r ] ) ;
+    unlink( plainName ) ;  unlink( cipherName ) ;
+    return 0 ;
+}
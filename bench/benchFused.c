@@ -0,0 +1,108 @@
+/*----------------------------------------------------------------------------
+encryptFile() followed by fileDigest() against the fused encryptFileDigest()
+
+FILE:   benchFused.c
+
+Usage:  benchFused [ size in MB ]      ( default 256 MB )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+static char  plainName[]  = "/tmp/benchFusedPlainXXXXXX" ,
+             cipherName[] = "/tmp/benchFusedCipherXXXXXX" ;
+
+static int openIn( void )
+{
+    int fd = open( plainName , O_RDONLY ) ;
+    if ( fd < 0 )
+        exitError( "benchFused: could not open the plaintext file" ) ;
+    return fd ;
+}
+
+static int openOut( void )
+{
+    int fd = open( cipherName , O_RDWR | O_CREAT | O_TRUNC , 0600 ) ;
+    if ( fd < 0 )
+        exitError( "benchFused: could not open the ciphertext file" ) ;
+    return fd ;
+}
+
+//-----------------------------------------------------------------------------
+// Two passes: encrypt, then hash the plaintext ( or the ciphertext ) again
+
+static uint64_t twoPass( const myKey_t *K , digestOf_t which , uint8_t *md )
+{
+    uint64_t t0 = nowNs() ;
+
+    int fd_in = openIn() , fd_out = openOut() ;
+    encryptFile( fd_in , fd_out , K->key , K->iv ) ;
+    close( fd_in ) ;
+    close( fd_out ) ;
+
+    int fd = open( which == DIGEST_PLAINTEXT ? plainName : cipherName , O_RDONLY ) ;
+    fileDigest( fd , -1 , md ) ;
+    close( fd ) ;
+
+    return nowNs() - t0 ;
+}
+
+static uint64_t fused( const myKey_t *K , digestOf_t which , uint8_t *md )
+{
+    unsigned  mdLen ;
+    uint64_t  t0 = nowNs() ;
+
+    int fd_in = openIn() , fd_out = openOut() ;
+    encryptFileDigest( fd_in , fd_out , K->key , K->iv , which , md , &mdLen ) ;
+    close( fd_in ) ;
+    close( fd_out ) ;
+
+    return nowNs() - t0 ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t    size = ( argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 256 ) << 20 ;
+    myKey_t   K ;
+    uint8_t   buf[ 1 << 16 ] , md1[ EVP_MAX_MD_SIZE ] , md2[ EVP_MAX_MD_SIZE ] ;
+
+    RAND_bytes( (uint8_t *) &K , KEYSIZE ) ;
+
+    int fd = mkstemp( plainName ) ;
+    close( mkstemp( cipherName ) ) ;
+    for ( size_t done = 0 ; done < size ; done += sizeof(buf) )
+    {
+        RAND_bytes( buf , sizeof(buf) ) ;
+        write( fd , buf , sizeof(buf) ) ;
+    }
+    close( fd ) ;
+
+    fprintf( stdout , "%zu MB file ( page cache warm )\n\n" , size >> 20 ) ;
+
+    for ( digestOf_t which = DIGEST_PLAINTEXT ; which <= DIGEST_CIPHERTEXT ; which++ )
+    {
+        const char *side = which == DIGEST_PLAINTEXT ? "plaintext " : "ciphertext" ;
+
+        for ( ioEngine_t engine = IO_ENGINE_STREAM ; engine <= IO_ENGINE_MMAP ; engine++ )
+        {
+            setIOEngine( engine ) ;
+            uint64_t ns2 = twoPass( &K , which , md1 ) ,
+                     ns1 = fused( &K , which , md2 ) ;
+
+            if ( memcmp( md1 , md2 , SHA256_DIGEST_LENGTH ) != 0 )
+                exitError( "benchFused: the fused digest differs from fileDigest()" ) ;
+
+            fprintf( stdout , "%s digest, %-6s  two passes %8.1f MB/s   fused %8.1f MB/s   ( x%.2f )\n" , 
+                     side , engine == IO_ENGINE_STREAM ? "stream" : "mmap" , 
+                     size / 1e6 / ( ns2 / 1e9 ) , size / 1e6 / ( ns1 / 1e9 ) , (double) ns2 / ns1 ) ;
+        }
+    }
+
+    unlink( plainName ) ;  unlink( cipherName ) ;
+    return 0 ;
+}
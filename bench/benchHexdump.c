@@ -0,0 +1,91 @@
+/*----------------------------------------------------------------------------
+hexDump_fp() against OpenSSL's BIO_dump_indent_fp(), after checking that
+both produce the same bytes
+
+FILE:   benchHexdump.c
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define ITERATIONS   200000
+#define CHECK_MAX    600
+
+//-----------------------------------------------------------------------------
+// Everything BIO_dump_indent_fp() writes, in a malloc()ed buffer
+
+static size_t dumpOpenSSL( char **text , const uint8_t *s , int len , int indent )
+{
+    size_t  size = 0 ;
+    FILE   *f    = open_memstream( text , &size ) ;
+
+    BIO_dump_indent_fp( f , s , len , indent ) ;
+    fclose( f ) ;
+    return size ;
+}
+
+//-----------------------------------------------------------------------------
+static void checkOne( const uint8_t *s , int len , int indent )
+{
+    char   *expect , *got = malloc( hexDumpLen( len , indent ) + 1 ) ;
+    size_t  nExpect = dumpOpenSSL( &expect , s , len , indent ) ;
+    size_t  nGot    = hexDump( got , s , len , indent ) ;
+
+    if ( nGot != nExpect || nGot != hexDumpLen( len , indent ) || memcmp( got , expect , nGot ) != 0 )
+    {
+        fprintf( stderr , "benchHexdump: output differs for len=%d indent=%d\n" , len , indent ) ;
+        exit(-1) ;
+    }
+    free( expect ) ;
+    free( got ) ;
+}
+
+int main( int argc , char *argv[] )
+{
+    static unsigned sizes[] = { 4 , 16 , 32 , 48 , 160 , 1024 } ;
+    static uint8_t  big[ 0x120000 ] ;
+    char            name[ 64 ] ;
+    uint64_t        t0 ;
+
+    // Every byte value, every row width and ragged tails; then offsets
+    // wide enough to need 5 and 6 hex digits
+    RAND_bytes( big , sizeof(big) ) ;
+    for ( int b = 0 ; b < 256 ; b++ )
+        big[ b ] = b ;
+    for ( int indent = -2 ; indent <= 70 ; indent++ )
+        for ( int len = 0 ; len <= CHECK_MAX ; len++ )
+            checkOne( big + ( len & 7 ) , len , indent ) ;
+    checkOne( big , 0x12345 , 4 ) ;
+    checkOne( big , sizeof(big) , 8 ) ;
+    printf( "hexDump() matches BIO_dump_indent_fp() for every length up to %d "
+            "and indent -2 .. 70\n\n" , CHECK_MAX ) ;
+
+    FILE *devNull = fopen( "/dev/null" , "w" ) ;
+    if ( devNull == NULL )
+        exitError( "benchHexdump: cannot open /dev/null" ) ;
+
+    for ( unsigned s = 0 ; s < sizeof(sizes) / sizeof(sizes[0]) ; s++ )
+    {
+        unsigned n     = sizes[ s ] ;
+        unsigned iters = ITERATIONS / ( 1 + n / 64 ) ;
+
+        t0 = nowNs() ;
+        for ( unsigned i = 0 ; i < iters ; i++ )
+            BIO_dump_indent_fp( devNull , big , n , 4 ) ;
+        snprintf( name , sizeof(name) , "BIO_dump_indent_fp  %5u B" , n ) ;
+        benchReport( name , nowNs() - t0 , iters ) ;
+
+        t0 = nowNs() ;
+        for ( unsigned i = 0 ; i < iters ; i++ )
+            hexDump_fp( devNull , big , n , 4 ) ;
+        snprintf( name , sizeof(name) , "hexDump_fp          %5u B" , n ) ;
+        benchReport( name , nowNs() - t0 , iters ) ;
+    }
+
+    fclose( devNull ) ;
+    return 0 ;
+}
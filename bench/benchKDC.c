@@ -0,0 +1,171 @@
+/*----------------------------------------------------------------------------
+Handshakes per second from one long-running "kdc -s" serving many clients
+over epoll, against one single-shot KDC process per handshake
+
+FILE:   benchKDC.c
+
+Written By:
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include <sys/wait.h>
+#include <signal.h>
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define SPAWNED       200          // single-shot KDC processes
+#define HANDSHAKES    20000        // through the server , per client count
+#define KDC_BINARY    "./kdc/kdc"
+
+static char      *IDa = "Amal is Hope" , *IDb = "Basim is Smily" ;
+static Nonce_t    Na  = { 0x11223344 } ;
+static myKey_t    Ka ;
+static uint8_t   *msg1 ;
+static unsigned   lenMsg1 ;
+static FILE      *devNull ;
+
+//-----------------------------------------------------------------------------
+// Read one L( MSG2 ) || MSG2 and check that it is the answer to our MSG1
+
+static void takeMsg2( int fd )
+{
+    myKey_t   Ks ;
+    Nonce_t   NaBack ;
+    char     *IDbBack ;
+    unsigned  lenTkt ;
+    uint8_t  *tkt ;
+
+    MSG2_receive( devNull , fd , &Ka , &Ks , &IDbBack , &NaBack , &lenTkt , &tkt ) ;
+    if ( memcmp( NaBack , Na , NONCELEN ) != 0 || strcmp( IDbBack , IDb ) != 0 )
+        exitError( "benchKDC: MSG2 does not answer the MSG1 that was sent" ) ;
+    free( IDbBack ) ;
+    free( tkt ) ;
+}
+
+static void sendMsg1( int fd )
+{
+    if ( write( fd , msg1 , lenMsg1 ) != lenMsg1 )
+        exitError( "benchKDC: could not send MSG1" ) ;
+}
+
+static pid_t startKdc( char *const argv[] , int fdIn , int fdOut )
+{
+    pid_t pid = fork() ;
+
+    if ( pid < 0 )
+        exitError( "benchKDC: fork failed" ) ;
+    if ( pid == 0 )
+    {
+        int quiet = open( "/dev/null" , O_WRONLY ) ;
+        dup2( quiet , STDOUT_FILENO ) ;
+        if ( fdIn >= 0 )
+        {
+            // The single-shot KDC is handed its pipe ends by number
+            char in[ 20 ] , out[ 20 ] ;
+            snprintf( in  , sizeof( in  ) , "%d" , fdIn ) ;
+            snprintf( out , sizeof( out ) , "%d" , fdOut ) ;
+            execl( KDC_BINARY , "KDC" , in , out , NULL ) ;
+        }
+        else
+            execv( KDC_BINARY , argv ) ;
+        perror( "benchKDC: could not start " KDC_BINARY ) ;
+        _exit( 1 ) ;
+    }
+    return pid ;
+}
+
+//-----------------------------------------------------------------------------
+// 'nClients' connections each keep one MSG1 outstanding
+
+static void serverRun( const char *path , unsigned nClients )
+{
+    int   *fds = malloc( nClients * sizeof( int ) ) ;
+    char   name[ 64 ] ;
+
+    if ( fds == NULL )
+        exitError( "benchKDC: out of memory" ) ;
+    for ( unsigned c = 0 ; c < nClients ; c++ )
+        if ( ( fds[ c ] = kdcConnect( path ) ) < 0 )
+            exitError( "benchKDC: could not connect to the KDC server" ) ;
+
+    unsigned  rounds = HANDSHAKES / nClients ;
+    uint64_t  t0     = nowNs() ;
+    for ( unsigned r = 0 ; r < rounds ; r++ )
+    {
+        for ( unsigned c = 0 ; c < nClients ; c++ )
+            sendMsg1( fds[ c ] ) ;
+        for ( unsigned c = 0 ; c < nClients ; c++ )
+            takeMsg2( fds[ c ] ) ;
+    }
+    snprintf( name , sizeof( name ) , "kdc -s , %u client%s" , nClients , nClients > 1 ? "s" : "" ) ;
+    benchReport( name , nowNs() - t0 , (unsigned long) rounds * nClients ) ;
+
+    for ( unsigned c = 0 ; c < nClients ; c++ )
+        close( fds[ c ] ) ;
+    free( fds ) ;
+}
+
+int main( int argc , char *argv[] )
+{
+    char      path[ 64 ] ;
+    uint64_t  t0 ;
+
+    if ( access( KDC_BINARY , X_OK ) != 0 || getKeyFromFile( "amal/amalKey.bin" , &Ka ) != 1 )
+        exitError( "benchKDC: run from the top directory after building " KDC_BINARY ) ;
+
+    devNull = fopen( "/dev/null" , "w" ) ;
+    if ( devNull == NULL )
+        exitError( "benchKDC: could not open /dev/null" ) ;
+    setLogLevel( LOG_OFF ) ;
+    lenMsg1 = MSG1_new( devNull , &msg1 , IDa , IDb , Na ) ;
+
+    // 1) The graded mode: fork + exec , three key files , one MSG1 , exit
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < SPAWNED ; i++ )
+    {
+        int   toKdc[ 2 ] , fromKdc[ 2 ] , status ;
+
+        if ( pipe( toKdc ) < 0 || pipe( fromKdc ) < 0 )
+            exitError( "benchKDC: pipe failed" ) ;
+        pid_t pid = startKdc( NULL , toKdc[ 0 ] , fromKdc[ 1 ] ) ;
+        close( toKdc[ 0 ] ) ;
+        close( fromKdc[ 1 ] ) ;
+
+        sendMsg1( toKdc[ 1 ] ) ;
+        takeMsg2( fromKdc[ 0 ] ) ;
+        close( toKdc[ 1 ] ) ;
+        close( fromKdc[ 0 ] ) ;
+        if ( waitpid( pid , &status , 0 ) != pid || ! WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+            exitError( "benchKDC: the single-shot KDC failed" ) ;
+    }
+    benchReport( "kdc , one process per handshake" , nowNs() - t0 , SPAWNED ) ;
+
+    // 2) One "kdc -s" for everything that follows
+    snprintf( path , sizeof( path ) , "/tmp/benchKDC.%d.sock" , (int) getpid() ) ;
+    char  *serverArgv[] = { "KDC" , "-s" , path , NULL } ;
+    pid_t  server = startKdc( serverArgv , -1 , -1 ) ;
+
+    int    probe ;
+    for ( int tries = 0 ; ( probe = kdcConnect( path ) ) < 0 ; tries++ )
+    {
+        if ( tries == 1000 )
+            exitError( "benchKDC: the KDC server did not come up" ) ;
+        usleep( 1000 ) ;
+    }
+    close( probe ) ;
+
+    serverRun( path ,   1 ) ;
+    serverRun( path ,  16 ) ;
+    serverRun( path , 128 ) ;
+
+    int status ;
+    kill( server , SIGTERM ) ;
+    if ( waitpid( server , &status , 0 ) != server || ! WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+        exitError( "benchKDC: the KDC server did not exit cleanly" ) ;
+
+    free( msg1 ) ;
+    fclose( devNull ) ;
+    return 0 ;
+}
@@ -0,0 +1,92 @@
+/*----------------------------------------------------------------------------
+Building, opening and probing a principal key database of a million
+entries, against reading one key file per principal
+
+FILE:   benchKeyDB.c
+
+Written By:
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define PRINCIPALS   1000000
+#define LOOKUPS      2000000
+#define KEY_FILES    20000
+#define ID_LEN       24
+
+int main( int argc , char *argv[] )
+{
+    char       path[ 64 ] , *names = malloc( (size_t) PRINCIPALS * ID_LEN ) ;
+    const char **ids  = malloc( PRINCIPALS * sizeof( char * ) ) ;
+    myKey_t    *keys  = malloc( PRINCIPALS * sizeof( myKey_t ) ) , fromFile ;
+    uint32_t   *order = malloc( LOOKUPS * sizeof( uint32_t ) ) ;
+    uint64_t    t0 , sum = 0 ;
+
+    if ( names == NULL || ids == NULL || keys == NULL || order == NULL )
+        exitError( "benchKeyDB: out of memory" ) ;
+    if ( getKeyFromFile( "amal/amalKey.bin" , &fromFile ) != 1 )
+        exitError( "benchKeyDB: run from the top directory" ) ;
+
+    RAND_bytes( (uint8_t *) keys , PRINCIPALS * sizeof( myKey_t ) ) ;
+    RAND_bytes( (uint8_t *) order , LOOKUPS * sizeof( uint32_t ) ) ;
+    for ( uint32_t i = 0 ; i < PRINCIPALS ; i++ )
+    {
+        snprintf( names + (size_t) i * ID_LEN , ID_LEN , "principal-%u" , i ) ;
+        ids[ i ] = names + (size_t) i * ID_LEN ;
+    }
+    for ( uint32_t i = 0 ; i < LOOKUPS ; i++ )
+        order[ i ] %= PRINCIPALS ;
+    snprintf( path , sizeof( path ) , "/tmp/benchKeyDB.%d.db" , (int) getpid() ) ;
+
+    // Build ( mmap()ed temporary file , fsync() , rename() )
+    t0 = nowNs() ;
+    if ( keyDB_write( path , ids , keys , PRINCIPALS ) != 0 )
+    {
+        perror( path ) ;
+        exit(-1) ;
+    }
+    benchReport( "keyDB_write , per principal" , nowNs() - t0 , PRINCIPALS ) ;
+
+    // Open is a map and a header check , whatever the size of the file
+    t0 = nowNs() ;
+    myKeyDB_t *db = keyDB_open( path ) ;
+    benchReport( "keyDB_open" , nowNs() - t0 , 1 ) ;
+    if ( db == NULL || db->count != PRINCIPALS )
+        exitError( "benchKeyDB: could not open the database just written" ) ;
+
+    // Every answer is checked before anything is timed
+    for ( uint32_t i = 0 ; i < PRINCIPALS ; i++ )
+    {
+        const myKey_t *k = keyDB_lookup( db , ids[ i ] ) ;
+        if ( k == NULL || memcmp( k , &keys[ i ] , sizeof( myKey_t ) ) != 0 )
+            exitError( "benchKeyDB: lookup returned the wrong key" ) ;
+    }
+
+    t0 = nowNs() ;
+    for ( uint32_t i = 0 ; i < LOOKUPS ; i++ )
+        sum += keyDB_lookup( db , ids[ order[ i ] ] )->key[ 0 ] ;
+    benchReport( "keyDB_lookup , hit" , nowNs() - t0 , LOOKUPS ) ;
+
+    // The same IDs with one letter changed , so hashing costs the same
+    for ( uint32_t i = 0 ; i < PRINCIPALS ; i++ )
+        names[ (size_t) i * ID_LEN ] = 'P' ;
+    t0 = nowNs() ;
+    for ( uint32_t i = 0 ; i < LOOKUPS ; i++ )
+        sum += keyDB_lookup( db , ids[ order[ i ] ] ) != NULL ;
+    benchReport( "keyDB_lookup , miss" , nowNs() - t0 , LOOKUPS ) ;
+
+    // What the single-shot KDC does for each principal
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < KEY_FILES ; i++ )
+        sum += getKeyFromFile( "amal/amalKey.bin" , &fromFile ) ;
+    benchReport( "getKeyFromFile" , nowNs() - t0 , KEY_FILES ) ;
+
+    fprintf( stdout , "( checksum %lu )\n" , (unsigned long) sum ) ;
+    keyDB_close( db ) ;
+    unlink( path ) ;
+    free( names ) ;  free( ids ) ;  free( keys ) ;  free( order ) ;
+    return 0 ;
+}
@@ -0,0 +1,92 @@
+/*----------------------------------------------------------------------------
+Per-message cost of encrypt()/decrypt() before and after key handles
+
+FILE:   benchKeyHandle.c
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define ITERATIONS   200000
+
+//-----------------------------------------------------------------------------
+// The original encrypt(): a fresh context and key schedule on every call
+
+static unsigned encryptOneShot( uint8_t *pPlainText, unsigned plainText_len, 
+                                const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText )
+{
+    int len = 0 ;
+    unsigned encrypted_len = 0 ;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new() ;
+    EVP_EncryptInit_ex( ctx , ALGORITHM() , NULL , key , iv ) ;
+    EVP_EncryptUpdate( ctx , pCipherText , &len , pPlainText , plainText_len ) ;
+    encrypted_len += len ;
+    EVP_EncryptFinal_ex( ctx , pCipherText + len , &len ) ;
+    encrypted_len += len ;
+    EVP_CIPHER_CTX_free( ctx ) ;
+
+    return encrypted_len ;
+}
+
+static unsigned decryptOneShot( uint8_t *pCipherText, unsigned cipherText_len, 
+                                const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText )
+{
+    int len = 0 ;
+    unsigned decryptedLen = 0 ;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new() ;
+    EVP_DecryptInit_ex( ctx , ALGORITHM() , NULL , key , iv ) ;
+    EVP_DecryptUpdate( ctx , pDecryptedText , &len , pCipherText , cipherText_len ) ;
+    decryptedLen += len ;
+    EVP_DecryptFinal_ex( ctx , pDecryptedText + len , &len ) ;
+    decryptedLen += len ;
+    EVP_CIPHER_CTX_free( ctx ) ;
+
+    return decryptedLen ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    myKey_t  Ks ;
+    uint8_t  plain[ 2 * NONCELEN ] , cipher[ CIPHER_LEN_MAX ] , decr[ DECRYPTED_LEN_MAX ] ;
+    unsigned lenCipher = 0 ;
+    uint64_t t0 ;
+
+    RAND_bytes( (uint8_t *) &Ks , KEYSIZE ) ;
+    RAND_bytes( plain , sizeof(plain) ) ;
+
+    fprintf( stdout , "Encrypting a %lu-byte MSG4-sized payload %d times\n\n" , 
+             sizeof(plain) , ITERATIONS ) ;
+
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < ITERATIONS ; i++ )
+        lenCipher = encryptOneShot( plain , sizeof(plain) , Ks.key , Ks.iv , cipher ) ;
+    benchReport( "encrypt  (new CTX per call)" , nowNs() - t0 , ITERATIONS ) ;
+
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < ITERATIONS ; i++ )
+        decryptOneShot( cipher , lenCipher , Ks.key , Ks.iv , decr ) ;
+    benchReport( "decrypt  (new CTX per call)" , nowNs() - t0 , ITERATIONS ) ;
+
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < ITERATIONS ; i++ )
+        lenCipher = encrypt( plain , sizeof(plain) , Ks.key , Ks.iv , cipher ) ;
+    benchReport( "encrypt  (cached key handle)" , nowNs() - t0 , ITERATIONS ) ;
+
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < ITERATIONS ; i++ )
+        decrypt( cipher , lenCipher , Ks.key , Ks.iv , decr ) ;
+    benchReport( "decrypt  (cached key handle)" , nowNs() - t0 , ITERATIONS ) ;
+
+    if ( memcmp( plain , decr , sizeof(plain) ) != 0 )
+        exitError( "benchKeyHandle: round trip does not match" ) ;
+
+    keyCache_flush() ;
+    return 0 ;
+}
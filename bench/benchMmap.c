@@ -0,0 +1,94 @@
+/*----------------------------------------------------------------------------
+Stream against mmap engines for encryptFile(), decryptFile() and fileDigest()
+
+FILE:   benchMmap.c
+
+Usage:  benchMmap [ size in MB ]      ( default 256 MB )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+static char  plainName[]  = "/tmp/benchMmapPlainXXXXXX" ,
+             cipherName[] = "/tmp/benchMmapCipherXXXXXX" ,
+             roundName[]  = "/tmp/benchMmapRoundXXXXXX" ;
+
+typedef enum { OP_ENCRYPT , OP_DECRYPT , OP_DIGEST }  op_t ;
+
+//-----------------------------------------------------------------------------
+// Run one operation with the given engine and print time, MB/s and syscalls
+// The output is opened O_RDWR so that the mmap engine can map it as well
+
+static void run( op_t op , ioEngine_t engine , const myKey_t *K , size_t size , uint8_t *md )
+{
+    static const char *opName[] = { "encryptFile()" , "decryptFile()" , "fileDigest() " } ;
+    char   *from = op == OP_DECRYPT ? cipherName : plainName ,
+           *to   = op == OP_ENCRYPT ? cipherName : roundName ;
+    int     fd_in  = open( from , O_RDONLY ) ,
+            fd_out = op == OP_DIGEST ? -1 : open( to , O_RDWR | O_CREAT | O_TRUNC , 0600 ) ;
+
+    if ( fd_in < 0 || ( op != OP_DIGEST && fd_out < 0 ) )
+        exitError( "benchMmap: could not open the scratch files" ) ;
+
+    setIOEngine( engine ) ;
+    unsigned long  sc0 = ioSyscalls() ;
+    uint64_t       t0  = nowNs() ;
+
+    if ( op == OP_ENCRYPT )
+        encryptFile( fd_in , fd_out , K->key , K->iv ) ;
+    else if ( op == OP_DECRYPT )
+        decryptFile( fd_in , fd_out , K->key , K->iv ) ;
+    else
+        fileDigest( fd_in , fd_out , md ) ;
+
+    uint64_t       ns = nowNs() - t0 ;
+    unsigned long  sc = ioSyscalls() - sc0 ;
+
+    fprintf( stdout , "%s %-7s %10.1f ms %10.1f MB/s %10lu read/write syscalls\n" , opName[ op ] , 
+             engine == IO_ENGINE_STREAM ? "stream" : "mmap" , ns / 1e6 , size / 1e6 / ( ns / 1e9 ) , sc ) ;
+
+    close( fd_in ) ;
+    if ( fd_out >= 0 )
+        close( fd_out ) ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t    size = ( argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 256 ) << 20 ;
+    myKey_t   K ;
+    uint8_t   buf[ 1 << 16 ] , md1[ EVP_MAX_MD_SIZE ] , md2[ EVP_MAX_MD_SIZE ] ;
+
+    RAND_bytes( (uint8_t *) &K , KEYSIZE ) ;
+
+    int fd = mkstemp( plainName ) ;
+    close( mkstemp( cipherName ) ) ;
+    close( mkstemp( roundName ) ) ;
+    for ( size_t done = 0 ; done < size ; done += sizeof(buf) )
+    {
+        RAND_bytes( buf , sizeof(buf) ) ;
+        write( fd , buf , sizeof(buf) ) ;
+    }
+    close( fd ) ;
+
+    fprintf( stdout , "%zu MB file ( page cache warm )\n\n" , size >> 20 ) ;
+
+    ioEngine_t engines[] = { IO_ENGINE_STREAM , IO_ENGINE_MMAP } ;
+    for ( int e = 0 ; e < 2 ; e++ )
+    {
+        run( OP_ENCRYPT , engines[ e ] , &K , size , NULL ) ;
+        run( OP_DECRYPT , engines[ e ] , &K , size , NULL ) ;
+        run( OP_DIGEST  , engines[ e ] , &K , size , e == 0 ? md1 : md2 ) ;
+        fprintf( stdout , "\n" ) ;
+    }
+
+    if ( memcmp( md1 , md2 , SHA256_DIGEST_LENGTH ) != 0 )
+        exitError( "benchMmap: the two engines disagree on the digest" ) ;
+
+    unlink( plainName ) ;  unlink( cipherName ) ;  unlink( roundName ) ;
+    return 0 ;
+}
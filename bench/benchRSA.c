@@ -0,0 +1,82 @@
+/*----------------------------------------------------------------------------
+getRSAfromFile(): PEM parse every call, cache hits, and DER sidecar loads
+
+FILE:   benchRSA.c
+
+Usage:  benchRSA [ iterations ]      ( default 2000 )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+static char  pemName[] = "/tmp/benchRSAXXXXXX" ;
+
+//-----------------------------------------------------------------------------
+// Load the key 'iters' times, flushing the cache first when 'flush' is set
+
+static void run( const char *name , int public , int iters , int flush )
+{
+    uint64_t t0 = nowNs() ;
+    for ( int i = 0 ; i < iters ; i++ )
+    {
+        if ( flush )
+            rsaCache_flush() ;
+        RSA *rsa = getRSAfromFile( pemName , public ) ;
+        if ( rsa == NULL )
+            exitError( "benchRSA: could not load the key" ) ;
+        RSA_free( rsa ) ;
+    }
+    benchReport( name , nowNs() - t0 , iters ) ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    int      iters = argc > 1 ? atoi( argv[1] ) : 2000 ;
+    char     derName[ sizeof(pemName) + 4 ] ;
+    RSA     *rsa = RSA_new() ;
+    BIGNUM  *e   = BN_new() ;
+
+    BN_set_word( e , RSA_F4 ) ;
+    if ( RSA_generate_key_ex( rsa , 2048 , e , NULL ) != 1 )
+        exitError( "benchRSA: could not generate a key" ) ;
+
+    for ( int public = 0 ; public <= 1 ; public++ )
+    {
+        int   fd = mkstemp( pemName ) ;
+        FILE *fp = fdopen( fd , "w" ) ;
+        if ( public )
+            PEM_write_RSA_PUBKEY( fp , rsa ) ;
+        else
+            PEM_write_RSAPrivateKey( fp , rsa , NULL , NULL , 0 , NULL , NULL ) ;
+        fclose( fp ) ;
+        sprintf( derName , "%s.der" , pemName ) ;
+
+        fprintf( stdout , "\n2048-bit %s key\n" , public ? "public" : "private" ) ;
+
+        setRSAderSidecar( 0 ) ;
+        run( "PEM parse per call" , public , iters , 1 ) ;
+        run( "cache hit"          , public , iters , 0 ) ;
+        if ( public )                                  // private keys get no sidecar
+        {
+            setRSAderSidecar( 1 ) ;
+            rsaCache_flush() ;
+            RSA_free( getRSAfromFile( pemName , public ) ) ;   // writes the sidecar
+            run( "DER sidecar per call" , public , iters , 1 ) ;
+            setRSAderSidecar( 0 ) ;
+        }
+
+        rsaCache_flush() ;
+        unlink( derName ) ;
+        unlink( pemName ) ;
+        strcpy( pemName + strlen( pemName ) - 6 , "XXXXXX" ) ;
+    }
+
+    RSA_free( rsa ) ;
+    BN_free( e ) ;
+    return 0 ;
+}
@@ -0,0 +1,276 @@
+/*----------------------------------------------------------------------------
+Handshake latency through "kdc -s" while its key database is replaced and
+reloaded ( SIGHUP ) every few milliseconds, against the same load without
+reloads
+
+FILE:   benchReload.c
+
+Written By:
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define CLIENTS        16
+#define ROUNDS         5000         // each client keeps one MSG1 outstanding
+#define PRINCIPALS     100000       // besides Amal and Basim , in each version
+#define RELOAD_US      2000         // between two reloads
+#define KDC_BINARY     "./kdc/kdc"
+#define SERVER_LOG     "kdc/logKDCserver.txt"
+
+static char      *IDa = "Amal is Hope" , *IDb = "Basim is Smily" ;
+static Nonce_t    Na  = { 0x55667788 } ;
+static myKey_t    Ka ;
+static uint8_t   *msg1 ;
+static unsigned   lenMsg1 ;
+static FILE      *devNull ;
+
+static char       live[ 64 ] , version[ 2 ][ 64 ] ;
+static pid_t      server ;
+static int        reloading ;
+static unsigned   reloads ;
+
+//-----------------------------------------------------------------------------
+// Two versions of the database: the same Amal and Basim , different others
+
+static void buildVersions( void )
+{
+    const char **ids  = malloc( ( PRINCIPALS + 2 ) * sizeof( char * ) ) ;
+    myKey_t     *keys = malloc( ( PRINCIPALS + 2 ) * sizeof( myKey_t ) ) ;
+    char        *names = malloc( (size_t) PRINCIPALS * 24 ) ;
+
+    if ( ids == NULL || keys == NULL || names == NULL )
+        exitError( "benchReload: out of memory" ) ;
+    if ( getKeyFromFile( "amal/amalKey.bin" , &keys[ 0 ] ) != 1
+         || getKeyFromFile( "basim/basimKey.bin" , &keys[ 1 ] ) != 1 )
+        exitError( "benchReload: run from the top directory" ) ;
+    ids[ 0 ] = IDa ;
+    ids[ 1 ] = IDb ;
+    for ( unsigned i = 0 ; i < PRINCIPALS ; i++ )
+    {
+        snprintf( names + (size_t) i * 24 , 24 , "principal-%u" , i ) ;
+        ids[ i + 2 ] = names + (size_t) i * 24 ;
+    }
+
+    for ( int v = 0 ; v < 2 ; v++ )
+    {
+        RAND_bytes( (uint8_t *) &keys[ 2 ] , PRINCIPALS * sizeof( myKey_t ) ) ;
+        if ( keyDB_write( version[ v ] , ids , keys , PRINCIPALS + 2 ) != 0 )
+        {
+            perror( version[ v ] ) ;
+            exit(-1) ;
+        }
+    }
+    free( ids ) ;  free( keys ) ;  free( names ) ;
+}
+
+// Swap the other version in the way "./keyDB" does , by rename() , and
+// tell the server
+static void *reloader( void *arg )
+{
+    char tmp[ 80 ] ;
+
+    snprintf( tmp , sizeof( tmp ) , "%s.next" , live ) ;
+    while ( __atomic_load_n( &reloading , __ATOMIC_ACQUIRE ) )
+    {
+        if ( link( version[ ( reloads + 1 ) % 2 ] , tmp ) != 0 || rename( tmp , live ) != 0 )
+            exitError( "benchReload: could not replace the database" ) ;
+        kill( server , SIGHUP ) ;
+        reloads++ ;
+        usleep( RELOAD_US ) ;
+    }
+    return NULL ;
+}
+
+//-----------------------------------------------------------------------------
+// What a reader and a reload cost in one process , with nothing competing
+
+static void costs( void )
+{
+    myKeyStore_t  *ks     = keyStore_open( live ) ;
+    int            reader ;
+    uint64_t       t0 , sum = 0 ;
+
+    if ( ks == NULL )
+        exitError( "benchReload: could not open the key store" ) ;
+    reader = keyStore_reader( ks ) ;
+
+    const myKeySnap_t *snap = keyStore_enter( ks , reader ) ;
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < 1000000 ; i++ )
+        sum += keyDB_lookup( snap->db , IDa )->key[ 0 ] ;
+    benchReport( "keyDB_lookup" , nowNs() - t0 , 1000000 ) ;
+    keyStore_exit( ks , reader ) ;
+
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < 1000000 ; i++ )
+    {
+        snap = keyStore_enter( ks , reader ) ;
+        sum += keyDB_lookup( snap->db , IDa )->key[ 0 ] ;
+        keyStore_exit( ks , reader ) ;
+    }
+    benchReport( "keyStore_enter + lookup + exit" , nowNs() - t0 , 1000000 ) ;
+
+    t0 = nowNs() ;
+    for ( int i = 0 ; i < 1000 ; i++ )
+        sum += keyStore_reload( ks ) == 0 ;
+    benchReport( "keyStore_reload" , nowNs() - t0 , 1000 ) ;
+
+    keyStore_close( ks ) ;
+    if ( sum == 0 )
+        fprintf( stdout , "( checksum %lu )\n" , (unsigned long) sum ) ;
+}
+
+//-----------------------------------------------------------------------------
+static int cmpNs( const void *a , const void *b )
+{
+    uint64_t x = *(const uint64_t *) a , y = *(const uint64_t *) b ;
+    return ( x > y ) - ( x < y ) ;
+}
+
+static void report( const char *name , uint64_t *ns , unsigned n )
+{
+    qsort( ns , n , sizeof( uint64_t ) , cmpNs ) ;
+    fprintf( stdout , "%-28s p50 %7.1f us   p99 %7.1f us   p999 %7.1f us   max %8.1f us\n" , name ,
+             ns[ n / 2 ] / 1e3 , ns[ n * 99 / 100 ] / 1e3 , ns[ n * 999 / 1000 ] / 1e3 , ns[ n - 1 ] / 1e3 ) ;
+}
+
+// ROUNDS rounds of one MSG1 per client; the latency of each is from its
+// send to its MSG2 being read and checked
+static void run( const char *path , const char *name , uint64_t *ns )
+{
+    int       fds[ CLIENTS ] ;
+    uint64_t  sent[ CLIENTS ] ;
+
+    for ( int c = 0 ; c < CLIENTS ; c++ )
+        if ( ( fds[ c ] = kdcConnect( path ) ) < 0 )
+            exitError( "benchReload: could not connect to the KDC server" ) ;
+
+    uint64_t t0 = nowNs() ;
+    for ( unsigned r = 0 ; r < ROUNDS ; r++ )
+    {
+        for ( int c = 0 ; c < CLIENTS ; c++ )
+        {
+            sent[ c ] = nowNs() ;
+            if ( write( fds[ c ] , msg1 , lenMsg1 ) != lenMsg1 )
+                exitError( "benchReload: could not send MSG1" ) ;
+        }
+        for ( int c = 0 ; c < CLIENTS ; c++ )
+        {
+            myKey_t   Ks ;
+            Nonce_t   NaBack ;
+            char     *IDbBack ;
+            unsigned  lenTkt ;
+            uint8_t  *tkt ;
+
+            MSG2_receive( devNull , fds[ c ] , &Ka , &Ks , &IDbBack , &NaBack , &lenTkt , &tkt ) ;
+            ns[ r * CLIENTS + c ] = nowNs() - sent[ c ] ;
+            if ( memcmp( NaBack , Na , NONCELEN ) != 0 || strcmp( IDbBack , IDb ) != 0 )
+                exitError( "benchReload: MSG2 does not answer the MSG1 that was sent" ) ;
+            free( IDbBack ) ;
+            free( tkt ) ;
+        }
+    }
+    benchReport( name , nowNs() - t0 , ROUNDS * CLIENTS ) ;
+
+    for ( int c = 0 ; c < CLIENTS ; c++ )
+        close( fds[ c ] ) ;
+}
+
+//-----------------------------------------------------------------------------
+static unsigned reloadsLogged( void )
+{
+    char      line[ 256 ] ;
+    unsigned  n = 0 ;
+    FILE     *f = fopen( SERVER_LOG , "r" ) ;
+
+    while ( f != NULL && fgets( line , sizeof( line ) , f ) )
+        n += strstr( line , "as key database version" ) != NULL ;
+    if ( f != NULL )
+        fclose( f ) ;
+    return n ;
+}
+
+int main( int argc , char *argv[] )
+{
+    char       sock[ 64 ] ;
+    uint64_t  *steady = malloc( ROUNDS * CLIENTS * sizeof( uint64_t ) ) ;
+    uint64_t  *moving = malloc( ROUNDS * CLIENTS * sizeof( uint64_t ) ) ;
+    pthread_t  thread ;
+    int        status ;
+
+    if ( steady == NULL || moving == NULL )
+        exitError( "benchReload: out of memory" ) ;
+    if ( access( KDC_BINARY , X_OK ) != 0 || getKeyFromFile( "amal/amalKey.bin" , &Ka ) != 1 )
+        exitError( "benchReload: run from the top directory after building " KDC_BINARY ) ;
+
+    devNull = fopen( "/dev/null" , "w" ) ;
+    if ( devNull == NULL )
+        exitError( "benchReload: could not open /dev/null" ) ;
+    setLogLevel( LOG_OFF ) ;
+    lenMsg1 = MSG1_new( devNull , &msg1 , IDa , IDb , Na ) ;
+
+    int pid = (int) getpid() ;
+    snprintf( sock         , sizeof( sock )         , "/tmp/benchReload.%d.sock" , pid ) ;
+    snprintf( live         , sizeof( live )         , "/tmp/benchReload.%d.db"   , pid ) ;
+    snprintf( version[ 0 ] , sizeof( version[ 0 ] ) , "/tmp/benchReload.%d.v0"   , pid ) ;
+    snprintf( version[ 1 ] , sizeof( version[ 1 ] ) , "/tmp/benchReload.%d.v1"   , pid ) ;
+    buildVersions() ;
+    if ( link( version[ 0 ] , live ) != 0 )
+        exitError( "benchReload: could not create the live database" ) ;
+    costs() ;
+
+    // The server logs each reload ( LOG_INFO ) and nothing per handshake
+    server = fork() ;
+    if ( server < 0 )
+        exitError( "benchReload: fork failed" ) ;
+    if ( server == 0 )
+    {
+        int quiet = open( "/dev/null" , O_WRONLY ) ;
+        dup2( quiet , STDOUT_FILENO ) ;
+        setenv( LOG_LEVEL_ENV , "info" , 1 ) ;
+        execl( KDC_BINARY , "KDC" , "-s" , sock , live , NULL ) ;
+        perror( "benchReload: could not start " KDC_BINARY ) ;
+        _exit( 1 ) ;
+    }
+
+    int probe ;
+    for ( int tries = 0 ; ( probe = kdcConnect( sock ) ) < 0 ; tries++ )
+    {
+        if ( tries == 1000 )
+            exitError( "benchReload: the KDC server did not come up" ) ;
+        usleep( 1000 ) ;
+    }
+    close( probe ) ;
+
+    run( sock , "kdc -s , steady keys" , steady ) ;
+
+    __atomic_store_n( &reloading , 1 , __ATOMIC_RELEASE ) ;
+    if ( pthread_create( &thread , NULL , reloader , NULL ) != 0 )
+        exitError( "benchReload: could not start the reloader" ) ;
+    run( sock , "kdc -s , reloading" , moving ) ;
+    __atomic_store_n( &reloading , 0 , __ATOMIC_RELEASE ) ;
+    pthread_join( thread , NULL ) ;
+
+    kill( server , SIGTERM ) ;
+    if ( waitpid( server , &status , 0 ) != server || ! WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+        exitError( "benchReload: the KDC server did not exit cleanly" ) ;
+
+    fprintf( stdout , "\n%u databases of %u principals swapped in , %u reloads logged by the server\n" ,
+             reloads , PRINCIPALS + 2 , reloadsLogged() ) ;
+    report( "steady keys" , steady , ROUNDS * CLIENTS ) ;
+    report( "reloading"   , moving , ROUNDS * CLIENTS ) ;
+
+    unlink( live ) ;
+    unlink( version[ 0 ] ) ;
+    unlink( version[ 1 ] ) ;
+    free( steady ) ;  free( moving ) ;  free( msg1 ) ;
+    fclose( devNull ) ;
+    return 0 ;
+}
@@ -0,0 +1,410 @@
+/*----------------------------------------------------------------------------
+Microbenchmark suite for myCrypto: messages, files and the MSG1-MSG5 steps
+
+FILE:   benchSuite.c
+
+Usage:  benchSuite [ --json FILE ] [ --baseline FILE ] [ --threshold PCT ]
+                   [ --reps N ] [ --max-msg BYTES ] [ --max-file BYTES ]
+
+        Every case is warmed up, then timed over --reps repetitions ( default 5 )
+        of enough operations to last BENCH_REP_NS each; the median is reported
+        Message sizes sweep 16 B to --max-msg ( default 1 MB ) and file sizes
+        16 B to --max-file ( default 64 MB, pass 1073741824 for 1 GB ), x4 a step
+        Results go to --json ( default stdout ) as one JSON object per line
+        With --baseline, any case slower than the baseline by more than
+        --threshold percent ( default 10 ) is reported and the exit status is 1
+
+Written By:
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+#define BENCH_REP_NS      20000000ull      // target length of one repetition
+#define BENCH_WARMUP_NS   50000000ull
+#define BENCH_MAX_REPS    64
+#define BENCH_MAX_CASES   256
+
+//-----------------------------------------------------------------------------
+// allocs/op: count every allocation in the process, OpenSSL's included, by
+// interposing on the allocator and forwarding to glibc's own entry points
+
+extern void *__libc_malloc ( size_t n ) ;
+extern void *__libc_calloc ( size_t n , size_t size ) ;
+extern void *__libc_realloc( void *p , size_t n ) ;
+
+static unsigned long  nAllocs = 0 ;
+
+void *malloc( size_t n )
+{
+    __atomic_fetch_add( &nAllocs , 1 , __ATOMIC_RELAXED ) ;
+    return __libc_malloc( n ) ;
+}
+
+void *calloc( size_t n , size_t size )
+{
+    __atomic_fetch_add( &nAllocs , 1 , __ATOMIC_RELAXED ) ;
+    return __libc_calloc( n , size ) ;
+}
+
+void *realloc( void *p , size_t n )
+{
+    __atomic_fetch_add( &nAllocs , 1 , __ATOMIC_RELAXED ) ;
+    return __libc_realloc( p , n ) ;
+}
+
+//-----------------------------------------------------------------------------
+// One benchmark case: 'op' runs one operation of 'size' bytes
+
+typedef struct {
+            char     name[ 64 ] ;
+            size_t   size ;
+            double   nsPerOp , mbPerSec , allocsPerOp ;
+        }  result_t ;
+
+typedef void ( *benchOp_t )( size_t size ) ;
+
+static result_t  results[ BENCH_MAX_CASES ] ;
+static unsigned  nResults = 0 ;
+static unsigned  nReps = 5 ;
+
+static int cmpDouble( const void *a , const void *b )
+{
+    double x = *(const double *) a , y = *(const double *) b ;
+    return x < y ? -1 : x > y ;
+}
+
+static void measure( const char *name , size_t size , benchOp_t op )
+{
+    double    ns[ BENCH_MAX_REPS ] ;
+    uint64_t  t0 , elapsed = 0 ;
+    unsigned long iters = 0 , allocs ;
+
+    // Warm up, and learn how many operations fill one repetition
+    t0 = nowNs() ;
+    do
+    {
+        op( size ) ;
+        iters++ ;
+        elapsed = nowNs() - t0 ;
+    } while ( elapsed < BENCH_WARMUP_NS && iters < 1000000 ) ;
+
+    unsigned long perRep = iters * BENCH_REP_NS / ( elapsed ? elapsed : 1 ) ;
+    if ( perRep == 0 )
+        perRep = 1 ;
+
+    allocs = __atomic_load_n( &nAllocs , __ATOMIC_RELAXED ) ;
+    for ( unsigned r = 0 ; r < nReps ; r++ )
+    {
+        t0 = nowNs() ;
+        for ( unsigned long i = 0 ; i < perRep ; i++ )
+            op( size ) ;
+        ns[ r ] = (double) ( nowNs() - t0 ) / perRep ;
+    }
+    allocs = __atomic_load_n( &nAllocs , __ATOMIC_RELAXED ) - allocs ;
+    qsort( ns , nReps , sizeof(double) , cmpDouble ) ;
+
+    result_t *res = &results[ nResults++ ] ;
+    snprintf( res->name , sizeof(res->name) , "%s" , name ) ;
+    res->size        = size ;
+    res->nsPerOp     = ns[ nReps / 2 ] ;
+    res->mbPerSec    = size / res->nsPerOp * 1e3 ;
+    res->allocsPerOp = (double) allocs / ( perRep * nReps ) ;
+
+    fprintf( stderr , "%-16s %10zu B %14.1f ns/op %10.1f MB/s %8.2f allocs/op\n" ,
+             name , size , res->nsPerOp , res->mbPerSec , res->allocsPerOp ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Shared state for the operations
+
+static myKey_t   K , Ka , Kb , Ks ;
+static uint8_t  *msgIn , *msgOut , *msgCipher ;
+static unsigned  msgCipherLen ;
+static char      plainName[]  = "/tmp/benchSuitePlainXXXXXX" ,
+                 cipherName[] = "/tmp/benchSuiteCipherXXXXXX" ,
+                 outName[]    = "/tmp/benchSuiteOutXXXXXX" ;
+static FILE     *nullLog ;
+static int       pipeFd[ 2 ] ;
+
+static void opEncrypt( size_t size )
+{
+    encrypt( msgIn , size , K.key , K.iv , msgOut ) ;
+}
+
+static void opDecrypt( size_t size )
+{
+    decrypt( msgCipher , msgCipherLen , K.key , K.iv , msgOut ) ;
+}
+
+static void fileOp( const char *from , int which )
+{
+    int fd_in  = open( from , O_RDONLY ) ,
+        fd_out = which == 2 ? -1 : open( outName , O_RDWR | O_TRUNC ) ;
+    uint8_t md[ EVP_MAX_MD_SIZE ] ;
+
+    if ( which == 0 )
+        encryptFile( fd_in , fd_out , K.key , K.iv ) ;
+    else if ( which == 1 )
+        decryptFile( fd_in , fd_out , K.key , K.iv ) ;
+    else
+        fileDigest( fd_in , -1 , md ) ;
+
+    close( fd_in ) ;
+    if ( fd_out >= 0 )
+        close( fd_out ) ;
+}
+
+static void opEncryptFile( size_t size ) { fileOp( plainName  , 0 ) ; }
+static void opDecryptFile( size_t size ) { fileOp( cipherName , 1 ) ; }
+static void opFileDigest ( size_t size ) { fileOp( plainName  , 2 ) ; }
+
+//-----------------------------------------------------------------------------
+// The protocol steps, each _receive fed from a pipe exactly as the parties do:
+// MSG1 and MSG3 as they are, MSG2 / MSG4 / MSG5 behind their length
+
+static const char  IDa[] = "Amal is Hope" , IDb[] = "Basim is Smiley" ;
+static Nonce_t     Na , Na2 , Nb , fNa2 , fNb ;
+static uint8_t    *msg[ 6 ] ;
+static unsigned    msgLen[ 6 ] , tktLen ;
+static uint8_t    *tkt ;
+
+static void sendMsg( int n )
+{
+    if ( n == 2 || n == 4 || n == 5 )
+        write( pipeFd[ 1 ] , &msgLen[ n ] , LENSIZE ) ;
+    write( pipeFd[ 1 ] , msg[ n ] , msgLen[ n ] ) ;
+}
+
+static void opMSG1new( size_t size ) { uint8_t *m ; MSG1_new( nullLog , &m , IDa , IDb , Na ) ; free( m ) ; }
+static void opMSG2new( size_t size ) { uint8_t *m ; MSG2_new( nullLog , &m , &Ka , &Kb , &Ks , IDa , IDb , &Na ) ; free( m ) ; }
+static void opMSG3new( size_t size ) { uint8_t *m ; MSG3_new( nullLog , &m , tktLen , tkt , &Na2 ) ; free( m ) ; }
+static void opMSG4new( size_t size ) { uint8_t *m ; MSG4_new( nullLog , &m , &Ks , &fNa2 , &Nb ) ; free( m ) ; }
+static void opMSG5new( size_t size ) { uint8_t *m ; MSG5_new( nullLog , &m , &Ks , &fNb ) ; free( m ) ; }
+
+static void opMSG1receive( size_t size )
+{
+    char    *a , *b ;
+    Nonce_t  n ;
+    sendMsg( 1 ) ;
+    MSG1_receive( nullLog , pipeFd[ 0 ] , &a , &b , n ) ;
+    free( a ) ;  free( b ) ;
+}
+
+static void opMSG2receive( size_t size )
+{
+    myKey_t   s ;
+    char     *b ;
+    Nonce_t   n ;
+    unsigned  len ;
+    uint8_t  *t ;
+    sendMsg( 2 ) ;
+    MSG2_receive( nullLog , pipeFd[ 0 ] , &Ka , &s , &b , &n , &len , &t ) ;
+    free( b ) ;  free( t ) ;
+}
+
+static void opMSG3receive( size_t size )
+{
+    myKey_t   s ;
+    char     *a ;
+    Nonce_t   n ;
+    sendMsg( 3 ) ;
+    MSG3_receive( nullLog , pipeFd[ 0 ] , &Kb , &s , &a , &n ) ;
+    free( a ) ;
+}
+
+static void opMSG4receive( size_t size )
+{
+    Nonce_t  f , n ;
+    sendMsg( 4 ) ;
+    MSG4_receive( nullLog , pipeFd[ 0 ] , &Ks , &f , &n ) ;
+}
+
+static void opMSG5receive( size_t size )
+{
+    sendMsg( 5 ) ;
+    MSG5_receive( nullLog , pipeFd[ 0 ] , &Ks , &fNb ) ;
+}
+
+static void setupProtocol( void )
+{
+    RAND_bytes( (uint8_t *) &Ka , KEYSIZE ) ;
+    RAND_bytes( (uint8_t *) &Kb , KEYSIZE ) ;
+    RAND_bytes( (uint8_t *) &Ks , KEYSIZE ) ;
+    RAND_bytes( (uint8_t *) Na  , NONCELEN ) ;
+    RAND_bytes( (uint8_t *) Na2 , NONCELEN ) ;
+    RAND_bytes( (uint8_t *) Nb  , NONCELEN ) ;
+    fNonce( fNa2 , Na2 ) ;
+    fNonce( fNb  , Nb ) ;
+
+    if ( pipe( pipeFd ) != 0 || ( nullLog = fopen( "/dev/null" , "w" ) ) == NULL )
+        exitError( "benchSuite: could not set up the protocol pipe" ) ;
+
+    // Real messages to feed the receivers, built once
+    char     *b ;
+    myKey_t   s ;
+    Nonce_t   n ;
+    msgLen[ 1 ] = MSG1_new( nullLog , &msg[ 1 ] , IDa , IDb , Na ) ;
+    msgLen[ 2 ] = MSG2_new( nullLog , &msg[ 2 ] , &Ka , &Kb , &Ks , IDa , IDb , &Na ) ;
+    sendMsg( 2 ) ;
+    MSG2_receive( nullLog , pipeFd[ 0 ] , &Ka , &s , &b , &n , &tktLen , &tkt ) ;
+    free( b ) ;
+    msgLen[ 3 ] = MSG3_new( nullLog , &msg[ 3 ] , tktLen , tkt , &Na2 ) ;
+    msgLen[ 4 ] = MSG4_new( nullLog , &msg[ 4 ] , &Ks , &fNa2 , &Nb ) ;
+    msgLen[ 5 ] = MSG5_new( nullLog , &msg[ 5 ] , &Ks , &fNb ) ;
+}
+
+//-----------------------------------------------------------------------------
+
+static void makeFile( const char *name , size_t size )
+{
+    uint8_t  buf[ 1 << 16 ] ;
+    int      fd = open( name , O_WRONLY | O_TRUNC ) ;
+
+    for ( size_t done = 0 ; done < size ; )
+    {
+        size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf) ;
+        RAND_bytes( buf , n ) ;
+        if ( write( fd , buf , n ) != (ssize_t) n )
+            exitError( "benchSuite: could not write the scratch file" ) ;
+        done += n ;
+    }
+    close( fd ) ;
+}
+
+static void writeJson( FILE *out )
+{
+    fprintf( out , "{\"benchmarks\":[\n" ) ;
+    for ( unsigned i = 0 ; i < nResults ; i++ )
+        fprintf( out , "{\"name\":\"%s\",\"size\":%zu,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f,\"allocs_per_op\":%.2f}%s\n" ,
+                 results[ i ].name , results[ i ].size , results[ i ].nsPerOp , results[ i ].mbPerSec ,
+                 results[ i ].allocsPerOp , i + 1 < nResults ? "," : "" ) ;
+    fprintf( out , "]}\n" ) ;
+}
+
+// Compare with a file written by writeJson(). Returns the number of regressions
+static unsigned compareBaseline( const char *path , double threshold )
+{
+    char      line[ 512 ] , name[ 64 ] ;
+    size_t    size ;
+    double    ns , mb , allocs ;
+    unsigned  regressions = 0 , matched = 0 ;
+
+    FILE *fp = fopen( path , "r" ) ;
+    if ( fp == NULL )
+    {
+        fprintf( stderr , "benchSuite: no baseline at %s\n" , path ) ;
+        return 0 ;
+    }
+
+    fprintf( stderr , "\nAgainst baseline %s ( threshold %.0f%% ):\n" , path , threshold ) ;
+    while ( fgets( line , sizeof(line) , fp ) )
+    {
+        if ( sscanf( line , "{\"name\":\"%63[^\"]\",\"size\":%zu,\"ns_per_op\":%lf,\"mb_per_s\":%lf,\"allocs_per_op\":%lf" ,
+                     name , &size , &ns , &mb , &allocs ) != 5 )
+            continue ;
+
+        for ( unsigned i = 0 ; i < nResults ; i++ )
+        {
+            result_t *r = &results[ i ] ;
+            if ( r->size != size || strcmp( r->name , name ) != 0 )
+                continue ;
+
+            double change = ( r->nsPerOp / ns - 1 ) * 100 ;
+            matched++ ;
+            if ( change > threshold || r->allocsPerOp > allocs + 0.5 )
+            {
+                regressions++ ;
+                fprintf( stderr , "  REGRESSION %-16s %10zu B %+7.1f%% time   allocs/op %.2f -> %.2f\n" ,
+                         name , size , change , allocs , r->allocsPerOp ) ;
+            }
+            else if ( change < -threshold )
+                fprintf( stderr , "  faster     %-16s %10zu B %+7.1f%% time\n" , name , size , change ) ;
+        }
+    }
+    fclose( fp ) ;
+
+    fprintf( stderr , "  %u cases compared, %u regressions\n" , matched , regressions ) ;
+    return regressions ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    const char *jsonPath = NULL , *baseline = NULL ;
+    double      threshold = 10 ;
+    size_t      maxMsg  = 1 << 20 ,
+                maxFile = 64 << 20 ;
+
+    for ( int a = 1 ; a + 1 < argc ; a += 2 )
+    {
+        if      ( strcmp( argv[ a ] , "--json" ) == 0 )       jsonPath  = argv[ a + 1 ] ;
+        else if ( strcmp( argv[ a ] , "--baseline" ) == 0 )   baseline  = argv[ a + 1 ] ;
+        else if ( strcmp( argv[ a ] , "--threshold" ) == 0 )  threshold = atof( argv[ a + 1 ] ) ;
+        else if ( strcmp( argv[ a ] , "--reps" ) == 0 )       nReps     = atoi( argv[ a + 1 ] ) ;
+        else if ( strcmp( argv[ a ] , "--max-msg" ) == 0 )    maxMsg    = strtoull( argv[ a + 1 ] , NULL , 10 ) ;
+        else if ( strcmp( argv[ a ] , "--max-file" ) == 0 )   maxFile   = strtoull( argv[ a + 1 ] , NULL , 10 ) ;
+        else
+        {
+            fprintf( stderr , "benchSuite: unknown option %s\n" , argv[ a ] ) ;
+            exit( -1 ) ;
+        }
+    }
+    if ( nReps < 1 || nReps > BENCH_MAX_REPS )
+        nReps = 5 ;
+
+    RAND_bytes( (uint8_t *) &K , KEYSIZE ) ;
+    msgIn     = malloc( maxMsg ) ;
+    msgOut    = malloc( maxMsg + INITVECTOR_LEN ) ;
+    msgCipher = malloc( maxMsg + INITVECTOR_LEN ) ;
+    if ( msgIn == NULL || msgOut == NULL || msgCipher == NULL )
+        exitError( "benchSuite: Out of Memory allocating message buffers" ) ;
+    RAND_bytes( msgIn , maxMsg ) ;
+
+    for ( size_t size = 16 ; size <= maxMsg ; size *= 4 )
+        measure( "encrypt" , size , opEncrypt ) ;
+    for ( size_t size = 16 ; size <= maxMsg ; size *= 4 )
+    {
+        msgCipherLen = encrypt( msgIn , size , K.key , K.iv , msgCipher ) ;
+        measure( "decrypt" , size , opDecrypt ) ;
+    }
+
+    close( mkstemp( plainName ) ) ;
+    close( mkstemp( cipherName ) ) ;
+    close( mkstemp( outName ) ) ;
+    for ( size_t size = 16 ; size <= maxFile ; size *= 4 )
+    {
+        makeFile( plainName , size ) ;
+        measure( "encryptFile" , size , opEncryptFile ) ;
+
+        // encryptFile() left the ciphertext of this size in outName
+        rename( outName , cipherName ) ;
+        close( open( outName , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ) ;
+        measure( "decryptFile" , size , opDecryptFile ) ;
+        measure( "fileDigest"  , size , opFileDigest ) ;
+    }
+    unlink( plainName ) ;  unlink( cipherName ) ;  unlink( outName ) ;
+
+    setupProtocol() ;
+    measure( "MSG1_new"     , msgLen[ 1 ] , opMSG1new ) ;
+    measure( "MSG1_receive" , msgLen[ 1 ] , opMSG1receive ) ;
+    measure( "MSG2_new"     , msgLen[ 2 ] , opMSG2new ) ;
+    measure( "MSG2_receive" , msgLen[ 2 ] , opMSG2receive ) ;
+    measure( "MSG3_new"     , msgLen[ 3 ] , opMSG3new ) ;
+    measure( "MSG3_receive" , msgLen[ 3 ] , opMSG3receive ) ;
+    measure( "MSG4_new"     , msgLen[ 4 ] , opMSG4new ) ;
+    measure( "MSG4_receive" , msgLen[ 4 ] , opMSG4receive ) ;
+    measure( "MSG5_new"     , msgLen[ 5 ] , opMSG5new ) ;
+    measure( "MSG5_receive" , msgLen[ 5 ] , opMSG5receive ) ;
+
+    FILE *out = jsonPath ? fopen( jsonPath , "w" ) : stdout ;
+    if ( out == NULL )
+        exitError( "benchSuite: could not open the JSON output" ) ;
+    writeJson( out ) ;
+    if ( out != stdout )
+        fclose( out ) ;
+
+    return baseline && compareBaseline( baseline , threshold ) > 0 ? 1 : 0 ;
+}
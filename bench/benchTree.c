@@ -0,0 +1,61 @@
+/*----------------------------------------------------------------------------
+Plain SHA-256 fileDigest() against the Merkle tree digest on 1, 2, 4, ... threads
+
+FILE:   benchTree.c
+
+Usage:  benchTree [ size in MB ]      ( default 512 MB )
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+static char  plainName[] = "/tmp/benchTreeXXXXXX" ;
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t    size = ( argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 512 ) << 20 ;
+    uint8_t   buf[ 1 << 16 ] , md[ EVP_MAX_MD_SIZE ] ;
+    long      nCPU = sysconf( _SC_NPROCESSORS_ONLN ) ;
+
+    int fd = mkstemp( plainName ) ;
+    for ( size_t done = 0 ; done < size ; done += sizeof(buf) )
+    {
+        RAND_bytes( buf , sizeof(buf) ) ;
+        write( fd , buf , sizeof(buf) ) ;
+    }
+    close( fd ) ;
+
+    fprintf( stdout , "%zu MB file ( page cache warm ), %ld CPUs, %d KB leaves\n\n" , 
+             size >> 20 , nCPU , TREE_CHUNK_LEN >> 10 ) ;
+
+    fd = open( plainName , O_RDONLY ) ;
+    uint64_t t0 = nowNs() ;
+    fileDigest( fd , -1 , md ) ;
+    uint64_t base = nowNs() - t0 ;
+    close( fd ) ;
+    fprintf( stdout , "SHA-256          %8.1f ms %8.1f MB/s\n" , base / 1e6 , size / 1e6 / ( base / 1e9 ) ) ;
+
+    for ( unsigned nThreads = 1 ; nThreads <= 2 * (unsigned) nCPU ; nThreads *= 2 )
+    {
+        myTreeDigest_t t ;
+
+        fd = open( plainName , O_RDONLY ) ;
+        t0 = nowNs() ;
+        if ( fileDigestTree( fd , -1 , nThreads , &t ) != 0 )
+            exitError( "benchTree: fileDigestTree failed" ) ;
+        uint64_t ns = nowNs() - t0 ;
+        close( fd ) ;
+
+        fprintf( stdout , "tree %3u threads %8.1f ms %8.1f MB/s   ( x%.2f )\n" , nThreads , 
+                 ns / 1e6 , size / 1e6 / ( ns / 1e9 ) , (double) base / ns ) ;
+        treeDigest_free( &t ) ;
+    }
+
+    unlink( plainName ) ;
+    return 0 ;
+}
@@ -0,0 +1,106 @@
+/*----------------------------------------------------------------------------
+encryptFile() / decryptFile() with the stream, mmap and io_uring engines
+over a sweep of file sizes
+
+FILE:   benchUring.c
+
+Usage:  benchUring [ largest size in MB ]      ( default 1024 MB; 10240 for 10 GB )
+
+Before every run the input is flushed and dropped from the page cache with
+POSIX_FADV_DONTNEED, so the engines have to go to the disk for it
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include "../myCrypto.h"
+#include "benchUtil.h"
+
+static char  plainName[]  = "/tmp/benchUringPlainXXXXXX" ,
+             cipherName[] = "/tmp/benchUringCipherXXXXXX" ,
+             roundName[]  = "/tmp/benchUringRoundXXXXXX" ;
+
+static void dropCache( const char *name )
+{
+    int fd = open( name , O_RDONLY ) ;
+    fdatasync( fd ) ;
+    posix_fadvise( fd , 0 , 0 , POSIX_FADV_DONTNEED ) ;
+    close( fd ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the elapsed time in ns of one encryptFile() or decryptFile()
+
+static uint64_t run( int encrypting , ioEngine_t engine , const myKey_t *K )
+{
+    char *from = encrypting ? plainName  : cipherName ,
+         *to   = encrypting ? cipherName : roundName ;
+
+    dropCache( from ) ;
+
+    int fd_in  = open( from , O_RDONLY ) ,
+        fd_out = open( to , O_RDWR | O_CREAT | O_TRUNC , 0600 ) ;
+    if ( fd_in < 0 || fd_out < 0 )
+        exitError( "benchUring: could not open the scratch files" ) ;
+
+    setIOEngine( engine ) ;
+    uint64_t t0 = nowNs() ;
+
+    if ( encrypting )
+        encryptFile( fd_in , fd_out , K->key , K->iv ) ;
+    else
+        decryptFile( fd_in , fd_out , K->key , K->iv ) ;
+    fdatasync( fd_out ) ;   // the data has to reach the disk, not just the page cache
+
+    uint64_t ns = nowNs() - t0 ;
+    close( fd_in ) ;  close( fd_out ) ;
+    return ns ;
+}
+
+//-----------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t       maxMB = argc > 1 ? strtoul( argv[1] , NULL , 10 ) : 1024 ;
+    myKey_t      K ;
+    uint8_t      buf[ 1 << 16 ] ;
+    ioEngine_t   engines[] = { IO_ENGINE_STREAM , IO_ENGINE_MMAP , IO_ENGINE_URING } ;
+    const char  *names[]   = { "stream" , "mmap" , "io_uring" } ;
+
+    RAND_bytes( (uint8_t *) &K , KEYSIZE ) ;
+    close( mkstemp( plainName ) ) ;
+    close( mkstemp( cipherName ) ) ;
+    close( mkstemp( roundName ) ) ;
+
+    fprintf( stdout , "%8s  %-9s %14s %14s\n" , "size" , "engine" , "encrypt MB/s" , "decrypt MB/s" ) ;
+
+    if ( maxMB == 0 )
+        maxMB = 1 ;
+
+    // 1 , 4 , 16 ... MB , always ending on the size asked for
+    for ( size_t mb = 1 ; ; mb = mb * 4 < maxMB ? mb * 4 : maxMB )
+    {
+        size_t size = mb << 20 ;
+        int    fd   = open( plainName , O_WRONLY | O_TRUNC ) ;
+        for ( size_t done = 0 ; done < size ; done += sizeof(buf) )
+        {
+            RAND_bytes( buf , sizeof(buf) ) ;
+            write( fd , buf , sizeof(buf) ) ;
+        }
+        close( fd ) ;
+
+        for ( int e = 0 ; e < 3 ; e++ )
+        {
+            uint64_t enc = run( 1 , engines[ e ] , &K ) ,
+                     dec = run( 0 , engines[ e ] , &K ) ;
+            fprintf( stdout , "%6zu MB  %-9s %14.1f %14.1f\n" , mb , names[ e ] , 
+                     size / 1e6 / ( enc / 1e9 ) , size / 1e6 / ( dec / 1e9 ) ) ;
+        }
+        fprintf( stdout , "\n" ) ;
+        if ( mb == maxMB )
+            break ;
+    }
+
+    unlink( plainName ) ;  unlink( cipherName ) ;  unlink( roundName ) ;
+    return 0 ;
+}
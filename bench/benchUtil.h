@@ -0,0 +1,47 @@
+/*----------------------------------------------------------------------------
+Benchmark helpers shared by the programs in bench/
+
+FILE:   benchUtil.h
+
+Written By: 
+     1- Zoe Zinn
+	 2- Josh Kuesters
+----------------------------------------------------------------------------*/
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// Monotonic wall-clock time in nanoseconds
+static inline uint64_t nowNs( void )
+{
+    struct timespec ts ;
+    clock_gettime( CLOCK_MONOTONIC , &ts ) ;
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec ;
+}
+
+// Print one result line in a fixed layout so runs can be diffed by eye
+static inline void benchReport( const char *name , uint64_t elapsedNs , unsigned long ops )
+{
+    fprintf( stdout , "%-40s %12lu ops %10.1f ns/op %14.0f ops/sec\n" , name , ops ,
+             (double) elapsedNs / ops , ops * 1e9 / elapsedNs ) ;
+}
+
+// read() + write() family system calls made by this process so far,
+// from /proc/self/io. Returns 0 where that file does not exist
+static inline unsigned long ioSyscalls( void )
+{
+    unsigned long  syscr = 0 , syscw = 0 ;
+    char           line[ 128 ] ;
+    FILE          *f = fopen( "/proc/self/io" , "r" ) ;
+
+    if ( f == NULL )
+        return 0 ;
+    while ( fgets( line , sizeof(line) , f ) )
+    {
+        sscanf( line , "syscr: %lu" , &syscr ) ;
+        sscanf( line , "syscw: %lu" , &syscw ) ;
+    }
+    fclose( f ) ;
+    return syscr + syscw ;
+}
@@ -14,6 +14,7 @@ Submitted on: 12/04/2023
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <time.h>
+#include <string.h>
 
 #include "wrappers.h"
 
@@ -24,6 +25,24 @@ Submitted on: 12/04/2023
 //--------------------------------------------------------------------------
 int main( int argc , char *argv[] )
 {
+    // "dispatcher -b K" runs the exchange K more times and has Amal report
+    // handshakes/s and the latency of each step. HANDSHAKES is read by all 
+    // three parties ( see handshakesFromEnv() in myCrypto.h )
+    int  bench = 0 ;
+    if ( argc > 1 )
+    {
+        if ( argc != 3 || strcmp( argv[1] , "-b" ) != 0 || atoi( argv[2] ) <= 0 )
+        {
+            fprintf( stderr , "Usage: %s [ -b <handshakes> ]\n" , argv[0] ) ;
+            exit(-1) ;
+        }
+        setenv( "HANDSHAKES" , argv[2] , 1 ) ;
+        bench = 1 ;
+    }
+
+    struct timespec  start , end ;
+    clock_gettime( CLOCK_MONOTONIC , &start ) ;
+
     printf("\nDispatcher started ... ");
     char myUserName[30];
     getlogin_r (myUserName, 30);
@@ -155,6 +174,14 @@ int main( int argc , char *argv[] )
                 // if (  WIFEXITED( exitStatus ) )
                 //         printf(" with status =%d\n" , WEXITSTATUS(exitStatus ) ) ;
 
+                if ( bench )
+                {
+                    clock_gettime( CLOCK_MONOTONIC , &end ) ;
+                    printf("\nDispatcher: %d handshakes, process start-up included, took %.3f s\n" ,
+                           atoi( argv[2] ) + 1 , ( end.tv_sec - start.tv_sec ) 
+                                               + ( end.tv_nsec - start.tv_nsec ) / 1e9 ) ;
+                }
+
                 printf("\nThe Dispatcher process has terminated\n\n");
             }
         }
@@ -0,0 +1,407 @@
+/*-------------------------------------------------------------------------------
+
+FILE:   fileCheck.c
+
+Check the file formats that no handshake exercises, in /tmp, e.g.
+    ./fileCheck
+  - envelopes: decrypt for each recipient, rewrap, a removed recipient is
+    rejected, an interrupted rewrap is finished from its journal
+  - decryptFileChunked() rejects a container cut short and a short chunk
+    that is not the last
+  - decryptRange() over a seekable container against the plaintext, and
+    its rejection of an index with chunks out of place or left out
+  - digestState_save() / _load() and fileDigestResume() against SHA-256,
+    decryptFileDigest() with the wrong key
+Exits non-zero on the first check that fails
+-------------------------------------------------------------------------------*/
+
+#include "myCrypto.h"
+#include <sys/stat.h>
+
+#define PLAIN_LEN   ( 5 * FILE_CHUNK_LEN + 1234 )     // a short last chunk
+
+static uint8_t  *plain ;
+static char      plainPath[ 64 ] , envPath[ 64 ] , outPath[ 64 ] ,
+                 seekPath[ 64 ] , statePath[ 64 ] ;
+static unsigned  checks ;
+
+//--------------------------------------------------------------------------
+static void check( int ok , const char *what )
+{
+    checks++ ;
+    if ( ok )
+        return ;
+    fprintf( stderr , "fileCheck: FAILED: %s\n" , what ) ;
+    exit(-1) ;
+}
+
+static void writeFile( const char *path , const uint8_t *buf , size_t len )
+{
+    int fd = open( path , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+    if ( fd < 0 || write( fd , buf , len ) != (ssize_t) len )
+    {
+        perror( path ) ;
+        exit(-1) ;
+    }
+    close( fd ) ;
+}
+
+// Whether 'path' holds exactly the plaintext
+static int holdsPlain( const char *path )
+{
+    uint8_t      *buf = malloc( PLAIN_LEN + 1 ) ;
+    int           fd  = open( path , O_RDONLY ) ;
+    ssize_t       got = fd < 0 ? -1 : read( fd , buf , PLAIN_LEN + 1 ) ;
+    int           ok  = got == PLAIN_LEN && memcmp( buf , plain , PLAIN_LEN ) == 0 ;
+
+    if ( fd >= 0 )
+        close( fd ) ;
+    free( buf ) ;
+    return ok ;
+}
+
+static RSA *newKey( void )
+{
+    RSA    *rsa = RSA_new() ;
+    BIGNUM *e   = BN_new() ;
+
+    if ( rsa == NULL || e == NULL || BN_set_word( e , RSA_F4 ) != 1
+         || RSA_generate_key_ex( rsa , 2048 , e , NULL ) != 1 )
+        handleErrors( "fileCheck: could not generate an RSA key" ) ;
+    BN_free( e ) ;
+    return rsa ;
+}
+
+//--------------------------------------------------------------------------
+// Decrypt 'envPath' with 'key' into 'outPath'. Returns what envelopeDecryptFile() did
+static ssize_t envelopeTo( RSA *key )
+{
+    int in  = open( envPath , O_RDONLY ) ;
+    int out = open( outPath , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+
+    if ( in < 0 || out < 0 )
+        exitError( "fileCheck: could not open the envelope" ) ;
+    ssize_t len = envelopeDecryptFile( in , out , key ) ;
+    close( in ) ;
+    close( out ) ;
+    return len ;
+}
+
+static void checkEnvelopes( void )
+{
+    RSA   *a = newKey() , *b = newKey() , *c = newKey() ;
+    RSA   *ab[] = { a , b } , *ac[] = { a , c } , *justB[] = { b } ;
+    char   journal[ 80 ] ;
+
+    int in  = open( plainPath , O_RDONLY ) ;
+    int out = open( envPath , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+    check( envelopeEncryptFile( in , out , ab , 2 ) > PLAIN_LEN , "envelopeEncryptFile() for two recipients" ) ;
+    close( in ) ;
+    close( out ) ;
+
+    check( envelopeTo( a ) == PLAIN_LEN && holdsPlain( outPath ) , "the first recipient decrypts" ) ;
+    check( envelopeTo( b ) == PLAIN_LEN && holdsPlain( outPath ) , "the second recipient decrypts" ) ;
+    check( envelopeTo( c ) == -1 , "a key that is not a recipient is rejected" ) ;
+
+    check( envelopeRewrap( envPath , c , ac , 2 ) == -1 , "a rewrap needs a current recipient" ) ;
+    check( envelopeRewrap( envPath , b , ac , 2 ) == 0  , "envelopeRewrap() from B to A and C" ) ;
+    check( envelopeTo( c ) == PLAIN_LEN && holdsPlain( outPath ) , "an added recipient decrypts" ) ;
+    check( envelopeTo( a ) == PLAIN_LEN && holdsPlain( outPath ) , "a kept recipient still decrypts" ) ;
+    check( envelopeTo( b ) == -1 , "a removed recipient is rejected" ) ;
+    snprintf( journal , sizeof( journal ) , "%s.rewrap" , envPath ) ;
+    check( access( journal , F_OK ) != 0 , "a finished rewrap leaves no journal" ) ;
+
+    // Crash after the journal was written and the header only half rewritten
+    int      fd = open( envPath , O_RDWR ) ;
+    uint8_t  fixed[ ENVELOPE_FIXED_LEN ] ;
+    check( fd >= 0 && pread( fd , fixed , ENVELOPE_FIXED_LEN , 0 ) == ENVELOPE_FIXED_LEN , "reading the header" ) ;
+    uint32_t hLen = ntohl( *(uint32_t *) ( fixed + 12 ) ) ;
+    uint8_t *header = malloc( hLen + SHA256_DIGEST_LENGTH ) , *torn = calloc( 1 , hLen / 2 ) ;
+
+    check( envelopeRewrap( envPath , a , justB , 1 ) == 0 , "envelopeRewrap() from A and C to B" ) ;
+    check( pread( fd , header , hLen , 0 ) == hLen , "reading the new header" ) ;
+    SHA256( header , hLen , header + hLen ) ;
+    writeFile( journal , header , hLen + SHA256_DIGEST_LENGTH ) ;
+    check( pwrite( fd , torn , hLen / 2 , 0 ) == hLen / 2 , "tearing the header" ) ;
+    check( envelopeTo( b ) == -1 , "a torn header is rejected" ) ;
+    check( envelopeRecover( envPath ) == 0 && access( journal , F_OK ) != 0 , "envelopeRecover() replays the journal" ) ;
+    check( envelopeTo( b ) == PLAIN_LEN && holdsPlain( outPath ) , "the recovered header decrypts" ) ;
+    check( envelopeTo( a ) == -1 , "the recovered header has only the new recipients" ) ;
+
+    // A journal cut short was never acted on and is dropped
+    writeFile( journal , header , hLen / 2 ) ;
+    check( envelopeRecover( envPath ) == 0 && access( journal , F_OK ) != 0 , "a partial journal is dropped" ) ;
+    check( envelopeTo( b ) == PLAIN_LEN , "a partial journal leaves the header alone" ) ;
+
+    close( fd ) ;
+    free( header ) ;  free( torn ) ;
+    RSA_free( a ) ;  RSA_free( b ) ;  RSA_free( c ) ;
+    unlink( envPath ) ;
+}
+
+//--------------------------------------------------------------------------
+// Decrypt the chunked container at 'path' into 'outPath'
+static ssize_t unchunk( const char *path , const uint8_t *key , const uint8_t *iv )
+{
+    int in  = open( path , O_RDONLY ) ;
+    int out = open( outPath , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+
+    if ( in < 0 || out < 0 )
+        exitError( "fileCheck: could not open the chunked container" ) ;
+    ssize_t len = decryptFileChunked( in , out , key , iv , 2 ) ;
+    close( in ) ;
+    close( out ) ;
+    return len ;
+}
+
+// Encrypt the first 'plainLen' bytes of the plaintext into 'path'. Returns its size
+static off_t chunkify( const char *path , size_t plainLen , const uint8_t *key , const uint8_t *iv , 
+                       ssize_t (*encrypt)( int , int , const uint8_t * , const uint8_t * , unsigned ) )
+{
+    struct stat st ;
+
+    writeFile( plainPath , plain , plainLen ) ;
+    int in  = open( plainPath , O_RDONLY ) ;
+    int out = open( path , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+    check( in >= 0 && out >= 0 && encrypt( in , out , key , iv , 2 ) > 0 && fstat( out , &st ) == 0 ,
+           "encrypting a chunked container" ) ;
+    close( in ) ;
+    close( out ) ;
+    writeFile( plainPath , plain , PLAIN_LEN ) ;
+    return st.st_size ;
+}
+
+static void checkChunked( void )
+{
+    uint8_t   key[ SYMMETRIC_KEY_LEN ] , iv[ INITVECTOR_LEN ] , footer[ CHUNK_INDEX_FOOTER_LEN ] ;
+    uint8_t  *buf = calloc( 1 , 2 * FILE_CHUNK_LEN ) ;
+    uint32_t  field ;
+
+    RAND_bytes( key , sizeof( key ) ) ;
+    RAND_bytes( iv , sizeof( iv ) ) ;
+
+    // A container cut at a chunk boundary, or inside its end marker, is rejected
+    off_t size = chunkify( envPath , PLAIN_LEN , key , iv , encryptFileChunked ) ;
+    check( unchunk( envPath , key , iv ) == PLAIN_LEN && holdsPlain( outPath ) , "decryptFileChunked()" ) ;
+    int fd = open( envPath , O_RDONLY ) ;
+    check( pread( fd , &field , 4 , CHUNKED_HEADER_LEN ) == 4 , "reading the first chunk length" ) ;
+    close( fd ) ;
+    off_t chunk = 4 + ntohl( field ) ;
+
+    check( truncate( envPath , size - 8 ) == 0 && unchunk( envPath , key , iv ) == -1 ,
+           "decryptFileChunked() rejects a missing chunk count" ) ;
+    check( truncate( envPath , size - 12 ) == 0 && unchunk( envPath , key , iv ) == -1 ,
+           "decryptFileChunked() rejects a missing end marker" ) ;
+    check( truncate( envPath , CHUNKED_HEADER_LEN + 2 * chunk ) == 0 && unchunk( envPath , key , iv ) == -1 ,
+           "decryptFileChunked() rejects a cut at a chunk boundary" ) ;
+
+    // The same for the seekable container, whose index follows L = 0
+    size = chunkify( seekPath , PLAIN_LEN , key , iv , encryptFileSeekable ) ;
+    check( unchunk( seekPath , key , iv ) == PLAIN_LEN && holdsPlain( outPath ) , "decryptFileChunked() of a seekable container" ) ;
+    fd = open( seekPath , O_RDONLY ) ;
+    check( pread( fd , footer , CHUNK_INDEX_FOOTER_LEN , size - CHUNK_INDEX_FOOTER_LEN ) == CHUNK_INDEX_FOOTER_LEN ,
+           "reading the footer" ) ;
+    close( fd ) ;
+    off_t indexOffset = 0 ;
+    for ( int b = 0 ; b < 8 ; b++ )
+        indexOffset = ( indexOffset << 8 ) | footer[ b ] ;
+    check( truncate( seekPath , size - CHUNK_INDEX_FOOTER_LEN ) == 0 && unchunk( seekPath , key , iv ) == -1 ,
+           "decryptFileChunked() rejects a missing footer" ) ;
+    check( truncate( seekPath , indexOffset ) == 0 && unchunk( seekPath , key , iv ) == -1 , 
+           "decryptFileChunked() rejects a missing index" ) ;
+
+    // A short chunk 0 followed by chunk 1 of the same key and IV, and a
+    // proper end marker for two chunks
+    off_t shortChunk = chunkify( seekPath , 100 , key , iv , encryptFileChunked ) - CHUNKED_HEADER_LEN - 12 ;
+    chunkify( envPath , PLAIN_LEN , key , iv , encryptFileChunked ) ;
+    int head = open( seekPath , O_RDONLY ) , tail = open( envPath , O_RDONLY ) ;
+    off_t spliced = CHUNKED_HEADER_LEN + shortChunk ;
+    check( pread( head , buf , spliced , 0 ) == spliced
+           && pread( tail , buf + spliced , chunk , CHUNKED_HEADER_LEN + chunk ) == chunk , "reading the chunks to splice" ) ;
+    close( head ) ;
+    close( tail ) ;
+    spliced += chunk ;
+    buf[ spliced + 4 + 7 ] = 2 ;
+    writeFile( seekPath , buf , spliced + 12 ) ;
+    check( unchunk( seekPath , key , iv ) == -1 , "decryptFileChunked() rejects a short chunk that is not the last" ) ;
+
+    free( buf ) ;
+    unlink( envPath ) ;
+    unlink( seekPath ) ;
+}
+
+//--------------------------------------------------------------------------
+static void checkRanges( void )
+{
+    uint8_t  key[ SYMMETRIC_KEY_LEN ] , iv[ INITVECTOR_LEN ] , *buf = malloc( 3 * FILE_CHUNK_LEN ) ;
+    struct { uint64_t offset ; size_t len ; } ranges[] = {
+            { 0 , 1 } , { 0 , FILE_CHUNK_LEN } , { FILE_CHUNK_LEN - 5 , 10 } ,
+            { 2 * FILE_CHUNK_LEN + 17 , 2 * FILE_CHUNK_LEN + 100 } , { PLAIN_LEN - 3 , 3 } } ;
+
+    RAND_bytes( key , sizeof( key ) ) ;
+    RAND_bytes( iv , sizeof( iv ) ) ;
+    int in  = open( plainPath , O_RDONLY ) ;
+    int out = open( seekPath , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+    check( encryptFileSeekable( in , out , key , iv , 2 ) > 0 , "encryptFileSeekable()" ) ;
+    close( in ) ;
+    close( out ) ;
+
+    int fd = open( seekPath , O_RDONLY ) ;
+    for ( size_t r = 0 ; r < sizeof( ranges ) / sizeof( ranges[ 0 ] ) ; r++ )
+        check( decryptRange( fd , ranges[ r ].offset , ranges[ r ].len , key , buf ) == (ssize_t) ranges[ r ].len
+               && memcmp( buf , plain + ranges[ r ].offset , ranges[ r ].len ) == 0 , "decryptRange() within the file" ) ;
+    check( decryptRange( fd , PLAIN_LEN - 10 , 100 , key , buf ) == 10
+           && memcmp( buf , plain + PLAIN_LEN - 10 , 10 ) == 0 , "decryptRange() is short at end of file" ) ;
+    check( decryptRange( fd , PLAIN_LEN + 1 , 10 , key , buf ) <= 0 , "decryptRange() past end of file" ) ;
+
+    key[ 0 ] ^= 1 ;                                  // decryptRange() names the chunk on stderr
+    check( decryptRange( fd , 0 , 10 , key , buf ) == -1 , "decryptRange() rejects the wrong key" ) ;
+    key[ 0 ] ^= 1 ;
+
+    // Swapping two whole index entries keeps every chunk decryptable but
+    // puts them in the wrong place
+    struct stat st ;
+    check( fstat( fd , &st ) == 0 , "fstat() of the seekable container" ) ;
+    uint8_t *file = malloc( st.st_size ) , *footer = file + st.st_size - CHUNK_INDEX_FOOTER_LEN ;
+    check( pread( fd , file , st.st_size , 0 ) == st.st_size , "reading the seekable container" ) ;
+    close( fd ) ;
+    uint64_t indexOffset = 0 , nChunks = 0 ;
+    for ( int b = 0 ; b < 8 ; b++ )
+    {
+        indexOffset = ( indexOffset << 8 ) | footer[ b ] ;
+        nChunks     = ( nChunks << 8 ) | footer[ 8 + b ] ;
+    }
+    uint8_t *entry1 = file + indexOffset + CHUNK_INDEX_ENTRY_LEN , entry[ CHUNK_INDEX_ENTRY_LEN ] ;
+    memcpy( entry , entry1 , CHUNK_INDEX_ENTRY_LEN ) ;
+    memcpy( entry1 , entry1 + CHUNK_INDEX_ENTRY_LEN , CHUNK_INDEX_ENTRY_LEN ) ;
+    memcpy( entry1 + CHUNK_INDEX_ENTRY_LEN , entry , CHUNK_INDEX_ENTRY_LEN ) ;
+    writeFile( seekPath , file , st.st_size ) ;
+    fd = open( seekPath , O_RDONLY ) ;
+    check( decryptRange( fd , FILE_CHUNK_LEN , 10 , key , buf ) == -1 , "decryptRange() rejects chunks out of place" ) ;
+    check( decryptRange( fd , 0 , 10 , key , buf ) == 10 , "decryptRange() still reads the chunks in place" ) ;
+    close( fd ) ;
+    memcpy( entry1 + CHUNK_INDEX_ENTRY_LEN , entry1 , CHUNK_INDEX_ENTRY_LEN ) ;
+    memcpy( entry1 , entry , CHUNK_INDEX_ENTRY_LEN ) ;
+
+    // An index that leaves out the last chunk
+    memcpy( file + indexOffset + ( nChunks - 1 ) * CHUNK_INDEX_ENTRY_LEN , footer , CHUNK_INDEX_FOOTER_LEN ) ;
+    footer = file + indexOffset + ( nChunks - 1 ) * CHUNK_INDEX_ENTRY_LEN ;
+    footer[ 15 ]-- ;
+    writeFile( seekPath , file , footer + CHUNK_INDEX_FOOTER_LEN - file ) ;
+    fd = open( seekPath , O_RDONLY ) ;
+    check( decryptRange( fd , 0 , 10 , key , buf ) == -1 , "decryptRange() rejects an index short of a chunk" ) ;
+
+    close( fd ) ;
+    free( file ) ;
+    free( buf ) ;
+    unlink( seekPath ) ;
+}
+
+//--------------------------------------------------------------------------
+static void checkDigests( void )
+{
+    uint8_t          whole[ SHA256_DIGEST_LENGTH ] , got[ SHA256_DIGEST_LENGTH ] ;
+    myDigestState_t  s , back ;
+
+    SHA256( plain , PLAIN_LEN , whole ) ;
+
+    // Feed the first part, save, load into another state, feed the rest
+    writeFile( plainPath , plain , PLAIN_LEN / 3 ) ;
+    int fd = open( plainPath , O_RDONLY ) ;
+    digestState_init( &s ) ;
+    check( digestState_feed( &s , fd , statePath , 0 ) == PLAIN_LEN / 3 , "digestState_feed() of the first part" ) ;
+    close( fd ) ;
+    check( digestState_load( &back , statePath ) == 0 && back.offset == PLAIN_LEN / 3 , "digestState_load()" ) ;
+
+    writeFile( plainPath , plain , PLAIN_LEN ) ;
+    fd = open( plainPath , O_RDONLY ) ;
+    check( digestState_feed( &back , fd , NULL , 0 ) == PLAIN_LEN - PLAIN_LEN / 3 , "digestState_feed() of the rest" ) ;
+    check( digestState_digest( &back , got ) == SHA256_DIGEST_LENGTH && memcmp( got , whole , sizeof( got ) ) == 0 ,
+           "a resumed digest matches SHA-256 of the whole file" ) ;
+
+    // fileDigestResume() picks up the checkpoint written above
+    unlink( statePath ) ;
+    digestState_init( &s ) ;
+    s.offset = 0 ;
+    check( digestState_save( &s , statePath ) == 0 , "digestState_save()" ) ;
+    check( fileDigestResume( fd , statePath , got ) == SHA256_DIGEST_LENGTH && memcmp( got , whole , sizeof( got ) ) == 0 ,
+           "fileDigestResume() from an empty checkpoint" ) ;
+    check( fileDigestResume( fd , statePath , got ) == SHA256_DIGEST_LENGTH && memcmp( got , whole , sizeof( got ) ) == 0 ,
+           "fileDigestResume() from a finished checkpoint" ) ;
+    close( fd ) ;
+
+    // A corrupt checkpoint is refused
+    uint8_t state[ DIGEST_STATE_LEN ] ;
+    fd = open( statePath , O_RDWR ) ;
+    check( fd >= 0 && pread( fd , state , sizeof( state ) , 0 ) == sizeof( state ) , "reading the checkpoint" ) ;
+    state[ 20 ] ^= 1 ;
+    check( pwrite( fd , state , sizeof( state ) , 0 ) == sizeof( state ) , "corrupting the checkpoint" ) ;
+    close( fd ) ;
+    check( digestState_load( &back , statePath ) == -1 , "digestState_load() refuses a corrupt checkpoint" ) ;
+    check( truncate( statePath , DIGEST_STATE_LEN / 2 ) == 0 && digestState_load( &back , statePath ) == -1 ,
+           "digestState_load() refuses a truncated checkpoint" ) ;
+
+    unlink( statePath ) ;
+
+    // decryptFileDigest() with the wrong key returns -1 and leaves a mapped
+    // output as it was found
+    uint8_t  key[ SYMMETRIC_KEY_LEN ] , iv[ INITVECTOR_LEN ] ;
+    unsigned gotLen = sizeof( got ) ;
+    struct stat st ;
+
+    RAND_bytes( key , sizeof( key ) ) ;
+    RAND_bytes( iv , sizeof( iv ) ) ;
+    int in  = open( plainPath , O_RDONLY ) ;
+    int out = open( envPath , O_RDWR | O_CREAT | O_TRUNC , 0600 ) ;
+    check( encryptFileDigest( in , out , key , iv , DIGEST_PLAINTEXT , got , &gotLen ) > PLAIN_LEN
+           && memcmp( got , whole , sizeof( got ) ) == 0 , "encryptFileDigest()" ) ;
+    close( in ) ;
+    close( out ) ;
+
+    in  = open( envPath , O_RDONLY ) ;
+    out = open( outPath , O_RDWR | O_CREAT | O_TRUNC , 0600 ) ;
+    check( decryptFileDigest( in , out , key , iv , DIGEST_PLAINTEXT , got , &gotLen ) == PLAIN_LEN
+           && memcmp( got , whole , sizeof( got ) ) == 0 && holdsPlain( outPath ) , "decryptFileDigest()" ) ;
+    check( ftruncate( out , 0 ) == 0 && lseek( out , 0 , SEEK_SET ) == 0 , "emptying the output" ) ;
+    lseek( in , 0 , SEEK_SET ) ;
+    key[ 0 ] ^= 1 ;
+    check( decryptFileDigest( in , out , key , iv , DIGEST_PLAINTEXT , got , &gotLen ) == -1 && gotLen == 0 ,
+           "decryptFileDigest() rejects the wrong key" ) ;
+    check( fstat( out , &st ) == 0 && st.st_size == 0 , "a rejected decryptFileDigest() leaves the output empty" ) ;
+    close( in ) ;
+    close( out ) ;
+    unlink( envPath ) ;
+}
+
+//--------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    int pid = (int) getpid() ;
+
+    snprintf( plainPath , sizeof( plainPath ) , "/tmp/fileCheck.%d.plain" , pid ) ;
+    snprintf( envPath   , sizeof( envPath )   , "/tmp/fileCheck.%d.env"   , pid ) ;
+    snprintf( outPath   , sizeof( outPath )   , "/tmp/fileCheck.%d.out"   , pid ) ;
+    snprintf( seekPath  , sizeof( seekPath )  , "/tmp/fileCheck.%d.seek"  , pid ) ;
+    snprintf( statePath , sizeof( statePath ) , "/tmp/fileCheck.%d.state" , pid ) ;
+
+    plain = malloc( PLAIN_LEN ) ;
+    if ( plain == NULL )
+        exitError( "fileCheck: out of memory" ) ;
+    RAND_bytes( plain , PLAIN_LEN ) ;
+    writeFile( plainPath , plain , PLAIN_LEN ) ;
+
+    checkEnvelopes() ;
+    printf( "envelopes: decrypt , rewrap , removed recipient , journal replay    OK\n" ) ;
+    checkChunked() ;
+    printf( "decryptFileChunked() , truncated containers , short chunks       OK\n" ) ;
+    checkRanges() ;
+    printf( "decryptRange() , malformed indexes                               OK\n" ) ;
+    checkDigests() ;
+    printf( "digestState_save() / _load() , fileDigestResume() , digests      OK\n" ) ;
+
+    unlink( plainPath ) ;
+    unlink( outPath ) ;
+    free( plain ) ;
+    printf( "All %u checks passed\n" , checks ) ;
+    return 0 ;
+}
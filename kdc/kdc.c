@@ -13,9 +13,133 @@ Submitted on:
 #include <linux/random.h>
 #include <time.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
 
 #include "../myCrypto.h"
 
+//-----------------------------------------------------------------------------
+static void onStopSignal( int sig )
+{
+    kdcStop() ;
+}
+
+// SIGHUP is blocked everywhere and taken here, one reload at a time,
+// while the epoll loop keeps answering on whichever snapshot is current
+typedef struct {
+            myKeyStore_t  *keys ;
+            FILE          *log ;
+            const char    *dbPath ;
+            int            stopping ;
+        }  reloader_t ;
+
+static void *reloadOnHangup( void *arg )
+{
+    reloader_t  *r = arg ;
+    sigset_t     hangup ;
+    int          sig ;
+
+    sigemptyset( &hangup ) ;
+    sigaddset( &hangup , SIGHUP ) ;
+    while ( sigwait( &hangup , &sig ) == 0 && ! __atomic_load_n( &r->stopping , __ATOMIC_ACQUIRE ) )
+    {
+        uint64_t version = keyStore_reload( r->keys ) ;
+        if ( version == 0 )
+            fprintf( r->log , "\nCould not map the key database %s; still serving the previous one\n" , r->dbPath ) ;
+        else
+            LOGF( LOG_INFO , r->log , "\nReloaded %s as key database version %lu\n" , r->dbPath , (unsigned long) version ) ;
+        LOG_FLUSH( r->log ) ;
+    }
+    return NULL ;
+}
+
+//*************************************
+// Server Mode:  kdc -s [ <socket> [ <key database> ] ]
+//*************************************
+// The principals' keys are mapped from one file ( see keyDB_open() ) and every
+// MSG1 on every connection to the socket is answered until SIGINT or SIGTERM
+// ( see kdcServe() in myCrypto.h ). SIGHUP maps the file again without
+// stopping: "./keyDB" renames the new database into place , then "kill -HUP"
+static int serverMain( const char *path , const char *dbPath )
+{
+    FILE     *log ;
+    sigset_t  signals ;
+
+    // Blocked before any thread starts ( the log writer too ) , and inherited
+    // by every thread: only the reloader ever takes SIGHUP, and SIGINT and
+    // SIGTERM only reach kdcServe() while it waits in epoll
+    sigemptyset( &signals ) ;
+    sigaddset( &signals , SIGHUP ) ;
+    sigaddset( &signals , SIGINT ) ;
+    sigaddset( &signals , SIGTERM ) ;
+    pthread_sigmask( SIG_BLOCK , &signals , NULL ) ;
+
+    setCipherModeFromEnv() ;
+    setLogLevelFromEnv() ;
+
+    log = logOpen( "kdc/logKDCserver.txt" ) ;
+    if ( ! log )
+    {
+        fprintf( stderr , "The KDC server could not create its log file\n" ) ;
+        exit(-1) ;
+    }
+
+    myKeyStore_t *keys = keyStore_open( dbPath ) ;
+    if ( keys == NULL )
+    {
+        fprintf( stderr , "\nCould not map the key database %s ( build it with ./keyDB )\n" , dbPath ) ;
+        fprintf( log    , "\nCould not map the key database %s ( build it with ./keyDB )\n" , dbPath ) ;
+        exit(-1) ;
+    }
+
+    int listenFd = kdcListen( path ) ;
+    if ( listenFd < 0 )
+    {
+        fprintf( stderr , "\nThe KDC server could not listen on %s: %s\n" , path , strerror( errno ) ) ;
+        fprintf( log    , "\nThe KDC server could not listen on %s: %s\n" , path , strerror( errno ) ) ;
+        exit(-1) ;
+    }
+
+    struct sigaction  sa = { .sa_handler = onStopSignal } ;
+    sigemptyset( &sa.sa_mask ) ;
+    sigaction( SIGINT  , &sa , NULL ) ;
+    sigaction( SIGTERM , &sa , NULL ) ;
+
+    pthread_t   reloadThread ;
+    reloader_t  reloader = { keys , log , dbPath , 0 } ;
+    if ( pthread_create( &reloadThread , NULL , reloadOnHangup , &reloader ) != 0 )
+    {
+        fprintf( stderr , "\nThe KDC server could not start its reload thread\n" ) ;
+        exit(-1) ;
+    }
+
+    unsigned long count = keys->current->db->count ;
+    fprintf( stdout , "The KDC is serving %lu principals on %s ( reload with SIGHUP , stop with SIGINT or SIGTERM )\n" , 
+             count , path ) ;
+    if ( LOG_ON( LOG_INFO ) )
+    {
+        BANNER( log ) ;
+        fprintf( log , "Starting the KDC server on %s\n" , path ) ;
+        BANNER( log ) ;
+        fprintf( log , "\n%lu principals in %s\n" , count , dbPath ) ;
+        fflush( log ) ;
+    }
+
+    uint64_t served = kdcServe( listenFd , log , keys , 0 ) ;
+
+    close( listenFd ) ;
+    unlink( path ) ;
+    __atomic_store_n( &reloader.stopping , 1 , __ATOMIC_RELEASE ) ;
+    pthread_kill( reloadThread , SIGHUP ) ;
+    pthread_join( reloadThread , NULL ) ;
+    keyStore_close( keys ) ;
+
+    LOGF( LOG_INFO , log , "\nThe KDC server answered %lu MSG1s and has terminated normally. Goodbye\n" , 
+                           (unsigned long) served ) ;
+    fclose( log ) ;
+    return 0 ;
+}
+
 //*************************************
 // The Main Loop
 //*************************************
@@ -28,28 +152,45 @@ int main ( int argc , char * argv[] )
 
     fprintf( stdout , "Starting the KDC's   %s\n"  , developerName ) ;
 
+    if ( argc > 1 && strcmp( argv[1] , "-s" ) == 0 )
+        return serverMain( argc > 2 ? argv[2] : KDC_SOCKET_PATH , argc > 3 ? argv[3] : KEYDB_PATH ) ;
+
     if( argc < 3 )
     {
         printf("\nMissing command-line file descriptors: %s <getFr. Amal> "
-               "<sendTo Amal>\n\n", argv[0]) ;
+               "<sendTo Amal>\n"
+               "   or: %s -s [ <socket> [ <key database> ] ]\n\n", argv[0] , argv[0]) ;
         exit(-1) ;
     }
 
     fd_A2K    = atoi(argv[1]);  // Read from Amal   File Descriptor
     fd_K2A    = atoi(argv[2]);  // Send to   Amal   File Descriptor
 
-    log = fopen("kdc/logKDC.txt" , "w" );
+    // All parties must agree on how MSG2 .. MSG5 are encrypted
+    // ( AES-CBC unless the dispatcher exported CIPHER_MODE=gcm )
+    setCipherModeFromEnv() ;
+
+    // Log levels below LOG_LEVEL=... are skipped ( those below -DLOG_LEVEL are not even built )
+    setLogLevelFromEnv() ;
+
+    // Latency histograms, when built with -DMYCRYPTO_STATS ( also dumped on SIGUSR1 )
+    stats_install( "kdc/statsKDC.txt" ) ;
+
+    log = logOpen( "kdc/logKDC.txt" );
     if( ! log )
     {
         fprintf( stderr , "The KDC's   %s. Could not create log file\n"  , developerName ) ;
         exit(-1) ;
     }
 
-    BANNER( log ) ;
-    fprintf( log , "Starting the KDC\n"  ) ;
-    BANNER( log ) ;
+    if ( LOG_ON( LOG_INFO ) )
+    {
+        BANNER( log ) ;
+        fprintf( log , "Starting the KDC\n"  ) ;
+        BANNER( log ) ;
 
-    fprintf( log , "\n<readFr. Amal> FD=%d , <sendTo Amal> FD=%d\n\n" , fd_A2K , fd_K2A );
+        fprintf( log , "\n<readFr. Amal> FD=%d , <sendTo Amal> FD=%d\n\n" , fd_A2K , fd_K2A );
+    }
 
     // Get Amal's master keys with the KDC and dump it to the log
     myKey_t  Ka ;    // Amal's master key with the KDC
@@ -63,16 +204,19 @@ int main ( int argc , char * argv[] )
         exit(-1);
     }
 	// On success, print "Amal has this Master Ka { key , IV }\n" to the Log file
-    fprintf( log , "Amal has this Master Ka { key , IV }\n" );
-	// BIO_dump the Key IV indented 4 spaces to the right
-    BIO_dump_indent_fp(log, Ka.key, SYMMETRIC_KEY_LEN, 4);
-    fprintf( log , "\n" );
-	// BIO_dump the IV indented 4 spaces to the righ
-    BIO_dump_indent_fp(log, Ka.iv, INITVECTOR_LEN, 4);
-    fprintf( log , "\n" );
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log , "Amal has this Master Ka { key , IV }\n" );
+        // BIO_dump the Key IV indented 4 spaces to the right
+        logDump(log, Ka.key, SYMMETRIC_KEY_LEN, 4);
+        fprintf( log , "\n" );
+        // BIO_dump the IV indented 4 spaces to the righ
+        logDump(log, Ka.iv, INITVECTOR_LEN, 4);
+        fprintf( log , "\n" );
+    }
 
 
-    fflush( log ) ;
+    LOG_FLUSH( log ) ;
     
     // Get Basim's master keys with the KDC
     myKey_t   Kb ;    // Basim's master key with the KDC    
@@ -86,96 +230,139 @@ int main ( int argc , char * argv[] )
         exit(-1);
     }
 	// On success, print "Basim has this Master Ka { key , IV }\n" to the Log file
-    fprintf( log , "Basim has this Master Kb { key , IV }\n" );
-	// BIO_dump the Key IV indented 4 spaces to the right
-    BIO_dump_indent_fp(log, Kb.key, SYMMETRIC_KEY_LEN, 4);
-    fprintf( log , "\n" );
-	// BIO_dump the IV indented 4 spaces to the right
-    BIO_dump_indent_fp(log, Kb.iv, INITVECTOR_LEN, 4);
-    fprintf( log , "\n" );
-    fflush( log ) ;
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log , "Basim has this Master Kb { key , IV }\n" );
+        // BIO_dump the Key IV indented 4 spaces to the right
+        logDump(log, Kb.key, SYMMETRIC_KEY_LEN, 4);
+        fprintf( log , "\n" );
+        // BIO_dump the IV indented 4 spaces to the right
+        logDump(log, Kb.iv, INITVECTOR_LEN, 4);
+        fprintf( log , "\n" );
+    }
+    LOG_FLUSH( log ) ;
 
-    //*************************************
-    // Receive  & Display   Message 1
-    //*************************************
-    BANNER( log ) ;
-    fprintf( log , "         MSG1 Receive\n");
-    BANNER( log ) ;
+    // Benchmark mode ( "dispatcher -b K" ): K more handshakes after this 
+    // first one, logged only to a binary trace
+    unsigned  nTimed = handshakesFromEnv() ;
+    FILE     *realLog = log ;
+
+    for ( unsigned hs = 0 ; hs <= nTimed ; hs++ )
+    {
+        if ( hs == 1 && ! logTracing() )
+        {
+            log = logOpen( "/dev/null" ) ;
+            if ( ! log )
+            {
+                fprintf( stderr , "\nThe KDC could not open /dev/null\n" ) ;
+                exit(-1) ;
+            }
+        }
 
-    char *IDa , *IDb ;
-    Nonce_t  Na ;
+        //*************************************
+        // Receive  & Display   Message 1
+        //*************************************
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG1 Receive\n");
+            BANNER( log ) ;
+        }
+
+        char *IDa , *IDb ;
+        Nonce_t  Na ;
     
-    // Get MSG1 from Amal
-    MSG1_receive( log , fd_A2K , &IDa , &IDb , Na ) ;
+        // Get MSG1 from Amal
+        MSG1_receive( log , fd_A2K , &IDa , &IDb , Na ) ;
 
-    fprintf( log , "\nKDC received message 1 from Amal with:\n"
-                   "    IDa = '%s'\n"
-                   "    IDb = '%s'\n" , IDa , IDb ) ;
+        LOGF( LOG_INFO , log , "\nKDC received message 1 from Amal with:\n" ) ;
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            fprintf( log , "    IDa = '%s'\n"
+                           "    IDb = '%s'\n" , IDa , IDb ) ;
 
-    fprintf( log , "    Na ( %lu Bytes ) is:\n" , NONCELEN ) ;
-     // BIO_dump the nonce Na
-    BIO_dump_indent_fp(log, Na, NONCELEN, 4);
-    fprintf( log , "\n" );
+            fprintf( log , "    Na ( %lu Bytes ) is:\n" , NONCELEN ) ;
+            // BIO_dump the nonce Na
+            logDump(log, Na, NONCELEN, 4);
+            fprintf( log , "\n" );
+        }
 
-    fflush( log ) ;
+        LOG_FLUSH( log ) ;
 
-    //*************************************   
-    // Construct & Send    Message 2
-    //*************************************
-    // PA-04 Part Two
-    BANNER( log ) ;
-    fprintf( log , "         MSG2 New\n");
-    BANNER( log ) ;
+        //*************************************   
+        // Construct & Send    Message 2
+        //*************************************
+        // PA-04 Part Two
+        if ( LOG_ON( LOG_INFO ) )
+        {
+            BANNER( log ) ;
+            fprintf( log , "         MSG2 New\n");
+            BANNER( log ) ;
+        }
 
-    // Get the session key
-    myKey_t  Ks ;
+        // Get the session key
+        myKey_t  Ks ;
 
-    // Use  getKeyFromFile
-	// On failure, print "\nCould not get Session key & IV.\n" to both  stderr and the Log file
-	// and exit(-1)
-    if (getKeyFromFile("kdc/sessionKey.bin", &Ks) == -1) {
-        fprintf(stderr, "\nCould not get Session key & IV.\n");
-        fprintf(log, "\nCould not get Session key & IV.\n");
-        exit(-1);
-    }
+        // Use  getKeyFromFile
+    	// On failure, print "\nCould not get Session key & IV.\n" to both  stderr and the Log file
+    	// and exit(-1)
+        if (getKeyFromFile("kdc/sessionKey.bin", &Ks) == -1) {
+            fprintf(stderr, "\nCould not get Session key & IV.\n");
+            fprintf(log, "\nCould not get Session key & IV.\n");
+            exit(-1);
+        }
 	
-    fprintf( log , "KDC: created this session key Ks { Key , IV } (%lu Bytes ) is:\n", sizeof(myKey_t) );
-	// BIO_dump the Key indented 4 spaces to the right
-    BIO_dump_indent_fp(log, &Ks, sizeof(myKey_t), 4);
-    fprintf( log , "\n" );
+        if ( LOG_ON( LOG_DEBUG ) )
+        {
+            fprintf( log , "KDC: created this session key Ks { Key , IV } (%lu Bytes ) is:\n", sizeof(myKey_t) );
+            // BIO_dump the Key indented 4 spaces to the right
+            logDump(log, &Ks, sizeof(myKey_t), 4);
+            fprintf( log , "\n" );
+        }
 
-    unsigned  LenMsg2 ;
-    uint8_t  *msg2 ;
-    LenMsg2 = MSG2_new( log , &msg2 , &Ka, &Kb, &Ks, IDa , IDb , &Na ) ;
+        unsigned  LenMsg2 ;
+        uint8_t  *msg2 ;
+        LenMsg2 = MSG2_new( log , &msg2 , &Ka, &Kb, &Ks, IDa , IDb , &Na ) ;
 
-    // Concat MSG2's length to the message
-    uint8_t *newMSG2ptr = (uint8_t *) malloc(LenMsg2 + LENSIZE) ;
-    uint8_t *m = newMSG2ptr ;
+        // Concat MSG2's length to the message
+        uint8_t *newMSG2ptr = (uint8_t *) malloc(LenMsg2 + LENSIZE) ;
+        uint8_t *m = newMSG2ptr ;
 
-    memcpy(m, &LenMsg2, LENSIZE);
-    m += LENSIZE ;
+        memcpy(m, &LenMsg2, LENSIZE);
+        m += LENSIZE ;
 
-    memcpy(m, msg2, LenMsg2) ;
-    m += LenMsg2 ;
+        memcpy(m, msg2, LenMsg2) ;
+        m += LenMsg2 ;
     
-    // Send the entire message 2 to Amal via the appropriate pipe
-    if (write(fd_K2A, newMSG2ptr, (LenMsg2 + LENSIZE)) != (LenMsg2 + LENSIZE))
-    {
-        fprintf(stderr, "\nCould not write MSG2 to Amal.\n");
-        fprintf(log, "\nCould not write MSG2 to Amal.\n");
-        exit(-1);
-    }
+        // Send the entire message 2 to Amal via the appropriate pipe
+        if (statWrite(fd_K2A, newMSG2ptr, (LenMsg2 + LENSIZE)) != (LenMsg2 + LENSIZE))
+        {
+            fprintf(stderr, "\nCould not write MSG2 to Amal.\n");
+            fprintf(log, "\nCould not write MSG2 to Amal.\n");
+            exit(-1);
+        }
+
+        LOGF( LOG_INFO , log , "The KDC sent the above Encrypted MSG2 ( %u bytes ) Successfully\n", LenMsg2);
 
-    fprintf(log, "The KDC sent the above Encrypted MSG2 ( %u bytes ) Successfully\n", LenMsg2);
+        // Deallocate any memory allocated for msg2
+        free(msg2);
+        free(newMSG2ptr);
+        free(IDa);
+        free(IDb);
 
-    // Deallocate any memory allocated for msg2
-    free(msg2);
+    }
+
+    if ( log != realLog )
+    {
+        fclose( log ) ;
+        log = realLog ;
+    }
 
     //*************************************   
     // Final Clean-Up
     //*************************************
     
-    fprintf( log , "\nThe KDC has terminated normally. Goodbye\n" ) ;
+    LOGF( LOG_INFO , log , "\nThe KDC has terminated normally. Goodbye\n" ) ;
     fclose( log ) ;  
     return 0 ;
 }
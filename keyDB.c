@@ -0,0 +1,103 @@
+/*-------------------------------------------------------------------------------
+
+FILE:   keyDB.c
+
+Build the principal key database that "kdc -s" maps ( see keyDB_open() ), e.g.
+    ./keyDB kdc/principals.db "Amal is Hope" amal/amalKey.bin "Basim is Smily" basim/basimKey.bin
+    ./keyDB -r 1000000 big.db      ( also principal-0 ... principal-999999 , random keys )
+    ./keyDB -q kdc/principals.db "Amal is Hope"     ( dump one principal's key and IV )
+-------------------------------------------------------------------------------*/
+
+#include "myCrypto.h"
+
+#define RANDOM_ID_LEN   24
+
+//--------------------------------------------------------------------------
+static void usage( const char *me )
+{
+    fprintf( stderr , "Usage: %s [ -r <random principals> ] <database> [ <ID> <key file> ] ...\n"
+                      "       %s -q <database> <ID>\n" , me , me ) ;
+    exit(-1) ;
+}
+
+static int query( const char *path , const char *id )
+{
+    myKeyDB_t *db = keyDB_open( path ) ;
+    if ( db == NULL )
+    {
+        fprintf( stderr , "%s: missing or not a key database\n" , path ) ;
+        exit(-1) ;
+    }
+
+    const myKey_t *k = keyDB_lookup( db , id ) ;
+    if ( k == NULL )
+    {
+        fprintf( stderr , "'%s' is not one of the %lu principals in %s\n" , id , (unsigned long) db->count , path ) ;
+        exit(-1) ;
+    }
+
+    printf( "'%s' has this Master key { key , IV }\n" , id ) ;
+    hexDump_fp( stdout , k->key , SYMMETRIC_KEY_LEN , 4 ) ;
+    printf( "\n" ) ;
+    hexDump_fp( stdout , k->iv , INITVECTOR_LEN , 4 ) ;
+    keyDB_close( db ) ;
+    return 0 ;
+}
+
+//--------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    size_t  nRandom = 0 ;
+    int     arg = 1 ;
+
+    if ( argc == 4 && strcmp( argv[1] , "-q" ) == 0 )
+        return query( argv[2] , argv[3] ) ;
+
+    if ( argc > 2 && strcmp( argv[1] , "-r" ) == 0 )
+    {
+        nRandom = strtoul( argv[2] , NULL , 10 ) ;
+        arg     = 3 ;
+    }
+    if ( argc - arg < 1 || ( argc - arg - 1 ) % 2 != 0 )
+        usage( argv[0] ) ;
+
+    const char  *path   = argv[ arg++ ] ;
+    size_t       nGiven = ( argc - arg ) / 2 , n = nRandom + nGiven ;
+    const char **ids    = malloc( ( n ? n : 1 ) * sizeof( char * ) ) ;
+    myKey_t     *keys   = malloc( ( n ? n : 1 ) * sizeof( myKey_t ) ) ;
+    char        *names  = malloc( nRandom * RANDOM_ID_LEN + 1 ) ;
+    if ( ids == NULL || keys == NULL || names == NULL )
+        exitError( "keyDB: out of memory" ) ;
+
+    for ( size_t i = 0 ; i < nGiven ; i++ )
+    {
+        ids[ i ] = argv[ arg + 2 * i ] ;
+        if ( getKeyFromFile( argv[ arg + 2 * i + 1 ] , &keys[ i ] ) != 1 )
+        {
+            fprintf( stderr , "Could not get the key & IV of '%s' from %s\n" , ids[ i ] , argv[ arg + 2 * i + 1 ] ) ;
+            exit(-1) ;
+        }
+    }
+
+    if ( nRandom > 0 && RAND_bytes( (uint8_t *) &keys[ nGiven ] , nRandom * sizeof( myKey_t ) ) != 1 )
+        handleErrors( "keyDB: RAND_bytes failed" ) ;
+    for ( size_t i = 0 ; i < nRandom ; i++ )
+    {
+        char *name = names + i * RANDOM_ID_LEN ;
+        snprintf( name , RANDOM_ID_LEN , "principal-%zu" , i ) ;
+        ids[ nGiven + i ] = name ;
+    }
+
+    if ( keyDB_write( path , ids , keys , n ) != 0 )
+    {
+        if ( errno == EEXIST )
+            fprintf( stderr , "%s: every ID must be given only once\n" , path ) ;
+        else
+            perror( path ) ;
+        exit(-1) ;
+    }
+    printf( "%s now holds %zu principals\n" , path , n ) ;
+
+    free( ids ) ;  free( keys ) ;  free( names ) ;
+    return 0 ;
+}
@@ -11,16 +11,20 @@ Submitted on:
 	 
 ----------------------------------------------------------------------------*/
 
+#define _GNU_SOURCE     // fopencookie() for the asynchronous logs
 #include "myCrypto.h"
 
 //***********************************************************************
 // pLAB-01
 //***********************************************************************
 
+static void logAtAbort( void ) ;
+
 void handleErrors( char *msg)
 {
     fprintf( stderr , "%s\n" , msg ) ;
     ERR_print_errors_fp(stderr);
+    logAtAbort() ;          // abort() flushes nothing, the async logs included
     abort();
 }
 
@@ -30,124 +34,85 @@ void handleErrors( char *msg)
 // Caller must allocate sufficient memory for the cipher text
 // Returns size of the cipher text in bytes
 
-unsigned   encrypt( uint8_t *pPlainText, unsigned plainText_len, 
+unsigned   encrypt_r( myCryptoCtx_t *ctx , uint8_t *pPlainText, unsigned plainText_len, 
                     const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText )
 {
-    int status;
-    unsigned len = 0, encrypted_len = 0;
-
-    /* Create and initialize the context */
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx)
-    {
-        handleErrors("encrypt: failed to create CTX");
-    }
-
-    // Initialize the encryption operation
-    status = EVP_EncryptInit_ex(ctx, ALGORITHM(), NULL, key, iv);
-    if (status == -1)
-    {
-        handleErrors("encrypt: failed to EncryptInit_ex");
-    }
-
-    // Call EncryptUpdate as many times as needed (e.g. inside a loop)
-    // to perform regular encryption
-    status = EVP_EncryptUpdate(ctx, pCipherText, &len, pPlainText, plainText_len);
-    if (status == -1)
-    {
-        handleErrors("encrypt: failed to EncryptUpdate");
-    }
-    encrypted_len += len;
-
-    // If additional ciphertext may still be generated,
-    // the pCipherText pointer must be first advanced forward
-    pCipherText += len;
-
-    // Finalize the encryption
-    status = EVP_EncryptFinal_ex(ctx, pCipherText, &len);
-    if (status == -1)
-    {
-        handleErrors("encrypt: failed to EncryptFinal_ex");
-    }
-    encrypted_len += len;
-
-    /* Clean up */
-    EVP_CIPHER_CTX_free(ctx);
-
-    return encrypted_len;
+    // The (key,IV) pair is expanded only the first time it is seen.
+    // Later calls reuse the cached context instead of building a new one
+    STAT_BEGIN( tStat ) ;
+    myKeyHandle_t *h = keyCache_get_r( ctx , key , iv ) ;
+
+    unsigned len = keyHandle_encrypt( h , pPlainText , plainText_len , pCipherText ) ;
+    STAT_END( STAT_ENCRYPT , tStat ) ;
+    return len ;
 }
 
 //-----------------------------------------------------------------------------
 // Decrypt the cipher text stored at 'pCipherText' into the 
 // caller-allocated memory at 'pDecryptedText'
 // Caller must allocate sufficient memory for the decrypted text
-// Returns size of the decrypted text in bytes
+// Returns size of the decrypted text in bytes, or -1 if the padding is wrong
 
-unsigned   decrypt( uint8_t *pCipherText, unsigned cipherText_len, 
+int        decrypt_r( myCryptoCtx_t *ctx , uint8_t *pCipherText, unsigned cipherText_len, 
                     const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText)
 {
-    int status;
-    unsigned len = 0, decryptedLen = 0;
-
-    /* Create and initialize the context */
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx)
-    {
-        handleErrors("decrypt: failed to create CTX");
-    }
-
-    // Initialize the decryption operation.
-    status = EVP_DecryptInit_ex(ctx, ALGORITHM(), NULL, key, iv);
-    if (status == -1)
-    {
-        handleErrors("decrypt: failed to DecryptInit_ex");
-    }
-
-    // Call DecryptUpdate as many times as needed (e.g. inside a loop)
-    // to perform regular decryption
-    status = EVP_DecryptUpdate(ctx, pDecryptedText, &len, pCipherText, cipherText_len);
-    if (status == -1)
-    {
-        handleErrors("decrypt: failed to DecryptUpdate");
-    }
-    decryptedLen += len;
-
-    // If additional plaintext may still be generated,
-    // the pDecryptedText pointer must be first advanced forward
-    pDecryptedText += len;
-
-    // Finalize the decryption
-    status = EVP_DecryptFinal_ex(ctx, pDecryptedText, &len);
-    if (status == -1)
-    {
-        handleErrors("decrypt: failed to DecryptFinal_ex");
-    }
-    decryptedLen += len;
+    STAT_BEGIN( tStat ) ;
+    myKeyHandle_t *h = keyCache_get_r( ctx , key , iv ) ;
 
-    /* Clean up */
-    EVP_CIPHER_CTX_free(ctx);
-
-    return decryptedLen;
+    int len = keyHandle_decrypt( h , pCipherText , cipherText_len , pDecryptedText ) ;
+    STAT_END( STAT_DECRYPT , tStat ) ;
+    return len ;
 }
 
 //***********************************************************************
 // PA-01
 //***********************************************************************
 
-static unsigned char   plaintext [ PLAINTEXT_LEN_MAX ] , // Temporarily store plaintext
-                       ciphertext[ CIPHER_LEN_MAX    ] , // Temporarily store outcome of encryption
-                       decryptext[ DECRYPTED_LEN_MAX ] ; // Temporarily store decrypted text
+// The scratch buffers plaintext[], ciphertext[], decryptext[] and ciphertext2[]
+// used to be static arrays here, which made this code non-reentrant.
+// They now live in a myCryptoCtx_t ( see Thread-safe Contexts below )
+
+// Zero-copy versions for regular files ( see File I/O Engines below )
+// They return -1 without touching either descriptor when they do not apply
+static long   cipherFileMapped( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , int encrypting ) ;
+static long   cipherFileUring ( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , int encrypting ) ;
+static long   fileDigestMapped( int fd_in , int fd_out , uint8_t *digest ) ;
 
-// above arrays being static to resolve runtime stack size issue. 
-// However, that makes the code non-reentrant for multithreaded application
+// Merkle root instead of plain SHA-256 when setDigestMode() asks for it
+static long   fileDigestTreeRoot( int fd_in , int fd_out , uint8_t *digest ) ;
+
+// Answer from the digest cache, or hash and record; -1 if it does not apply
+static long   fileDigestCached( int fd_in , uint8_t *digest ) ;
+
+#include <limits.h>
+#include <errno.h>
+
+// encryptFile() / decryptFile() return an int: a length past INT_MAX
+// ( a file over 2 GiB ) is reported as -1 rather than wrapped
+static int fileLenResult( long len )
+{
+    if ( len > INT_MAX )
+    {
+        errno = EOVERFLOW ;
+        return -1 ;
+    }
+    return (int) len ;
+}
 
 //-----------------------------------------------------------------------------
 
-int    encryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv )
+int    encryptFile_r( myCryptoCtx_t *mctx , int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv )
 {
+    long mapped = cipherFileUring( fd_in , fd_out , key , iv , 1 ) ;
+    if ( mapped < 0 )
+        mapped = cipherFileMapped( fd_in , fd_out , key , iv , 1 ) ;
+    if ( mapped >= 0 )
+        return fileLenResult( mapped ) ;
+
     int status;
     unsigned plaintext_len;
-    unsigned encrypted_len = 0, len = 0;
+    unsigned len = 0;
+    long     encrypted_len = 0;
 
     /* Create and initialize the context */
     EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
@@ -165,9 +130,9 @@ int    encryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv
 
     // Call EncryptUpdate as many times as needed (e.g. inside a loop)
     // to perform regular encryption
-    while ((plaintext_len = read(fd_in, plaintext, PLAINTEXT_LEN_MAX)) != 0)
+    while ((plaintext_len = read(fd_in, mctx->plaintext, PLAINTEXT_LEN_MAX)) != 0)
     {
-        status = EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len);
+        status = EVP_EncryptUpdate(ctx, mctx->ciphertext, &len, mctx->plaintext, plaintext_len);
         if (status == -1)
         {
             handleErrors("encrypt: failed to EncryptUpdate");
@@ -176,30 +141,37 @@ int    encryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv
 
         // If additional ciphertext may still be generated,
         // the ciphertext pointer must be first advanced forward
-        write(fd_out, ciphertext, len);
+        write(fd_out, mctx->ciphertext, len);
     }
 
     // Finalize the encryption
-    status = EVP_EncryptFinal_ex(ctx, ciphertext, &len);
+    status = EVP_EncryptFinal_ex(ctx, mctx->ciphertext, &len);
     if (status == -1)
     {
         handleErrors("encrypt: failed to EncryptFinal_ex");
     }
     encrypted_len += len;
-    write(fd_out, ciphertext, len);
+    write(fd_out, mctx->ciphertext, len);
 
     /* Clean up */
     EVP_CIPHER_CTX_free(ctx);
 
-    return encrypted_len;
+    return fileLenResult( encrypted_len );
 }
 
 //-----------------------------------------------------------------------------
-int    decryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv )
+int    decryptFile_r( myCryptoCtx_t *mctx , int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv )
 {
+    long mapped = cipherFileUring( fd_in , fd_out , key , iv , 0 ) ;
+    if ( mapped < 0 )
+        mapped = cipherFileMapped( fd_in , fd_out , key , iv , 0 ) ;
+    if ( mapped >= 0 )
+        return fileLenResult( mapped ) ;
+
     int status;
     unsigned ciphertext_len;
-    unsigned decrypted_len = 0, len = 0;
+    unsigned len = 0;
+    long     decrypted_len = 0;
 
     /* Initialize the context */
     EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
@@ -217,9 +189,9 @@ int    decryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv
 
     // Call DecryptUpdate as many times as needed (e.g. inside a loop)
     // to perform regular decryption
-    while ((ciphertext_len = read(fd_in, ciphertext, CIPHER_LEN_MAX)) != 0)
+    while ((ciphertext_len = read(fd_in, mctx->ciphertext, CIPHER_LEN_MAX)) != 0)
     {
-        status = EVP_DecryptUpdate(ctx, decryptext, &len, ciphertext, ciphertext_len);
+        status = EVP_DecryptUpdate(ctx, mctx->decryptext, &len, mctx->ciphertext, ciphertext_len);
         if (status == -1)
         {
             handleErrors("decrypt: failed to DecryptUpdate");
@@ -228,22 +200,22 @@ int    decryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv
 
         // If additional plaintext may still be generated,
         // the plaintext pointer must be first advanced forward
-        write(fd_out, decryptext, len);
+        write(fd_out, mctx->decryptext, len);
     }
 
     // Finalize the decryption
-    status = EVP_DecryptFinal_ex(ctx, decryptext, &len);
+    status = EVP_DecryptFinal_ex(ctx, mctx->decryptext, &len);
     if (status == -1)
     {
         handleErrors("decrypt: failed to DecryptFinal_ex");
     }
     decrypted_len += len;
-    write(fd_out, decryptext, len);
+    write(fd_out, mctx->decryptext, len);
 
     /* Clean up */
     EVP_CIPHER_CTX_free(ctx);
 
-    return decrypted_len;
+    return fileLenResult( decrypted_len );
 }
 
 
@@ -253,6 +225,15 @@ int    decryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv
 //***********************************************************************
 
 RSA *getRSAfromFile(char * filename, int public)
+{
+    // Parsed once per file version, then shared ( see RSA Key Cache below )
+    return rsaCache_get( filename , public ) ;
+}
+
+//-----------------------------------------------------------------------------
+// The actual PEM parse, done by the cache on a miss
+
+static RSA *parseRSAfile(char * filename, int public)
 {
     FILE * fp = fopen(filename,"rb");
     if (fp == NULL)
@@ -283,6 +264,17 @@ size_t fileDigest( int fd_in , int fd_out , uint8_t *digest )
 // file to 'fd_out'
 // Returns actual size in bytes of the computed hash (a.k.a. digest value)
 {
+    if ( getDigestMode() == DIGEST_MODE_TREE )
+        return fileDigestTreeRoot( fd_in , fd_out , digest ) ;
+
+    long cached = fd_out > 0 ? -1 : fileDigestCached( fd_in , digest ) ;
+    if ( cached >= 0 )
+        return cached ;
+
+    long mapped = fileDigestMapped( fd_in , fd_out , digest ) ;
+    if ( mapped >= 0 )
+        return mapped ;
+
     unsigned mdLen = 0;
 	// Use EVP_MD_CTX_create() to create new hashing context
     EVP_MD_CTX *mdCtx = EVP_MD_CTX_create();
@@ -388,6 +380,7 @@ int getKeyFromFile( char *keyF , myKey_t *x )
 
 unsigned MSG1_new ( FILE *log , uint8_t **msg1 , const char *IDa , const char *IDb , const Nonce_t Na )
 {
+    STAT_BEGIN( tStat ) ;
 
     //  Check against any NULL pointers in the arguments
     if (msg1 == NULL || IDa == NULL || IDb == NULL || Na == NULL)
@@ -431,11 +424,15 @@ unsigned MSG1_new ( FILE *log , uint8_t **msg1 , const char *IDa , const char *I
     // Copy the nonce
     memcpy(p, Na, NONCELEN) ;
 
-    fprintf( log , "The following new MSG1 ( %u bytes ) has been created by MSG1_new ():\n" , LenMsg1 ) ;
-    // BIO_dumpt the completed MSG1 indented 4 spaces to the right
-    BIO_dump_indent_fp(log, *msg1, LenMsg1, 4);
-    fprintf( log , "\n" ) ;
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log , "The following new MSG1 ( %u bytes ) has been created by MSG1_new ():\n" , LenMsg1 ) ;
+        // BIO_dumpt the completed MSG1 indented 4 spaces to the right
+        logDump(log, *msg1, LenMsg1, 4);
+        fprintf( log , "\n" ) ;
+    }
     
+    STAT_END( STAT_MSG1_NEW , tStat ) ;
     return LenMsg1;
 }
 
@@ -445,6 +442,7 @@ unsigned MSG1_new ( FILE *log , uint8_t **msg1 , const char *IDa , const char *I
 
 void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
 {
+    STAT_BEGIN( tStat ) ;
 
     //  Check against any NULL pointers in the arguments
     if (IDa == NULL || IDb == NULL || Na == NULL)
@@ -459,7 +457,7 @@ void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
     // Read in the components of Msg1:  L(A)  ||  A   ||  L(B)  ||  B   ||  Na
     // 1) Read Len(ID_A)  from the pipe
     // On failure to read Len(IDa):
-    if (read(fd, &LenA, sizeof(LenA)) != sizeof(LenA))
+    if (statRead(fd, &LenA, sizeof(LenA)) != sizeof(LenA))
     {
         fprintf( log , "Unable to receive all %lu bytes of Len(IDA) "
                        "in MSG1_receive() ... EXITING\n" , LENSIZE );
@@ -482,7 +480,7 @@ void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
     }
 
  	// On failure to read ID_A from the pipe
-    if (read(fd, *IDa, LenA) != LenA)
+    if (statRead(fd, *IDa, LenA) != LenA)
     {
         fprintf( log , "Unable to receive all %u bytes of IDA in MSG1_receive() "
                        "... EXITING\n" , LenA );
@@ -493,7 +491,7 @@ void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
 
     // 3) Read Len( ID_B )  from the pipe
     // On failure to read Len( ID_B ):
-    if (read(fd, &lenB, sizeof(lenB)) != sizeof(lenB))
+    if (statRead(fd, &lenB, sizeof(lenB)) != sizeof(lenB))
     {
         fprintf( log , "Unable to receive all %lu bytes of Len(IDB) "
                        "in MSG1_receive() ... EXITING\n" , LENSIZE );
@@ -515,7 +513,7 @@ void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
     }
 
  	// On failure to read ID_B from the pipe
-    if (read(fd, *IDb, lenB) != lenB)
+    if (statRead(fd, *IDb, lenB) != lenB)
     {
         fprintf( log , "Unable to receive all %u bytes of IDB in MSG1_receive() "
                        "... EXITING\n" , lenB );
@@ -526,7 +524,7 @@ void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
     
     // 5) Read Na
  	// On failure to read Na from the pipe
-    if (read(fd, Na, NONCELEN) != NONCELEN)
+    if (statRead(fd, Na, NONCELEN) != NONCELEN)
     {
         fprintf( log , "Unable to receive all %lu bytes of Na "
                        "in MSG1_receive() ... EXITING\n" , NONCELEN );
@@ -536,10 +534,11 @@ void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
     }
     LenMsg1 += NONCELEN ;
  
-    fprintf( log , "MSG1 ( %u bytes ) has been received"
-                   " on FD %d by MSG1_receive():\n" ,  LenMsg1 , fd  ) ;   
-    fflush( log ) ;
+    LOGF( LOG_INFO , log , "MSG1 ( %u bytes ) has been received"
+                           " on FD %d by MSG1_receive():\n" ,  LenMsg1 , fd  ) ;   
+    LOG_FLUSH( log ) ;
 
+    STAT_END( STAT_MSG1_RECEIVE , tStat ) ;
     return ;
 }
 
@@ -548,7 +547,14 @@ void  MSG1_receive( FILE *log , int fd , char **IDa , char **IDb , Nonce_t Na )
 // PA-04   Part  TWO
 //***********************************************************************
 
-static unsigned char   ciphertext2[ CIPHER_LEN_MAX    ] ; // Temporarily store outcome of encryption
+// Encrypt / decrypt one protocol message with whichever mode setCipherMode() chose
+// These live with the AEAD code at the end of this file
+static unsigned  sealMsg( myCryptoCtx_t *ctx , const myKey_t *k , uint8_t *pPlainText , unsigned plainText_len , 
+                          uint8_t *pCipherText ) ;
+static unsigned  openMsg( myCryptoCtx_t *ctx , FILE *log , const char *who , const myKey_t *k , 
+                          uint8_t *pCipherText , unsigned cipherText_len , uint8_t *pDecryptedText ) ;
+static unsigned  sealedLen( unsigned plainText_len ) ;
+static void      sealBatch( myCryptoCtx_t *ctx , myCipherJob_t *jobs , unsigned nJobs ) ;
 
 //-----------------------------------------------------------------------------
 // Build a new Message #2 from the KDC to Amal
@@ -558,9 +564,10 @@ static unsigned char   ciphertext2[ CIPHER_LEN_MAX    ] ; // Temporarily store o
 // Log milestone steps to the 'log' file for debugging purposes
 // Returns the size (in bytes) of the encrypted (using Ka) Message #2  
 
-unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t *Kb , 
+unsigned MSG2_new_r( myCryptoCtx_t *ctx , FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t *Kb , 
                    const myKey_t *Ks , const char *IDa , const char *IDb  , Nonce_t *Na )
 {
+    STAT_BEGIN( tStat ) ;
 
     //  Check against any NULL pointers in the arguments
     if (msg2 == NULL || Ka == NULL || Kb == NULL || Ks == NULL || IDa == NULL || IDb == NULL || Na == NULL)
@@ -571,13 +578,13 @@ unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t
 
     //---------------------------------------------------------------------------------------
     // Construct TktPlain = { Ks  || L(IDa)  || IDa }
-    // in the global scratch buffer plaintext[]
+    // in the context's scratch buffer plaintext[]
 
     // Build the ticket
     unsigned  LenA    = strlen(IDa) + 1;                                                  //  number of bytes in IDa ;
     unsigned LenTick  = sizeof(myKey_t) + sizeof(unsigned) + LenA ;                       //  number of bytes in the ticket before encryption ;
     uint8_t *t ;
-    t = plaintext ;
+    t = ctx->plaintext ;
 
     // Copy the session key into the temporary plaintext buffer
     memcpy(t, Ks, sizeof(myKey_t)) ;
@@ -591,15 +598,18 @@ unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t
     strcpy(t, IDa) ;
     t += LenA ;
 
-    fprintf( log ,"Plaintext Ticket (%u Bytes) is\n" , LenTick);
-    BIO_dump_indent_fp ( log , plaintext, LenTick, 4 ) ;  fprintf( log , "\n") ; 
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log ,"Plaintext Ticket (%u Bytes) is\n" , LenTick);
+        logDump ( log , ctx->plaintext, LenTick, 4 ) ;  fprintf( log , "\n") ; 
+    }
 
-    // Use that global array as a scratch buffer for building the plaintext of the ticket
-    // Compute its encrypted version in the global scratch buffer ciphertext[]
+    // Use the context's plaintext[] as a scratch buffer for building the plaintext of the ticket
+    // Compute its encrypted version in the context's scratch buffer ciphertext[]
 
     // Now, set TktCipher = encrypt( Kb , plaintext );
-    // Store the result in the global scratch buffer ciphertext[]
-    unsigned TktCipher = encrypt(plaintext, LenTick, Kb->key, Kb->iv, ciphertext) ;
+    // Store the result in the context's scratch buffer ciphertext[]
+    unsigned TktCipher = sealMsg( ctx , Kb, ctx->plaintext, LenTick, ctx->ciphertext) ;
 
     //---------------------------------------------------------------------------------------
     // Construct the rest of Message 2 then encrypt it using Ka
@@ -611,8 +621,8 @@ unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t
     unsigned *lenPtr  = &LenMsg2; 
     uint8_t  *p ;
 
-    // Allocate memory for msg1. MUST always check malloc() did not fail
-    *msg2 = (uint8_t *) malloc(LenMsg2) ;
+    // Allocate memory for msg2, sized for the sealed message. MUST always check malloc() did not fail
+    *msg2 = (uint8_t *) malloc( sealedLen( LenMsg2 ) ) ;
     if (*msg2 == NULL)
     {
         fprintf( stderr , "MSG2_new: message could not be allocated\n" ) ;
@@ -620,9 +630,9 @@ unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t
     }
 
     // Fill in Msg2 Plaintext:  Ks || L(IDb) || IDb || Na || len(TktCipher) || TktCipher
-    // Reuse that global array plaintext[] as a scratch buffer for building the plaintext of the MSG2
-    memset(plaintext, 0, PLAINTEXT_LEN_MAX) ;
-    p = plaintext;
+    // Reuse the context's plaintext[] as a scratch buffer for building the plaintext of the MSG2
+    memset(ctx->plaintext, 0, PLAINTEXT_LEN_MAX) ;
+    p = ctx->plaintext;
 
     // Copy the session key into the temporary plaintext buffer
     memcpy(p, Ks, sizeof(myKey_t)) ;
@@ -645,40 +655,50 @@ unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t
     p += sizeof(unsigned) ;
 
     // Copy the ticket cipher text into the temporary plaintext buffer
-    memcpy(p, ciphertext, TktCipher) ;
+    memcpy(p, ctx->ciphertext, TktCipher) ;
 
     // Now, encrypt Message 2 using Ka. 
-    // Use the global scratch buffer ciphertext2[] to collect the results
+    // Use the context's scratch buffer ciphertext2[] to collect the results
 
     // // TESTING PURPOSES
     // fprintf( log ,"This is the plaintext MSG2 before Encryption:\n");  
-    // BIO_dump_indent_fp ( log , plaintext, LenMsg2, 4) ;  fprintf( log , "\n") ;
+    // logDump ( log , plaintext, LenMsg2, 4) ;  fprintf( log , "\n") ;
     // // END TESTING PURPOSES
 
-    unsigned Msg2CipherLen = encrypt(plaintext, LenMsg2, Ka->key, Ka->iv, ciphertext2) ;
+    unsigned Msg2CipherLen = sealMsg( ctx , Ka, ctx->plaintext, LenMsg2, ctx->ciphertext2) ;
 
-    fprintf( log ,"This is the new MSG2 ( %u Bytes ) before Encryption:\n" , LenMsg2);  
-    fprintf( log ,"    Ks { key + IV } (%lu Bytes) is:\n" , sizeof(myKey_t) );
-    BIO_dump_indent_fp ( log , Ks, sizeof(myKey_t), 4) ;  fprintf( log , "\n") ; 
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log ,"This is the new MSG2 ( %u Bytes ) before Encryption:\n" , LenMsg2);  
+        fprintf( log ,"    Ks { key + IV } (%lu Bytes) is:\n" , sizeof(myKey_t) );
+        logDump ( log , Ks, sizeof(myKey_t), 4) ;  fprintf( log , "\n") ; 
 
-    fprintf( log ,"    IDb (%u Bytes) is:\n" , LenB );
-    BIO_dump_indent_fp ( log , IDb, LenB, 4 ) ;  fprintf( log , "\n") ; 
+        fprintf( log ,"    IDb (%u Bytes) is:\n" , LenB );
+        logDump ( log , IDb, LenB, 4 ) ;  fprintf( log , "\n") ; 
 
-    fprintf( log ,"    Na (%lu Bytes) is:\n" , NONCELEN);
-    BIO_dump_indent_fp ( log , Na, NONCELEN, 4) ;  fprintf( log , "\n") ; 
+        fprintf( log ,"    Na (%lu Bytes) is:\n" , NONCELEN);
+        logDump ( log , Na, NONCELEN, 4) ;  fprintf( log , "\n") ; 
+    }
 
-    fprintf( log ,"    Encrypted Ticket (%u Bytes) is\n" , TktCipher );
-    BIO_dump_indent_fp ( log , ciphertext, TktCipher, 4 ) ;  fprintf( log , "\n") ; 
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log ,"    Encrypted Ticket (%u Bytes) is\n" , TktCipher );
+        logDump ( log , ctx->ciphertext, TktCipher, 4 ) ;  fprintf( log , "\n") ; 
+    }
 
     // Copy the encrypted ciphertext to Caller's msg2 buffer.
-    memcpy(*msg2, ciphertext2, Msg2CipherLen) ;
+    memcpy(*msg2, ctx->ciphertext2, Msg2CipherLen) ;
 
-    fprintf( log , "The following new Encrypted MSG2 ( %u bytes ) has been"
-                   " created by MSG2_new():  \n" , Msg2CipherLen ) ;
-    BIO_dump_indent_fp( log , *msg2 , Msg2CipherLen , 4 ) ;    fprintf( log , "\n" ) ;    
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log , "The following new Encrypted MSG2 ( %u bytes ) has been"
+                       " created by MSG2_new():  \n" , Msg2CipherLen ) ;
+        logDump( log , *msg2 , Msg2CipherLen , 4 ) ;    fprintf( log , "\n" ) ;    
+    }
 
-    fflush( log ) ;    
+    LOG_FLUSH( log ) ;    
     
+    STAT_END( STAT_MSG2_NEW , tStat ) ;
     return Msg2CipherLen ;    
 
 }
@@ -688,9 +708,10 @@ unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t
 // Parse the incoming msg2 into the component fields 
 // *Ks, *IDb, *Na and TktCipher = Encr{ Ks  || L(IDb)  || IDb }
 
-void MSG2_receive( FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **IDb , 
+void MSG2_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **IDb , 
                        Nonce_t *Na , unsigned *lenTktCipher , uint8_t **tktCipher )
 {
+    STAT_BEGIN( tStat ) ;
 
     //  Check against any NULL pointers in the arguments
     if (Ka == NULL || Ks == NULL || IDb == NULL || Na == NULL || log == NULL)
@@ -704,7 +725,7 @@ void MSG2_receive( FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **
  
     // Read in the components of Msg2: Encr{ Ks  || L(IDb)  || IDb || Na || L(Tkt) Encr{ Tkt } }
     // 1) Read the message length from the pipe
-    if (read(fd, &LenMsg2Encr, LENSIZE) != LENSIZE)
+    if (statRead(fd, &LenMsg2Encr, LENSIZE) != LENSIZE)
     {
         fprintf( log , "Unable to receive all %lu bytes of Len(Msg2Encr) "
                        "in MSG2_receive() ... EXITING\n" , LENSIZE );
@@ -714,7 +735,7 @@ void MSG2_receive( FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **
     }
 
     // 2) Read the whole encrypted message2 from the pipe
-    if (read(fd, ciphertext2, LenMsg2Encr) != LenMsg2Encr)
+    if (statRead(fd, ctx->ciphertext2, LenMsg2Encr) != LenMsg2Encr)
     {
 
         fprintf( log , "Unable to receive all %u bytes of Msg2Encr "
@@ -724,13 +745,13 @@ void MSG2_receive( FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **
         exitError( "Unable to receive all bytes Msg2Encr in MSG2_receive()" );
     }
 
-    memset(plaintext, 0, PLAINTEXT_LEN_MAX) ;
+    memset(ctx->plaintext, 0, PLAINTEXT_LEN_MAX) ;
 
     // 3) Decrypt the entire message2
-    LenMsg2 = decrypt(ciphertext2, LenMsg2Encr, Ka->key, Ka->iv, plaintext) ;
+    LenMsg2 = openMsg( ctx , log, "MSG2_receive()", Ka, ctx->ciphertext2, LenMsg2Encr, ctx->plaintext) ;
     
     // 4) Read in the Ks from the plaintext buffer
-    p = plaintext;
+    p = ctx->plaintext;
 
     memcpy(Ks, p, sizeof(myKey_t));
     p += sizeof(myKey_t) ;
@@ -772,12 +793,15 @@ void MSG2_receive( FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **
     memcpy(*tktCipher, p, *lenTktCipher) ;
     p += *lenTktCipher ;
 
-    fprintf( log ,"MSG2_receive() got the following Encrypted MSG2 ( %u bytes ) Successfully\n" 
-                 , LenMsg2Encr );
-    BIO_dump_indent_fp( log , ciphertext2, LenMsg2Encr , 4 ) ; fprintf( log , "\n" ) ;
-    fflush( log ) ;
-
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log ,"MSG2_receive() got the following Encrypted MSG2 ( %u bytes ) Successfully\n" 
+                     , LenMsg2Encr );
+        logDump( log , ctx->ciphertext2, LenMsg2Encr , 4 ) ; fprintf( log , "\n" ) ;
+    }
+    LOG_FLUSH( log ) ;
 
+    STAT_END( STAT_MSG2_RECEIVE , tStat ) ;
 }
 
 //-----------------------------------------------------------------------------
@@ -789,6 +813,7 @@ void MSG2_receive( FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **
 unsigned MSG3_new( FILE *log , uint8_t **msg3 , const unsigned lenTktCipher , const uint8_t *tktCipher,  
                    const Nonce_t *Na2 )
 {
+    STAT_BEGIN( tStat ) ;
 
     if (msg3 == NULL || tktCipher == NULL || Na2 == NULL)
     {
@@ -813,11 +838,15 @@ unsigned MSG3_new( FILE *log , uint8_t **msg3 , const unsigned lenTktCipher , co
     m += NONCELEN ;
 
     // Print info to the log
-    fprintf( log , "\nThe following new MSG3 ( %u bytes ) has been created by "
-                   "MSG3_new ():\n" , LenMsg3 ) ;
-    BIO_dump_indent_fp( log , *msg3 , LenMsg3 , 4 ) ;    fprintf( log , "\n" ) ;    
-    fflush( log ) ;    
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log , "\nThe following new MSG3 ( %u bytes ) has been created by "
+                       "MSG3_new ():\n" , LenMsg3 ) ;
+        logDump( log , *msg3 , LenMsg3 , 4 ) ;    fprintf( log , "\n" ) ;    
+    }
+    LOG_FLUSH( log ) ;    
 
+    STAT_END( STAT_MSG3_NEW , tStat ) ;
     return LenMsg3 ;
 
 }
@@ -829,8 +858,9 @@ unsigned MSG3_new( FILE *log , uint8_t **msg3 , const unsigned lenTktCipher , co
 // The value of Kb is set by the caller
 // The buffer for IDA is to be allocated here into *IDa
 
-void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char **IDa , Nonce_t *Na2 )
+void MSG3_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char **IDa , Nonce_t *Na2 )
 {
+    STAT_BEGIN( tStat ) ;
 
     if (Kb == NULL || Ks == NULL || IDa == NULL || Na2 == NULL)
     {
@@ -840,7 +870,7 @@ void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char *
 
     // Read the length of the ticket cipher first
     unsigned LenTktCiph = 0;
-    if (read(fd, &LenTktCiph, LENSIZE) != LENSIZE)
+    if (statRead(fd, &LenTktCiph, LENSIZE) != LENSIZE)
     {
         fprintf( log , "Unable to receive all %lu bytes of LenTktCiph "
                        "in MSG3_receive() ... EXITING\n" , LENSIZE );
@@ -849,7 +879,7 @@ void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char *
     }
 
     // Read the ticket cipher into the ciphertext buffer
-    if (read(fd, ciphertext, LenTktCiph) != LenTktCiph)
+    if (statRead(fd, ctx->ciphertext, LenTktCiph) != LenTktCiph)
     {
         fprintf( log , "Unable to receive all %u bytes of TktCiph "
                        "in MSG3_receive() ... EXITING\n" , LenTktCiph );
@@ -858,7 +888,7 @@ void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char *
     }
 
     // Read the Nonce2 into the nonce struct
-    if (read(fd, Na2, NONCELEN) != NONCELEN)
+    if (statRead(fd, Na2, NONCELEN) != NONCELEN)
     {
         fprintf( log , "Unable to receive all %lu bytes of Na2 "
                        "in MSG3_receive() ... EXITING\n" , NONCELEN );
@@ -867,20 +897,26 @@ void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char *
     }
 
     // Print the ticket cipher info
-    fprintf( log ,"The following Encrypted TktCipher ( %u bytes ) was received by MSG3_receive()\n" 
-                 , LenTktCiph );
-    BIO_dump_indent_fp( log , ciphertext, LenTktCiph, 4) ;   fprintf( log , "\n");
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log ,"The following Encrypted TktCipher ( %u bytes ) was received by MSG3_receive()\n" 
+                     , LenTktCiph );
+        logDump( log , ctx->ciphertext, LenTktCiph, 4) ;   fprintf( log , "\n");
+    }
 
     // Decrypt the ticket cipher
-    unsigned LenTkt = decrypt(ciphertext, LenTktCiph, Kb->key, Kb->iv, plaintext) ;
+    unsigned LenTkt = openMsg( ctx , log, "MSG3_receive()", Kb, ctx->ciphertext, LenTktCiph, ctx->plaintext) ;
 
     // Print the decrypted ticket info
-    fprintf( log ,"Here is the Decrypted Ticket ( %u bytes ) in MSG3_receive():\n" , LenTkt ) ;
-    BIO_dump_indent_fp( log , plaintext, LenTkt, 4) ;   fprintf( log , "\n");
-    fflush( log ) ;
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log ,"Here is the Decrypted Ticket ( %u bytes ) in MSG3_receive():\n" , LenTkt ) ;
+        logDump( log , ctx->plaintext, LenTkt, 4) ;   fprintf( log , "\n");
+    }
+    LOG_FLUSH( log ) ;
 
     // Get Ks from the plaintext
-    uint8_t *p = plaintext;
+    uint8_t *p = ctx->plaintext;
 
     memcpy(Ks, p, sizeof(myKey_t)) ;
     p += sizeof(myKey_t);
@@ -904,6 +940,7 @@ void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char *
     memcpy(*IDa, p, (LenA)) ;
     p += (LenA) ;
 
+    STAT_END( STAT_MSG3_RECEIVE , tStat ) ;
 }
 
 //-----------------------------------------------------------------------------
@@ -914,8 +951,9 @@ void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char *
 
 // Returns the size of Message #4 after being encrypted by Ks in bytes
 
-unsigned MSG4_new( FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2 , Nonce_t *Nb )
+unsigned MSG4_new_r( myCryptoCtx_t *ctx , FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2 , Nonce_t *Nb )
 {
+    STAT_BEGIN( tStat ) ;
 
     if (msg4 == NULL || Ks == NULL || fNa2 == NULL || Nb == NULL)
     {
@@ -924,7 +962,7 @@ unsigned MSG4_new( FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2
     }
 
     // Construct MSG4 Plaintext = { f(Na2)  ||  Nb }
-    // Use the global scratch buffer plaintext[] for MSG4 plaintext and fill it in with component values
+    // Use the context's scratch buffer plaintext[] for MSG4 plaintext and fill it in with component values
     unsigned LenNb = NONCELEN;
     unsigned LenMsg4 = NONCELEN + NONCELEN;
     
@@ -932,8 +970,8 @@ unsigned MSG4_new( FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2
     Nonce_t result;
     fNonce(result, *fNa2);
 
-    memset(plaintext, 0, PLAINTEXT_LEN_MAX) ;
-    uint8_t *p = plaintext;
+    memset(ctx->plaintext, 0, PLAINTEXT_LEN_MAX) ;
+    uint8_t *p = ctx->plaintext;
 
     // Copy f(Na2) into the plaintext buffer
     memcpy(p, result, NONCELEN) ;
@@ -944,15 +982,18 @@ unsigned MSG4_new( FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2
     p += NONCELEN;
 
 
-    fprintf(log, "Basim is sending this f( Na2 ) in MSG4:\n");
-    BIO_dump_indent_fp(log, result, NONCELEN, 4);   fprintf(log, "\n");
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf(log, "Basim is sending this f( Na2 ) in MSG4:\n");
+        logDump(log, result, NONCELEN, 4);   fprintf(log, "\n");
 
-    fprintf(log, "Basim is sending this nonce Nb in MSG4:\n");
-    BIO_dump_indent_fp(log, Nb, NONCELEN, 4);   fprintf(log, "\n");
+        fprintf(log, "Basim is sending this nonce Nb in MSG4:\n");
+        logDump(log, Nb, NONCELEN, 4);   fprintf(log, "\n");
+    }
 
     // Now, encrypt MSG4 plaintext using the session key Ks;
-    // Use the global scratch buffer ciphertext[] to collect the result. Make sure it fits.
-    unsigned LenMSG4cipher = encrypt(plaintext, LenMsg4, Ks->key, Ks->iv, ciphertext2) ;
+    // Use the context's scratch buffer ciphertext[] to collect the result. Make sure it fits.
+    unsigned LenMSG4cipher = sealMsg( ctx , Ks, ctx->plaintext, LenMsg4, ctx->ciphertext2) ;
 
     // Now allocate a buffer for the caller, and copy the encrypted MSG4 to it
     *msg4 = malloc( LenMSG4cipher ) ;
@@ -962,12 +1003,16 @@ unsigned MSG4_new( FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2
         exit(-1) ;
     }
 
-    memcpy(*msg4, ciphertext2, LenMSG4cipher) ;
+    memcpy(*msg4, ctx->ciphertext2, LenMSG4cipher) ;
 
-    fprintf( log , "The following new Encrypted MSG4 ( %u bytes ) has been"
-                   " created by MSG4_new ():  \n" , LenMSG4cipher ) ;
-    BIO_dump_indent_fp( log , *msg4 , LenMSG4cipher , 4 ) ;    fprintf( log , "\n" ) ;
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log , "The following new Encrypted MSG4 ( %u bytes ) has been"
+                       " created by MSG4_new ():  \n" , LenMSG4cipher ) ;
+        logDump( log , *msg4 , LenMSG4cipher , 4 ) ;    fprintf( log , "\n" ) ;
+    }
 
+    STAT_END( STAT_MSG4_NEW , tStat ) ;
     return LenMSG4cipher;  
 }
 
@@ -975,8 +1020,9 @@ unsigned MSG4_new( FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2
 // Receive Message #4 by Amal from Basim
 // Parse the incoming encrypted msg4 into the values rcvd_fNa2 and Nb
 
-void  MSG4_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2 , Nonce_t *Nb )
+void  MSG4_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2 , Nonce_t *Nb )
 {
+    STAT_BEGIN( tStat ) ;
     if (Ks == NULL || rcvd_fNa2 == NULL || Nb == NULL)
     {
         fprintf( stderr , "MSG4_receive: NULL pointer argument\n" ) ;
@@ -984,7 +1030,7 @@ void  MSG4_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2
     }
 
     unsigned LenMsg4Encr = 0, LenMsg4 = 0;
-    if (read(fd, &LenMsg4Encr, LENSIZE) != LENSIZE)
+    if (statRead(fd, &LenMsg4Encr, LENSIZE) != LENSIZE)
     {
         fprintf( log , "Unable to receive all %lu bytes of Len(Msg4Encr) "
                                           "in MSG4_receive() ... EXITING\n" , LENSIZE );
@@ -993,8 +1039,8 @@ void  MSG4_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2
             exitError( "Unable to receive all bytes LenMsg4Encr in MSG4_receive()" );
     }
 
-    memset(ciphertext2, 0, CIPHER_LEN_MAX) ;
-    if (read (fd, ciphertext2, LenMsg4Encr) != LenMsg4Encr)
+    memset(ctx->ciphertext2, 0, CIPHER_LEN_MAX) ;
+    if (statRead(fd, ctx->ciphertext2, LenMsg4Encr) != LenMsg4Encr)
     {
         fprintf( log , "Unable to receive all %u bytes of Msg4Encr "
                             "in MSG4_receive() ... EXITING\n" , LenMsg4Encr );
@@ -1003,19 +1049,25 @@ void  MSG4_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2
             exitError( "Unable to receive all bytes Msg4Encr in MSG4_receive()" );
     }
 
-    fprintf( log ,"The following Encrypted MSG4 ( %u bytes ) was received:\n" , LenMsg4Encr );
-    BIO_dump_indent_fp(log, ciphertext2, LenMsg4Encr, 4); fprintf(log, "\n");
-    fflush(log);
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log ,"The following Encrypted MSG4 ( %u bytes ) was received:\n" , LenMsg4Encr );
+        logDump(log, ctx->ciphertext2, LenMsg4Encr, 4); fprintf(log, "\n");
+    }
+    LOG_FLUSH(log);
 
-    fprintf(log, "\nAmal is expecting back this f( Na2 ) in MSG4:\n") ;
-    BIO_dump_indent_fp(log, rcvd_fNa2, NONCELEN, 4); fprintf( log , "\n" );
-    fflush(log) ;
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf(log, "\nAmal is expecting back this f( Na2 ) in MSG4:\n") ;
+        logDump(log, rcvd_fNa2, NONCELEN, 4); fprintf( log , "\n" );
+    }
+    LOG_FLUSH(log) ;
 
-    memset(plaintext, 0, PLAINTEXT_LEN_MAX);
-    LenMsg4 = decrypt(ciphertext2, LenMsg4Encr, Ks->key, Ks->iv, plaintext);
+    memset(ctx->plaintext, 0, PLAINTEXT_LEN_MAX);
+    LenMsg4 = openMsg( ctx , log, "MSG4_receive()", Ks, ctx->ciphertext2, LenMsg4Encr, ctx->plaintext);
 
     uint8_t *p;
-    p = plaintext;
+    p = ctx->plaintext;
 
     memcpy(rcvd_fNa2, p, NONCELEN);
     p += NONCELEN;
@@ -1023,13 +1075,21 @@ void  MSG4_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2
     memcpy(Nb, p, NONCELEN);
     p += NONCELEN;
 
-    fprintf(log, "Basim returned the following f( Na2 )   >>>> VALID\n") ;
-    BIO_dump_indent_fp(log, rcvd_fNa2, NONCELEN, 4); fprintf( log , "\n" );
-    fflush(log) ;
+    LOGF( LOG_INFO , log , "Basim returned the following f( Na2 )   >>>> VALID\n") ;
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        logDump(log, rcvd_fNa2, NONCELEN, 4); fprintf( log , "\n" );
+    }
+    LOG_FLUSH(log) ;
+
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf(log, "Amal also received this Nb :\n") ;
+        logDump(log, Nb, NONCELEN, 4); fprintf( log , "\n" );
+    }
+    LOG_FLUSH(log) ;
 
-    fprintf(log, "Amal also received this Nb :\n") ;
-    BIO_dump_indent_fp(log, Nb, NONCELEN, 4); fprintf( log , "\n" );
-    fflush(log) ;
+    STAT_END( STAT_MSG4_RECEIVE , tStat ) ;
 }
 
 //-----------------------------------------------------------------------------
@@ -1039,8 +1099,9 @@ void  MSG4_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2
 // All other arguments have been initialized by caller
 // Returns the size of Message #5  in bytes
 
-unsigned MSG5_new( FILE *log , uint8_t **msg5, const myKey_t *Ks ,  Nonce_t *fNb )
+unsigned MSG5_new_r( myCryptoCtx_t *ctx , FILE *log , uint8_t **msg5, const myKey_t *Ks ,  Nonce_t *fNb )
 {
+    STAT_BEGIN( tStat ) ;
 
     if (msg5 == NULL || Ks == NULL || fNb == NULL)
     {
@@ -1049,18 +1110,18 @@ unsigned MSG5_new( FILE *log , uint8_t **msg5, const myKey_t *Ks ,  Nonce_t *fNb
     }
 
     // Construct MSG5 Plaintext  = {  f(Nb)  }
-    // Use the global scratch buffer plaintext[] for MSG5 plaintext. Make sure it fits 
+    // Use the context's scratch buffer plaintext[] for MSG5 plaintext. Make sure it fits 
     unsigned LenMsg5 = NONCELEN;
-    memset(plaintext, 0, PLAINTEXT_LEN_MAX) ;
-    uint8_t *p = plaintext;
+    memset(ctx->plaintext, 0, PLAINTEXT_LEN_MAX) ;
+    uint8_t *p = ctx->plaintext;
 
     // Copy f(Nb) into the plaintext buffer
     memcpy(p, fNb, NONCELEN) ;
     p += NONCELEN;
 
     // Now, encrypt( Ks , {plaintext} );
-    // Use the global scratch buffer ciphertext[] to collect result. Make sure it fits.
-    unsigned LenMSG5cipher = encrypt(plaintext, LenMsg5, Ks->key, Ks->iv, ciphertext2) ;
+    // Use the context's scratch buffer ciphertext[] to collect result. Make sure it fits.
+    unsigned LenMSG5cipher = sealMsg( ctx , Ks, ctx->plaintext, LenMsg5, ctx->ciphertext2) ;
 
     // Now allocate a buffer for the caller, and copy the encrypted MSG5 to it
     *msg5 = (uint8_t *) malloc( LenMSG5cipher ) ;
@@ -1070,13 +1131,17 @@ unsigned MSG5_new( FILE *log , uint8_t **msg5, const myKey_t *Ks ,  Nonce_t *fNb
         exit(-1) ;
     }
 
-    memcpy(*msg5, ciphertext2, LenMSG5cipher) ;
+    memcpy(*msg5, ctx->ciphertext2, LenMSG5cipher) ;
 
-    fprintf( log , "The following new Encrypted MSG5 ( %u bytes ) has been"
-                   " created by MSG5_new ():  \n" , LenMSG5cipher ) ;
-    BIO_dump_indent_fp( log , *msg5 , LenMSG5cipher , 4 ) ;    fprintf( log , "\n" ) ;    
-    fflush( log ) ;    
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log , "The following new Encrypted MSG5 ( %u bytes ) has been"
+                       " created by MSG5_new ():  \n" , LenMSG5cipher ) ;
+        logDump( log , *msg5 , LenMSG5cipher , 4 ) ;    fprintf( log , "\n" ) ;    
+    }
+    LOG_FLUSH( log ) ;    
 
+    STAT_END( STAT_MSG5_NEW , tStat ) ;
     return LenMSG5cipher;
 }
 
@@ -1084,8 +1149,9 @@ unsigned MSG5_new( FILE *log , uint8_t **msg5, const myKey_t *Ks ,  Nonce_t *fNb
 // Receive Message 5 by Basim from Amal
 // Parse the incoming msg5 into the value fNb
 
-void  MSG5_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb )
+void  MSG5_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb )
 {
+    STAT_BEGIN( tStat ) ;
 
     if (Ks == NULL || fNb == NULL)
     {
@@ -1095,10 +1161,10 @@ void  MSG5_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb )
 
     // Read Len( Msg5 ) followed by reading Msg5 itself
     // Always make sure read() and write() succeed
-    // Use the global scratch buffer ciphertext[] to receive encrypted MSG5.
+    // Use the context's scratch buffer ciphertext[] to receive encrypted MSG5.
     // Make sure it fits.
     unsigned LenMSG5cipher = 0;
-    if (read(fd, &LenMSG5cipher, LENSIZE) != LENSIZE)
+    if (statRead(fd, &LenMSG5cipher, LENSIZE) != LENSIZE)
     {
         fprintf( log , "Unable to receive all %lu bytes of Len(MSG5cipher) "
                        "in MSG5_receive() ... EXITING\n" , LENSIZE );
@@ -1107,7 +1173,7 @@ void  MSG5_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb )
         exitError( "Unable to receive all bytes LenMSG5cipher in MSG5_receive()" );
     }
 
-    if (read(fd, ciphertext2, LenMSG5cipher) != LenMSG5cipher)
+    if (statRead(fd, ctx->ciphertext2, LenMSG5cipher) != LenMSG5cipher)
     {
         fprintf( log , "Unable to receive all %u bytes of MSG5cipher "
                        "in MSG5_receive() ... EXITING\n" , LenMSG5cipher );
@@ -1117,24 +1183,32 @@ void  MSG5_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb )
     }
 
     // Now, Decrypt MSG5 using Ks
-    // Use the global scratch buffer decryptext[] to collect the results of decryption
+    // Use the context's scratch buffer decryptext[] to collect the results of decryption
     // Make sure it fits
-    unsigned LenMSG5 = decrypt(ciphertext2, LenMSG5cipher, Ks->key, Ks->iv, decryptext) ;
+    unsigned LenMSG5 = openMsg( ctx , log, "MSG5_receive()", Ks, ctx->ciphertext2, LenMSG5cipher, ctx->decryptext) ;
 
 
     // Parse MSG5 into its components f( Nb )
-    uint8_t *p = decryptext;
+    uint8_t *p = ctx->decryptext;
 
     memcpy(fNb, p, NONCELEN);
     p += NONCELEN;
     
-    fprintf( log, "Basim is expecting back this f( Nb ) in MSG5:\n") ;
-    BIO_dump_indent_fp(log, fNb, NONCELEN, 4); fprintf( log , "\n" );
-    fflush(log) ;
+    if ( LOG_ON( LOG_DEBUG ) )
+    {
+        fprintf( log, "Basim is expecting back this f( Nb ) in MSG5:\n") ;
+        logDump(log, fNb, NONCELEN, 4); fprintf( log , "\n" );
+    }
+    LOG_FLUSH(log) ;
+
+    if ( LOG_ON( LOG_TRACE ) )
+    {
+        fprintf( log ,"The following Encrypted MSG5 ( %u bytes ) has been received:\n" , LenMSG5cipher );
+        logDump(log, ctx->ciphertext2, LenMSG5cipher, 4); fprintf(log, "\n");
+    }
+    LOG_FLUSH(log);
 
-    fprintf( log ,"The following Encrypted MSG5 ( %u bytes ) has been received:\n" , LenMSG5cipher );
-    BIO_dump_indent_fp(log, ciphertext2, LenMSG5cipher, 4); fprintf(log, "\n");
-    fflush(log);
+    STAT_END( STAT_MSG5_RECEIVE , tStat ) ;
 }
 
 //-----------------------------------------------------------------------------
@@ -1158,4 +1232,5860 @@ void     fNonce( Nonce_t r , Nonce_t n )
 
     // Convert back to big endian
     r[0] = htonl(fNonce) ;
-    }
\ No newline at end of file
+    }
+
+//***********************************************************************
+// Key Handles
+//***********************************************************************
+
+//-----------------------------------------------------------------------------
+// Build a handle for the given (key,IV) pair. The cipher object is fetched
+// once, and both contexts get the expanded key schedule here, so that
+// keyHandle_encrypt() / keyHandle_decrypt() only need to rewind the IV
+// Returns NULL if the handle could not be allocated
+
+myKeyHandle_t *keyHandle_new( const uint8_t *key , const uint8_t *iv )
+{
+    if ( key == NULL || iv == NULL )
+    {
+        fprintf( stderr , "keyHandle_new: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    myKeyHandle_t *h = (myKeyHandle_t *) calloc( 1 , sizeof(myKeyHandle_t) ) ;
+    if ( h == NULL )
+        return NULL ;
+
+    memcpy( h->k.key , key , SYMMETRIC_KEY_LEN ) ;
+    memcpy( h->k.iv  , iv  , INITVECTOR_LEN    ) ;
+
+    // Fetch the implementation of ALGORITHM once instead of on every Init
+    h->cipher = EVP_CIPHER_fetch( NULL , EVP_CIPHER_get0_name( ALGORITHM() ) , NULL ) ;
+    if ( h->cipher == NULL )
+        handleErrors( "keyHandle_new: failed to fetch the cipher" ) ;
+
+    h->encCtx = EVP_CIPHER_CTX_new() ;
+    h->decCtx = EVP_CIPHER_CTX_new() ;
+    if ( h->encCtx == NULL || h->decCtx == NULL )
+        handleErrors( "keyHandle_new: failed to create CTX" ) ;
+
+    if ( EVP_EncryptInit_ex( h->encCtx , h->cipher , NULL , h->k.key , h->k.iv ) != 1 )
+        handleErrors( "keyHandle_new: failed to EncryptInit_ex" ) ;
+
+    if ( EVP_DecryptInit_ex( h->decCtx , h->cipher , NULL , h->k.key , h->k.iv ) != 1 )
+        handleErrors( "keyHandle_new: failed to DecryptInit_ex" ) ;
+
+    return h ;
+}
+
+//-----------------------------------------------------------------------------
+// Release a handle and wipe the key material it holds
+
+void keyHandle_free( myKeyHandle_t *h )
+{
+    if ( h == NULL )
+        return ;
+
+    EVP_CIPHER_CTX_free( h->encCtx ) ;
+    EVP_CIPHER_CTX_free( h->decCtx ) ;
+    EVP_CIPHER_free( h->cipher ) ;
+    EVP_CIPHER_CTX_free( h->aeadEncCtx ) ;
+    EVP_CIPHER_CTX_free( h->aeadDecCtx ) ;
+    EVP_CIPHER_free( h->aead ) ;
+
+    OPENSSL_cleanse( h , sizeof(myKeyHandle_t) ) ;
+    free( h ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Same contract as encrypt(), but using the pre-initialized context in 'h'
+// Returns size of the cipher text in bytes
+
+unsigned keyHandle_encrypt( myKeyHandle_t *h , uint8_t *pPlainText, unsigned plainText_len , 
+                            uint8_t *pCipherText )
+{
+    int      len = 0 ;
+    unsigned encrypted_len = 0 ;
+
+    // Passing a NULL cipher and key keeps the existing key schedule
+    // and only resets the IV and the internal buffer
+    if ( EVP_EncryptInit_ex( h->encCtx , NULL , NULL , NULL , h->k.iv ) != 1 )
+        handleErrors( "encrypt: failed to EncryptInit_ex" ) ;
+
+    if ( EVP_EncryptUpdate( h->encCtx , pCipherText , &len , pPlainText , plainText_len ) != 1 )
+        handleErrors( "encrypt: failed to EncryptUpdate" ) ;
+    encrypted_len += len ;
+    pCipherText   += len ;
+
+    if ( EVP_EncryptFinal_ex( h->encCtx , pCipherText , &len ) != 1 )
+        handleErrors( "encrypt: failed to EncryptFinal_ex" ) ;
+    encrypted_len += len ;
+
+    return encrypted_len ;
+}
+
+//-----------------------------------------------------------------------------
+// Same contract as decrypt_r(), but using the pre-initialized context in 'h'
+// Returns size of the decrypted text in bytes, or -1 if the padding is wrong
+// ( a tampered or truncated message, or the wrong key )
+
+int keyHandle_decrypt( myKeyHandle_t *h , uint8_t *pCipherText, unsigned cipherText_len , 
+                       uint8_t *pDecryptedText )
+{
+    int      len = 0 ;
+    int      decryptedLen = 0 ;
+
+    if ( EVP_DecryptInit_ex( h->decCtx , NULL , NULL , NULL , h->k.iv ) != 1 )
+        handleErrors( "decrypt: failed to DecryptInit_ex" ) ;
+
+    if ( EVP_DecryptUpdate( h->decCtx , pDecryptedText , &len , pCipherText , cipherText_len ) != 1 )
+        handleErrors( "decrypt: failed to DecryptUpdate" ) ;
+    decryptedLen   += len ;
+    pDecryptedText += len ;
+
+    if ( EVP_DecryptFinal_ex( h->decCtx , pDecryptedText , &len ) != 1 )
+    {
+        OPENSSL_cleanse( pDecryptedText - decryptedLen , decryptedLen ) ;
+        return -1 ;
+    }
+    decryptedLen += len ;
+
+    return decryptedLen ;
+}
+
+//-----------------------------------------------------------------------------
+// Small per-context cache of handles, looked up by the (key,IV) bytes
+// A party only ever uses a handful of keys (its master key and Ks), so a
+// linear scan over KEY_CACHE_SLOTS entries is cheaper than hashing
+// When full, the oldest slot is evicted round-robin
+
+myKeyHandle_t *keyCache_get_r( myCryptoCtx_t *ctx , const uint8_t *key , const uint8_t *iv )
+{
+    for ( unsigned i = 0 ; i < KEY_CACHE_SLOTS ; i++ )
+    {
+        myKeyHandle_t *h = ctx->keyCache[ i ] ;
+        if ( h != NULL 
+             && memcmp( h->k.key , key , SYMMETRIC_KEY_LEN ) == 0
+             && memcmp( h->k.iv  , iv  , INITVECTOR_LEN    ) == 0 )
+            return h ;
+    }
+
+    myKeyHandle_t *h = keyHandle_new( key , iv ) ;
+    if ( h == NULL )
+        exitError( "keyCache_get: Out of Memory allocating a key handle" ) ;
+
+    keyHandle_free( ctx->keyCache[ ctx->keyCacheNext ] ) ;
+    ctx->keyCache[ ctx->keyCacheNext ] = h ;
+    ctx->keyCacheNext = ( ctx->keyCacheNext + 1 ) % KEY_CACHE_SLOTS ;
+
+    return h ;
+}
+
+//-----------------------------------------------------------------------------
+// Release every cached handle, e.g. before exiting or after a key rotation
+
+void keyCache_flush_r( myCryptoCtx_t *ctx )
+{
+    for ( unsigned i = 0 ; i < KEY_CACHE_SLOTS ; i++ )
+    {
+        keyHandle_free( ctx->keyCache[ i ] ) ;
+        ctx->keyCache[ i ] = NULL ;
+    }
+    ctx->keyCacheNext = 0 ;
+}
+
+//***********************************************************************
+// Batch Encryption
+//***********************************************************************
+
+// A single CBC chain is latency-bound: block i+1 cannot start before block i
+// leaves the last AES round. Independent streams have no such dependency, so
+// encryptBatch() runs BATCH_LANES of them through each AES round together.
+// This needs AES-NI, so it is compiled for x86 only and enabled at run time;
+// everywhere else each job simply goes through encrypt()
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+#define AES256_ROUNDS   14
+
+//-----------------------------------------------------------------------------
+// Two halves of the AES-256 key schedule step (Intel AES-NI white paper)
+
+__attribute__((target("aes,sse2")))
+static inline __m128i aes256Assist1( __m128i t1 , __m128i t2 )
+{
+    __m128i t4 ;
+
+    t2 = _mm_shuffle_epi32( t2 , 0xff ) ;
+    t4 = _mm_slli_si128( t1 , 4 ) ;   t1 = _mm_xor_si128( t1 , t4 ) ;
+    t4 = _mm_slli_si128( t4 , 4 ) ;   t1 = _mm_xor_si128( t1 , t4 ) ;
+    t4 = _mm_slli_si128( t4 , 4 ) ;   t1 = _mm_xor_si128( t1 , t4 ) ;
+
+    return _mm_xor_si128( t1 , t2 ) ;
+}
+
+__attribute__((target("aes,sse2")))
+static inline __m128i aes256Assist2( __m128i t1 , __m128i t3 )
+{
+    __m128i t2 , t4 ;
+
+    t4 = _mm_aeskeygenassist_si128( t1 , 0x00 ) ;
+    t2 = _mm_shuffle_epi32( t4 , 0xaa ) ;
+    t4 = _mm_slli_si128( t3 , 4 ) ;   t3 = _mm_xor_si128( t3 , t4 ) ;
+    t4 = _mm_slli_si128( t4 , 4 ) ;   t3 = _mm_xor_si128( t3 , t4 ) ;
+    t4 = _mm_slli_si128( t4 , 4 ) ;   t3 = _mm_xor_si128( t3 , t4 ) ;
+
+    return _mm_xor_si128( t3 , t2 ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Expand a 256-bit key into the 15 round keys used by _mm_aesenc_si128()
+
+__attribute__((target("aes,sse2")))
+static void aes256KeyExpand( const uint8_t *key , __m128i rk[ AES256_ROUNDS + 1 ] )
+{
+    rk[ 0] = _mm_loadu_si128( (const __m128i *) key ) ;
+    rk[ 1] = _mm_loadu_si128( (const __m128i *) ( key + 16 ) ) ;
+
+    rk[ 2] = aes256Assist1( rk[ 0] , _mm_aeskeygenassist_si128( rk[ 1] , 0x01 ) ) ;
+    rk[ 3] = aes256Assist2( rk[ 2] , rk[ 1] ) ;
+    rk[ 4] = aes256Assist1( rk[ 2] , _mm_aeskeygenassist_si128( rk[ 3] , 0x02 ) ) ;
+    rk[ 5] = aes256Assist2( rk[ 4] , rk[ 3] ) ;
+    rk[ 6] = aes256Assist1( rk[ 4] , _mm_aeskeygenassist_si128( rk[ 5] , 0x04 ) ) ;
+    rk[ 7] = aes256Assist2( rk[ 6] , rk[ 5] ) ;
+    rk[ 8] = aes256Assist1( rk[ 6] , _mm_aeskeygenassist_si128( rk[ 7] , 0x08 ) ) ;
+    rk[ 9] = aes256Assist2( rk[ 8] , rk[ 7] ) ;
+    rk[10] = aes256Assist1( rk[ 8] , _mm_aeskeygenassist_si128( rk[ 9] , 0x10 ) ) ;
+    rk[11] = aes256Assist2( rk[10] , rk[ 9] ) ;
+    rk[12] = aes256Assist1( rk[10] , _mm_aeskeygenassist_si128( rk[11] , 0x20 ) ) ;
+    rk[13] = aes256Assist2( rk[12] , rk[11] ) ;
+    rk[14] = aes256Assist1( rk[12] , _mm_aeskeygenassist_si128( rk[13] , 0x40 ) ) ;
+}
+
+//-----------------------------------------------------------------------------
+// State of one lane: which job it is working on and where it is in that job
+
+typedef struct {
+            myCipherJob_t  *job ;
+            unsigned        block , nBlocks ;
+            __m128i         chain ;                        // previous cipher block ( or the IV )
+            __m128i         rk[ AES256_ROUNDS + 1 ] ;
+        }  cbcLane_t ;
+
+__attribute__((target("aes,sse2")))
+static void cbcLane_start( cbcLane_t *lane , myCipherJob_t *job )
+{
+    lane->job     = job ;
+    lane->block   = 0 ;
+    lane->nBlocks = job->plainText_len / INITVECTOR_LEN + 1 ;   // PKCS#7 always adds a block's worth
+    lane->chain   = _mm_loadu_si128( (const __m128i *) job->iv ) ;
+    aes256KeyExpand( job->key , lane->rk ) ;
+}
+
+// Next plaintext block of the lane's job, with PKCS#7 padding on the last one
+__attribute__((target("aes,sse2")))
+static __m128i cbcLane_block( const cbcLane_t *lane )
+{
+    const myCipherJob_t *job = lane->job ;
+    unsigned  offset = lane->block * INITVECTOR_LEN ;
+
+    if ( lane->block + 1 < lane->nBlocks )
+        return _mm_loadu_si128( (const __m128i *) ( job->pPlainText + offset ) ) ;
+
+    uint8_t   last[ INITVECTOR_LEN ] ;
+    unsigned  rem = job->plainText_len - offset ;
+
+    memcpy( last , job->pPlainText + offset , rem ) ;
+    memset( last + rem , INITVECTOR_LEN - rem , INITVECTOR_LEN - rem ) ;
+
+    return _mm_loadu_si128( (const __m128i *) last ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Multi-buffer AES-256-CBC: every lane advances one block per iteration and
+// the rounds of all lanes are interleaved. A lane that finishes its job is
+// refilled with the next pending one, so short messages never stall the batch
+
+__attribute__((target("aes,sse2")))
+static void encryptBatchAESNI( myCipherJob_t *jobs , unsigned nJobs )
+{
+    cbcLane_t  lane[ BATCH_LANES ] ;
+    __m128i    s[ BATCH_LANES ] ;
+    unsigned   next = 0 , active = 0 ;
+
+    // A lane that never gets a job still runs the rounds below, on zero keys
+    memset( lane , 0 , sizeof(lane) ) ;
+    for ( unsigned l = 0 ; l < BATCH_LANES ; l++ )
+    {
+        if ( next < nJobs )
+        {
+            cbcLane_start( &lane[ l ] , &jobs[ next++ ] ) ;
+            active++ ;
+        }
+    }
+
+    while ( active > 0 )
+    {
+        // Idle lanes just churn zeros through the rounds; their result is discarded
+        for ( unsigned l = 0 ; l < BATCH_LANES ; l++ )
+        {
+            if ( lane[ l ].job == NULL )
+                s[ l ] = _mm_setzero_si128() ;
+            else
+                s[ l ] = _mm_xor_si128( _mm_xor_si128( cbcLane_block( &lane[ l ] ) , lane[ l ].chain ) ,
+                                        lane[ l ].rk[ 0 ] ) ;
+        }
+
+        for ( unsigned r = 1 ; r < AES256_ROUNDS ; r++ )
+            for ( unsigned l = 0 ; l < BATCH_LANES ; l++ )
+                s[ l ] = _mm_aesenc_si128( s[ l ] , lane[ l ].rk[ r ] ) ;
+
+        for ( unsigned l = 0 ; l < BATCH_LANES ; l++ )
+            s[ l ] = _mm_aesenclast_si128( s[ l ] , lane[ l ].rk[ AES256_ROUNDS ] ) ;
+
+        for ( unsigned l = 0 ; l < BATCH_LANES ; l++ )
+        {
+            cbcLane_t *ln = &lane[ l ] ;
+            if ( ln->job == NULL )
+                continue ;
+
+            _mm_storeu_si128( (__m128i *) ( ln->job->pCipherText + ln->block * INITVECTOR_LEN ) , s[ l ] ) ;
+            ln->chain = s[ l ] ;
+
+            if ( ++ln->block == ln->nBlocks )
+            {
+                ln->job->cipherText_len = ln->nBlocks * INITVECTOR_LEN ;
+                ln->job = NULL ;
+                active-- ;
+
+                if ( next < nJobs )
+                {
+                    cbcLane_start( ln , &jobs[ next++ ] ) ;
+                    active++ ;
+                }
+            }
+        }
+    }
+
+    // Round keys of the last jobs are still on the stack
+    OPENSSL_cleanse( lane , sizeof(lane) ) ;
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Encrypt 'nJobs' independent messages, each with its own key and IV
+// Produces exactly what encrypt() would produce for each job, and sets
+// each job's cipherText_len
+
+void encryptBatch_r( myCryptoCtx_t *ctx , myCipherJob_t *jobs , unsigned nJobs )
+{
+    if ( jobs == NULL && nJobs > 0 )
+    {
+        fprintf( stderr , "encryptBatch: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    if ( EVP_CIPHER_get_nid( ALGORITHM() ) == NID_aes_256_cbc && __builtin_cpu_supports( "aes" ) )
+    {
+        encryptBatchAESNI( jobs , nJobs ) ;
+        return ;
+    }
+#endif
+
+    for ( unsigned i = 0 ; i < nJobs ; i++ )
+        jobs[ i ].cipherText_len = encrypt_r( ctx , jobs[ i ].pPlainText , jobs[ i ].plainText_len , 
+                                            jobs[ i ].key , jobs[ i ].iv , jobs[ i ].pCipherText ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Build many Messages #2 at once. Each job produces the same encrypted MSG2
+// that MSG2_new() would for the same arguments ( in CBC mode; GCM messages
+// carry a random nonce ), but all tickets are encrypted
+// in one batch and then all the outer messages in a second one
+// Only a one-line summary is logged, since hex-dumping every message would
+// cost far more than building it. 'log' may be NULL
+// Returns the number of messages built
+
+unsigned MSG2_newBatch_r( myCryptoCtx_t *ctx , FILE *log , myMSG2Job_t *jobs , unsigned nJobs )
+{
+    if ( jobs == NULL && nJobs > 0 )
+    {
+        fprintf( stderr , "MSG2_newBatch: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    if ( nJobs == 0 )
+        return 0 ;
+
+    myCipherJob_t *cj        = (myCipherJob_t *) malloc( nJobs * sizeof(myCipherJob_t) ) ;
+    unsigned      *tktOffset = (unsigned *)      malloc( nJobs * sizeof(unsigned) ) ;
+    unsigned      *msgOffset = (unsigned *)      malloc( nJobs * sizeof(unsigned) ) ;
+    if ( cj == NULL || tktOffset == NULL || msgOffset == NULL )
+    {
+        fprintf( stderr , "MSG2_newBatch: scratch space could not be allocated\n" ) ;
+        exit(-1) ;
+    }
+
+    // Size both scratch arenas in one pass:
+    //   tktArena holds TktPlain || TktCipher   for each job
+    //   msgArena holds the MSG2 plaintext      for each job
+    size_t  tktTotal = 0 , msgTotal = 0 ;
+    for ( unsigned i = 0 ; i < nJobs ; i++ )
+    {
+        myMSG2Job_t *j = &jobs[ i ] ;
+        if ( j->Ka == NULL || j->Kb == NULL || j->Ks == NULL || j->IDa == NULL || j->IDb == NULL || j->Na == NULL )
+        {
+            fprintf( stderr , "MSG2_newBatch: NULL pointer argument in job %u\n" , i ) ;
+            exit(-1) ;
+        }
+
+        unsigned LenTick   = KEYSIZE + LENSIZE + strlen( j->IDa ) + 1 ;
+        unsigned TktCipher = sealedLen( LenTick ) ;
+        unsigned LenMsg2   = KEYSIZE + LENSIZE + strlen( j->IDb ) + 1 + NONCELEN + LENSIZE + TktCipher ;
+
+        tktOffset[ i ] = tktTotal ;   tktTotal += LenTick + TktCipher ;
+        msgOffset[ i ] = msgTotal ;   msgTotal += LenMsg2 ;
+    }
+
+    uint8_t *tktArena = (uint8_t *) malloc( tktTotal ) ;
+    uint8_t *msgArena = (uint8_t *) malloc( msgTotal ) ;
+    if ( tktArena == NULL || msgArena == NULL )
+    {
+        fprintf( stderr , "MSG2_newBatch: scratch space could not be allocated\n" ) ;
+        exit(-1) ;
+    }
+
+    // 1) TktPlain = { Ks || L(IDa) || IDa } , to be encrypted with Kb
+    for ( unsigned i = 0 ; i < nJobs ; i++ )
+    {
+        myMSG2Job_t *j    = &jobs[ i ] ;
+        unsigned     LenA = strlen( j->IDa ) + 1 ;
+        uint8_t     *t    = tktArena + tktOffset[ i ] ;
+
+        cj[ i ].pPlainText    = t ;
+        cj[ i ].plainText_len = KEYSIZE + LENSIZE + LenA ;
+        cj[ i ].key           = j->Kb->key ;
+        cj[ i ].iv            = j->Kb->iv ;
+        cj[ i ].pCipherText   = t + cj[ i ].plainText_len ;
+
+        memcpy( t , j->Ks , KEYSIZE ) ;   t += KEYSIZE ;
+        memcpy( t , &LenA , LENSIZE ) ;   t += LENSIZE ;
+        memcpy( t , j->IDa , LenA ) ;
+    }
+    sealBatch( ctx , cj , nJobs ) ;
+
+    // 2) MSG2 plain = { Ks || L(IDb) || IDb || Na || L(TktCipher) || TktCipher } , 
+    //    to be encrypted with Ka straight into the caller's new buffer
+    for ( unsigned i = 0 ; i < nJobs ; i++ )
+    {
+        myMSG2Job_t *j         = &jobs[ i ] ;
+        unsigned     LenB      = strlen( j->IDb ) + 1 ;
+        unsigned     TktCipher = cj[ i ].cipherText_len ;
+        uint8_t     *tkt       = cj[ i ].pCipherText ;
+        uint8_t     *p         = msgArena + msgOffset[ i ] ;
+        unsigned     LenMsg2   = KEYSIZE + LENSIZE + LenB + NONCELEN + LENSIZE + TktCipher ;
+
+        j->msg2 = (uint8_t *) malloc( sealedLen( LenMsg2 ) ) ;
+        if ( j->msg2 == NULL )
+        {
+            fprintf( stderr , "MSG2_newBatch: message could not be allocated\n" ) ;
+            exit(-1) ;
+        }
+
+        cj[ i ].pPlainText    = p ;
+        cj[ i ].plainText_len = LenMsg2 ;
+        cj[ i ].key           = j->Ka->key ;
+        cj[ i ].iv            = j->Ka->iv ;
+        cj[ i ].pCipherText   = j->msg2 ;
+
+        memcpy( p , j->Ks , KEYSIZE ) ;        p += KEYSIZE ;
+        memcpy( p , &LenB , LENSIZE ) ;        p += LENSIZE ;
+        memcpy( p , j->IDb , LenB ) ;          p += LenB ;
+        memcpy( p , j->Na , NONCELEN ) ;       p += NONCELEN ;
+        memcpy( p , &TktCipher , LENSIZE ) ;   p += LENSIZE ;
+        memcpy( p , tkt , TktCipher ) ;
+    }
+    sealBatch( ctx , cj , nJobs ) ;
+
+    for ( unsigned i = 0 ; i < nJobs ; i++ )
+        jobs[ i ].lenMsg2 = cj[ i ].cipherText_len ;
+
+    // The arenas held session keys in the clear
+    OPENSSL_cleanse( tktArena , tktTotal ) ;
+    OPENSSL_cleanse( msgArena , msgTotal ) ;
+    free( tktArena ) ;  free( msgArena ) ;
+    free( cj ) ;  free( tktOffset ) ;  free( msgOffset ) ;
+
+    if ( log != NULL && LOG_ON( LOG_INFO ) )
+    {
+        fprintf( log , "MSG2_newBatch() created %u new Encrypted MSG2s\n" , nJobs ) ;
+        fflush( log ) ;
+    }
+
+    return nJobs ;
+}
+
+//***********************************************************************
+// AEAD
+//***********************************************************************
+
+static cipherMode_t   cipherMode = MODE_CBC ;
+
+void setCipherMode( cipherMode_t mode )
+{
+    cipherMode = mode ;
+}
+
+cipherMode_t getCipherMode( void )
+{
+    return cipherMode ;
+}
+
+//-----------------------------------------------------------------------------
+// Let the dispatcher pick the mode for all three parties at once
+// Anything other than CIPHER_MODE=gcm leaves the default AES-CBC in place
+
+void setCipherModeFromEnv( void )
+{
+    char *mode = getenv( "CIPHER_MODE" ) ;
+
+    if ( mode != NULL && strcasecmp( mode , "gcm" ) == 0 )
+        setCipherMode( MODE_GCM ) ;
+    else
+        setCipherMode( MODE_CBC ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Create the GCM contexts of a handle the first time they are needed
+// Only the key is set here; each message supplies its own nonce
+
+static void keyHandle_initAEAD( myKeyHandle_t *h )
+{
+    if ( h->aead != NULL )
+        return ;
+
+    h->aead = EVP_CIPHER_fetch( NULL , EVP_CIPHER_get0_name( AEAD_ALGORITHM() ) , NULL ) ;
+    if ( h->aead == NULL )
+        handleErrors( "keyHandle_initAEAD: failed to fetch the cipher" ) ;
+
+    h->aeadEncCtx = EVP_CIPHER_CTX_new() ;
+    h->aeadDecCtx = EVP_CIPHER_CTX_new() ;
+    if ( h->aeadEncCtx == NULL || h->aeadDecCtx == NULL )
+        handleErrors( "keyHandle_initAEAD: failed to create CTX" ) ;
+
+    if ( EVP_EncryptInit_ex( h->aeadEncCtx , h->aead , NULL , h->k.key , NULL ) != 1 )
+        handleErrors( "keyHandle_initAEAD: failed to EncryptInit_ex" ) ;
+
+    if ( EVP_DecryptInit_ex( h->aeadDecCtx , h->aead , NULL , h->k.key , NULL ) != 1 )
+        handleErrors( "keyHandle_initAEAD: failed to DecryptInit_ex" ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Encrypt and authenticate 'pPlainText' into 'pCipherText' as Nonce || Cipher || Tag
+// The IV of the key only selects the cached handle ( see AEAD_NONCE_LEN )
+// Caller must allocate plainText_len + AEAD_OVERHEAD bytes
+// Returns size of the sealed message in bytes
+
+unsigned encryptAEAD_r( myCryptoCtx_t *ctx , uint8_t *pPlainText, unsigned plainText_len, 
+                      const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText )
+{
+    myKeyHandle_t *h = keyCache_get_r( ctx , key , iv ) ;
+    uint8_t       *nonce = pCipherText , *cipher = pCipherText + AEAD_NONCE_LEN ;
+    int            len = 0 ;
+    unsigned       encrypted_len = 0 ;
+
+    keyHandle_initAEAD( h ) ;
+
+    if ( RAND_bytes( nonce , AEAD_NONCE_LEN ) != 1 )
+        handleErrors( "encryptAEAD: failed to generate a nonce" ) ;
+
+    if ( EVP_EncryptInit_ex( h->aeadEncCtx , NULL , NULL , NULL , nonce ) != 1 )
+        handleErrors( "encryptAEAD: failed to EncryptInit_ex" ) ;
+
+    if ( EVP_EncryptUpdate( h->aeadEncCtx , cipher , &len , pPlainText , plainText_len ) != 1 )
+        handleErrors( "encryptAEAD: failed to EncryptUpdate" ) ;
+    encrypted_len += len ;
+
+    // GCM is a stream mode: Final never produces more bytes, only the tag
+    if ( EVP_EncryptFinal_ex( h->aeadEncCtx , cipher + encrypted_len , &len ) != 1 )
+        handleErrors( "encryptAEAD: failed to EncryptFinal_ex" ) ;
+    encrypted_len += len ;
+
+    if ( EVP_CIPHER_CTX_ctrl( h->aeadEncCtx , EVP_CTRL_GCM_GET_TAG , AEAD_TAG_LEN , 
+                              cipher + encrypted_len ) != 1 )
+        handleErrors( "encryptAEAD: failed to get the tag" ) ;
+
+    return AEAD_NONCE_LEN + encrypted_len + AEAD_TAG_LEN ;
+}
+
+//-----------------------------------------------------------------------------
+// Verify and decrypt a message sealed by encryptAEAD()
+// Returns size of the decrypted text in bytes, or -1 if the tag is wrong
+
+int decryptAEAD_r( myCryptoCtx_t *ctx , uint8_t *pCipherText, unsigned cipherText_len, 
+                 const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText )
+{
+    if ( cipherText_len < AEAD_OVERHEAD )
+        return -1 ;
+
+    myKeyHandle_t *h = keyCache_get_r( ctx , key , iv ) ;
+    uint8_t       *nonce  = pCipherText ,
+                  *cipher = pCipherText + AEAD_NONCE_LEN ,
+                  *tag    = pCipherText + cipherText_len - AEAD_TAG_LEN ;
+    int            len = 0 , decryptedLen = 0 ;
+
+    keyHandle_initAEAD( h ) ;
+
+    if ( EVP_DecryptInit_ex( h->aeadDecCtx , NULL , NULL , NULL , nonce ) != 1 )
+        handleErrors( "decryptAEAD: failed to DecryptInit_ex" ) ;
+
+    if ( EVP_DecryptUpdate( h->aeadDecCtx , pDecryptedText , &len , cipher , 
+                            cipherText_len - AEAD_OVERHEAD ) != 1 )
+        handleErrors( "decryptAEAD: failed to DecryptUpdate" ) ;
+    decryptedLen += len ;
+
+    if ( EVP_CIPHER_CTX_ctrl( h->aeadDecCtx , EVP_CTRL_GCM_SET_TAG , AEAD_TAG_LEN , tag ) != 1 )
+        handleErrors( "decryptAEAD: failed to set the tag" ) ;
+
+    // This is where the tag is checked
+    if ( EVP_DecryptFinal_ex( h->aeadDecCtx , pDecryptedText + decryptedLen , &len ) != 1 )
+    {
+        OPENSSL_cleanse( pDecryptedText , decryptedLen ) ;
+        return -1 ;
+    }
+    decryptedLen += len ;
+
+    return decryptedLen ;
+}
+
+//-----------------------------------------------------------------------------
+// Protocol message helpers used by MSG2 through MSG5
+
+static unsigned sealMsg( myCryptoCtx_t *ctx , const myKey_t *k , uint8_t *pPlainText , unsigned plainText_len , 
+                         uint8_t *pCipherText )
+{
+    if ( cipherMode == MODE_GCM )
+        return encryptAEAD_r( ctx , pPlainText , plainText_len , k->key , k->iv , pCipherText ) ;
+
+    return encrypt_r( ctx , pPlainText , plainText_len , k->key , k->iv , pCipherText ) ;
+}
+
+// A message that fails authentication ( GCM ) or whose padding does not
+// check ( CBC ) is fatal, just like a short read
+static unsigned openMsg( myCryptoCtx_t *ctx , FILE *log , const char *who , const myKey_t *k , 
+                         uint8_t *pCipherText , unsigned cipherText_len , uint8_t *pDecryptedText )
+{
+    int len ;
+
+    if ( cipherMode == MODE_GCM )
+        len = decryptAEAD_r( ctx , pCipherText , cipherText_len , k->key , k->iv , pDecryptedText ) ;
+    else
+        len = decrypt_r( ctx , pCipherText , cipherText_len , k->key , k->iv , pDecryptedText ) ;
+
+    if ( len < 0 )
+    {
+        fprintf( log , "%s of the %u-byte message does not verify in %s ... EXITING\n" , 
+                 cipherMode == MODE_GCM ? "Authentication tag" : "Padding" , cipherText_len , who );
+        fflush( log ) ;  fclose( log ) ;
+        fprintf( stderr , "Message failed authentication in %s\n" , who ) ;
+        exit(-1) ;
+    }
+
+    return len ;
+}
+
+// Size of the sealed form of a 'plainText_len'-byte message in the current mode
+static unsigned sealedLen( unsigned plainText_len )
+{
+    if ( cipherMode == MODE_GCM )
+        return plainText_len + AEAD_OVERHEAD ;
+
+    return ( plainText_len / INITVECTOR_LEN + 1 ) * INITVECTOR_LEN ;
+}
+
+static void sealBatch( myCryptoCtx_t *ctx , myCipherJob_t *jobs , unsigned nJobs )
+{
+    if ( cipherMode != MODE_GCM )
+    {
+        encryptBatch_r( ctx , jobs , nJobs ) ;
+        return ;
+    }
+
+    for ( unsigned i = 0 ; i < nJobs ; i++ )
+        jobs[ i ].cipherText_len = encryptAEAD_r( ctx , jobs[ i ].pPlainText , jobs[ i ].plainText_len , 
+                                                jobs[ i ].key , jobs[ i ].iv , jobs[ i ].pCipherText ) ;
+}
+
+//***********************************************************************
+// Chunked Files
+//***********************************************************************
+
+#include <pthread.h>
+
+#define CHUNK_CIPHER_MAX     ( FILE_CHUNK_LEN + INITVECTOR_LEN )
+#define CHUNKS_PER_THREAD    4        // chunks queued per worker in each batch
+
+typedef struct {
+            uint8_t   *in , *out ;
+            unsigned   inLen , outLen ;
+            uint64_t   index ;       // position of the chunk in the file
+            uint8_t    iv[ INITVECTOR_LEN ] ;
+        }  fileChunk_t ;
+
+// The reader fills a batch of chunks, the workers transform them in any
+// order, and the reader writes them back in file order. So the output is
+// the same whatever the number of threads
+typedef struct {
+            pthread_t        *threads ;
+            unsigned          nThreads ;
+            pthread_mutex_t   lock ;
+            pthread_cond_t    haveWork , workDone ;
+            unsigned long     generation ;   // bumped every time a new batch is posted
+            fileChunk_t      *chunks ;
+            unsigned          nChunks , next , finished ;
+            int               encrypting , quit , failed ;
+            const uint8_t    *key , *iv ;
+        }  chunkPool_t ;
+
+//-----------------------------------------------------------------------------
+// Read / write exactly 'len' bytes unless EOF comes first. Pipes and sockets
+// hand back short counts, which is harmless for a stream cipher loop but
+// would split a chunk in two here
+// Return the number of bytes transferred, or -1 on error
+
+static ssize_t readFull( int fd , uint8_t *buf , size_t len )
+{
+    size_t done = 0 ;
+    while ( done < len )
+    {
+        ssize_t n = read( fd , buf + done , len - done ) ;
+        if ( n == 0 )
+            break ;
+        if ( n < 0 )
+            return -1 ;
+        done += n ;
+    }
+    return done ;
+}
+
+static ssize_t writeFull( int fd , const uint8_t *buf , size_t len )
+{
+    size_t done = 0 ;
+    while ( done < len )
+    {
+        ssize_t n = write( fd , buf + done , len - done ) ;
+        if ( n <= 0 )
+            return -1 ;
+        done += n ;
+    }
+    return done ;
+}
+
+//-----------------------------------------------------------------------------
+// IV_i = AES-ECB( K , IV xor i ) with i as a big-endian 64-bit integer 
+// in the low half of the block. 'ecb' already holds the key schedule
+
+static void chunkIV( EVP_CIPHER_CTX *ecb , const uint8_t *iv , uint64_t index , uint8_t *ivOut )
+{
+    uint8_t  block[ INITVECTOR_LEN ] ;
+    int      len = 0 ;
+
+    memcpy( block , iv , INITVECTOR_LEN ) ;
+    for ( int b = 0 ; b < 8 ; b++ )
+        block[ INITVECTOR_LEN - 1 - b ] ^= (uint8_t) ( index >> ( 8 * b ) ) ;
+
+    if ( EVP_EncryptUpdate( ecb , ivOut , &len , block , INITVECTOR_LEN ) != 1 )
+        handleErrors( "chunkIV: failed to EncryptUpdate" ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Worker: owns its contexts, so nothing is shared with other workers
+// except the batch bookkeeping under pool->lock
+
+static void *chunkWorker( void *arg )
+{
+    chunkPool_t     *pool = (chunkPool_t *) arg ;
+    EVP_CIPHER_CTX  *ctx  = EVP_CIPHER_CTX_new() ,
+                    *ecb  = EVP_CIPHER_CTX_new() ;
+    unsigned long    seen = 0 ;
+
+    if ( ctx == NULL || ecb == NULL )
+        handleErrors( "chunkWorker: failed to create CTX" ) ;
+
+    if ( EVP_EncryptInit_ex( ecb , EVP_aes_256_ecb() , NULL , pool->key , NULL ) != 1 )
+        handleErrors( "chunkWorker: failed to EncryptInit_ex" ) ;
+    EVP_CIPHER_CTX_set_padding( ecb , 0 ) ;
+
+    if ( EVP_CipherInit_ex( ctx , ALGORITHM() , NULL , pool->key , NULL , pool->encrypting ) != 1 )
+        handleErrors( "chunkWorker: failed to CipherInit_ex" ) ;
+
+    pthread_mutex_lock( &pool->lock ) ;
+    for ( ;; )
+    {
+        while ( ! pool->quit && ( pool->generation == seen || pool->next >= pool->nChunks ) )
+        {
+            if ( pool->generation != seen && pool->next >= pool->nChunks )
+                seen = pool->generation ;   // nothing left for us in this batch
+            pthread_cond_wait( &pool->haveWork , &pool->lock ) ;
+        }
+        if ( pool->quit )
+            break ;
+
+        fileChunk_t *c = &pool->chunks[ pool->next++ ] ;
+        pthread_mutex_unlock( &pool->lock ) ;
+
+        int ok = 1 , len = 0 ;
+        chunkIV( ecb , pool->iv , c->index , c->iv ) ;
+        ok = ok && EVP_CipherInit_ex( ctx , NULL , NULL , NULL , c->iv , -1 ) == 1 ;
+        ok = ok && EVP_CipherUpdate( ctx , c->out , &len , c->in , c->inLen ) == 1 ;
+        c->outLen = len ;
+        ok = ok && EVP_CipherFinal_ex( ctx , c->out + c->outLen , &len ) == 1 ;   // bad padding when decrypting
+        c->outLen += len ;
+
+        pthread_mutex_lock( &pool->lock ) ;
+        if ( ! ok )
+            pool->failed = 1 ;
+        if ( ++pool->finished == pool->nChunks )
+            pthread_cond_signal( &pool->workDone ) ;
+    }
+    pthread_mutex_unlock( &pool->lock ) ;
+
+    EVP_CIPHER_CTX_free( ctx ) ;
+    EVP_CIPHER_CTX_free( ecb ) ;
+    return NULL ;
+}
+
+//-----------------------------------------------------------------------------
+
+static void chunkPool_start( chunkPool_t *pool , unsigned nThreads , int encrypting , 
+                             const uint8_t *key , const uint8_t *iv , fileChunk_t *chunks )
+{
+    if ( nThreads == 0 )
+    {
+        long n = sysconf( _SC_NPROCESSORS_ONLN ) ;
+        nThreads = n > 0 ? n : 1 ;
+    }
+
+    memset( pool , 0 , sizeof(chunkPool_t) ) ;
+    pool->nThreads   = nThreads ;
+    pool->encrypting = encrypting ;
+    pool->key        = key ;
+    pool->iv         = iv ;
+    pool->chunks     = chunks ;
+    pthread_mutex_init( &pool->lock , NULL ) ;
+    pthread_cond_init( &pool->haveWork , NULL ) ;
+    pthread_cond_init( &pool->workDone , NULL ) ;
+
+    pool->threads = (pthread_t *) malloc( nThreads * sizeof(pthread_t) ) ;
+    if ( pool->threads == NULL )
+        exitError( "chunkPool_start: Out of Memory allocating the worker threads" ) ;
+
+    for ( unsigned t = 0 ; t < nThreads ; t++ )
+        if ( pthread_create( &pool->threads[ t ] , NULL , chunkWorker , pool ) != 0 )
+            exitError( "chunkPool_start: could not create a worker thread" ) ;
+}
+
+// Post the first 'nChunks' chunks and wait until all of them are done
+// Returns 0 on success, -1 if any chunk failed
+static int chunkPool_run( chunkPool_t *pool , unsigned nChunks )
+{
+    if ( nChunks == 0 )
+        return 0 ;
+
+    pthread_mutex_lock( &pool->lock ) ;
+    pool->nChunks  = nChunks ;
+    pool->next     = 0 ;
+    pool->finished = 0 ;
+    pool->generation++ ;
+    pthread_cond_broadcast( &pool->haveWork ) ;
+
+    while ( pool->finished < pool->nChunks )
+        pthread_cond_wait( &pool->workDone , &pool->lock ) ;
+    int failed = pool->failed ;
+    pthread_mutex_unlock( &pool->lock ) ;
+
+    return failed ? -1 : 0 ;
+}
+
+static void chunkPool_stop( chunkPool_t *pool )
+{
+    pthread_mutex_lock( &pool->lock ) ;
+    pool->quit = 1 ;
+    pthread_cond_broadcast( &pool->haveWork ) ;
+    pthread_mutex_unlock( &pool->lock ) ;
+
+    for ( unsigned t = 0 ; t < pool->nThreads ; t++ )
+        pthread_join( pool->threads[ t ] , NULL ) ;
+
+    free( pool->threads ) ;
+    pthread_mutex_destroy( &pool->lock ) ;
+    pthread_cond_destroy( &pool->haveWork ) ;
+    pthread_cond_destroy( &pool->workDone ) ;
+}
+
+//-----------------------------------------------------------------------------
+// One allocation holding 'n' chunks with their input and output buffers
+
+static fileChunk_t *chunkBatch_new( unsigned n , uint8_t **arena )
+{
+    fileChunk_t *chunks = (fileChunk_t *) calloc( n , sizeof(fileChunk_t) ) ;
+    *arena = (uint8_t *) malloc( (size_t) n * ( CHUNK_CIPHER_MAX + CHUNK_CIPHER_MAX ) ) ;
+    if ( chunks == NULL || *arena == NULL )
+        exitError( "chunkBatch_new: Out of Memory allocating the chunk buffers" ) ;
+
+    for ( unsigned i = 0 ; i < n ; i++ )
+    {
+        chunks[ i ].in  = *arena + (size_t) i * 2 * CHUNK_CIPHER_MAX ;
+        chunks[ i ].out = chunks[ i ].in + CHUNK_CIPHER_MAX ;
+    }
+    return chunks ;
+}
+
+static void chunkBatch_free( fileChunk_t *chunks , uint8_t *arena , unsigned n )
+{
+    OPENSSL_cleanse( arena , (size_t) n * 2 * CHUNK_CIPHER_MAX ) ;
+    free( arena ) ;
+    free( chunks ) ;
+}
+
+//-----------------------------------------------------------------------------
+// 64-bit fields of the container are big-endian like the 32-bit ones
+
+static void put64( uint8_t *p , uint64_t v )
+{
+    for ( int b = 7 ; b >= 0 ; b-- , v >>= 8 )
+        p[ b ] = (uint8_t) v ;
+}
+
+static uint64_t get64( const uint8_t *p )
+{
+    uint64_t v = 0 ;
+    for ( int b = 0 ; b < 8 ; b++ )
+        v = ( v << 8 ) | p[ b ] ;
+    return v ;
+}
+
+//-----------------------------------------------------------------------------
+// Encrypt everything from 'fd_in' into a chunked container of the given 
+// version on 'fd_out'. CHUNKED_VERSION_INDEXED also gets the trailing index,
+// which is kept in memory until the end since 'fd_out' may not be seekable
+// Returns the number of bytes written to 'fd_out'
+
+static ssize_t chunkedEncrypt( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , 
+                               unsigned nThreads , unsigned version )
+{
+    chunkPool_t   pool ;
+    uint8_t      *arena , header[ CHUNKED_HEADER_LEN ] ;
+    uint8_t      *indexTbl = NULL ;        // CHUNK_INDEX_ENTRY_LEN bytes per chunk
+    size_t        indexCap = 0 ;
+    uint32_t      field ;
+    ssize_t       written = 0 ;
+    uint64_t      index = 0 ;
+    int           eof = 0 ;
+
+    memcpy( header , CHUNKED_MAGIC , 4 ) ;
+    field = htonl( version ) ;          memcpy( header + 4 , &field , 4 ) ;
+    field = htonl( FILE_CHUNK_LEN ) ;   memcpy( header + 8 , &field , 4 ) ;
+    if ( writeFull( fd_out , header , CHUNKED_HEADER_LEN ) != CHUNKED_HEADER_LEN )
+        handleErrors( "encryptFileChunked: failed to write the header" ) ;
+    written += CHUNKED_HEADER_LEN ;
+
+    chunkPool_start( &pool , nThreads , 1 , key , iv , NULL ) ;
+    unsigned     batch  = pool.nThreads * CHUNKS_PER_THREAD ;
+    fileChunk_t *chunks = chunkBatch_new( batch , &arena ) ;
+    pool.chunks = chunks ;
+
+    while ( ! eof )
+    {
+        unsigned n = 0 ;
+        while ( n < batch )
+        {
+            ssize_t got = readFull( fd_in , chunks[ n ].in , FILE_CHUNK_LEN ) ;
+            if ( got < 0 )
+                handleErrors( "encryptFileChunked: failed to read fd_in" ) ;
+            if ( got == 0 )
+            {
+                eof = 1 ;
+                break ;
+            }
+            chunks[ n ].inLen = got ;
+            chunks[ n ].index = index++ ;
+            n++ ;
+            if ( got < FILE_CHUNK_LEN )
+            {
+                eof = 1 ;
+                break ;
+            }
+        }
+
+        if ( chunkPool_run( &pool , n ) != 0 )
+            handleErrors( "encryptFileChunked: failed to encrypt a chunk" ) ;
+
+        for ( unsigned i = 0 ; i < n ; i++ )
+        {
+            field = htonl( chunks[ i ].outLen ) ;
+            if ( writeFull( fd_out , (uint8_t *) &field , 4 ) != 4 
+                 || writeFull( fd_out , chunks[ i ].out , chunks[ i ].outLen ) != chunks[ i ].outLen )
+                handleErrors( "encryptFileChunked: failed to write fd_out" ) ;
+
+            if ( version == CHUNKED_VERSION_INDEXED )
+            {
+                if ( ( chunks[ i ].index + 1 ) * CHUNK_INDEX_ENTRY_LEN > indexCap )
+                {
+                    indexCap = indexCap ? 2 * indexCap : 64 * CHUNK_INDEX_ENTRY_LEN ;
+                    indexTbl   = (uint8_t *) realloc( indexTbl , indexCap ) ;
+                    if ( indexTbl == NULL )
+                        exitError( "encryptFileSeekable: Out of Memory growing the chunk index" ) ;
+                }
+
+                uint8_t *e = indexTbl + chunks[ i ].index * CHUNK_INDEX_ENTRY_LEN ;
+                put64( e , written + 4 ) ;
+                field = htonl( chunks[ i ].outLen ) ;  memcpy( e +  8 , &field , 4 ) ;
+                field = htonl( chunks[ i ].inLen ) ;   memcpy( e + 12 , &field , 4 ) ;
+                memcpy( e + 16 , chunks[ i ].iv , INITVECTOR_LEN ) ;
+            }
+            written += 4 + chunks[ i ].outLen ;
+        }
+    }
+
+    chunkPool_stop( &pool ) ;
+    chunkBatch_free( chunks , arena , batch ) ;
+
+    if ( version == CHUNKED_VERSION )
+    {
+        // L = 0 and the chunk count, so a reader can tell the end from a truncation
+        uint8_t tail[ 4 + 8 ] = { 0 } ;
+
+        put64( tail + 4 , index ) ;
+        if ( writeFull( fd_out , tail , sizeof( tail ) ) != sizeof( tail ) )
+            handleErrors( "encryptFileChunked: failed to write the end marker" ) ;
+        written += sizeof( tail ) ;
+    }
+    else
+    {
+        uint8_t footer[ CHUNK_INDEX_FOOTER_LEN ] = { 0 } ;
+        size_t  indexLen = index * CHUNK_INDEX_ENTRY_LEN ;
+
+        // L = 0 ends the chunk list for a sequential reader
+        field = 0 ;
+        put64( footer , written + 4 ) ;
+        put64( footer + 8 , index ) ;
+        memcpy( footer + 16 , CHUNK_INDEX_MAGIC , 4 ) ;
+
+        if ( writeFull( fd_out , (uint8_t *) &field , 4 ) != 4
+             || writeFull( fd_out , indexTbl , indexLen ) != (ssize_t) indexLen
+             || writeFull( fd_out , footer , CHUNK_INDEX_FOOTER_LEN ) != CHUNK_INDEX_FOOTER_LEN )
+            handleErrors( "encryptFileSeekable: failed to write the chunk index" ) ;
+
+        written += 4 + indexLen + CHUNK_INDEX_FOOTER_LEN ;
+        free( indexTbl ) ;
+    }
+
+    return written ;
+}
+
+//-----------------------------------------------------------------------------
+// Encrypt everything from 'fd_in' into the chunked container on 'fd_out'
+// Returns the number of bytes written to 'fd_out'
+
+ssize_t encryptFileChunked( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , unsigned nThreads )
+{
+    return chunkedEncrypt( fd_in , fd_out , key , iv , nThreads , CHUNKED_VERSION ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Same as encryptFileChunked(), followed by the chunk index that decryptRange() uses
+
+ssize_t encryptFileSeekable( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , unsigned nThreads )
+{
+    return chunkedEncrypt( fd_in , fd_out , key , iv , nThreads , CHUNKED_VERSION_INDEXED ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Read what follows L = 0 on 'fd_in': the chunk count for CHUNKED_VERSION, the
+// index and its footer for CHUNKED_VERSION_INDEXED. 'indexOffset' is where the
+// index should start and 'buf' has room for CHUNK_CIPHER_MAX bytes
+// Returns 0 if the trailer agrees with the 'nChunks' chunks read and the 
+// stream ends right after it, -1 otherwise
+
+static int chunkedTrailer( int fd_in , unsigned version , uint64_t nChunks , 
+                           uint64_t indexOffset , uint8_t *buf )
+{
+    uint8_t footer[ CHUNK_INDEX_FOOTER_LEN ] ;
+
+    if ( version == CHUNKED_VERSION )
+    {
+        if ( readFull( fd_in , footer , 8 ) != 8 || get64( footer ) != nChunks )
+            return -1 ;
+    }
+    else
+    {
+        // The index is not needed here, only its length
+        uint64_t left = nChunks * CHUNK_INDEX_ENTRY_LEN ;
+        while ( left > 0 )
+        {
+            size_t want = left < CHUNK_CIPHER_MAX ? left : CHUNK_CIPHER_MAX ;
+            if ( readFull( fd_in , buf , want ) != (ssize_t) want )
+                return -1 ;
+            left -= want ;
+        }
+        if ( readFull( fd_in , footer , CHUNK_INDEX_FOOTER_LEN ) != CHUNK_INDEX_FOOTER_LEN
+             || get64( footer ) != indexOffset || get64( footer + 8 ) != nChunks
+             || memcmp( footer + 16 , CHUNK_INDEX_MAGIC , 4 ) != 0 )
+            return -1 ;
+    }
+
+    return readFull( fd_in , buf , 1 ) == 0 ? 0 : -1 ;
+}
+
+//-----------------------------------------------------------------------------
+// Decrypt a chunked container from 'fd_in' into 'fd_out'
+// Returns the number of plaintext bytes written, or -1 if the container is 
+// malformed, truncated, or a chunk does not decrypt ( wrong key, or corrupted data )
+
+ssize_t decryptFileChunked( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , unsigned nThreads )
+{
+    chunkPool_t   pool ;
+    uint8_t      *arena , header[ CHUNKED_HEADER_LEN ] ;
+    uint32_t      field ;
+    ssize_t       written = 0 ;
+    uint64_t      index = 0 , offset = CHUNKED_HEADER_LEN ;
+    int           eof = 0 , bad = 0 , ended = 0 ;
+
+    if ( readFull( fd_in , header , CHUNKED_HEADER_LEN ) != CHUNKED_HEADER_LEN 
+         || memcmp( header , CHUNKED_MAGIC , 4 ) != 0 )
+    {
+        fprintf( stderr , "decryptFileChunked: input is not a chunked container\n" ) ;
+        return -1 ;
+    }
+    memcpy( &field , header + 4 , 4 ) ;
+    unsigned version = ntohl( field ) ;
+    if ( version != CHUNKED_VERSION && version != CHUNKED_VERSION_INDEXED )
+    {
+        fprintf( stderr , "decryptFileChunked: unsupported container version %u\n" , ntohl( field ) ) ;
+        return -1 ;
+    }
+    memcpy( &field , header + 8 , 4 ) ;
+    if ( ntohl( field ) != FILE_CHUNK_LEN )
+    {
+        fprintf( stderr , "decryptFileChunked: unsupported chunk length %u\n" , ntohl( field ) ) ;
+        return -1 ;
+    }
+
+    chunkPool_start( &pool , nThreads , 0 , key , iv , NULL ) ;
+    unsigned     batch  = pool.nThreads * CHUNKS_PER_THREAD ;
+    fileChunk_t *chunks = chunkBatch_new( batch , &arena ) ;
+    pool.chunks = chunks ;
+
+    while ( ! eof && ! bad )
+    {
+        unsigned n = 0 ;
+        while ( n < batch )
+        {
+            ssize_t got = readFull( fd_in , (uint8_t *) &field , 4 ) ;
+            if ( got == 0 )
+            {
+                fprintf( stderr , "decryptFileChunked: the container ends without its end marker\n" ) ;
+                bad = 1 ;
+                break ;
+            }
+
+            unsigned len = ntohl( field ) ;
+            if ( got == 4 && len == 0 )
+            {
+                eof = 1 ;   // the end marker, checked once this batch is written
+                offset += 4 ;
+                break ;
+            }
+            if ( got != 4 || len > CHUNK_CIPHER_MAX || len % INITVECTOR_LEN != 0 
+                 || readFull( fd_in , chunks[ n ].in , len ) != len )
+            {
+                fprintf( stderr , "decryptFileChunked: chunk %lu is truncated or corrupted\n" , 
+                         (unsigned long) index ) ;
+                bad = 1 ;
+                break ;
+            }
+            chunks[ n ].inLen = len ;
+            chunks[ n ].index = index++ ;
+            offset += 4 + len ;
+            n++ ;
+        }
+
+        if ( ! bad && chunkPool_run( &pool , n ) != 0 )
+        {
+            fprintf( stderr , "decryptFileChunked: a chunk failed to decrypt\n" ) ;
+            bad = 1 ;
+        }
+
+        for ( unsigned i = 0 ; i < n && ! bad ; i++ )
+        {
+            // Only the last chunk may be short
+            if ( ended )
+            {
+                fprintf( stderr , "decryptFileChunked: chunk %lu follows a short chunk\n" , 
+                         (unsigned long) chunks[ i ].index ) ;
+                bad = 1 ;
+                break ;
+            }
+            ended = chunks[ i ].outLen != FILE_CHUNK_LEN ;
+
+            if ( writeFull( fd_out , chunks[ i ].out , chunks[ i ].outLen ) != chunks[ i ].outLen )
+                handleErrors( "decryptFileChunked: failed to write fd_out" ) ;
+            written += chunks[ i ].outLen ;
+        }
+    }
+
+    if ( eof && ! bad && chunkedTrailer( fd_in , version , index , offset , chunks[ 0 ].in ) != 0 )
+    {
+        fprintf( stderr , "decryptFileChunked: the end marker does not match the chunks\n" ) ;
+        bad = 1 ;
+    }
+
+    chunkPool_stop( &pool ) ;
+    chunkBatch_free( chunks , arena , batch ) ;
+
+    return bad ? -1 : written ;
+}
+
+//***********************************************************************
+// Seekable Files
+//***********************************************************************
+
+#include <sys/stat.h>
+
+// Every chunk but the last holds FILE_CHUNK_LEN plaintext bytes and so 
+// CHUNK_CIPHER_MAX ciphertext bytes: chunk c has a fixed place in the file
+
+static uint64_t chunkAt( uint64_t c )
+{
+    return CHUNKED_HEADER_LEN + c * ( 4 + CHUNK_CIPHER_MAX ) + 4 ;
+}
+
+// Read the container's geometry: chunk length, where the index starts and
+// how many chunks there are. Returns 0 on success, -1 if 'fd' does not hold
+// a seekable container
+
+static int seekableOpen( int fd , unsigned *chunkLen , uint64_t *indexOffset , uint64_t *nChunks )
+{
+    struct stat st ;
+    uint8_t     header[ CHUNKED_HEADER_LEN ] , footer[ CHUNK_INDEX_FOOTER_LEN ] ,
+                last[ CHUNK_INDEX_ENTRY_LEN ] ;
+    uint32_t    field ;
+
+    if ( fstat( fd , &st ) != 0 || st.st_size < CHUNKED_HEADER_LEN + 4 + CHUNK_INDEX_FOOTER_LEN )
+        return -1 ;
+
+    if ( pread( fd , header , CHUNKED_HEADER_LEN , 0 ) != CHUNKED_HEADER_LEN
+         || pread( fd , footer , CHUNK_INDEX_FOOTER_LEN , st.st_size - CHUNK_INDEX_FOOTER_LEN ) 
+                != CHUNK_INDEX_FOOTER_LEN )
+        return -1 ;
+
+    memcpy( &field , header + 4 , 4 ) ;
+    if ( memcmp( header , CHUNKED_MAGIC , 4 ) != 0 || ntohl( field ) != CHUNKED_VERSION_INDEXED
+         || memcmp( footer + 16 , CHUNK_INDEX_MAGIC , 4 ) != 0 )
+        return -1 ;
+
+    memcpy( &field , header + 8 , 4 ) ;
+    *chunkLen    = ntohl( field ) ;
+    *indexOffset = get64( footer ) ;
+    *nChunks     = get64( footer + 8 ) ;
+
+    // The index must sit exactly between the end marker and the footer
+    if ( *chunkLen != FILE_CHUNK_LEN 
+         || *indexOffset + *nChunks * CHUNK_INDEX_ENTRY_LEN + CHUNK_INDEX_FOOTER_LEN != (uint64_t) st.st_size )
+        return -1 ;
+    if ( *nChunks == 0 )
+        return *indexOffset == chunkAt( 0 ) ? 0 : -1 ;
+
+    // and the last chunk must end right before the end marker
+    if ( pread( fd , last , CHUNK_INDEX_ENTRY_LEN , *indexOffset + ( *nChunks - 1 ) * CHUNK_INDEX_ENTRY_LEN )
+                != CHUNK_INDEX_ENTRY_LEN )
+        return -1 ;
+    memcpy( &field , last + 8 , 4 ) ;
+    if ( get64( last ) != chunkAt( *nChunks - 1 ) || get64( last ) + ntohl( field ) + 4 != *indexOffset )
+        return -1 ;
+
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+
+ssize_t decryptRange( int fd , uint64_t offset , size_t len , const uint8_t *key , uint8_t *out )
+{
+    unsigned   chunkLen ;
+    uint64_t   indexOffset , nChunks ;
+    size_t     produced = 0 ;
+    uint8_t    entry[ CHUNK_INDEX_ENTRY_LEN ] ;
+    uint32_t   field ;
+
+    if ( out == NULL || key == NULL )
+    {
+        fprintf( stderr , "decryptRange: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    if ( seekableOpen( fd , &chunkLen , &indexOffset , &nChunks ) != 0 )
+    {
+        fprintf( stderr , "decryptRange: input is not a seekable container\n" ) ;
+        return -1 ;
+    }
+
+    if ( len == 0 || offset / chunkLen >= nChunks )
+        return 0 ;
+
+    uint8_t *cipher = (uint8_t *) malloc( chunkLen + INITVECTOR_LEN ) ,
+            *plain  = (uint8_t *) malloc( chunkLen + INITVECTOR_LEN ) ;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new() ;
+    if ( cipher == NULL || plain == NULL || ctx == NULL )
+        exitError( "decryptRange: Out of Memory allocating the chunk buffers" ) ;
+
+    // The key schedule is set up once; each chunk only brings its IV
+    if ( EVP_DecryptInit_ex( ctx , ALGORITHM() , NULL , key , NULL ) != 1 )
+        handleErrors( "decryptRange: failed to DecryptInit_ex" ) ;
+
+    ssize_t result = 0 ;
+    for ( uint64_t c = offset / chunkLen ; c < nChunks && produced < len ; c++ )
+    {
+        if ( pread( fd , entry , CHUNK_INDEX_ENTRY_LEN , indexOffset + c * CHUNK_INDEX_ENTRY_LEN ) 
+                != CHUNK_INDEX_ENTRY_LEN )
+        {
+            result = -1 ;
+            break ;
+        }
+
+        uint64_t  at = get64( entry ) ;
+        unsigned  cipherLen , plainLen ;
+        memcpy( &field , entry +  8 , 4 ) ;  cipherLen = ntohl( field ) ;
+        memcpy( &field , entry + 12 , 4 ) ;  plainLen  = ntohl( field ) ;
+
+        // offset / chunkLen only finds the right chunk if the ones before it are full
+        if ( at != chunkAt( c ) || ( c + 1 < nChunks && plainLen != chunkLen ) )
+        {
+            fprintf( stderr , "decryptRange: the index entry of chunk %lu is malformed\n" , (unsigned long) c ) ;
+            result = -1 ;
+            break ;
+        }
+
+        int n1 = 0 , n2 = 0 ;
+        if ( cipherLen > chunkLen + INITVECTOR_LEN || plainLen > chunkLen
+             || pread( fd , cipher , cipherLen , at ) != cipherLen
+             || EVP_DecryptInit_ex( ctx , NULL , NULL , NULL , entry + 16 ) != 1
+             || EVP_DecryptUpdate( ctx , plain , &n1 , cipher , cipherLen ) != 1
+             || EVP_DecryptFinal_ex( ctx , plain + n1 , &n2 ) != 1
+             || (unsigned) ( n1 + n2 ) != plainLen )
+        {
+            fprintf( stderr , "decryptRange: chunk %lu is corrupted\n" , (unsigned long) c ) ;
+            result = -1 ;
+            break ;
+        }
+
+        // Only the first chunk can start part-way in; later ones start at 0
+        uint64_t  chunkStart = c * chunkLen ;
+        unsigned  from = offset + produced - chunkStart ;
+        if ( from >= plainLen )
+            break ;   // the range starts past the end of the file
+
+        size_t take = plainLen - from ;
+        if ( take > len - produced )
+            take = len - produced ;
+
+        memcpy( out + produced , plain + from , take ) ;
+        produced += take ;
+    }
+
+    OPENSSL_cleanse( plain , chunkLen + INITVECTOR_LEN ) ;
+    free( cipher ) ;  free( plain ) ;
+    EVP_CIPHER_CTX_free( ctx ) ;
+
+    return result < 0 ? -1 : (ssize_t) produced ;
+}
+
+//***********************************************************************
+// File I/O Engines
+//***********************************************************************
+
+#include <sys/mman.h>
+
+static ioEngine_t   ioEngine = IO_ENGINE_AUTO ;
+
+void setIOEngine( ioEngine_t engine )
+{
+    ioEngine = engine ;
+}
+
+ioEngine_t getIOEngine( void )
+{
+    return ioEngine ;
+}
+
+//-----------------------------------------------------------------------------
+// A mapping of the bytes of a regular file from its current offset onwards
+// mmap() needs a page-aligned file offset, so 'base' may start a little 
+// before 'data'
+
+typedef struct {
+            uint8_t  *base , *data ;
+            size_t    mapLen , len ;
+            off_t     start , origSize ;
+        }  fileMap_t ;
+
+static int mmapAllowed( void )
+{
+    return ioEngine != IO_ENGINE_STREAM ;
+}
+
+static int mapFile( int fd , off_t start , size_t len , int prot , fileMap_t *m )
+{
+    long   page    = sysconf( _SC_PAGESIZE ) ;
+    off_t  pageOff = start - start % page ;
+
+    m->start  = start ;
+    m->len    = len ;
+    m->mapLen = len + ( start - pageOff ) ;
+    m->base   = mmap( NULL , m->mapLen , prot , MAP_SHARED , fd , pageOff ) ;
+    if ( m->base == MAP_FAILED )
+        return -1 ;
+
+    m->data = m->base + ( start - pageOff ) ;
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+// Map what is left of a regular input file, hinting the kernel that it will
+// be read front to back. Returns -1 if 'fd' is not a non-empty regular file
+
+static int mapInput( int fd , fileMap_t *m )
+{
+    struct stat st ;
+    off_t       start ;
+
+    if ( fstat( fd , &st ) != 0 || ! S_ISREG( st.st_mode ) )
+        return -1 ;
+
+    start = lseek( fd , 0 , SEEK_CUR ) ;
+    if ( start < 0 || st.st_size <= start )
+        return -1 ;
+
+    if ( mapFile( fd , start , st.st_size - start , PROT_READ , m ) != 0 )
+        return -1 ;
+
+    madvise( m->base , m->mapLen , MADV_SEQUENTIAL ) ;
+    return 0 ;
+}
+
+// Leave the descriptor where read() would have left it: at end of file
+static void unmapInput( int fd , fileMap_t *m )
+{
+    munmap( m->base , m->mapLen ) ;
+    lseek( fd , m->start + m->len , SEEK_SET ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Map room for up to 'maxLen' bytes at the current offset of a regular
+// output file, growing it first. The descriptor must be open O_RDWR, since
+// a shared writable mapping needs read access, and not O_APPEND, since
+// stores into the mapping would not honour it
+// Returns -1 if the output cannot be mapped
+
+static int mapOutput( int fd , size_t maxLen , fileMap_t *m )
+{
+    struct stat st ;
+    int         flags = fcntl( fd , F_GETFL ) ;
+    off_t       start ;
+
+    if ( flags < 0 || ( flags & O_ACCMODE ) != O_RDWR || ( flags & O_APPEND ) 
+         || fstat( fd , &st ) != 0 || ! S_ISREG( st.st_mode ) || maxLen == 0 )
+        return -1 ;
+
+    start = lseek( fd , 0 , SEEK_CUR ) ;
+    if ( start < 0 )
+        return -1 ;
+
+    // Real blocks rather than a sparse file: a full disk or quota fails here,
+    // where the stream path can take over, not as SIGBUS on a store later
+    m->origSize = st.st_size ;
+    if ( posix_fallocate( fd , start , maxLen ) != 0 )
+    {
+        ftruncate( fd , st.st_size ) ;
+        return -1 ;
+    }
+
+    if ( mapFile( fd , start , maxLen , PROT_READ | PROT_WRITE , m ) != 0 )
+    {
+        ftruncate( fd , st.st_size ) ;
+        return -1 ;
+    }
+    return 0 ;
+}
+
+// Trim the file back to what was really written ( the decrypted size is only
+// known at the end ) without cutting off data that was already past it
+static void unmapOutput( int fd , fileMap_t *m , size_t used )
+{
+    off_t end = m->start + used ;
+
+    munmap( m->base , m->mapLen ) ;
+    ftruncate( fd , end > m->origSize ? end : m->origSize ) ;
+    lseek( fd , end , SEEK_SET ) ;
+}
+
+// Give up on a mapped output: the file goes back to the size it had
+static void discardOutput( int fd , fileMap_t *m )
+{
+    munmap( m->base , m->mapLen ) ;
+    ftruncate( fd , m->origSize ) ;
+    lseek( fd , m->start , SEEK_SET ) ;
+}
+
+//-----------------------------------------------------------------------------
+// encryptFile() / decryptFile() from a mapped input, either into a mapped
+// output or through FILE_IO_SLICE-sized write() calls
+// Returns the number of bytes produced, or -1 if the mapped path does not apply
+
+static long cipherFileMapped( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , int encrypting )
+{
+    fileMap_t  in , out ;
+    uint8_t   *buf = NULL ;
+    size_t     produced = 0 , maxOut ;
+    int        len = 0 , toMap , failed = 0 ;
+
+    if ( ! mmapAllowed() || mapInput( fd_in , &in ) != 0 )
+        return -1 ;
+
+    // PKCS#7 always adds 1 to 16 bytes; decrypting never grows the data
+    maxOut = encrypting ? ( in.len / INITVECTOR_LEN + 1 ) * INITVECTOR_LEN : in.len ;
+    toMap  = mapOutput( fd_out , maxOut , &out ) == 0 ;
+    if ( ! toMap )
+    {
+        buf = (uint8_t *) malloc( FILE_IO_SLICE + INITVECTOR_LEN ) ;
+        if ( buf == NULL )
+        {
+            munmap( in.base , in.mapLen ) ;   // nothing consumed yet; let the stream path try
+            return -1 ;
+        }
+    }
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new() ;
+    if ( ctx == NULL )
+        handleErrors( "cipherFileMapped: failed to create CTX" ) ;
+
+    if ( EVP_CipherInit_ex( ctx , ALGORITHM() , NULL , key , iv , encrypting ) != 1 )
+        handleErrors( "cipherFileMapped: failed to CipherInit_ex" ) ;
+
+    // EVP_CipherUpdate() takes an int length, so even the fully mapped case
+    // is fed in slices
+    for ( size_t done = 0 ; done < in.len ; done += FILE_IO_SLICE )
+    {
+        size_t   n   = in.len - done < FILE_IO_SLICE ? in.len - done : FILE_IO_SLICE ;
+        uint8_t *dst = toMap ? out.data + produced : buf ;
+
+        if ( EVP_CipherUpdate( ctx , dst , &len , in.data + done , n ) != 1 )
+            handleErrors( "cipherFileMapped: failed to CipherUpdate" ) ;
+
+        if ( ! toMap && writeFull( fd_out , buf , len ) != len )
+            handleErrors( "cipherFileMapped: failed to write fd_out" ) ;
+        produced += len ;
+    }
+
+    // A wrong padding ( or key ) returns what the stream path returns: the
+    // bytes decrypted before the last block. A mapped output is left as it
+    // was found rather than holding unverified plaintext
+    uint8_t *dst = toMap ? out.data + produced : buf ;
+    if ( EVP_CipherFinal_ex( ctx , dst , &len ) != 1 )
+    {
+        failed = 1 ;
+        len    = 0 ;
+    }
+    if ( ! toMap && writeFull( fd_out , buf , len ) != len )
+        handleErrors( "cipherFileMapped: failed to write fd_out" ) ;
+    produced += len ;
+
+    EVP_CIPHER_CTX_free( ctx ) ;
+    unmapInput( fd_in , &in ) ;
+    if ( toMap && failed )
+        discardOutput( fd_out , &out ) ;
+    else if ( toMap )
+        unmapOutput( fd_out , &out , produced ) ;
+    else
+    {
+        OPENSSL_cleanse( buf , FILE_IO_SLICE + INITVECTOR_LEN ) ;
+        free( buf ) ;
+    }
+
+    return produced ;
+}
+
+//-----------------------------------------------------------------------------
+// fileDigest() over a mapped input. The copy to 'fd_out', if any, is written
+// straight from the mapping
+// Returns the digest length, or -1 if the mapped path does not apply
+
+static long fileDigestMapped( int fd_in , int fd_out , uint8_t *digest )
+{
+    fileMap_t  in ;
+    unsigned   mdLen = 0 ;
+
+    if ( ! mmapAllowed() || mapInput( fd_in , &in ) != 0 )
+        return -1 ;
+
+    EVP_MD_CTX *mdCtx = EVP_MD_CTX_create() ;
+    if ( mdCtx == NULL )
+        handleErrors( "fileDigest: failed to create CTX" ) ;
+
+    if ( EVP_DigestInit( mdCtx , EVP_sha256() ) != 1 )
+        handleErrors( "fileDigest: failed to DigestInit" ) ;
+
+    for ( size_t done = 0 ; done < in.len ; done += FILE_IO_SLICE )
+    {
+        size_t n = in.len - done < FILE_IO_SLICE ? in.len - done : FILE_IO_SLICE ;
+
+        if ( EVP_DigestUpdate( mdCtx , in.data + done , n ) != 1 )
+            handleErrors( "fileDigest: failed to DigestUpdate" ) ;
+
+        if ( fd_out > 0 && writeFull( fd_out , in.data + done , n ) != (ssize_t) n )
+            handleErrors( "fileDigest: failed to write to fd_out" ) ;
+    }
+
+    if ( EVP_DigestFinal( mdCtx , digest , &mdLen ) != 1 )
+        handleErrors( "fileDigest: failed to DigestFinal" ) ;
+
+    EVP_MD_CTX_destroy( mdCtx ) ;
+    unmapInput( fd_in , &in ) ;
+
+    return mdLen ;
+}
+
+//-----------------------------------------------------------------------------
+// io_uring, driven through the raw system calls so that liburing is not
+// needed. Only what the pipeline below uses is wrapped
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+typedef struct {
+            int                   fd ;
+            unsigned             *sqHead , *sqTail , *sqMask , *sqArray ;
+            unsigned             *cqHead , *cqTail , *cqMask ;
+            struct io_uring_sqe  *sqes ;
+            struct io_uring_cqe  *cqes ;
+            void                 *sqRing , *cqRing ;
+            size_t                sqRingLen , cqRingLen , sqesLen ;
+            unsigned              toSubmit ;
+        }  uring_t ;
+
+static int uring_init( uring_t *r , unsigned entries )
+{
+    struct io_uring_params p ;
+
+    memset( r , 0 , sizeof(uring_t) ) ;
+    memset( &p , 0 , sizeof(p) ) ;
+
+    r->fd = syscall( __NR_io_uring_setup , entries , &p ) ;
+    if ( r->fd < 0 )
+        return -1 ;
+
+    r->sqRingLen = p.sq_off.array + p.sq_entries * sizeof(unsigned) ;
+    r->cqRingLen = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe) ;
+    r->sqesLen   = p.sq_entries * sizeof(struct io_uring_sqe) ;
+
+    r->sqRing = mmap( NULL , r->sqRingLen , PROT_READ | PROT_WRITE , MAP_SHARED | MAP_POPULATE , 
+                      r->fd , IORING_OFF_SQ_RING ) ;
+    r->cqRing = mmap( NULL , r->cqRingLen , PROT_READ | PROT_WRITE , MAP_SHARED | MAP_POPULATE , 
+                      r->fd , IORING_OFF_CQ_RING ) ;
+    r->sqes   = mmap( NULL , r->sqesLen   , PROT_READ | PROT_WRITE , MAP_SHARED | MAP_POPULATE , 
+                      r->fd , IORING_OFF_SQES ) ;
+    if ( r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED || r->sqes == MAP_FAILED )
+    {
+        close( r->fd ) ;
+        return -1 ;
+    }
+
+    r->sqHead  = (unsigned *) ( (uint8_t *) r->sqRing + p.sq_off.head ) ;
+    r->sqTail  = (unsigned *) ( (uint8_t *) r->sqRing + p.sq_off.tail ) ;
+    r->sqMask  = (unsigned *) ( (uint8_t *) r->sqRing + p.sq_off.ring_mask ) ;
+    r->sqArray = (unsigned *) ( (uint8_t *) r->sqRing + p.sq_off.array ) ;
+    r->cqHead  = (unsigned *) ( (uint8_t *) r->cqRing + p.cq_off.head ) ;
+    r->cqTail  = (unsigned *) ( (uint8_t *) r->cqRing + p.cq_off.tail ) ;
+    r->cqMask  = (unsigned *) ( (uint8_t *) r->cqRing + p.cq_off.ring_mask ) ;
+    r->cqes    = (struct io_uring_cqe *) ( (uint8_t *) r->cqRing + p.cq_off.cqes ) ;
+
+    return 0 ;
+}
+
+static void uring_free( uring_t *r )
+{
+    munmap( r->sqes   , r->sqesLen ) ;
+    munmap( r->cqRing , r->cqRingLen ) ;
+    munmap( r->sqRing , r->sqRingLen ) ;
+    close( r->fd ) ;
+}
+
+// Queue one read or write; it reaches the kernel on the next uring_enter()
+// The ring is sized so that it can never be full here
+static void uring_queue( uring_t *r , int op , int fd , void *buf , unsigned len , 
+                         uint64_t off , int bufIndex , uint64_t userData )
+{
+    unsigned             tail = *r->sqTail ;
+    unsigned             idx  = tail & *r->sqMask ;
+    struct io_uring_sqe *sqe  = &r->sqes[ idx ] ;
+
+    memset( sqe , 0 , sizeof(*sqe) ) ;
+    sqe->opcode    = bufIndex >= 0 ? op : ( op == IORING_OP_READ_FIXED ? IORING_OP_READ : IORING_OP_WRITE ) ;
+    sqe->fd        = fd ;
+    sqe->addr      = (uint64_t) (uintptr_t) buf ;
+    sqe->len       = len ;
+    sqe->off       = off ;
+    sqe->buf_index = bufIndex >= 0 ? bufIndex : 0 ;
+    sqe->user_data = userData ;
+
+    r->sqArray[ idx ] = idx ;
+    __atomic_store_n( r->sqTail , tail + 1 , __ATOMIC_RELEASE ) ;
+    r->toSubmit++ ;
+}
+
+// Submit what is queued and, if 'wait', block until at least one completion
+static int uring_enter( uring_t *r , int wait )
+{
+    int n ;
+    do
+        n = syscall( __NR_io_uring_enter , r->fd , r->toSubmit , wait ? 1 : 0 , 
+                     wait ? IORING_ENTER_GETEVENTS : 0 , NULL , 0 ) ;
+    while ( n < 0 && errno == EINTR ) ;
+
+    if ( n < 0 )
+        return -1 ;
+    r->toSubmit -= n < (int) r->toSubmit ? n : r->toSubmit ;
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+// Plain pread() / pwrite() fallback for kernels or sandboxes without io_uring.
+// Same block size and offsets as the ring, just one block at a time
+
+static long cipherFilePread( int fd_in , int fd_out , off_t inStart , size_t len , off_t outStart , 
+                             EVP_CIPHER_CTX *ctx , uint8_t *in , uint8_t *out )
+{
+    size_t produced = 0 ;
+    int    n = 0 ;
+
+    for ( size_t done = 0 ; done < len ; done += URING_BLOCK )
+    {
+        size_t want = len - done < URING_BLOCK ? len - done : URING_BLOCK ;
+        size_t got  = 0 ;
+        while ( got < want )
+        {
+            ssize_t r = pread( fd_in , in + got , want - got , inStart + done + got ) ;
+            if ( r <= 0 )
+                handleErrors( "cipherFileUring: failed to read fd_in" ) ;
+            got += r ;
+        }
+
+        if ( EVP_CipherUpdate( ctx , out , &n , in , want ) != 1 )
+            handleErrors( "cipherFileUring: failed to CipherUpdate" ) ;
+        if ( n > 0 && pwrite( fd_out , out , n , outStart + produced ) != n )
+            handleErrors( "cipherFileUring: failed to write fd_out" ) ;
+        produced += n ;
+    }
+
+    // A wrong padding adds nothing, as on the stream path
+    if ( EVP_CipherFinal_ex( ctx , out , &n ) != 1 )
+        n = 0 ;
+    if ( n > 0 && pwrite( fd_out , out , n , outStart + produced ) != n )
+        handleErrors( "cipherFileUring: failed to write fd_out" ) ;
+    produced += n ;
+
+    return produced ;
+}
+
+//-----------------------------------------------------------------------------
+// encryptFile() / decryptFile() through io_uring
+// Block b of the input lives in slot b % URING_DEPTH. A slot cycles through
+//     read queued -> read done -> ciphered, write queued -> write done -> free
+// CBC forces the cipher step to go in block order, but while one block is
+// being ciphered the next reads and the previous writes are all in flight
+// Returns the number of bytes produced, or -1 if this engine does not apply
+
+// user_data of a request = operation in the top byte, then
+//     for a read  : the block number
+//     for a write : its length << 8 | slot
+#define URING_OP_READ        1ull
+#define URING_OP_WRITE       2ull
+#define URING_TAG(op,v)      ( ( (op) << 56 ) | (v) )
+#define URING_TAG_OP(t)      ( (t) >> 56 )
+#define URING_TAG_VALUE(t)   ( (t) & ( ( 1ull << 56 ) - 1 ) )
+
+static long cipherFileUring( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , int encrypting )
+{
+    struct stat  stIn , stOut ;
+    int          flags = fcntl( fd_out , F_GETFL ) ;
+    off_t        inStart , outStart ;
+
+    if ( ioEngine != IO_ENGINE_URING 
+         || fstat( fd_in , &stIn ) != 0 || ! S_ISREG( stIn.st_mode )
+         || fstat( fd_out , &stOut ) != 0 || ! S_ISREG( stOut.st_mode ) 
+         || flags < 0 || ( flags & O_APPEND ) )
+        return -1 ;
+
+    inStart  = lseek( fd_in  , 0 , SEEK_CUR ) ;
+    outStart = lseek( fd_out , 0 , SEEK_CUR ) ;
+    if ( inStart < 0 || outStart < 0 || stIn.st_size <= inStart )
+        return -1 ;
+
+    size_t    len     = stIn.st_size - inStart ;
+    uint64_t  nBlocks = ( len + URING_BLOCK - 1 ) / URING_BLOCK ;
+
+    // One arena: URING_DEPTH input buffers followed by URING_DEPTH output buffers
+    // Each output has room for a block plus what Final may add
+    size_t    outSize = URING_BLOCK + INITVECTOR_LEN ;
+    uint8_t  *arena   = (uint8_t *) aligned_alloc( 4096 , URING_DEPTH * ( URING_BLOCK + outSize ) ) ;
+    if ( arena == NULL )
+        return -1 ;
+    uint8_t  *inBuf [ URING_DEPTH ] , *outBuf[ URING_DEPTH ] ;
+    for ( int s = 0 ; s < URING_DEPTH ; s++ )
+    {
+        inBuf [ s ] = arena + s * URING_BLOCK ;
+        outBuf[ s ] = arena + URING_DEPTH * URING_BLOCK + s * outSize ;
+    }
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new() ;
+    if ( ctx == NULL )
+        handleErrors( "cipherFileUring: failed to create CTX" ) ;
+    if ( EVP_CipherInit_ex( ctx , ALGORITHM() , NULL , key , iv , encrypting ) != 1 )
+        handleErrors( "cipherFileUring: failed to CipherInit_ex" ) ;
+
+    size_t    produced = 0 ;
+    uring_t   ring ;
+    int       n = 0 ;
+
+    if ( uring_init( &ring , 2 * URING_DEPTH ) != 0 )
+    {
+        produced = cipherFilePread( fd_in , fd_out , inStart , len , outStart , ctx , inBuf[ 0 ] , outBuf[ 0 ] ) ;
+    }
+    else
+    {
+        // Registered buffers spare the kernel from pinning pages on every request
+        // If RLIMIT_MEMLOCK is too small for them, plain READ / WRITE are used
+        struct iovec  iov[ 2 * URING_DEPTH ] ;
+        for ( int s = 0 ; s < URING_DEPTH ; s++ )
+        {
+            iov[ s ]               = (struct iovec) { inBuf [ s ] , URING_BLOCK } ;
+            iov[ URING_DEPTH + s ] = (struct iovec) { outBuf[ s ] , outSize } ;
+        }
+        int fixed = syscall( __NR_io_uring_register , ring.fd , IORING_REGISTER_BUFFERS , 
+                             iov , 2 * URING_DEPTH ) == 0 ;
+
+        uint64_t  nextRead = 0 , nextCipher = 0 , writesPending = 0 ;
+        unsigned  readLen [ URING_DEPTH ] ;
+        int       readDone[ URING_DEPTH ] = { 0 } , slotFree[ URING_DEPTH ] ;
+
+        for ( int s = 0 ; s < URING_DEPTH ; s++ )
+            slotFree[ s ] = 1 ;
+
+        while ( nextCipher < nBlocks || writesPending > 0 )
+        {
+            // Keep every free slot busy reading ahead
+            while ( nextRead < nBlocks && slotFree[ nextRead % URING_DEPTH ] )
+            {
+                int s = nextRead % URING_DEPTH ;
+                readLen[ s ]  = len - nextRead * URING_BLOCK < URING_BLOCK ? len - nextRead * URING_BLOCK 
+                                                                           : URING_BLOCK ;
+                slotFree[ s ] = 0 ;
+                uring_queue( &ring , IORING_OP_READ_FIXED , fd_in , inBuf[ s ] , readLen[ s ] , 
+                             inStart + nextRead * URING_BLOCK , fixed ? s : -1 , 
+                             URING_TAG( URING_OP_READ , nextRead ) ) ;
+                nextRead++ ;
+            }
+
+            // Cipher every block whose read has landed, strictly in order
+            while ( nextCipher < nBlocks && readDone[ nextCipher % URING_DEPTH ] )
+            {
+                int s = nextCipher % URING_DEPTH , m = 0 ;
+                readDone[ s ] = 0 ;
+
+                if ( EVP_CipherUpdate( ctx , outBuf[ s ] , &n , inBuf[ s ] , readLen[ s ] ) != 1 )
+                    handleErrors( "cipherFileUring: failed to CipherUpdate" ) ;
+                if ( nextCipher == nBlocks - 1 )
+                {
+                    if ( EVP_CipherFinal_ex( ctx , outBuf[ s ] + n , &m ) != 1 )
+                        m = 0 ;      // wrong padding: nothing more, as on the stream path
+                    n += m ;
+                }
+
+                if ( n > 0 )
+                {
+                    uring_queue( &ring , IORING_OP_WRITE_FIXED , fd_out , outBuf[ s ] , n , 
+                                 outStart + produced , fixed ? URING_DEPTH + s : -1 , 
+                                 URING_TAG( URING_OP_WRITE , (uint64_t) n << 8 | s ) ) ;
+                    writesPending++ ;
+                }
+                else
+                    slotFree[ s ] = 1 ;
+
+                produced += n ;
+                nextCipher++ ;
+            }
+
+            if ( uring_enter( &ring , 1 ) != 0 )
+                handleErrors( "cipherFileUring: io_uring_enter failed" ) ;
+
+            unsigned head = *ring.cqHead ;
+            unsigned tail = __atomic_load_n( ring.cqTail , __ATOMIC_ACQUIRE ) ;
+            for ( ; head != tail ; head++ )
+            {
+                struct io_uring_cqe *cqe = &ring.cqes[ head & *ring.cqMask ] ;
+                uint64_t             op  = URING_TAG_OP( cqe->user_data ) ,
+                                     val = URING_TAG_VALUE( cqe->user_data ) ;
+
+                if ( op == URING_OP_READ )
+                {
+                    uint64_t b = val ;
+                    int      s = b % URING_DEPTH ;
+
+                    // A short read of a regular file is rare; finish it synchronously
+                    int got = cqe->res ;
+                    while ( got >= 0 && (unsigned) got < readLen[ s ] )
+                    {
+                        ssize_t r = pread( fd_in , inBuf[ s ] + got , readLen[ s ] - got , 
+                                           inStart + b * URING_BLOCK + got ) ;
+                        got = r > 0 ? got + r : -1 ;
+                    }
+                    if ( got < 0 )
+                        handleErrors( "cipherFileUring: failed to read fd_in" ) ;
+                    readDone[ s ] = 1 ;
+                }
+                else
+                {
+                    int s    = val & 0xff ;
+                    int want = val >> 8 ;
+                    if ( cqe->res != want )
+                        handleErrors( "cipherFileUring: failed to write fd_out" ) ;
+                    slotFree[ s ] = 1 ;
+                    writesPending-- ;
+                }
+            }
+            __atomic_store_n( ring.cqHead , head , __ATOMIC_RELEASE ) ;
+        }
+
+        uring_free( &ring ) ;
+    }
+
+    EVP_CIPHER_CTX_free( ctx ) ;
+    OPENSSL_cleanse( arena , URING_DEPTH * ( URING_BLOCK + outSize ) ) ;
+    free( arena ) ;
+
+    // Leave both descriptors where the read() / write() loop would have
+    lseek( fd_in  , inStart + len , SEEK_SET ) ;
+    lseek( fd_out , outStart + produced , SEEK_SET ) ;
+
+    return produced ;
+}
+
+//***********************************************************************
+// Thread-safe Contexts
+//***********************************************************************
+
+myCryptoCtx_t *myCryptoCtx_new( void )
+{
+    // Zeroed, so the key cache starts out empty
+    myCryptoCtx_t *ctx = calloc( 1 , sizeof( myCryptoCtx_t ) ) ;
+    if ( ! ctx )
+        exitError( "myCryptoCtx_new: Out of Memory allocating a context" ) ;
+
+    return ctx ;
+}
+
+//-----------------------------------------------------------------------------
+void myCryptoCtx_free( myCryptoCtx_t *ctx )
+{
+    if ( ! ctx )
+        return ;
+
+    keyCache_flush_r( ctx ) ;
+
+    // The buffers held plaintext and key material
+    OPENSSL_cleanse( ctx , sizeof( myCryptoCtx_t ) ) ;
+    free( ctx ) ;
+}
+
+//-----------------------------------------------------------------------------
+// One context per thread, hung off a pthread key whose destructor frees it
+
+static pthread_key_t   threadCtxKey ;
+static pthread_once_t  threadCtxOnce = PTHREAD_ONCE_INIT ;
+
+static void threadCtx_destroy( void *ctx )
+{
+    myCryptoCtx_free( ctx ) ;
+}
+
+static void threadCtx_init( void )
+{
+    if ( pthread_key_create( &threadCtxKey , threadCtx_destroy ) != 0 )
+        exitError( "myCryptoCtx_thread: pthread_key_create failed" ) ;
+}
+
+myCryptoCtx_t *myCryptoCtx_thread( void )
+{
+    pthread_once( &threadCtxOnce , threadCtx_init ) ;
+
+    myCryptoCtx_t *ctx = pthread_getspecific( threadCtxKey ) ;
+    if ( ! ctx )
+    {
+        ctx = myCryptoCtx_new() ;
+        pthread_setspecific( threadCtxKey , ctx ) ;
+    }
+
+    return ctx ;
+}
+
+//-----------------------------------------------------------------------------
+// The original non-reentrant API, now running on the calling thread's context
+
+unsigned   encrypt( uint8_t *pPlainText, unsigned plainText_len, 
+                    const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText )
+{
+    return encrypt_r( myCryptoCtx_thread() , pPlainText , plainText_len , key , iv , pCipherText ) ;
+}
+
+// A wrong padding, which the original never checked, decrypts to nothing
+
+unsigned   decrypt( uint8_t *pCipherText, unsigned cipherText_len, 
+                    const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText )
+{
+    int len = decrypt_r( myCryptoCtx_thread() , pCipherText , cipherText_len , key , iv , pDecryptedText ) ;
+    return len < 0 ? 0 : len ;
+}
+
+int    encryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv )
+{
+    return encryptFile_r( myCryptoCtx_thread() , fd_in , fd_out , key , iv ) ;
+}
+
+int    decryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv )
+{
+    return decryptFile_r( myCryptoCtx_thread() , fd_in , fd_out , key , iv ) ;
+}
+
+unsigned MSG2_new( FILE *log , uint8_t **msg2, const myKey_t *Ka , const myKey_t *Kb , 
+                   const myKey_t *Ks , const char *IDa , const char *IDb  , Nonce_t *Na )
+{
+    return MSG2_new_r( myCryptoCtx_thread() , log , msg2 , Ka , Kb , Ks , IDa , IDb , Na ) ;
+}
+
+void MSG2_receive( FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **IDb , 
+                   Nonce_t *Na , unsigned *lenTktCipher , uint8_t **tktCipher )
+{
+    MSG2_receive_r( myCryptoCtx_thread() , log , fd , Ka , Ks , IDb , Na , lenTktCipher , tktCipher ) ;
+}
+
+void MSG3_receive( FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , char **IDa , Nonce_t *Na2 )
+{
+    MSG3_receive_r( myCryptoCtx_thread() , log , fd , Kb , Ks , IDa , Na2 ) ;
+}
+
+unsigned MSG4_new( FILE *log , uint8_t **msg4, const myKey_t *Ks , Nonce_t *fNa2 , Nonce_t *Nb )
+{
+    return MSG4_new_r( myCryptoCtx_thread() , log , msg4 , Ks , fNa2 , Nb ) ;
+}
+
+void  MSG4_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *rcvd_fNa2 , Nonce_t *Nb )
+{
+    MSG4_receive_r( myCryptoCtx_thread() , log , fd , Ks , rcvd_fNa2 , Nb ) ;
+}
+
+unsigned MSG5_new( FILE *log , uint8_t **msg5, const myKey_t *Ks ,  Nonce_t *fNb )
+{
+    return MSG5_new_r( myCryptoCtx_thread() , log , msg5 , Ks , fNb ) ;
+}
+
+void  MSG5_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb )
+{
+    MSG5_receive_r( myCryptoCtx_thread() , log , fd , Ks , fNb ) ;
+}
+
+myKeyHandle_t *keyCache_get( const uint8_t *key , const uint8_t *iv )
+{
+    return keyCache_get_r( myCryptoCtx_thread() , key , iv ) ;
+}
+
+void keyCache_flush( void )
+{
+    keyCache_flush_r( myCryptoCtx_thread() ) ;
+}
+
+void encryptBatch( myCipherJob_t *jobs , unsigned nJobs )
+{
+    encryptBatch_r( myCryptoCtx_thread() , jobs , nJobs ) ;
+}
+
+unsigned MSG2_newBatch( FILE *log , myMSG2Job_t *jobs , unsigned nJobs )
+{
+    return MSG2_newBatch_r( myCryptoCtx_thread() , log , jobs , nJobs ) ;
+}
+
+unsigned encryptAEAD( uint8_t *pPlainText, unsigned plainText_len, 
+                      const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText )
+{
+    return encryptAEAD_r( myCryptoCtx_thread() , pPlainText , plainText_len , key , iv , pCipherText ) ;
+}
+
+int decryptAEAD( uint8_t *pCipherText, unsigned cipherText_len, 
+                 const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText )
+{
+    return decryptAEAD_r( myCryptoCtx_thread() , pCipherText , cipherText_len , key , iv , pDecryptedText ) ;
+}
+
+//***********************************************************************
+// Fused Encrypt + Digest
+//***********************************************************************
+
+// Cipher 'fd_in' into 'fd_out' in FUSED_BLOCK steps, hashing each step's input
+// or output right after the cipher touched it, so every byte crosses the
+// memory bus once. A regular input is read from a mapping, and a regular
+// output opened O_RDWR is written into one, exactly as cipherFileMapped() does
+
+static ssize_t cipherFileDigest( int fd_in , int fd_out , const uint8_t *key , const uint8_t *iv , 
+                                 int encrypting , digestOf_t which , 
+                                 uint8_t *digest , unsigned *digestLen )
+{
+    fileMap_t  in , out ;
+    uint8_t   *inBuf , *outBuf ;
+    size_t     consumed = 0 , produced = 0 ;
+    int        len = 0 , fromMap , toMap = 0 , failed = 0 ;
+
+    if ( digest == NULL || digestLen == NULL )
+    {
+        fprintf( stderr , "cipherFileDigest: NULL digest or digestLen\n" ) ;
+        exit( -1 ) ;
+    }
+
+    // The digest covers the input of the cipher when it is the plaintext
+    // side of an encryption or the ciphertext side of a decryption
+    int hashInput = ( which == DIGEST_PLAINTEXT ) == ( encrypting != 0 ) ;
+
+    fromMap = mmapAllowed() && mapInput( fd_in , &in ) == 0 ;
+    if ( fromMap )
+    {
+        size_t maxOut = encrypting ? ( in.len / INITVECTOR_LEN + 1 ) * INITVECTOR_LEN : in.len ;
+        toMap = mapOutput( fd_out , maxOut , &out ) == 0 ;
+    }
+
+    inBuf  = (uint8_t *) malloc( FUSED_BLOCK ) ;
+    outBuf = (uint8_t *) malloc( FUSED_BLOCK + INITVECTOR_LEN ) ;
+    if ( inBuf == NULL || outBuf == NULL )
+        exitError( "cipherFileDigest: Out of Memory allocating buffers" ) ;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new() ;
+    EVP_MD_CTX     *mdCtx = EVP_MD_CTX_create() ;
+    if ( ctx == NULL || mdCtx == NULL )
+        handleErrors( "cipherFileDigest: failed to create CTX" ) ;
+
+    if ( EVP_CipherInit_ex( ctx , ALGORITHM() , NULL , key , iv , encrypting ) != 1 )
+        handleErrors( "cipherFileDigest: failed to CipherInit_ex" ) ;
+    if ( EVP_DigestInit( mdCtx , EVP_sha256() ) != 1 )
+        handleErrors( "cipherFileDigest: failed to DigestInit" ) ;
+
+    for ( ;; )
+    {
+        const uint8_t *src ;
+        size_t         n ;
+
+        if ( fromMap )
+        {
+            n   = in.len - consumed < FUSED_BLOCK ? in.len - consumed : FUSED_BLOCK ;
+            src = in.data + consumed ;
+        }
+        else
+        {
+            ssize_t got = readFull( fd_in , inBuf , FUSED_BLOCK ) ;
+            if ( got < 0 )
+                handleErrors( "cipherFileDigest: failed to read fd_in" ) ;
+            n   = got ;
+            src = inBuf ;
+        }
+        if ( n == 0 )
+            break ;
+        consumed += n ;
+
+        uint8_t *dst = toMap ? out.data + produced : outBuf ;
+        if ( EVP_CipherUpdate( ctx , dst , &len , src , n ) != 1 )
+            handleErrors( "cipherFileDigest: failed to CipherUpdate" ) ;
+
+        if ( EVP_DigestUpdate( mdCtx , hashInput ? src : dst , hashInput ? n : (size_t) len ) != 1 )
+            handleErrors( "cipherFileDigest: failed to DigestUpdate" ) ;
+
+        if ( ! toMap && writeFull( fd_out , outBuf , len ) != len )
+            handleErrors( "cipherFileDigest: failed to write fd_out" ) ;
+        produced += len ;
+
+        // A short read means end of file
+        if ( ! fromMap && n < FUSED_BLOCK )
+            break ;
+    }
+
+    // A wrong padding ( or key ) skips the last block and leaves no digest
+    // A mapped output is left as it was found, as in cipherFileMapped()
+    uint8_t *dst = toMap ? out.data + produced : outBuf ;
+    if ( EVP_CipherFinal_ex( ctx , dst , &len ) != 1 )
+    {
+        failed = 1 ;
+        len    = 0 ;
+    }
+    if ( ! hashInput && EVP_DigestUpdate( mdCtx , dst , len ) != 1 )
+        handleErrors( "cipherFileDigest: failed to DigestUpdate" ) ;
+    if ( ! toMap && writeFull( fd_out , outBuf , len ) != len )
+        handleErrors( "cipherFileDigest: failed to write fd_out" ) ;
+    produced += len ;
+
+    if ( EVP_DigestFinal( mdCtx , digest , digestLen ) != 1 )
+        handleErrors( "cipherFileDigest: failed to DigestFinal" ) ;
+    if ( failed )
+    {
+        OPENSSL_cleanse( digest , *digestLen ) ;
+        *digestLen = 0 ;
+    }
+
+    EVP_MD_CTX_destroy( mdCtx ) ;
+    EVP_CIPHER_CTX_free( ctx ) ;
+    if ( fromMap )
+        unmapInput( fd_in , &in ) ;
+    if ( toMap && failed )
+        discardOutput( fd_out , &out ) ;
+    else if ( toMap )
+        unmapOutput( fd_out , &out , produced ) ;
+
+    OPENSSL_cleanse( inBuf , FUSED_BLOCK ) ;
+    OPENSSL_cleanse( outBuf , FUSED_BLOCK + INITVECTOR_LEN ) ;
+    free( inBuf ) ;
+    free( outBuf ) ;
+
+    return failed ? -1 : (ssize_t) produced ;
+}
+
+//-----------------------------------------------------------------------------
+ssize_t encryptFileDigest( int fd_in , int fd_out , const uint8_t *key , const uint8_t *iv , 
+                           digestOf_t which , uint8_t *digest , unsigned *digestLen )
+{
+    return cipherFileDigest( fd_in , fd_out , key , iv , 1 , which , digest , digestLen ) ;
+}
+
+//-----------------------------------------------------------------------------
+ssize_t decryptFileDigest( int fd_in , int fd_out , const uint8_t *key , const uint8_t *iv , 
+                           digestOf_t which , uint8_t *digest , unsigned *digestLen )
+{
+    return cipherFileDigest( fd_in , fd_out , key , iv , 0 , which , digest , digestLen ) ;
+}
+
+//***********************************************************************
+// Tree Digests
+//***********************************************************************
+
+static digestMode_t   digestMode = DIGEST_MODE_SHA256 ;
+
+void setDigestMode( digestMode_t mode )
+{
+    digestMode = mode ;
+}
+
+digestMode_t getDigestMode( void )
+{
+    return digestMode ;
+}
+
+//-----------------------------------------------------------------------------
+// The one-byte prefixes keep a leaf from ever being mistaken for a node
+
+static void treeLeaf( EVP_MD_CTX *md , const uint8_t *data , size_t len , uint8_t *out )
+{
+    static const uint8_t  tag = 0x00 ;
+
+    if (    EVP_DigestInit_ex( md , EVP_sha256() , NULL ) != 1
+         || EVP_DigestUpdate( md , &tag , 1 ) != 1 
+         || EVP_DigestUpdate( md , data , len ) != 1
+         || EVP_DigestFinal_ex( md , out , NULL ) != 1 )
+        handleErrors( "fileDigestTree: failed to hash a leaf" ) ;
+}
+
+static void treeNode( EVP_MD_CTX *md , const uint8_t *left , const uint8_t *right , uint8_t *out )
+{
+    static const uint8_t  tag = 0x01 ;
+
+    if (    EVP_DigestInit_ex( md , EVP_sha256() , NULL ) != 1
+         || EVP_DigestUpdate( md , &tag , 1 ) != 1 
+         || EVP_DigestUpdate( md , left  , SHA256_DIGEST_LENGTH ) != 1
+         || EVP_DigestUpdate( md , right , SHA256_DIGEST_LENGTH ) != 1
+         || EVP_DigestFinal_ex( md , out , NULL ) != 1 )
+        handleErrors( "fileDigestTree: failed to hash a node" ) ;
+}
+
+// Fold the leaves of 't' into its root, one level at a time
+static void treeFold( myTreeDigest_t *t )
+{
+    size_t    n     = t->nLeaves ;
+    uint8_t (*level)[ SHA256_DIGEST_LENGTH ] = malloc( n * SHA256_DIGEST_LENGTH ) ;
+
+    EVP_MD_CTX *md = EVP_MD_CTX_create() ;
+    if ( level == NULL || md == NULL )
+        exitError( "fileDigestTree: Out of Memory folding the tree" ) ;
+
+    memcpy( level , t->leaves , n * SHA256_DIGEST_LENGTH ) ;
+    while ( n > 1 )
+    {
+        for ( size_t i = 0 ; i < n / 2 ; i++ )
+            treeNode( md , level[ 2*i ] , level[ 2*i + 1 ] , level[ i ] ) ;
+        if ( n % 2 )
+            memcpy( level[ n / 2 ] , level[ n - 1 ] , SHA256_DIGEST_LENGTH ) ;
+        n = ( n + 1 ) / 2 ;
+    }
+    memcpy( t->root , level[ 0 ] , SHA256_DIGEST_LENGTH ) ;
+
+    EVP_MD_CTX_destroy( md ) ;
+    free( level ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Read exactly 'len' bytes at 'offset', or fewer at end of file
+
+static ssize_t preadFull( int fd , uint8_t *buf , size_t len , off_t offset )
+{
+    size_t done = 0 ;
+    while ( done < len )
+    {
+        ssize_t n = pread( fd , buf + done , len - done , offset + done ) ;
+        if ( n == 0 )
+            break ;
+        if ( n < 0 )
+            return -1 ;
+        done += n ;
+    }
+    return done ;
+}
+
+//-----------------------------------------------------------------------------
+// Regular files: every worker claims the next unhashed leaf until none are left
+// Leaves come straight from a mapping if there is one, else through pread()
+
+typedef struct {
+            myTreeDigest_t   *t ;
+            int               fd ;
+            const uint8_t    *data ;      // mapping of the hashed range, or NULL
+            pthread_mutex_t   lock ;
+            size_t            next ;
+            int               failed ;
+        }  treeJob_t ;
+
+static void *treeWorker( void *arg )
+{
+    treeJob_t   *job = (treeJob_t *) arg ;
+    uint8_t     *buf = NULL ;
+
+    EVP_MD_CTX *md = EVP_MD_CTX_create() ;
+    if ( md == NULL )
+        handleErrors( "treeWorker: failed to create CTX" ) ;
+
+    if ( job->data == NULL && ( buf = (uint8_t *) malloc( TREE_CHUNK_LEN ) ) == NULL )
+        exitError( "treeWorker: Out of Memory allocating a chunk buffer" ) ;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock( &job->lock ) ;
+        size_t i = job->next++ ;
+        pthread_mutex_unlock( &job->lock ) ;
+        if ( i >= job->t->nLeaves )
+            break ;
+
+        uint64_t       off = (uint64_t) i * TREE_CHUNK_LEN ;
+        size_t         n   = job->t->fileLen - off < TREE_CHUNK_LEN ? job->t->fileLen - off : TREE_CHUNK_LEN ;
+        const uint8_t *src = job->data + off ;
+
+        if ( job->data == NULL )
+        {
+            if ( preadFull( job->fd , buf , n , job->t->start + off ) != (ssize_t) n )
+            {
+                job->failed = 1 ;
+                break ;
+            }
+            src = buf ;
+        }
+        treeLeaf( md , src , n , job->t->leaves[ i ] ) ;
+    }
+
+    EVP_MD_CTX_destroy( md ) ;
+    free( buf ) ;
+    return NULL ;
+}
+
+// Returns 0, -1 if 'fd_in' is not a regular file, or -2 if it could not be read
+static int treeHashParallel( int fd_in , unsigned nThreads , myTreeDigest_t *t )
+{
+    struct stat  st ;
+    fileMap_t    in ;
+    treeJob_t    job ;
+    int          mapped ;
+
+    if ( fstat( fd_in , &st ) != 0 || ! S_ISREG( st.st_mode ) )
+        return -1 ;
+    off_t start = lseek( fd_in , 0 , SEEK_CUR ) ;
+    if ( start < 0 )
+        return -1 ;
+
+    t->start   = start ;
+    t->fileLen = st.st_size > start ? st.st_size - start : 0 ;
+    t->nLeaves = t->fileLen ? ( t->fileLen + TREE_CHUNK_LEN - 1 ) / TREE_CHUNK_LEN : 1 ;
+    t->leaves  = malloc( t->nLeaves * SHA256_DIGEST_LENGTH ) ;
+    if ( t->leaves == NULL )
+        exitError( "fileDigestTree: Out of Memory allocating the leaves" ) ;
+
+    // mapInput() refuses empty files; an empty leaf needs no data anyway
+    mapped = t->fileLen && mmapAllowed() && mapInput( fd_in , &in ) == 0 ;
+
+    memset( &job , 0 , sizeof(job) ) ;
+    job.t    = t ;
+    job.fd   = fd_in ;
+    job.data = mapped ? in.data : NULL ;
+    pthread_mutex_init( &job.lock , NULL ) ;
+
+    if ( nThreads == 0 )
+    {
+        long n = sysconf( _SC_NPROCESSORS_ONLN ) ;
+        nThreads = n > 0 ? n : 1 ;
+    }
+    if ( nThreads > t->nLeaves )
+        nThreads = t->nLeaves ;
+
+    if ( t->fileLen == 0 )
+        treeWorker( &job ) ;
+    else
+    {
+        pthread_t *threads = (pthread_t *) malloc( nThreads * sizeof(pthread_t) ) ;
+        if ( threads == NULL )
+            exitError( "fileDigestTree: Out of Memory allocating the worker threads" ) ;
+
+        for ( unsigned w = 0 ; w < nThreads ; w++ )
+            if ( pthread_create( &threads[ w ] , NULL , treeWorker , &job ) != 0 )
+                exitError( "fileDigestTree: could not create a worker thread" ) ;
+        for ( unsigned w = 0 ; w < nThreads ; w++ )
+            pthread_join( threads[ w ] , NULL ) ;
+        free( threads ) ;
+    }
+    pthread_mutex_destroy( &job.lock ) ;
+
+    if ( mapped )
+        unmapInput( fd_in , &in ) ;
+    else
+        lseek( fd_in , t->start + t->fileLen , SEEK_SET ) ;
+
+    if ( job.failed )
+    {
+        treeDigest_free( t ) ;
+        return -2 ;
+    }
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+// Pipes, or a copy to 'fd_out' that has to come out in order: one chunk at a time
+
+static int treeHashStream( int fd_in , int fd_out , myTreeDigest_t *t )
+{
+    size_t    cap = 64 ;
+    ssize_t   n ;
+    uint8_t  *buf = (uint8_t *) malloc( TREE_CHUNK_LEN ) ;
+
+    EVP_MD_CTX *md = EVP_MD_CTX_create() ;
+    t->leaves = malloc( cap * SHA256_DIGEST_LENGTH ) ;
+    if ( buf == NULL || md == NULL || t->leaves == NULL )
+        exitError( "fileDigestTree: Out of Memory allocating buffers" ) ;
+
+    off_t start = lseek( fd_in , 0 , SEEK_CUR ) ;
+    t->start   = start < 0 ? 0 : start ;
+    t->fileLen = 0 ;
+    t->nLeaves = 0 ;
+
+    do
+    {
+        if ( ( n = readFull( fd_in , buf , TREE_CHUNK_LEN ) ) < 0 )
+        {
+            EVP_MD_CTX_destroy( md ) ;
+            free( buf ) ;
+            treeDigest_free( t ) ;
+            return -1 ;
+        }
+
+        // Only an empty stream may end with an empty leaf
+        if ( n == 0 && t->nLeaves > 0 )
+            break ;
+
+        if ( t->nLeaves == cap )
+        {
+            cap *= 2 ;
+            t->leaves = realloc( t->leaves , cap * SHA256_DIGEST_LENGTH ) ;
+            if ( t->leaves == NULL )
+                exitError( "fileDigestTree: Out of Memory growing the leaves" ) ;
+        }
+        treeLeaf( md , buf , n , t->leaves[ t->nLeaves++ ] ) ;
+        t->fileLen += n ;
+
+        if ( fd_out > 0 && writeFull( fd_out , buf , n ) != n )
+            handleErrors( "fileDigest: failed to write to fd_out" ) ;
+    } while ( n == TREE_CHUNK_LEN ) ;
+
+    EVP_MD_CTX_destroy( md ) ;
+    free( buf ) ;
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+int fileDigestTree( int fd_in , int fd_out , unsigned nThreads , myTreeDigest_t *t )
+{
+    if ( t == NULL )
+    {
+        fprintf( stderr , "fileDigestTree: NULL tree\n" ) ;
+        exit( -1 ) ;
+    }
+    memset( t , 0 , sizeof(myTreeDigest_t) ) ;
+
+    int status = fd_out > 0 ? -1 : treeHashParallel( fd_in , nThreads , t ) ;
+    if ( status == -1 )
+        status = treeHashStream( fd_in , fd_out , t ) ;
+    if ( status != 0 )
+        return -1 ;
+
+    treeFold( t ) ;
+    return 0 ;
+}
+
+void treeDigest_free( myTreeDigest_t *t )
+{
+    if ( t == NULL )
+        return ;
+    free( t->leaves ) ;
+    t->leaves  = NULL ;
+    t->nLeaves = 0 ;
+}
+
+//-----------------------------------------------------------------------------
+int treeDigest_verifyChunk( int fd , const myTreeDigest_t *t , size_t i )
+{
+    uint8_t   leaf[ SHA256_DIGEST_LENGTH ] ;
+
+    if ( t == NULL || i >= t->nLeaves )
+        return -1 ;
+
+    uint64_t  off = (uint64_t) i * TREE_CHUNK_LEN ;
+    size_t    n   = t->fileLen - off < TREE_CHUNK_LEN ? t->fileLen - off : TREE_CHUNK_LEN ;
+    uint8_t  *buf = (uint8_t *) malloc( n ? n : 1 ) ;
+    if ( buf == NULL )
+        exitError( "treeDigest_verifyChunk: Out of Memory allocating a chunk buffer" ) ;
+
+    // A file that shrank into this chunk has changed it
+    ssize_t got = preadFull( fd , buf , n , t->start + off ) ;
+    if ( got < 0 )
+    {
+        free( buf ) ;
+        return -1 ;
+    }
+
+    EVP_MD_CTX *md = EVP_MD_CTX_create() ;
+    if ( md == NULL )
+        handleErrors( "treeDigest_verifyChunk: failed to create CTX" ) ;
+    treeLeaf( md , buf , got , leaf ) ;
+    EVP_MD_CTX_destroy( md ) ;
+    free( buf ) ;
+
+    return memcmp( leaf , t->leaves[ i ] , SHA256_DIGEST_LENGTH ) == 0 ;
+}
+
+//-----------------------------------------------------------------------------
+static long fileDigestTreeRoot( int fd_in , int fd_out , uint8_t *digest )
+{
+    myTreeDigest_t  t ;
+
+    if ( fileDigestTree( fd_in , fd_out , 0 , &t ) != 0 )
+        handleErrors( "fileDigest: failed to read fd_in" ) ;
+
+    memcpy( digest , t.root , SHA256_DIGEST_LENGTH ) ;
+    treeDigest_free( &t ) ;
+
+    return SHA256_DIGEST_LENGTH ;
+}
+
+//***********************************************************************
+// Batch Digests
+//***********************************************************************
+
+typedef struct {
+            myDigestJob_t    *jobs ;
+            size_t            nJobs , next ;
+            pthread_mutex_t   lock ;
+        }  digestBatch_t ;
+
+//-----------------------------------------------------------------------------
+// Hash the rest of 'fd' with the worker's context 'md'. A regular file bigger
+// than the worker's buffer is hashed from a mapping ( unless the stream engine
+// was chosen ); anything else is read into 'buf'. The offset is left at the end
+// Returns 0, or -1 on a read error
+
+static int digestOne( int fd , EVP_MD_CTX *md , const EVP_MD *sha , uint8_t *buf , 
+                      myDigestJob_t *job )
+{
+    struct stat  st ;
+    fileMap_t    m ;
+    ssize_t      n ;
+    uint64_t     left = UINT64_MAX ;
+
+    if ( EVP_DigestInit_ex( md , sha , NULL ) != 1 )
+        handleErrors( "fileDigestBatch: failed to DigestInit_ex" ) ;
+    job->bytes = 0 ;
+
+    if ( fstat( fd , &st ) == 0 && S_ISREG( st.st_mode ) )
+    {
+        off_t start = lseek( fd , 0 , SEEK_CUR ) ;
+        if ( start >= 0 )
+            left = st.st_size > start ? st.st_size - start : 0 ;
+
+        if ( left != UINT64_MAX && left > DIGEST_BATCH_BUF && mmapAllowed() 
+             && mapFile( fd , start , left , PROT_READ , &m ) == 0 )
+        {
+            madvise( m.base , m.mapLen , MADV_SEQUENTIAL ) ;
+            for ( size_t done = 0 ; done < m.len ; done += FILE_IO_SLICE )
+            {
+                size_t k = m.len - done < FILE_IO_SLICE ? m.len - done : FILE_IO_SLICE ;
+                if ( EVP_DigestUpdate( md , m.data + done , k ) != 1 )
+                    handleErrors( "fileDigestBatch: failed to DigestUpdate" ) ;
+            }
+            job->bytes = m.len ;
+            unmapInput( fd , &m ) ;
+            left = 0 ;
+        }
+    }
+
+    // A regular file stops once its known size has been read, which saves
+    // the trailing read() that only returns 0 on every small file
+    while ( left > 0 && ( n = read( fd , buf , DIGEST_BATCH_BUF ) ) != 0 )
+    {
+        if ( n < 0 )
+            return -1 ;
+        if ( EVP_DigestUpdate( md , buf , n ) != 1 )
+            handleErrors( "fileDigestBatch: failed to DigestUpdate" ) ;
+        job->bytes += n ;
+        if ( left != UINT64_MAX )
+            left = (uint64_t) n < left ? left - n : 0 ;
+    }
+
+    if ( EVP_DigestFinal_ex( md , job->digest , &job->digestLen ) != 1 )
+        handleErrors( "fileDigestBatch: failed to DigestFinal_ex" ) ;
+    return 0 ;
+}
+
+// digestOne() by way of the digest cache, if one is open ( see Digest Cache below )
+static int digestCached( int fd , EVP_MD_CTX *md , const EVP_MD *sha , uint8_t *buf , 
+                         myDigestJob_t *job ) ;
+
+//-----------------------------------------------------------------------------
+// Workers claim DIGEST_BATCH_CLAIM jobs at a time, so the lock is taken
+// once per claim rather than once per file
+
+static void *digestWorker( void *arg )
+{
+    digestBatch_t  *batch = (digestBatch_t *) arg ;
+    uint8_t        *buf   = (uint8_t *) malloc( DIGEST_BATCH_BUF ) ;
+    EVP_MD         *sha   = EVP_MD_fetch( NULL , "SHA256" , NULL ) ;
+    EVP_MD_CTX     *md    = EVP_MD_CTX_new() ;
+
+    if ( buf == NULL || sha == NULL || md == NULL )
+        exitError( "digestWorker: Out of Memory allocating a worker" ) ;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock( &batch->lock ) ;
+        size_t first = batch->next ;
+        batch->next += DIGEST_BATCH_CLAIM ;
+        pthread_mutex_unlock( &batch->lock ) ;
+        if ( first >= batch->nJobs )
+            break ;
+
+        size_t last = first + DIGEST_BATCH_CLAIM < batch->nJobs ? first + DIGEST_BATCH_CLAIM : batch->nJobs ;
+        for ( size_t i = first ; i < last ; i++ )
+        {
+            myDigestJob_t *job = &batch->jobs[ i ] ;
+            int            fd  = job->fd ;
+
+            job->digestLen = 0 ;
+            job->bytes     = 0 ;
+            if ( fd < 0 && job->path != NULL )
+                fd = open( job->path , O_RDONLY | O_CLOEXEC ) ;
+            if ( fd < 0 )
+                continue ;
+
+            if ( digestCached( fd , md , sha , buf , job ) != 0 )
+                job->digestLen = 0 ;
+
+            if ( job->fd < 0 )
+                close( fd ) ;
+        }
+    }
+
+    EVP_MD_CTX_free( md ) ;
+    EVP_MD_free( sha ) ;
+    free( buf ) ;
+    return NULL ;
+}
+
+//-----------------------------------------------------------------------------
+size_t fileDigestBatch( myDigestJob_t *jobs , size_t nJobs , unsigned nThreads , myDigestStats_t *stats )
+{
+    digestBatch_t    batch ;
+    struct timespec  t0 , t1 ;
+    size_t           failed = 0 ;
+    uint64_t         bytes = 0 ;
+
+    if ( jobs == NULL && nJobs > 0 )
+    {
+        fprintf( stderr , "fileDigestBatch: NULL jobs\n" ) ;
+        exit( -1 ) ;
+    }
+
+    clock_gettime( CLOCK_MONOTONIC , &t0 ) ;
+
+    if ( nThreads == 0 )
+    {
+        long n = sysconf( _SC_NPROCESSORS_ONLN ) ;
+        nThreads = n > 0 ? n : 1 ;
+    }
+    size_t claims = ( nJobs + DIGEST_BATCH_CLAIM - 1 ) / DIGEST_BATCH_CLAIM ;
+    if ( nThreads > claims )
+        nThreads = claims ? claims : 1 ;
+
+    batch.jobs  = jobs ;
+    batch.nJobs = nJobs ;
+    batch.next  = 0 ;
+    pthread_mutex_init( &batch.lock , NULL ) ;
+
+    // The calling thread is one of the workers
+    pthread_t *threads = (pthread_t *) malloc( nThreads * sizeof(pthread_t) ) ;
+    if ( threads == NULL )
+        exitError( "fileDigestBatch: Out of Memory allocating the worker threads" ) ;
+    for ( unsigned w = 1 ; w < nThreads ; w++ )
+        if ( pthread_create( &threads[ w ] , NULL , digestWorker , &batch ) != 0 )
+            exitError( "fileDigestBatch: could not create a worker thread" ) ;
+    digestWorker( &batch ) ;
+    for ( unsigned w = 1 ; w < nThreads ; w++ )
+        pthread_join( threads[ w ] , NULL ) ;
+    free( threads ) ;
+    pthread_mutex_destroy( &batch.lock ) ;
+
+    clock_gettime( CLOCK_MONOTONIC , &t1 ) ;
+
+    for ( size_t i = 0 ; i < nJobs ; i++ )
+    {
+        if ( jobs[ i ].digestLen == 0 )
+            failed++ ;
+        bytes += jobs[ i ].bytes ;
+    }
+
+    if ( stats != NULL )
+    {
+        stats->files     = nJobs ;
+        stats->failed    = failed ;
+        stats->bytes     = bytes ;
+        stats->elapsedNs = ( t1.tv_sec - t0.tv_sec ) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec ;
+
+        double secs = stats->elapsedNs ? stats->elapsedNs / 1e9 : 1e-9 ;
+        stats->filesPerSec = nJobs / secs ;
+        stats->mbPerSec    = bytes / 1e6 / secs ;
+    }
+
+    return failed ;
+}
+
+//***********************************************************************
+// Resumable Digests
+//***********************************************************************
+
+#include <limits.h>
+
+#define DIGEST_FEED_BUF   ( 1 << 20 )
+
+void digestState_init( myDigestState_t *s )
+{
+    if ( s == NULL )
+    {
+        fprintf( stderr , "digestState_init: NULL state\n" ) ;
+        exit( -1 ) ;
+    }
+    SHA256_Init( &s->sha ) ;
+    s->offset = 0 ;
+}
+
+//-----------------------------------------------------------------------------
+// SHA256_CTX as DIGEST_STATE_WORDS big-endian words, in declaration order
+
+static void digestState_words( const SHA256_CTX *c , uint32_t *w )
+{
+    unsigned k = 0 ;
+    for ( int i = 0 ; i < 8 ; i++ )            w[ k++ ] = c->h[ i ] ;
+    w[ k++ ] = c->Nl ;
+    w[ k++ ] = c->Nh ;
+    for ( int i = 0 ; i < SHA_LBLOCK ; i++ )   w[ k++ ] = c->data[ i ] ;
+    w[ k++ ] = c->num ;
+    w[ k++ ] = c->md_len ;
+}
+
+static void digestState_unwords( SHA256_CTX *c , const uint32_t *w )
+{
+    unsigned k = 0 ;
+    for ( int i = 0 ; i < 8 ; i++ )            c->h[ i ] = w[ k++ ] ;
+    c->Nl = w[ k++ ] ;
+    c->Nh = w[ k++ ] ;
+    for ( int i = 0 ; i < SHA_LBLOCK ; i++ )   c->data[ i ] = w[ k++ ] ;
+    c->num    = w[ k++ ] ;
+    c->md_len = w[ k++ ] ;
+}
+
+//-----------------------------------------------------------------------------
+int digestState_save( const myDigestState_t *s , const char *path )
+{
+    uint8_t   rec[ DIGEST_STATE_LEN ] , check[ SHA256_DIGEST_LENGTH ] ;
+    uint32_t  w[ DIGEST_STATE_WORDS ] , v ;
+    char      tmp[ PATH_MAX ] ;
+
+    if ( s == NULL || path == NULL )
+    {
+        fprintf( stderr , "digestState_save: NULL state or path\n" ) ;
+        exit( -1 ) ;
+    }
+
+    memcpy( rec , DIGEST_STATE_MAGIC , 4 ) ;
+    v = htonl( DIGEST_STATE_VERSION ) ;
+    memcpy( rec + 4 , &v , 4 ) ;
+    put64( rec + 8 , s->offset ) ;
+    digestState_words( &s->sha , w ) ;
+    for ( int i = 0 ; i < DIGEST_STATE_WORDS ; i++ )
+    {
+        v = htonl( w[ i ] ) ;
+        memcpy( rec + 16 + 4 * i , &v , 4 ) ;
+    }
+    SHA256( rec , DIGEST_STATE_LEN - 8 , check ) ;
+    memcpy( rec + DIGEST_STATE_LEN - 8 , check , 8 ) ;
+
+    // Readers see either the old checkpoint or the new one, never half of each
+    if ( snprintf( tmp , sizeof(tmp) , "%s.tmp" , path ) >= (int) sizeof(tmp) )
+        return -1 ;
+    int fd = open( tmp , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+    if ( fd < 0 )
+        return -1 ;
+    if ( writeFull( fd , rec , DIGEST_STATE_LEN ) != DIGEST_STATE_LEN || fsync( fd ) != 0 )
+    {
+        close( fd ) ;
+        unlink( tmp ) ;
+        return -1 ;
+    }
+    close( fd ) ;
+
+    return rename( tmp , path ) == 0 ? 0 : -1 ;
+}
+
+//-----------------------------------------------------------------------------
+int digestState_load( myDigestState_t *s , const char *path )
+{
+    uint8_t   rec[ DIGEST_STATE_LEN ] , check[ SHA256_DIGEST_LENGTH ] ;
+    uint32_t  w[ DIGEST_STATE_WORDS ] , v ;
+    myDigestState_t  t ;
+
+    if ( s == NULL || path == NULL )
+    {
+        fprintf( stderr , "digestState_load: NULL state or path\n" ) ;
+        exit( -1 ) ;
+    }
+
+    int fd = open( path , O_RDONLY ) ;
+    if ( fd < 0 )
+        return -1 ;
+    ssize_t n = readFull( fd , rec , DIGEST_STATE_LEN ) ;
+    close( fd ) ;
+    if ( n != DIGEST_STATE_LEN )
+        return -1 ;
+
+    SHA256( rec , DIGEST_STATE_LEN - 8 , check ) ;
+    memcpy( &v , rec + 4 , 4 ) ;
+    if ( memcmp( rec , DIGEST_STATE_MAGIC , 4 ) != 0 || ntohl( v ) != DIGEST_STATE_VERSION 
+         || memcmp( rec + DIGEST_STATE_LEN - 8 , check , 8 ) != 0 )
+        return -1 ;
+
+    for ( int i = 0 ; i < DIGEST_STATE_WORDS ; i++ )
+    {
+        memcpy( &v , rec + 16 + 4 * i , 4 ) ;
+        w[ i ] = ntohl( v ) ;
+    }
+    digestState_unwords( &t.sha , w ) ;
+    t.offset = get64( rec + 8 ) ;
+
+    // SHA-256 counts bits in Nh:Nl; it must agree with the recorded offset
+    uint64_t bits = ( (uint64_t) t.sha.Nh << 32 ) | t.sha.Nl ;
+    if ( bits / 8 != t.offset || t.sha.num >= SHA256_CBLOCK || t.sha.md_len != SHA256_DIGEST_LENGTH )
+        return -1 ;
+
+    *s = t ;
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+int64_t digestState_feed( myDigestState_t *s , int fd , const char *checkpoint , uint64_t every )
+{
+    uint8_t  *buf ;
+    uint64_t  fed = 0 , sinceSave = 0 ;
+    ssize_t   n ;
+    int       seekable = 1 ;
+
+    if ( s == NULL )
+    {
+        fprintf( stderr , "digestState_feed: NULL state\n" ) ;
+        exit( -1 ) ;
+    }
+    if ( every == 0 )
+        every = DIGEST_CHECKPOINT_EVERY ;
+
+    buf = (uint8_t *) malloc( DIGEST_FEED_BUF ) ;
+    if ( buf == NULL )
+        exitError( "digestState_feed: Out of Memory allocating a buffer" ) ;
+
+    for ( ;; )
+    {
+        n = seekable ? pread( fd , buf , DIGEST_FEED_BUF , s->offset ) : -1 ;
+        if ( n < 0 && seekable && errno == ESPIPE )
+            seekable = 0 ;
+        if ( ! seekable )
+            n = read( fd , buf , DIGEST_FEED_BUF ) ;
+        if ( n < 0 )
+        {
+            free( buf ) ;
+            return -1 ;
+        }
+        if ( n == 0 )
+            break ;
+
+        SHA256_Update( &s->sha , buf , n ) ;
+        s->offset += n ;
+        fed       += n ;
+        sinceSave += n ;
+
+        if ( checkpoint != NULL && sinceSave >= every )
+        {
+            if ( digestState_save( s , checkpoint ) != 0 )
+            {
+                free( buf ) ;
+                return -1 ;
+            }
+            sinceSave = 0 ;
+        }
+    }
+    free( buf ) ;
+
+    if ( checkpoint != NULL && digestState_save( s , checkpoint ) != 0 )
+        return -1 ;
+    return fed ;
+}
+
+//-----------------------------------------------------------------------------
+unsigned digestState_digest( const myDigestState_t *s , uint8_t *digest )
+{
+    SHA256_CTX  c = s->sha ;
+
+    SHA256_Final( digest , &c ) ;
+    OPENSSL_cleanse( &c , sizeof(c) ) ;
+    return SHA256_DIGEST_LENGTH ;
+}
+
+//-----------------------------------------------------------------------------
+size_t fileDigestResume( int fd_in , const char *checkpoint , uint8_t *digest )
+{
+    myDigestState_t  s ;
+
+    if ( checkpoint == NULL || digestState_load( &s , checkpoint ) != 0 )
+        digestState_init( &s ) ;
+
+    if ( digestState_feed( &s , fd_in , checkpoint , 0 ) < 0 )
+        return 0 ;
+
+    return digestState_digest( &s , digest ) ;
+}
+
+//***********************************************************************
+// Digest Cache
+//***********************************************************************
+
+#include <sys/file.h>
+
+typedef struct {
+            char       magic[ 4 ] ;
+            uint32_t   version ;
+            uint64_t   nSlots ;
+            uint64_t   hits , misses , stores ;   // lifetime counters, updated atomically
+            uint8_t    pad[ 24 ] ;
+        }  digestCacheHeader_t ;
+
+// 'seq' is odd while a writer is rewriting the slot
+typedef struct {
+            uint32_t   seq , used ;
+            uint64_t   dev , ino , size ;
+            int64_t    mtimeNs , ctimeNs ;
+            uint8_t    digest[ SHA256_DIGEST_LENGTH ] ;
+        }  digestCacheSlot_t ;
+
+static struct {
+            int                   fd ;
+            size_t                mapLen ;
+            digestCacheHeader_t  *hdr ;       // NULL while no cache is open
+            digestCacheSlot_t    *slots ;
+            uint64_t              mask ;
+            pthread_mutex_t       lock ;      // flock() does not exclude threads sharing 'fd'
+            myDigestCacheStats_t  mine ;
+        }  digestCache = { .fd = -1 , .lock = PTHREAD_MUTEX_INITIALIZER } ;
+
+//-----------------------------------------------------------------------------
+int digestCache_open( const char *path , size_t nSlots )
+{
+    struct stat  st ;
+    size_t       n = 1 ;
+
+    if ( path == NULL )
+    {
+        fprintf( stderr , "digestCache_open: NULL path\n" ) ;
+        exit( -1 ) ;
+    }
+    digestCache_close() ;
+
+    while ( n < ( nSlots ? nSlots : DIGEST_CACHE_SLOTS ) )
+        n <<= 1 ;
+
+    int fd = open( path , O_RDWR | O_CREAT | O_CLOEXEC , 0600 ) ;
+    if ( fd < 0 )
+        return -1 ;
+
+    // Whoever finds the file empty lays it out, under the lock
+    flock( fd , LOCK_EX ) ;
+    if ( fstat( fd , &st ) != 0 )
+        goto fail ;
+    if ( st.st_size == 0 )
+    {
+        digestCacheHeader_t  h ;
+
+        memset( &h , 0 , sizeof(h) ) ;
+        memcpy( h.magic , DIGEST_CACHE_MAGIC , 4 ) ;
+        h.version = DIGEST_CACHE_VERSION ;
+        h.nSlots  = n ;
+        if ( ftruncate( fd , sizeof(h) + n * sizeof(digestCacheSlot_t) ) != 0
+             || pwrite( fd , &h , sizeof(h) , 0 ) != sizeof(h) )
+            goto fail ;
+        st.st_size = sizeof(h) + n * sizeof(digestCacheSlot_t) ;
+    }
+    else
+    {
+        digestCacheHeader_t  h ;
+
+        if ( pread( fd , &h , sizeof(h) , 0 ) != sizeof(h) 
+             || memcmp( h.magic , DIGEST_CACHE_MAGIC , 4 ) != 0 || h.version != DIGEST_CACHE_VERSION
+             || h.nSlots == 0 || ( h.nSlots & ( h.nSlots - 1 ) ) != 0
+             || (uint64_t) st.st_size != sizeof(h) + h.nSlots * sizeof(digestCacheSlot_t) )
+            goto fail ;
+        n = h.nSlots ;
+    }
+    flock( fd , LOCK_UN ) ;
+
+    void *map = mmap( NULL , st.st_size , PROT_READ | PROT_WRITE , MAP_SHARED , fd , 0 ) ;
+    if ( map == MAP_FAILED )
+    {
+        close( fd ) ;
+        return -1 ;
+    }
+
+    digestCache.fd     = fd ;
+    digestCache.mapLen = st.st_size ;
+    digestCache.hdr    = (digestCacheHeader_t *) map ;
+    digestCache.slots  = (digestCacheSlot_t *) ( digestCache.hdr + 1 ) ;
+    digestCache.mask   = n - 1 ;
+    memset( &digestCache.mine , 0 , sizeof(digestCache.mine) ) ;
+    return 0 ;
+
+fail:
+    flock( fd , LOCK_UN ) ;
+    close( fd ) ;
+    return -1 ;
+}
+
+void digestCache_close( void )
+{
+    if ( digestCache.hdr == NULL )
+        return ;
+
+    munmap( digestCache.hdr , digestCache.mapLen ) ;
+    close( digestCache.fd ) ;
+    digestCache.hdr = NULL ;
+    digestCache.fd  = -1 ;
+}
+
+void digestCache_stats( myDigestCacheStats_t *mine , myDigestCacheStats_t *all )
+{
+    if ( mine != NULL )
+    {
+        mine->hits   = __atomic_load_n( &digestCache.mine.hits   , __ATOMIC_RELAXED ) ;
+        mine->misses = __atomic_load_n( &digestCache.mine.misses , __ATOMIC_RELAXED ) ;
+        mine->stores = __atomic_load_n( &digestCache.mine.stores , __ATOMIC_RELAXED ) ;
+    }
+    if ( all != NULL )
+    {
+        memset( all , 0 , sizeof(myDigestCacheStats_t) ) ;
+        if ( digestCache.hdr != NULL )
+        {
+            all->hits   = __atomic_load_n( &digestCache.hdr->hits   , __ATOMIC_RELAXED ) ;
+            all->misses = __atomic_load_n( &digestCache.hdr->misses , __ATOMIC_RELAXED ) ;
+            all->stores = __atomic_load_n( &digestCache.hdr->stores , __ATOMIC_RELAXED ) ;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+static void digestCache_count( uint64_t *mine , uint64_t *all )
+{
+    __atomic_fetch_add( mine , 1 , __ATOMIC_RELAXED ) ;
+    __atomic_fetch_add( all  , 1 , __ATOMIC_RELAXED ) ;
+}
+
+static uint64_t digestCache_home( const struct stat *st )
+{
+    uint64_t h = ( (uint64_t) st->st_ino * 0x9E3779B97F4A7C15ULL ) ^ ( (uint64_t) st->st_dev * 0xC2B2AE3D27D4EB4FULL ) ;
+    return ( h ^ ( h >> 29 ) ) & digestCache.mask ;
+}
+
+static int64_t mtimeNs( const struct stat *st )
+{
+    return (int64_t) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec ;
+}
+
+// utimensat() can put an old mtime back on new contents, but it cannot do
+// that to the ctime, so the ctime has to match as well
+static int64_t ctimeNs( const struct stat *st )
+{
+    return (int64_t) st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec ;
+}
+
+// A consistent copy of one slot: retry while a writer is in the middle of it
+// A writer that died mid-update leaves 'seq' odd for good, so give up after
+// a while and report the slot as empty
+#define DIGEST_CACHE_SPINS   ( 1 << 16 )
+
+static void digestCache_read( const digestCacheSlot_t *slot , digestCacheSlot_t *copy )
+{
+    uint32_t before , after ;
+
+    for ( unsigned spins = 0 ; spins < DIGEST_CACHE_SPINS ; spins++ )
+    {
+        before = __atomic_load_n( &slot->seq , __ATOMIC_ACQUIRE ) ;
+        if ( before & 1 )
+            continue ;
+        memcpy( copy , slot , sizeof(digestCacheSlot_t) ) ;
+        __atomic_thread_fence( __ATOMIC_ACQUIRE ) ;
+        after = __atomic_load_n( &slot->seq , __ATOMIC_RELAXED ) ;
+        if ( before == after )
+            return ;
+    }
+    copy->used = 0 ;
+}
+
+// Returns 1 and fills 'digest' on a hit
+static int digestCache_lookup( const struct stat *st , uint8_t *digest )
+{
+    uint64_t           home = digestCache_home( st ) ;
+    digestCacheSlot_t  s ;
+
+    for ( unsigned p = 0 ; p < DIGEST_CACHE_PROBE ; p++ )
+    {
+        digestCache_read( &digestCache.slots[ ( home + p ) & digestCache.mask ] , &s ) ;
+        if ( ! s.used )
+            break ;
+        if ( s.dev != (uint64_t) st->st_dev || s.ino != (uint64_t) st->st_ino )
+            continue ;
+
+        if ( s.size == (uint64_t) st->st_size && s.mtimeNs == mtimeNs( st ) && s.ctimeNs == ctimeNs( st ) )
+        {
+            memcpy( digest , s.digest , SHA256_DIGEST_LENGTH ) ;
+            digestCache_count( &digestCache.mine.hits , &digestCache.hdr->hits ) ;
+            return 1 ;
+        }
+        break ;
+    }
+
+    digestCache_count( &digestCache.mine.misses , &digestCache.hdr->misses ) ;
+    return 0 ;
+}
+
+// Record the digest in this file's slot, a free one, or else its home slot
+static void digestCache_store( const struct stat *st , const uint8_t *digest )
+{
+    struct timespec  now ;
+    uint64_t         home = digestCache_home( st ) ;
+
+    clock_gettime( CLOCK_REALTIME , &now ) ;
+    int64_t nowNs = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec ;
+    if ( nowNs - mtimeNs( st ) < DIGEST_CACHE_RACY_NS || nowNs - ctimeNs( st ) < DIGEST_CACHE_RACY_NS )
+        return ;
+
+    pthread_mutex_lock( &digestCache.lock ) ;
+    flock( digestCache.fd , LOCK_EX ) ;
+
+    digestCacheSlot_t *slot = &digestCache.slots[ home ] ;
+    for ( unsigned p = 0 ; p < DIGEST_CACHE_PROBE ; p++ )
+    {
+        digestCacheSlot_t *s = &digestCache.slots[ ( home + p ) & digestCache.mask ] ;
+        if ( ! s->used || ( s->dev == (uint64_t) st->st_dev && s->ino == (uint64_t) st->st_ino ) )
+        {
+            slot = s ;
+            break ;
+        }
+    }
+
+    uint32_t seq = slot->seq ;
+    __atomic_store_n( &slot->seq , seq + 1 , __ATOMIC_RELAXED ) ;
+    __atomic_thread_fence( __ATOMIC_RELEASE ) ;
+    slot->dev     = st->st_dev ;
+    slot->ino     = st->st_ino ;
+    slot->size    = st->st_size ;
+    slot->mtimeNs = mtimeNs( st ) ;
+    slot->ctimeNs = ctimeNs( st ) ;
+    memcpy( slot->digest , digest , SHA256_DIGEST_LENGTH ) ;
+    slot->used    = 1 ;
+    __atomic_store_n( &slot->seq , seq + 2 , __ATOMIC_RELEASE ) ;
+
+    flock( digestCache.fd , LOCK_UN ) ;
+    pthread_mutex_unlock( &digestCache.lock ) ;
+
+    digestCache_count( &digestCache.mine.stores , &digestCache.hdr->stores ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Only a whole regular file is cached, and only if it did not change while
+// it was being hashed
+
+static int digestCached( int fd , EVP_MD_CTX *md , const EVP_MD *sha , uint8_t *buf , 
+                         myDigestJob_t *job )
+{
+    struct stat  before , after ;
+
+    if ( digestCache.hdr == NULL || fstat( fd , &before ) != 0 || ! S_ISREG( before.st_mode )
+         || lseek( fd , 0 , SEEK_CUR ) != 0 )
+        return digestOne( fd , md , sha , buf , job ) ;
+
+    if ( digestCache_lookup( &before , job->digest ) )
+    {
+        job->digestLen = SHA256_DIGEST_LENGTH ;
+        job->bytes     = 0 ;
+        lseek( fd , before.st_size , SEEK_SET ) ;
+        return 0 ;
+    }
+
+    if ( digestOne( fd , md , sha , buf , job ) != 0 )
+        return -1 ;
+
+    if ( fstat( fd , &after ) == 0 && after.st_size == before.st_size 
+         && mtimeNs( &after ) == mtimeNs( &before ) && ctimeNs( &after ) == ctimeNs( &before )
+         && job->bytes == (uint64_t) before.st_size )
+        digestCache_store( &before , job->digest ) ;
+    return 0 ;
+}
+
+static long fileDigestCached( int fd_in , uint8_t *digest )
+{
+    myDigestJob_t  job ;
+
+    if ( digestCache.hdr == NULL )
+        return -1 ;
+
+    uint8_t    *buf = (uint8_t *) malloc( DIGEST_BATCH_BUF ) ;
+    EVP_MD_CTX *md  = EVP_MD_CTX_new() ;
+    if ( buf == NULL || md == NULL )
+        exitError( "fileDigest: Out of Memory allocating a buffer" ) ;
+
+    memset( &job , 0 , sizeof(job) ) ;
+    if ( digestCached( fd_in , md , EVP_sha256() , buf , &job ) != 0 )
+        handleErrors( "fileDigest: failed to read fd_in" ) ;
+    memcpy( digest , job.digest , job.digestLen ) ;
+
+    EVP_MD_CTX_free( md ) ;
+    free( buf ) ;
+    return job.digestLen ;
+}
+
+//***********************************************************************
+// RSA Key Cache
+//***********************************************************************
+
+typedef struct {
+            char      *path ;         // NULL for a free slot
+            int        public ;
+            dev_t      dev ;
+            ino_t      ino ;
+            off_t      size ;
+            int64_t    mtimeNs , ctimeNs ;
+            RSA       *rsa ;          // the cache's own reference
+        }  rsaCacheEntry_t ;
+
+static rsaCacheEntry_t   rsaCache[ RSA_CACHE_SLOTS ] ;
+static unsigned          rsaCacheNext = 0 ;
+static int               rsaDerSidecar = 0 ;
+static pthread_mutex_t   rsaCacheLock = PTHREAD_MUTEX_INITIALIZER ;
+
+void setRSAderSidecar( int on )
+{
+    rsaDerSidecar = on ;
+}
+
+//-----------------------------------------------------------------------------
+// A sidecar is "MYRD" , version ( 4 bytes ) , then the dev , inode , size ,
+// mtime and ctime ( ns ) of the PEM file it was made from ( 8 bytes each ) ,
+// then the DER. It is used only while the PEM file has exactly that identity:
+// a PEM file restored with cp -p , tar or rsync -t can carry an old mtime,
+// but it always gets a new ctime
+#define RSA_SIDECAR_MAGIC     "MYRD"
+#define RSA_SIDECAR_VERSION   1
+#define RSA_SIDECAR_HDR       ( 8 + 5 * 8 )
+
+static void     put32( uint8_t *p , uint32_t v ) ;
+
+static void rsaSidecarHeader( uint8_t *h , const struct stat *pem )
+{
+    memcpy( h , RSA_SIDECAR_MAGIC , 4 ) ;
+    put32( h +  4 , RSA_SIDECAR_VERSION ) ;
+    put64( h +  8 , pem->st_dev ) ;
+    put64( h + 16 , pem->st_ino ) ;
+    put64( h + 24 , pem->st_size ) ;
+    put64( h + 32 , mtimeNs( pem ) ) ;
+    put64( h + 40 , ctimeNs( pem ) ) ;
+}
+
+// 'hdr' ( 'hdrLen' bytes , may be 0 ) followed by 'rsa' in DER, written
+// beside 'derPath' and renamed over it
+static int writeRSAder( RSA *rsa , int public , const char *derPath , const uint8_t *hdr , size_t hdrLen )
+{
+    uint8_t  *der = NULL ;
+    char      tmp[ PATH_MAX ] ;
+
+    int len = public ? i2d_RSA_PUBKEY( rsa , &der ) : i2d_RSAPrivateKey( rsa , &der ) ;
+    if ( len <= 0 )
+        return -1 ;
+
+    if ( snprintf( tmp , sizeof(tmp) , "%s.tmp" , derPath ) >= (int) sizeof(tmp) )
+    {
+        OPENSSL_clear_free( der , len ) ;
+        return -1 ;
+    }
+
+    int fd = open( tmp , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+    int ok = fd >= 0 && writeFull( fd , hdr , hdrLen ) == (ssize_t) hdrLen 
+                     && writeFull( fd , der , len ) == len ;
+    if ( fd >= 0 )
+        close( fd ) ;
+    OPENSSL_clear_free( der , len ) ;
+
+    if ( ! ok || rename( tmp , derPath ) != 0 )
+    {
+        unlink( tmp ) ;
+        return -1 ;
+    }
+    return 0 ;
+}
+
+int saveRSAasDER( RSA *rsa , int public , const char *derPath )
+{
+    if ( rsa == NULL || derPath == NULL )
+    {
+        fprintf( stderr , "saveRSAasDER: NULL key or path\n" ) ;
+        exit( -1 ) ;
+    }
+    return writeRSAder( rsa , public , derPath , NULL , 0 ) ;
+}
+
+//-----------------------------------------------------------------------------
+// The public key in the DER sidecar 'derPath', if it was made from the PEM
+// file as it is now ( 'pem' )
+
+static RSA *loadRSAsidecar( const char *derPath , const struct stat *pem )
+{
+    struct stat  st ;
+    uint8_t     *buf , expect[ RSA_SIDECAR_HDR ] ;
+    RSA         *rsa = NULL ;
+
+    int fd = open( derPath , O_RDONLY ) ;
+    if ( fd < 0 )
+        return NULL ;
+    if ( fstat( fd , &st ) != 0 || st.st_size <= RSA_SIDECAR_HDR || st.st_size > ( 1 << 20 ) )
+    {
+        close( fd ) ;
+        return NULL ;
+    }
+
+    rsaSidecarHeader( expect , pem ) ;
+    buf = (uint8_t *) malloc( st.st_size ) ;
+    if ( buf != NULL && readFull( fd , buf , st.st_size ) == st.st_size 
+         && memcmp( buf , expect , RSA_SIDECAR_HDR ) == 0 )
+    {
+        const uint8_t *p = buf + RSA_SIDECAR_HDR ;
+        rsa = d2i_RSA_PUBKEY( NULL , &p , st.st_size - RSA_SIDECAR_HDR ) ;
+    }
+    close( fd ) ;
+    free( buf ) ;
+    return rsa ;
+}
+
+// Only public keys get a sidecar: a private key's DER would be stored
+// unencrypted even when its PEM file is protected by a passphrase
+static RSA *loadRSA( const char *filename , int public , const struct stat *pem )
+{
+    char  derPath[ PATH_MAX ] ;
+    RSA  *rsa ;
+
+    uint8_t  hdr[ RSA_SIDECAR_HDR ] ;
+
+    int sidecar = rsaDerSidecar && public
+                  && snprintf( derPath , sizeof(derPath) , "%s.der" , filename ) < (int) sizeof(derPath) ;
+
+    if ( sidecar && ( rsa = loadRSAsidecar( derPath , pem ) ) != NULL )
+        return rsa ;
+
+    rsa = parseRSAfile( (char *) filename , public ) ;
+    if ( rsa != NULL && sidecar )
+    {
+        rsaSidecarHeader( hdr , pem ) ;
+        writeRSAder( rsa , public , derPath , hdr , sizeof(hdr) ) ;
+    }
+    return rsa ;
+}
+
+//-----------------------------------------------------------------------------
+// The parse happens outside the lock, so one slow key file does not hold up
+// lookups of the others; if two threads miss together, the first one in wins
+
+RSA *rsaCache_get( const char *filename , int public )
+{
+    struct stat  st ;
+    RSA         *rsa = NULL ;
+
+    if ( filename == NULL || stat( filename , &st ) != 0 )
+    {
+        fprintf( stderr , "getRSAfromFile: Unable to open RSA key file %s \n" , filename ? filename : "(null)" ) ;
+        return NULL ;
+    }
+
+    pthread_mutex_lock( &rsaCacheLock ) ;
+    for ( unsigned i = 0 ; i < RSA_CACHE_SLOTS && rsa == NULL ; i++ )
+    {
+        rsaCacheEntry_t *e = &rsaCache[ i ] ;
+        if ( e->path != NULL && e->public == public && e->dev == st.st_dev && e->ino == st.st_ino 
+             && e->size == st.st_size && e->mtimeNs == mtimeNs( &st ) && e->ctimeNs == ctimeNs( &st )
+             && strcmp( e->path , filename ) == 0 && RSA_up_ref( e->rsa ) == 1 )
+            rsa = e->rsa ;
+    }
+    pthread_mutex_unlock( &rsaCacheLock ) ;
+    if ( rsa != NULL )
+        return rsa ;
+
+    if ( ( rsa = loadRSA( filename , public , &st ) ) == NULL )
+        return NULL ;
+
+    pthread_mutex_lock( &rsaCacheLock ) ;
+
+    // Drop any older version of this key, then take a free or the oldest slot
+    rsaCacheEntry_t *slot = NULL ;
+    for ( unsigned i = 0 ; i < RSA_CACHE_SLOTS ; i++ )
+    {
+        rsaCacheEntry_t *e = &rsaCache[ i ] ;
+        if ( e->path != NULL && e->public == public && strcmp( e->path , filename ) == 0 )
+        {
+            free( e->path ) ;
+            RSA_free( e->rsa ) ;
+            e->path = NULL ;
+            e->rsa  = NULL ;
+        }
+        if ( e->path == NULL && slot == NULL )
+            slot = e ;
+    }
+    if ( slot == NULL )
+    {
+        slot = &rsaCache[ rsaCacheNext ] ;
+        rsaCacheNext = ( rsaCacheNext + 1 ) % RSA_CACHE_SLOTS ;
+        free( slot->path ) ;
+        RSA_free( slot->rsa ) ;
+    }
+
+    slot->path    = strdup( filename ) ;
+    slot->public  = public ;
+    slot->dev     = st.st_dev ;
+    slot->ino     = st.st_ino ;
+    slot->size    = st.st_size ;
+    slot->mtimeNs = mtimeNs( &st ) ;
+    slot->ctimeNs = ctimeNs( &st ) ;
+    slot->rsa     = rsa ;
+    if ( slot->path == NULL || RSA_up_ref( rsa ) != 1 )
+        exitError( "rsaCache_get: Out of Memory caching a key" ) ;
+
+    pthread_mutex_unlock( &rsaCacheLock ) ;
+    return rsa ;
+}
+
+//-----------------------------------------------------------------------------
+void rsaCache_flush( void )
+{
+    pthread_mutex_lock( &rsaCacheLock ) ;
+    for ( unsigned i = 0 ; i < RSA_CACHE_SLOTS ; i++ )
+    {
+        free( rsaCache[ i ].path ) ;
+        RSA_free( rsaCache[ i ].rsa ) ;
+        rsaCache[ i ].path = NULL ;
+        rsaCache[ i ].rsa  = NULL ;
+    }
+    rsaCacheNext = 0 ;
+    pthread_mutex_unlock( &rsaCacheLock ) ;
+}
+
+//***********************************************************************
+// Envelopes
+//***********************************************************************
+
+// What each recipient's RSA-OAEP block wraps, and the largest block accepted
+#define ENVELOPE_FILE_KEY_LEN   ( SYMMETRIC_KEY_LEN + INITVECTOR_LEN )
+#define ENVELOPE_WRAPPED_MAX    2048                // a 16384-bit modulus
+
+static void put32( uint8_t *p , uint32_t v )
+{
+    v = htonl( v ) ;
+    memcpy( p , &v , 4 ) ;
+}
+
+static uint32_t get32( const uint8_t *p )
+{
+    uint32_t v ;
+    memcpy( &v , p , 4 ) ;
+    return ntohl( v ) ;
+}
+
+// The key id: SHA-256 of the public half in DER, the same for a public key
+// and for the private key it belongs to
+static int envelopeKeyId( RSA *rsa , uint8_t *id )
+{
+    uint8_t *der = NULL ;
+    int      len = i2d_RSA_PUBKEY( rsa , &der ) ;
+
+    if ( len <= 0 )
+        return -1 ;
+    SHA256( der , len , id ) ;
+    OPENSSL_free( der ) ;
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+// Build a header for 'recipients' around the file key 'fk' into a malloc'ed
+// buffer at least 'minLen' bytes long. Returns its length, or -1
+
+static ssize_t envelopeHeader( RSA **recipients , unsigned n , const uint8_t *fk , 
+                               size_t minLen , uint8_t **header )
+{
+    size_t len = ENVELOPE_FIXED_LEN ;
+
+    if ( recipients == NULL || n == 0 || n > ENVELOPE_RECIPIENTS_MAX )
+        return -1 ;
+    for ( unsigned r = 0 ; r < n ; r++ )
+    {
+        if ( recipients[ r ] == NULL || RSA_size( recipients[ r ] ) > ENVELOPE_WRAPPED_MAX )
+            return -1 ;
+        len += SHA256_DIGEST_LENGTH + 4 + RSA_size( recipients[ r ] ) ;
+    }
+    len = ( len + ENVELOPE_HEADER_ALIGN - 1 ) / ENVELOPE_HEADER_ALIGN * ENVELOPE_HEADER_ALIGN ;
+    if ( len < minLen )
+        len = minLen ;
+
+    uint8_t *h = (uint8_t *) calloc( 1 , len ) ;
+    if ( h == NULL )
+        exitError( "envelopeHeader: Out of Memory allocating the header" ) ;
+
+    memcpy( h , ENVELOPE_MAGIC , 4 ) ;
+    put32( h + 4  , ENVELOPE_VERSION ) ;
+    put32( h + 8  , n ) ;
+    put32( h + 12 , len ) ;
+
+    uint8_t *p = h + ENVELOPE_FIXED_LEN ;
+    for ( unsigned r = 0 ; r < n ; r++ )
+    {
+        if ( envelopeKeyId( recipients[ r ] , p ) != 0 )
+            goto fail ;
+        p += SHA256_DIGEST_LENGTH ;
+
+        int wrapped = RSA_public_encrypt( ENVELOPE_FILE_KEY_LEN , fk , p + 4 , recipients[ r ] , 
+                                          RSA_PKCS1_OAEP_PADDING ) ;
+        if ( wrapped != RSA_size( recipients[ r ] ) )
+            goto fail ;
+        put32( p , wrapped ) ;
+        p += 4 + wrapped ;
+    }
+
+    *header = h ;
+    return len ;
+
+fail:
+    free( h ) ;
+    return -1 ;
+}
+
+//-----------------------------------------------------------------------------
+// Find 'privKey' among the recipients of 'header' and unwrap the file key
+// Returns 0, or -1
+
+static int envelopeOpen( const uint8_t *h , size_t len , RSA *privKey , uint8_t *fk )
+{
+    uint8_t  id[ SHA256_DIGEST_LENGTH ] , out[ ENVELOPE_WRAPPED_MAX ] ;
+    unsigned n = get32( h + 8 ) ;
+    size_t   at = ENVELOPE_FIXED_LEN ;
+
+    if ( privKey == NULL || envelopeKeyId( privKey , id ) != 0 )
+        return -1 ;
+
+    for ( unsigned r = 0 ; r < n ; r++ )
+    {
+        if ( at + SHA256_DIGEST_LENGTH + 4 > len )
+            return -1 ;
+        uint32_t wrapped = get32( h + at + SHA256_DIGEST_LENGTH ) ;
+        if ( wrapped > len - at - SHA256_DIGEST_LENGTH - 4 )
+            return -1 ;
+
+        if ( memcmp( h + at , id , SHA256_DIGEST_LENGTH ) == 0 )
+        {
+            if ( (int) wrapped != RSA_size( privKey ) || wrapped > sizeof(out) )
+                return -1 ;
+            int got = RSA_private_decrypt( wrapped , h + at + SHA256_DIGEST_LENGTH + 4 , out , 
+                                           privKey , RSA_PKCS1_OAEP_PADDING ) ;
+            if ( got != ENVELOPE_FILE_KEY_LEN )
+                return -1 ;
+            memcpy( fk , out , ENVELOPE_FILE_KEY_LEN ) ;
+            OPENSSL_cleanse( out , sizeof(out) ) ;
+            return 0 ;
+        }
+        at += SHA256_DIGEST_LENGTH + 4 + wrapped ;
+    }
+    return -1 ;
+}
+
+// Read and check a whole header from 'fd'. Returns its length, or -1
+static ssize_t envelopeRead( int fd , uint8_t **header )
+{
+    uint8_t  fixed[ ENVELOPE_FIXED_LEN ] ;
+
+    if ( readFull( fd , fixed , ENVELOPE_FIXED_LEN ) != ENVELOPE_FIXED_LEN 
+         || memcmp( fixed , ENVELOPE_MAGIC , 4 ) != 0 || get32( fixed + 4 ) != ENVELOPE_VERSION 
+         || get32( fixed + 8 ) == 0 || get32( fixed + 8 ) > ENVELOPE_RECIPIENTS_MAX )
+        return -1 ;
+
+    uint32_t len = get32( fixed + 12 ) ;
+    if ( len < ENVELOPE_FIXED_LEN || len > ENVELOPE_RECIPIENTS_MAX * ( SHA256_DIGEST_LENGTH + 4 + ENVELOPE_WRAPPED_MAX ) + ENVELOPE_HEADER_ALIGN )
+        return -1 ;
+
+    uint8_t *h = (uint8_t *) malloc( len ) ;
+    if ( h == NULL )
+        exitError( "envelopeRead: Out of Memory allocating the header" ) ;
+    memcpy( h , fixed , ENVELOPE_FIXED_LEN ) ;
+    if ( readFull( fd , h + ENVELOPE_FIXED_LEN , len - ENVELOPE_FIXED_LEN ) != len - ENVELOPE_FIXED_LEN )
+    {
+        free( h ) ;
+        return -1 ;
+    }
+
+    *header = h ;
+    return len ;
+}
+
+//-----------------------------------------------------------------------------
+ssize_t envelopeEncryptFile( int fd_in , int fd_out , RSA **recipients , unsigned nRecipients )
+{
+    uint8_t  fk[ ENVELOPE_FILE_KEY_LEN ] , *header ;
+
+    if ( RAND_bytes( fk , ENVELOPE_FILE_KEY_LEN ) != 1 )
+        handleErrors( "envelopeEncryptFile: RAND_bytes failed" ) ;
+
+    ssize_t hLen = envelopeHeader( recipients , nRecipients , fk , 0 , &header ) ;
+    if ( hLen < 0 )
+    {
+        OPENSSL_cleanse( fk , sizeof(fk) ) ;
+        return -1 ;
+    }
+    if ( writeFull( fd_out , header , hLen ) != hLen )
+        handleErrors( "envelopeEncryptFile: failed to write the header" ) ;
+    free( header ) ;
+
+    // One bulk pass, whatever the number of recipients
+    ssize_t body = encryptFile( fd_in , fd_out , fk , fk + SYMMETRIC_KEY_LEN ) ;
+    OPENSSL_cleanse( fk , sizeof(fk) ) ;
+
+    return hLen + body ;
+}
+
+//-----------------------------------------------------------------------------
+ssize_t envelopeDecryptFile( int fd_in , int fd_out , RSA *privKey )
+{
+    uint8_t  fk[ ENVELOPE_FILE_KEY_LEN ] , *header ;
+
+    ssize_t hLen = envelopeRead( fd_in , &header ) ;
+    if ( hLen < 0 )
+        return -1 ;
+    int status = envelopeOpen( header , hLen , privKey , fk ) ;
+    free( header ) ;
+    if ( status != 0 )
+        return -1 ;
+
+    ssize_t len = decryptFile( fd_in , fd_out , fk , fk + SYMMETRIC_KEY_LEN ) ;
+    OPENSSL_cleanse( fk , sizeof(fk) ) ;
+
+    return len ;
+}
+
+//-----------------------------------------------------------------------------
+// The journal of a rewrap is the new header followed by its SHA-256, in
+// "<path>.rewrap". It is on disk before the header is overwritten, so a
+// crash at any point leaves either the old header or a journal to replay
+
+#define ENVELOPE_JOURNAL_SUFFIX  ".rewrap"
+
+static int envelopeJournalPath( const char *path , char *journal )
+{
+    return snprintf( journal , PATH_MAX , "%s" ENVELOPE_JOURNAL_SUFFIX , path ) < PATH_MAX ? 0 : -1 ;
+}
+
+// Make the directory entry of 'path' durable
+static int fsyncParent( const char *path )
+{
+    char        dir[ PATH_MAX ] ;
+    const char *slash = strrchr( path , '/' ) ;
+
+    if ( slash == NULL )
+        strcpy( dir , "." ) ;
+    else if ( slash == path )
+        strcpy( dir , "/" ) ;
+    else if ( slash - path < PATH_MAX )
+    {
+        memcpy( dir , path , slash - path ) ;
+        dir[ slash - path ] = '\0' ;
+    }
+    else
+        return -1 ;
+
+    int fd = open( dir , O_RDONLY | O_DIRECTORY ) ;
+    if ( fd < 0 )
+        return -1 ;
+    int status = fsync( fd ) ;
+    close( fd ) ;
+    return status ;
+}
+
+//-----------------------------------------------------------------------------
+int envelopeRecover( const char *path )
+{
+    char         journal[ PATH_MAX ] ;
+    uint8_t      sum[ SHA256_DIGEST_LENGTH ] , *buf ;
+    struct stat  st ;
+
+    if ( envelopeJournalPath( path , journal ) != 0 )
+        return -1 ;
+    int jfd = open( journal , O_RDONLY ) ;
+    if ( jfd < 0 )
+        return errno == ENOENT ? 0 : -1 ;
+    if ( fstat( jfd , &st ) != 0 )
+    {
+        close( jfd ) ;
+        return -1 ;
+    }
+
+    // A journal cut short was never acted on: the header is still the old one
+    size_t hLen = st.st_size > SHA256_DIGEST_LENGTH ? st.st_size - SHA256_DIGEST_LENGTH : 0 ;
+    buf = (uint8_t *) malloc( st.st_size ? st.st_size : 1 ) ;
+    if ( buf == NULL )
+        exitError( "envelopeRecover: Out of Memory allocating the journal" ) ;
+    int complete = hLen >= ENVELOPE_FIXED_LEN 
+                   && readFull( jfd , buf , st.st_size ) == st.st_size
+                   && SHA256( buf , hLen , sum ) != NULL 
+                   && memcmp( sum , buf + hLen , SHA256_DIGEST_LENGTH ) == 0
+                   && get32( buf + 12 ) == hLen ;
+    close( jfd ) ;
+
+    int status = 0 ;
+    if ( complete )
+    {
+        int fd = open( path , O_WRONLY ) ;
+        status = fd >= 0 && pwrite( fd , buf , hLen , 0 ) == (ssize_t) hLen && fsync( fd ) == 0 ? 0 : -1 ;
+        if ( fd >= 0 )
+            close( fd ) ;
+    }
+    free( buf ) ;
+
+    if ( status == 0 )
+        unlink( journal ) ;
+    return status ;
+}
+
+//-----------------------------------------------------------------------------
+int envelopeRewrap( const char *path , RSA *privKey , RSA **recipients , unsigned nRecipients )
+{
+    uint8_t  fk[ ENVELOPE_FILE_KEY_LEN ] , *header , *fresh ;
+    char     journal[ PATH_MAX ] ;
+
+    if ( path == NULL || envelopeJournalPath( path , journal ) != 0 || envelopeRecover( path ) != 0 )
+        return -1 ;
+
+    int fd = open( path , O_RDWR ) ;
+    if ( fd < 0 )
+        return -1 ;
+    ssize_t hLen = envelopeRead( fd , &header ) ;
+    int status = hLen < 0 ? -1 : envelopeOpen( header , hLen , privKey , fk ) ;
+    if ( hLen >= 0 )
+        free( header ) ;
+    if ( status != 0 )
+    {
+        close( fd ) ;
+        return -1 ;
+    }
+
+    // Same file key, same header length: only the first hLen bytes change
+    // The new header grows by its SHA-256 to become the journal
+    ssize_t newLen = envelopeHeader( recipients , nRecipients , fk , hLen , &fresh ) ;
+    OPENSSL_cleanse( fk , sizeof(fk) ) ;
+    if ( newLen != hLen )
+    {
+        if ( newLen >= 0 )
+            free( fresh ) ;
+        close( fd ) ;
+        return -1 ;
+    }
+    fresh = (uint8_t *) realloc( fresh , hLen + SHA256_DIGEST_LENGTH ) ;
+    if ( fresh == NULL )
+        exitError( "envelopeRewrap: Out of Memory allocating the journal" ) ;
+    SHA256( fresh , hLen , fresh + hLen ) ;
+
+    int jfd = open( journal , O_WRONLY | O_CREAT | O_TRUNC , 0600 ) ;
+    status = jfd >= 0 && writeFull( jfd , fresh , hLen + SHA256_DIGEST_LENGTH ) == hLen + SHA256_DIGEST_LENGTH
+             && fsync( jfd ) == 0 && fsyncParent( journal ) == 0 ? 0 : -1 ;
+    if ( jfd >= 0 )
+        close( jfd ) ;
+
+    if ( status == 0 )
+        status = pwrite( fd , fresh , hLen , 0 ) == hLen && fsync( fd ) == 0 ? 0 : -1 ;
+    close( fd ) ;
+    free( fresh ) ;
+
+    // A journal left behind is replayed by the next envelopeRecover()
+    if ( status == 0 )
+        unlink( journal ) ;
+    return status ;
+}
+
+//***********************************************************************
+// Handshake Benchmark
+//***********************************************************************
+
+unsigned handshakesFromEnv( void )
+{
+    char *k = getenv( HANDSHAKES_ENV ) ;
+
+    if ( k == NULL )
+        return 0 ;
+
+    long n = strtol( k , NULL , 10 ) ;
+    return n > 0 ? (unsigned) n : 0 ;
+}
+
+//-----------------------------------------------------------------------------
+static int cmpLatency( const void *a , const void *b )
+{
+    uint64_t x = *(const uint64_t *) a , y = *(const uint64_t *) b ;
+
+    return ( x > y ) - ( x < y ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Nearest rank: the smallest sample with at least perMille / 1000 of all 
+// the samples at or below it
+
+static double percentileUs( const uint64_t *sorted , unsigned n , unsigned perMille )
+{
+    uint64_t rank = ( (uint64_t) n * perMille + 999 ) / 1000 ;
+
+    return sorted[ rank ? rank - 1 : 0 ] / 1e3 ;
+}
+
+//-----------------------------------------------------------------------------
+void latencyReport( FILE *out , const char *step , uint64_t *ns , unsigned n )
+{
+    if ( out == NULL || step == NULL || ns == NULL )
+    {
+        fprintf( stderr , "latencyReport: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    if ( n == 0 )
+        return ;
+
+    qsort( ns , n , sizeof( uint64_t ) , cmpLatency ) ;
+    fprintf( out , "    %-12s  p50 %10.1f us   p99 %10.1f us   p999 %10.1f us\n" , step ,
+             percentileUs( ns , n , 500 ) , percentileUs( ns , n , 990 ) , 
+             percentileUs( ns , n , 999 ) ) ;
+}
+
+//***********************************************************************
+// Latency Statistics
+//***********************************************************************
+
+#ifdef MYCRYPTO_STATS
+
+#include <signal.h>
+#include <stdarg.h>
+
+// One per thread, written only by its owner and never freed so that the
+// samples of threads that have exited are still dumped
+typedef struct statsThread {
+            uint64_t             count[ STAT_PROBES ] ;
+            uint64_t             ticks[ STAT_PROBES ] ;
+            uint64_t             hist [ STAT_PROBES ][ STAT_BUCKETS ] ;
+            struct statsThread  *next ;
+        }  statsThread_t ;
+
+static statsThread_t           *statsHead = NULL ;     // pushed with a CAS
+static __thread statsThread_t  *statsMine = NULL ;
+static uint64_t                 statsTick0 , statsNs0 ; // TSC calibration origin
+static int                      statsFd = -1 ;
+
+static const char *statsName[ STAT_PROBES ] = {
+            "encrypt" ,       "decrypt" ,
+            "MSG1_new" ,      "MSG1_receive" ,
+            "MSG2_new" ,      "MSG2_receive" ,
+            "MSG3_new" ,      "MSG3_receive" ,
+            "MSG4_new" ,      "MSG4_receive" ,
+            "MSG5_new" ,      "MSG5_receive" ,
+            "pipe read" ,     "pipe write"
+        } ;
+
+//-----------------------------------------------------------------------------
+static uint64_t statsMonoNs( void )
+{
+    struct timespec ts ;
+
+    clock_gettime( CLOCK_MONOTONIC , &ts ) ;
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec ;
+}
+
+//-----------------------------------------------------------------------------
+// First sample of this thread: link a fresh set of counters into the list
+
+static statsThread_t *statsRegister( void )
+{
+    statsThread_t *me = calloc( 1 , sizeof( statsThread_t ) ) ;
+    if ( me == NULL )
+        handleErrors( "stats_record: out of memory" ) ;
+
+    me->next = __atomic_load_n( &statsHead , __ATOMIC_RELAXED ) ;
+    while ( ! __atomic_compare_exchange_n( &statsHead , &me->next , me , 1 ,
+                                           __ATOMIC_RELEASE , __ATOMIC_RELAXED ) )
+        ;
+    statsMine = me ;
+    return me ;
+}
+
+//-----------------------------------------------------------------------------
+// Only the owner writes a counter: a plain add, published with a relaxed 
+// store so that a concurrent dump reads whole values
+
+static inline void statsBump( uint64_t *c , uint64_t v )
+{
+    __atomic_store_n( c , *c + v , __ATOMIC_RELAXED ) ;
+}
+
+void stats_record( statProbe_t probe , uint64_t ticks )
+{
+    statsThread_t *me = statsMine ;
+    if ( __builtin_expect( me == NULL , 0 ) )
+        me = statsRegister() ;
+
+    unsigned b = ticks ? 64 - __builtin_clzll( ticks ) : 0 ;
+    if ( b >= STAT_BUCKETS )
+        b = STAT_BUCKETS - 1 ;
+
+    statsBump( &me->count[ probe ] , 1 ) ;
+    statsBump( &me->ticks[ probe ] , ticks ) ;
+    statsBump( &me->hist [ probe ][ b ] , 1 ) ;
+}
+
+//-----------------------------------------------------------------------------
+ssize_t statRead( int fd , void *buf , size_t n )
+{
+    STAT_BEGIN( t ) ;
+    ssize_t got = read( fd , buf , n ) ;
+    STAT_END( STAT_PIPE_READ , t ) ;
+
+    return got ;
+}
+
+//-----------------------------------------------------------------------------
+ssize_t statWrite( int fd , const void *buf , size_t n )
+{
+    STAT_BEGIN( t ) ;
+    ssize_t put = write( fd , buf , n ) ;
+    STAT_END( STAT_PIPE_WRITE , t ) ;
+
+    return put ;
+}
+
+//-----------------------------------------------------------------------------
+// Ticks per microsecond since stats_install(), measured over at least 1 ms
+// Only clock_gettime() is used, so this is safe in a signal handler
+
+static uint64_t statsTicksPerUs( void )
+{
+    uint64_t ns ;
+
+    while ( ( ns = statsMonoNs() - statsNs0 ) < 1000000 )
+        ;
+    uint64_t perUs = ( stats_now() - statsTick0 ) * 1000 / ns ;
+
+    return perUs ? perUs : 1 ;
+}
+
+//-----------------------------------------------------------------------------
+// snprintf() with integer conversions only: glibc neither locks nor allocates
+
+static void statsLine( int fd , const char *fmt , ... )
+{
+    char     line[ 160 ] ;
+    va_list  ap ;
+
+    va_start( ap , fmt ) ;
+    int n = vsnprintf( line , sizeof( line ) , fmt , ap ) ;
+    va_end( ap ) ;
+
+    if ( n > 0 )
+        writeFull( fd , (uint8_t *) line , n < (int) sizeof( line ) ? n : sizeof( line ) - 1 ) ;
+}
+
+void stats_dump( int fd )
+{
+    uint64_t perUs = statsTicksPerUs() ;
+
+    statsLine( fd , "\n==== myCrypto latency  pid %d ====\n" , (int) getpid() ) ;
+
+    for ( unsigned p = 0 ; p < STAT_PROBES ; p++ )
+    {
+        uint64_t count = 0 , ticks = 0 , hist[ STAT_BUCKETS ] = { 0 } ;
+
+        statsThread_t *t = __atomic_load_n( &statsHead , __ATOMIC_ACQUIRE ) ;
+        for ( ; t != NULL ; t = t->next )
+        {
+            count += __atomic_load_n( &t->count[ p ] , __ATOMIC_RELAXED ) ;
+            ticks += __atomic_load_n( &t->ticks[ p ] , __ATOMIC_RELAXED ) ;
+            for ( unsigned b = 0 ; b < STAT_BUCKETS ; b++ )
+                hist[ b ] += __atomic_load_n( &t->hist[ p ][ b ] , __ATOMIC_RELAXED ) ;
+        }
+        if ( count == 0 )
+            continue ;
+
+        statsLine( fd , "%-14s %10llu calls   mean %10llu ns\n" , statsName[ p ] ,
+                   (unsigned long long) count , 
+                   (unsigned long long) ( ticks * 1000 / perUs / count ) ) ;
+
+        for ( unsigned b = 0 ; b < STAT_BUCKETS ; b++ )
+            if ( hist[ b ] )
+                statsLine( fd , "    < %10llu ns  %10llu\n" , 
+                           (unsigned long long) ( ( ( 1ull << b ) * 1000 + perUs - 1 ) / perUs ) ,
+                           (unsigned long long) hist[ b ] ) ;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void statsAtExit( void )
+{
+    stats_dump( statsFd ) ;
+}
+
+static void statsOnSignal( int sig )
+{
+    int saved = errno ;
+
+    stats_dump( statsFd ) ;
+    errno = saved ;
+}
+
+//-----------------------------------------------------------------------------
+void stats_install( const char *path )
+{
+    if ( path == NULL )
+    {
+        fprintf( stderr , "stats_install: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    statsFd = open( path , O_WRONLY | O_CREAT | O_TRUNC | O_APPEND , 0644 ) ;
+    if ( statsFd < 0 )
+    {
+        perror( "stats_install" ) ;
+        exit(-1) ;
+    }
+
+    statsNs0   = statsMonoNs() ;
+    statsTick0 = stats_now() ;
+    if ( statsMine == NULL )
+        statsRegister() ;
+
+    struct sigaction sa ;
+    memset( &sa , 0 , sizeof( sa ) ) ;
+    sa.sa_handler = statsOnSignal ;
+    sa.sa_flags   = SA_RESTART ;
+    sigemptyset( &sa.sa_mask ) ;
+    sigaction( SIGUSR1 , &sa , NULL ) ;
+
+    atexit( statsAtExit ) ;
+}
+
+#endif
+
+//***********************************************************************
+// Asynchronous Logs
+//***********************************************************************
+
+#include <sched.h>
+
+// Each record starts on a LOG_ALIGN boundary with this header. A record never
+// wraps around the end of the ring: the producer pads to the start instead
+#define LOG_ALIGN   16
+
+typedef enum { LOG_PAD = 0 , LOG_TEXT , LOG_DUMP , LOG_TEXT_REF }  logRecordType_t ;
+
+typedef struct {
+            uint8_t   type ;
+            uint8_t   byRef ;      // payload is a malloc()ed pointer to 'len' bytes
+            int16_t   indent ;     // LOG_DUMP only
+            uint32_t  len ;        // payload bytes
+            uint64_t  ns ;         // CLOCK_MONOTONIC, binary traces only
+        }  logRecord_t ;
+
+// Single producer ( whoever holds the FILE lock of 'in' ) , single consumer
+// ( the writer thread ). head and tail only ever grow
+typedef struct {
+            uint8_t          *ring ;
+            uint64_t          head , tail ;
+            int               sleeping , closing , drained ;
+            int               trace ;   // 'out' gets binary records, not text
+            struct traceDict *dict ;    // the text already in the trace
+            pthread_mutex_t   mtx ;
+            pthread_cond_t    wake ;
+            pthread_t         writer ;
+            FILE             *in ;      // the caller's stream, from fopencookie()
+            FILE             *out ;     // the real file, only touched by the writer
+        }  asyncLog_t ;
+
+static asyncLog_t      *asyncLogs[ LOG_ASYNC_MAX ] ;
+static pthread_mutex_t  asyncLogsMtx = PTHREAD_MUTEX_INITIALIZER ;
+static pthread_once_t   asyncLogsOnce = PTHREAD_ONCE_INIT ;
+
+//-----------------------------------------------------------------------------
+// Text that repeats in a trace ( banners, the same lines every handshake )
+// is written once; later copies are a LOG_TEXT_REF to its entry number.
+// The writer and traceRender() number the entries the same way: every 
+// LOG_TEXT record of at most TRACE_DICT_TEXT_MAX bytes, until there are
+// TRACE_DICT_ENTRIES of them. Only the writer needs the hash slots
+
+#define TRACE_DICT_SLOTS   ( 2 * TRACE_DICT_ENTRIES )
+
+typedef struct traceDict {
+            uint32_t   count ;
+            uint32_t   off[ TRACE_DICT_ENTRIES ] , len[ TRACE_DICT_ENTRIES ] ;
+            uint8_t   *arena ;
+            size_t     used , room ;
+            uint32_t   slot[ TRACE_DICT_SLOTS ] ;     // entry + 1 , or 0 if empty
+        }  traceDict_t ;
+
+static int traceDictAppend( traceDict_t *d , const uint8_t *text , uint32_t len )
+{
+    if ( len > TRACE_DICT_TEXT_MAX || d->count == TRACE_DICT_ENTRIES )
+        return 0 ;
+
+    if ( d->used + len > d->room )
+    {
+        size_t   room   = d->room ? 2 * d->room : 64 * 1024 ;
+        uint8_t *bigger = realloc( d->arena , room ) ;
+        if ( bigger == NULL )
+            return -1 ;
+        d->arena = bigger ;
+        d->room  = room ;
+    }
+
+    memcpy( d->arena + d->used , text , len ) ;
+    d->off[ d->count ] = d->used ;
+    d->len[ d->count ] = len ;
+    d->used += len ;
+    d->count++ ;
+    return 0 ;
+}
+
+//-----------------------------------------------------------------------------
+// The entry holding exactly this text, or -1 after remembering it
+
+static long traceDictLookup( traceDict_t *d , const uint8_t *text , uint32_t len )
+{
+    if ( len > TRACE_DICT_TEXT_MAX )
+        return -1 ;
+
+    uint32_t hash = 2166136261u ;               // FNV-1a
+    for ( uint32_t i = 0 ; i < len ; i++ )
+        hash = ( hash ^ text[ i ] ) * 16777619u ;
+
+    uint32_t i = hash & ( TRACE_DICT_SLOTS - 1 ) ;
+    for ( ; d->slot[ i ] != 0 ; i = ( i + 1 ) & ( TRACE_DICT_SLOTS - 1 ) )
+    {
+        uint32_t e = d->slot[ i ] - 1 ;
+        if ( d->len[ e ] == len && memcmp( d->arena + d->off[ e ] , text , len ) == 0 )
+            return e ;
+    }
+
+    uint32_t before = d->count ;
+    if ( traceDictAppend( d , text , len ) != 0 )
+        handleErrors( "logWriter: out of memory for the trace dictionary" ) ;
+    if ( d->count > before )
+        d->slot[ i ] = d->count ;
+    return -1 ;
+}
+
+//-----------------------------------------------------------------------------
+static void logWriteRecord( asyncLog_t *r , const logRecord_t *h , const uint8_t *payload )
+{
+    const uint8_t *data = payload ;
+
+    if ( h->byRef )
+        memcpy( &data , payload , sizeof( data ) ) ;
+
+    if ( r->trace )
+    {
+        uint8_t   rec[ TRACE_RECORD_LEN + 4 ] ;
+        long      e    = h->type == LOG_TEXT ? traceDictLookup( r->dict , data , h->len ) : -1 ;
+        uint32_t  len  = e >= 0 ? 4 : h->len ;
+
+        rec[ 0 ] = e >= 0 ? LOG_TEXT_REF : h->type ;
+        rec[ 1 ] = 0 ;
+        rec[ 2 ] = (uint8_t) ( (uint16_t) h->indent >> 8 ) ;
+        rec[ 3 ] = (uint8_t) h->indent ;
+        put32( rec + 4 , len ) ;
+        put64( rec + 8 , h->ns ) ;
+        if ( e >= 0 )
+        {
+            put32( rec + TRACE_RECORD_LEN , e ) ;
+            fwrite( rec , 1 , sizeof( rec ) , r->out ) ;
+        }
+        else
+        {
+            fwrite( rec , 1 , TRACE_RECORD_LEN , r->out ) ;
+            fwrite( data , 1 , h->len , r->out ) ;
+        }
+    }
+    else if ( h->type == LOG_TEXT )
+        fwrite( data , 1 , h->len , r->out ) ;
+    else
+        hexDump_fp( r->out , data , h->len , h->indent ) ;
+
+    if ( h->byRef )
+        free( (void *) data ) ;
+}
+
+//-----------------------------------------------------------------------------
+// The writer: format and write everything queued, flush once the ring is
+// empty, then sleep until the producer wakes it
+
+static void *logWriter( void *arg )
+{
+    asyncLog_t *r    = arg ;
+    uint64_t    head = r->head ;
+
+    for ( ;; )
+    {
+        uint64_t tail = __atomic_load_n( &r->tail , __ATOMIC_ACQUIRE ) ;
+
+        if ( head == tail )
+        {
+            fflush( r->out ) ;
+
+            pthread_mutex_lock( &r->mtx ) ;
+            __atomic_store_n( &r->sleeping , 1 , __ATOMIC_SEQ_CST ) ;
+            while ( head == __atomic_load_n( &r->tail , __ATOMIC_SEQ_CST ) && ! r->closing )
+                pthread_cond_wait( &r->wake , &r->mtx ) ;
+            __atomic_store_n( &r->sleeping , 0 , __ATOMIC_RELAXED ) ;
+            int done = r->closing && head == __atomic_load_n( &r->tail , __ATOMIC_ACQUIRE ) ;
+            pthread_mutex_unlock( &r->mtx ) ;
+
+            if ( done )
+                break ;
+            continue ;
+        }
+
+        while ( head != tail )
+        {
+            logRecord_t *h = (logRecord_t *) ( r->ring + ( head & ( LOG_RING_BYTES - 1 ) ) ) ;
+
+            if ( h->type == LOG_PAD )
+                head += LOG_RING_BYTES - ( head & ( LOG_RING_BYTES - 1 ) ) ;
+            else
+            {
+                logWriteRecord( r , h , (uint8_t *) ( h + 1 ) ) ;
+                size_t payload = h->byRef ? sizeof( void * ) : h->len ;
+                head += ( sizeof( logRecord_t ) + payload + LOG_ALIGN - 1 ) & ~( LOG_ALIGN - 1 ) ;
+            }
+            __atomic_store_n( &r->head , head , __ATOMIC_RELEASE ) ;
+        }
+    }
+
+    fflush( r->out ) ;
+    return NULL ;
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t logNs( void )
+{
+    struct timespec ts ;
+
+    clock_gettime( CLOCK_MONOTONIC , &ts ) ;
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec ;
+}
+
+//-----------------------------------------------------------------------------
+// Queue one record. The caller holds the FILE lock of r->in
+
+static void logPush( asyncLog_t *r , logRecordType_t type , const void *data , size_t len , int indent )
+{
+    if ( r->drained )
+    {
+        // After exit() has drained the ring the writer is gone
+        logRecord_t h = { type , 0 , indent , len , r->trace ? logNs() : 0 } ;
+        logWriteRecord( r , &h , data ) ;
+        return ;
+    }
+
+    logRecord_t h  = { type , len > LOG_INLINE_MAX , indent , len , r->trace ? logNs() : 0 } ;
+    const void *payload = data ;
+    void       *copy    = NULL ;
+
+    if ( h.byRef )
+    {
+        copy = malloc( len ) ;
+        if ( copy == NULL )
+            handleErrors( "logPush: out of memory" ) ;
+        memcpy( copy , data , len ) ;
+        payload = &copy ;
+        len     = sizeof( copy ) ;
+    }
+
+    size_t   need = ( sizeof( h ) + len + LOG_ALIGN - 1 ) & ~( LOG_ALIGN - 1 ) ;
+    uint64_t tail = r->tail ;
+    size_t   at   = tail & ( LOG_RING_BYTES - 1 ) ;
+    size_t   pad  = at + need > LOG_RING_BYTES ? LOG_RING_BYTES - at : 0 ;
+
+    // Full: let the writer catch up
+    while ( LOG_RING_BYTES - ( tail - __atomic_load_n( &r->head , __ATOMIC_ACQUIRE ) ) < pad + need )
+    {
+        pthread_mutex_lock( &r->mtx ) ;
+        pthread_cond_signal( &r->wake ) ;
+        pthread_mutex_unlock( &r->mtx ) ;
+        sched_yield() ;
+    }
+
+    if ( pad )
+    {
+        ( (logRecord_t *) ( r->ring + at ) )->type = LOG_PAD ;
+        tail += pad ;
+        at    = 0 ;
+    }
+    memcpy( r->ring + at , &h , sizeof( h ) ) ;
+    memcpy( r->ring + at + sizeof( h ) , payload , len ) ;
+
+    __atomic_store_n( &r->tail , tail + need , __ATOMIC_SEQ_CST ) ;
+    if ( __atomic_load_n( &r->sleeping , __ATOMIC_SEQ_CST ) )
+    {
+        pthread_mutex_lock( &r->mtx ) ;
+        pthread_cond_signal( &r->wake ) ;
+        pthread_mutex_unlock( &r->mtx ) ;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Stop the writer once it has emptied the ring
+
+static void logDrain( asyncLog_t *r )
+{
+    pthread_mutex_lock( &r->mtx ) ;
+    r->closing = 1 ;
+    pthread_cond_signal( &r->wake ) ;
+    pthread_mutex_unlock( &r->mtx ) ;
+
+    pthread_join( r->writer , NULL ) ;
+    r->drained = 1 ;
+}
+
+//-----------------------------------------------------------------------------
+// exit() runs this before stdio flushes its streams, so push what is still
+// buffered in each log first
+
+static void logAtExit( void )
+{
+    for ( unsigned i = 0 ; i < LOG_ASYNC_MAX ; i++ )
+    {
+        asyncLog_t *r = asyncLogs[ i ] ;
+        if ( r == NULL || r->drained )
+            continue ;
+
+        fflush( r->in ) ;
+        logDrain( r ) ;
+        fflush( r->out ) ;
+    }
+}
+
+// handleErrors() runs this before abort(), so that the lines leading up to
+// the error reach the logs. A stream another thread holds locked keeps what
+// it buffered, and the writer thread cannot wait for itself to finish
+static __thread int  logInCookie ;      // this thread is inside logCookieWrite()
+
+static void logAtAbort( void )
+{
+    static int        busy ;
+    static pthread_t  owner ;
+
+    if ( __atomic_exchange_n( &busy , 1 , __ATOMIC_ACQ_REL ) )
+    {
+        if ( pthread_equal( owner , pthread_self() ) )
+            return ;                    // failed again while draining
+        for ( ;; )
+            pause() ;                   // the first thread to fail aborts
+    }
+    owner = pthread_self() ;
+
+    for ( unsigned i = 0 ; i < LOG_ASYNC_MAX ; i++ )
+    {
+        asyncLog_t *r = asyncLogs[ i ] ;
+        if ( r == NULL || r->drained )
+            continue ;
+        if ( pthread_equal( r->writer , pthread_self() ) )
+        {
+            fflush( r->out ) ;
+            continue ;
+        }
+
+        if ( ! logInCookie && ftrylockfile( r->in ) == 0 )
+        {
+            fflush( r->in ) ;
+            funlockfile( r->in ) ;
+        }
+        logDrain( r ) ;
+        fflush( r->out ) ;
+    }
+}
+
+static void logInitOnce( void )
+{
+    atexit( logAtExit ) ;
+}
+
+//-----------------------------------------------------------------------------
+// fopencookie() callbacks of the caller's stream
+
+static ssize_t logCookieWrite( void *cookie , const char *buf , size_t size )
+{
+    logInCookie = 1 ;
+    logPush( cookie , LOG_TEXT , buf , size , 0 ) ;
+    logInCookie = 0 ;
+    return size ;
+}
+
+static int logCookieClose( void *cookie )
+{
+    asyncLog_t *r = cookie ;
+
+    if ( ! r->drained )
+        logDrain( r ) ;
+
+    pthread_mutex_lock( &asyncLogsMtx ) ;
+    for ( unsigned i = 0 ; i < LOG_ASYNC_MAX ; i++ )
+        if ( asyncLogs[ i ] == r )
+            asyncLogs[ i ] = NULL ;
+    pthread_mutex_unlock( &asyncLogsMtx ) ;
+
+    int status = fclose( r->out ) ;
+    if ( r->dict )
+        free( r->dict->arena ) ;
+    free( r->dict ) ;
+    pthread_mutex_destroy( &r->mtx ) ;
+    pthread_cond_destroy( &r->wake ) ;
+    free( r->ring ) ;
+    free( r ) ;
+    return status ;
+}
+
+//-----------------------------------------------------------------------------
+int logTracing( void )
+{
+    char *trace = getenv( LOG_BINARY_TRACE_ENV ) ;
+
+    return trace != NULL && strcmp( trace , "0" ) != 0 ;
+}
+
+//-----------------------------------------------------------------------------
+FILE *logOpen( const char *path )
+{
+    if ( path == NULL )
+    {
+        fprintf( stderr , "logOpen: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    pthread_once( &asyncLogsOnce , logInitOnce ) ;
+
+    asyncLog_t *r = calloc( 1 , sizeof( asyncLog_t ) ) ;
+    if ( r == NULL )
+        return NULL ;
+
+    // Take a slot first; with every slot in use the log is simply synchronous
+    unsigned slot = 0 ;
+    pthread_mutex_lock( &asyncLogsMtx ) ;
+    while ( slot < LOG_ASYNC_MAX && asyncLogs[ slot ] != NULL )
+        slot++ ;
+    if ( slot < LOG_ASYNC_MAX )
+        asyncLogs[ slot ] = r ;
+    pthread_mutex_unlock( &asyncLogsMtx ) ;
+    if ( slot == LOG_ASYNC_MAX )
+    {
+        free( r ) ;
+        return fopen( path , "w" ) ;
+    }
+
+    cookie_io_functions_t io = { NULL , logCookieWrite , NULL , logCookieClose } ;
+
+    pthread_mutex_init( &r->mtx , NULL ) ;
+    pthread_cond_init( &r->wake , NULL ) ;
+    r->ring = malloc( LOG_RING_BYTES ) ;
+
+    // LOG_BINARY_TRACE=1: a binary trace in path.trace, for traceRender() to turn into text later
+    r->trace = logTracing() ;
+    if ( r->trace && ( r->dict = calloc( 1 , sizeof( traceDict_t ) ) ) == NULL )
+        r->trace = 0 ;
+    if ( r->trace )
+    {
+        char     tracePath[ PATH_MAX ] ;
+        uint8_t  header[ TRACE_HEADER_LEN ] = TRACE_MAGIC ;
+
+        snprintf( tracePath , sizeof( tracePath ) , "%s%s" , path , TRACE_SUFFIX ) ;
+        r->out = fopen( tracePath , "w" ) ;
+        put32( header + 4 , TRACE_VERSION ) ;
+        put64( header + 8 , logNs() ) ;
+        if ( r->out != NULL && fwrite( header , 1 , sizeof( header ) , r->out ) != sizeof( header ) )
+        {
+            fclose( r->out ) ;
+            r->out = NULL ;
+        }
+    }
+    else
+        r->out = fopen( path , "w" ) ;
+    if ( r->out != NULL )
+        setvbuf( r->out , NULL , _IOFBF , LOG_INLINE_MAX ) ;
+
+    if ( r->ring != NULL && r->out != NULL 
+         && pthread_create( &r->writer , NULL , logWriter , r ) == 0 )
+    {
+        r->in = fopencookie( r , "w" , io ) ;
+        if ( r->in != NULL )
+            return r->in ;
+        logDrain( r ) ;
+    }
+
+    FILE *plain = r->out ;
+    asyncLogs[ slot ] = NULL ;
+    free( r->dict ) ;
+    pthread_mutex_destroy( &r->mtx ) ;
+    pthread_cond_destroy( &r->wake ) ;
+    free( r->ring ) ;
+    free( r ) ;
+    return plain ;
+}
+
+//-----------------------------------------------------------------------------
+int logDump( FILE *fp , const void *s , int len , int indent )
+{
+    asyncLog_t *r = NULL ;
+
+    for ( unsigned i = 0 ; i < LOG_ASYNC_MAX && r == NULL ; i++ )
+        if ( asyncLogs[ i ] != NULL && asyncLogs[ i ]->in == fp )
+            r = asyncLogs[ i ] ;
+
+    if ( r == NULL || len <= 0 )
+        return hexDump_fp( fp , s , len , indent ) ;
+
+    // Text still sitting in the stdio buffer goes first
+    flockfile( fp ) ;
+    fflush( fp ) ;
+    logPush( r , LOG_DUMP , s , len , indent ) ;
+    funlockfile( fp ) ;
+
+    return len ;
+}
+
+//-----------------------------------------------------------------------------
+// Read exactly 'len' bytes from a trace; 0 at a clean end, -1 if truncated
+
+static int traceRead( FILE *in , uint8_t *buf , size_t len , int atRecord )
+{
+    size_t got = fread( buf , 1 , len , in ) ;
+
+    if ( got == len )
+        return 1 ;
+    return got == 0 && atRecord ? 0 : -1 ;
+}
+
+long traceRender( FILE *in , FILE *out , int timestamps )
+{
+    if ( in == NULL || out == NULL )
+    {
+        fprintf( stderr , "traceRender: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    uint8_t      header[ TRACE_HEADER_LEN ] , rec[ TRACE_RECORD_LEN ] ;
+    uint8_t     *data = NULL ;
+    size_t       room = 0 ;
+    long         n    = 0 ;
+    traceDict_t *dict = calloc( 1 , sizeof( traceDict_t ) ) ;
+
+    if ( dict == NULL )
+        return -1 ;
+
+    if ( traceRead( in , header , sizeof( header ) , 0 ) != 1
+         || memcmp( header , TRACE_MAGIC , 4 ) != 0 || get32( header + 4 ) != TRACE_VERSION )
+    {
+        free( dict ) ;
+        return -1 ;
+    }
+    uint64_t start = get64( header + 8 ) ;
+
+    int status ;
+    while ( ( status = traceRead( in , rec , sizeof( rec ) , 1 ) ) == 1 )
+    {
+        uint8_t   type   = rec[ 0 ] ;
+        int16_t   indent = (int16_t) ( ( rec[ 2 ] << 8 ) | rec[ 3 ] ) ;
+        uint32_t  len    = get32( rec + 4 ) ;
+        uint64_t  ns     = get64( rec + 8 ) ;
+
+        if ( ( type != LOG_TEXT && type != LOG_DUMP && type != LOG_TEXT_REF ) 
+             || ( type == LOG_TEXT_REF && len != 4 ) || len > TRACE_PAYLOAD_MAX )
+            break ;
+        if ( len > room )
+        {
+            uint8_t *bigger = realloc( data , len ) ;
+            if ( bigger == NULL )
+                break ;
+            data = bigger ;
+            room = len ;
+        }
+        if ( traceRead( in , data , len , 0 ) != 1 )
+            break ;
+
+        const uint8_t *text = data ;
+        if ( type == LOG_TEXT_REF )
+        {
+            uint32_t e = get32( data ) ;
+            if ( e >= dict->count )
+                break ;
+            text = dict->arena + dict->off[ e ] ;
+            len  = dict->len[ e ] ;
+        }
+        else if ( type == LOG_TEXT && traceDictAppend( dict , data , len ) != 0 )
+            break ;
+
+        if ( timestamps )
+            fprintf( out , "[%12.3f us] " , ( ns - start ) / 1e3 ) ;
+        if ( type == LOG_DUMP )
+            hexDump_fp( out , text , len , indent ) ;
+        else
+            fwrite( text , 1 , len , out ) ;
+        n++ ;
+    }
+
+    free( data ) ;
+    free( dict->arena ) ;
+    free( dict ) ;
+    return status == 0 ? n : -1 ;
+}
+
+//***********************************************************************
+// Hex Dumps
+//***********************************************************************
+
+// One row after its offset: 3 characters per byte , two spaces , the ASCII
+// column and the newline
+#define HEXDUMP_WIDTH   16
+#define HEXDUMP_ROW     ( 3 * HEXDUMP_WIDTH + 2 + HEXDUMP_WIDTH + 1 )
+
+static const char hexDigits[] = "0123456789abcdef" ;
+
+// Same clamp and row width as OpenSSL's BIO_dump_indent_cb()
+static int hexDumpIndent( int indent )
+{
+    return indent < 0 ? 0 : indent > 64 ? 64 : indent ;
+}
+
+static int hexDumpWidth( int indent )
+{
+    return HEXDUMP_WIDTH - ( indent - ( indent > 6 ? 6 : indent ) + 3 ) / 4 ;
+}
+
+//-----------------------------------------------------------------------------
+// "%04x - "
+
+static unsigned hexDumpOffset( char *p , uint32_t off )
+{
+    unsigned digits = 4 ;
+
+    while ( digits < 8 && ( off >> ( 4 * digits ) ) != 0 )
+        digits++ ;
+    for ( unsigned d = 0 ; d < digits ; d++ )
+        p[ d ] = hexDigits[ ( off >> ( 4 * ( digits - 1 - d ) ) ) & 0xf ] ;
+    memcpy( p + digits , " - " , 3 ) ;
+
+    return digits + 3 ;
+}
+
+//-----------------------------------------------------------------------------
+// Any row: 'n' bytes of a row 'width' wide
+
+static char *hexRowScalar( char *p , const uint8_t *s , unsigned n , unsigned width )
+{
+    for ( unsigned j = 0 ; j < width ; j++ , p += 3 )
+    {
+        if ( j < n )
+        {
+            p[ 0 ] = hexDigits[ s[ j ] >> 4 ] ;
+            p[ 1 ] = hexDigits[ s[ j ] & 0xf ] ;
+            p[ 2 ] = j == 7 ? '-' : ' ' ;
+        }
+        else
+            memcpy( p , "   " , 3 ) ;
+    }
+
+    *p++ = ' ' ;
+    *p++ = ' ' ;
+    for ( unsigned j = 0 ; j < n ; j++ )
+        *p++ = s[ j ] >= ' ' && s[ j ] <= '~' ? s[ j ] : '.' ;
+    *p++ = '\n' ;
+
+    return p ;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The 32 hex digits of a row, as two vectors a ( bytes 0-7 ) and b ( 8-15 ),
+// are spread over the 48 columns with pshufb: columns 0-31 come from a and
+// 16-47 from b ( Z leaves a zero ), then the separators are OR-ed in
+#define Z   -128
+static const int8_t hexShufA[ 32 ] = {  0 ,  1 , Z ,  2 ,  3 , Z ,  4 ,  5 , Z ,  6 ,  7 , Z ,  8 ,  9 , Z , 10 ,
+                                       11 , Z , 12 , 13 , Z , 14 , 15 , Z ,  Z ,  Z , Z ,  Z ,  Z , Z ,  Z ,  Z } ;
+static const int8_t hexShufB[ 32 ] = {  Z ,  Z , Z ,  Z ,  Z , Z ,  Z ,  Z , 0 ,  1 , Z ,  2 ,  3 , Z ,  4 ,  5 ,
+                                        Z ,  6 , 7 ,  Z ,  8 , 9 ,  Z , 10 , 11 , Z , 12 , 13 ,  Z , 14 , 15 ,  Z } ;
+#undef Z
+static const char   hexSep[ 48 ]   = "\0\0 \0\0 \0\0 \0\0 \0\0 \0\0 \0\0 \0\0-\0\0 \0\0 \0\0 \0\0 \0\0 \0\0 \0\0 \0\0 " ;
+
+//-----------------------------------------------------------------------------
+// One full 16-byte row
+
+__attribute__((target("ssse3")))
+static char *hexRowSSSE3( char *p , const uint8_t *s )
+{
+    const __m128i lut = _mm_loadu_si128( (const __m128i *) hexDigits ) ;
+    const __m128i nib = _mm_set1_epi8( 0x0f ) ;
+
+    __m128i v  = _mm_loadu_si128( (const __m128i *) s ) ;
+    __m128i hi = _mm_shuffle_epi8( lut , _mm_and_si128( _mm_srli_epi16( v , 4 ) , nib ) ) ;
+    __m128i lo = _mm_shuffle_epi8( lut , _mm_and_si128( v , nib ) ) ;
+    __m128i a  = _mm_unpacklo_epi8( hi , lo ) ;
+    __m128i b  = _mm_unpackhi_epi8( hi , lo ) ;
+
+    __m128i c0 = _mm_shuffle_epi8( a , _mm_loadu_si128( (const __m128i *) hexShufA ) ) ;
+    __m128i c1 = _mm_or_si128( _mm_shuffle_epi8( a , _mm_loadu_si128( (const __m128i *) ( hexShufA + 16 ) ) ) ,
+                               _mm_shuffle_epi8( b , _mm_loadu_si128( (const __m128i *) hexShufB ) ) ) ;
+    __m128i c2 = _mm_shuffle_epi8( b , _mm_loadu_si128( (const __m128i *) ( hexShufB + 16 ) ) ) ;
+
+    _mm_storeu_si128( (__m128i *) p        , _mm_or_si128( c0 , _mm_loadu_si128( (const __m128i *) hexSep ) ) ) ;
+    _mm_storeu_si128( (__m128i *) ( p + 16 ) , _mm_or_si128( c1 , _mm_loadu_si128( (const __m128i *) ( hexSep + 16 ) ) ) ) ;
+    _mm_storeu_si128( (__m128i *) ( p + 32 ) , _mm_or_si128( c2 , _mm_loadu_si128( (const __m128i *) ( hexSep + 32 ) ) ) ) ;
+    p[ 48 ] = ' ' ;
+    p[ 49 ] = ' ' ;
+
+    // ' ' .. '~' as signed bytes; 0x80 and up are negative and fail the first test
+    __m128i printable = _mm_and_si128( _mm_cmpgt_epi8( v , _mm_set1_epi8( 0x1f ) ) ,
+                                       _mm_cmplt_epi8( v , _mm_set1_epi8( 0x7f ) ) ) ;
+    __m128i ascii     = _mm_or_si128( _mm_and_si128( printable , v ) ,
+                                      _mm_andnot_si128( printable , _mm_set1_epi8( '.' ) ) ) ;
+    _mm_storeu_si128( (__m128i *) ( p + 50 ) , ascii ) ;
+    p[ 66 ] = '\n' ;
+
+    return p + HEXDUMP_ROW ;
+}
+
+//-----------------------------------------------------------------------------
+// Two consecutive full rows, one per 128-bit lane ( pshufb stays within
+// a lane ), stored at p0 and p1
+
+__attribute__((target("avx2")))
+static void hexRows2AVX2( char *p0 , char *p1 , const uint8_t *s )
+{
+    const __m256i lut = _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i *) hexDigits ) ) ;
+    const __m256i nib = _mm256_set1_epi8( 0x0f ) ;
+
+    __m256i v  = _mm256_loadu_si256( (const __m256i *) s ) ;
+    __m256i hi = _mm256_shuffle_epi8( lut , _mm256_and_si256( _mm256_srli_epi16( v , 4 ) , nib ) ) ;
+    __m256i lo = _mm256_shuffle_epi8( lut , _mm256_and_si256( v , nib ) ) ;
+    __m256i a  = _mm256_unpacklo_epi8( hi , lo ) ;
+    __m256i b  = _mm256_unpackhi_epi8( hi , lo ) ;
+
+#define LANES( t )   _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i *) ( t ) ) )
+    __m256i c0 = _mm256_or_si256( _mm256_shuffle_epi8( a , LANES( hexShufA ) ) , LANES( hexSep ) ) ;
+    __m256i c1 = _mm256_or_si256( _mm256_or_si256( _mm256_shuffle_epi8( a , LANES( hexShufA + 16 ) ) ,
+                                                   _mm256_shuffle_epi8( b , LANES( hexShufB ) ) ) ,
+                                  LANES( hexSep + 16 ) ) ;
+    __m256i c2 = _mm256_or_si256( _mm256_shuffle_epi8( b , LANES( hexShufB + 16 ) ) , LANES( hexSep + 32 ) ) ;
+#undef LANES
+
+    __m256i printable = _mm256_and_si256( _mm256_cmpgt_epi8( v , _mm256_set1_epi8( 0x1f ) ) ,
+                                          _mm256_cmpgt_epi8( _mm256_set1_epi8( 0x7f ) , v ) ) ;
+    __m256i ascii     = _mm256_blendv_epi8( _mm256_set1_epi8( '.' ) , v , printable ) ;
+
+    char *row[ 2 ] = { p0 , p1 } ;
+    __m128i lane[ 2 ][ 4 ] = {
+        { _mm256_castsi256_si128( c0 ) , _mm256_castsi256_si128( c1 ) ,
+          _mm256_castsi256_si128( c2 ) , _mm256_castsi256_si128( ascii ) } ,
+        { _mm256_extracti128_si256( c0 , 1 ) , _mm256_extracti128_si256( c1 , 1 ) ,
+          _mm256_extracti128_si256( c2 , 1 ) , _mm256_extracti128_si256( ascii , 1 ) } } ;
+
+    for ( int r = 0 ; r < 2 ; r++ )
+    {
+        char *p = row[ r ] ;
+        _mm_storeu_si128( (__m128i *) p        , lane[ r ][ 0 ] ) ;
+        _mm_storeu_si128( (__m128i *) ( p + 16 ) , lane[ r ][ 1 ] ) ;
+        _mm_storeu_si128( (__m128i *) ( p + 32 ) , lane[ r ][ 2 ] ) ;
+        p[ 48 ] = ' ' ;
+        p[ 49 ] = ' ' ;
+        _mm_storeu_si128( (__m128i *) ( p + 50 ) , lane[ r ][ 3 ] ) ;
+        p[ 66 ] = '\n' ;
+    }
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+// 0 = scalar only , 1 = SSSE3 , 2 = AVX2. Racing first calls agree on the value
+
+static int hexDumpLevel( void )
+{
+    static int level = -1 ;
+
+    if ( level < 0 )
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        level = __builtin_cpu_supports( "avx2" ) ? 2 : __builtin_cpu_supports( "ssse3" ) ? 1 : 0 ;
+#else
+        level = 0 ;
+#endif
+    }
+    return level ;
+}
+
+//-----------------------------------------------------------------------------
+size_t hexDumpLen( int len , int indent )
+{
+    if ( len <= 0 )
+        return 0 ;
+
+    indent = hexDumpIndent( indent ) ;
+    size_t width  = hexDumpWidth( indent ) ;
+    size_t rows   = ( len + width - 1 ) / width ;
+    size_t maxOff = ( rows - 1 ) * width ;
+    size_t total  = rows * ( indent + 4 + 3 + 3 * width + 2 + 1 ) + len ;
+
+    // Offsets past 0xffff take a fifth hex digit, past 0xfffff a sixth, ...
+    for ( size_t limit = 0x10000 ; limit <= maxOff ; limit <<= 4 )
+        total += rows - ( limit + width - 1 ) / width ;
+
+    return total ;
+}
+
+//-----------------------------------------------------------------------------
+size_t hexDump( char *out , const void *s , int len , int indent )
+{
+    if ( len <= 0 )
+        return 0 ;
+    if ( out == NULL || s == NULL )
+    {
+        fprintf( stderr , "hexDump: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    const uint8_t *b     = s ;
+    char          *p     = out ;
+    unsigned       width , off = 0 ;
+    int            level = hexDumpLevel() ;
+
+    indent = hexDumpIndent( indent ) ;
+    width  = hexDumpWidth( indent ) ;
+
+    while ( off < (unsigned) len )
+    {
+        unsigned n = len - off < width ? len - off : width ;
+
+        memset( p , ' ' , indent ) ;
+        p += indent ;
+        p += hexDumpOffset( p , off ) ;
+
+#if defined(__x86_64__) || defined(__i386__)
+        if ( n == HEXDUMP_WIDTH && level > 0 )
+        {
+            if ( level == 2 && len - off >= 2 * HEXDUMP_WIDTH )
+            {
+                char *q = p + HEXDUMP_ROW ;
+
+                memset( q , ' ' , indent ) ;
+                q += indent ;
+                q += hexDumpOffset( q , off + HEXDUMP_WIDTH ) ;
+                hexRows2AVX2( p , q , b + off ) ;
+                p    = q + HEXDUMP_ROW ;
+                off += 2 * HEXDUMP_WIDTH ;
+                continue ;
+            }
+            p    = hexRowSSSE3( p , b + off ) ;
+            off += HEXDUMP_WIDTH ;
+            continue ;
+        }
+#endif
+        p    = hexRowScalar( p , b + off , n , width ) ;
+        off += width ;
+    }
+
+    return p - out ;
+}
+
+//-----------------------------------------------------------------------------
+int hexDump_fp( FILE *fp , const void *s , int len , int indent )
+{
+    char    stackBuf[ 4096 ] , *buf = stackBuf ;
+    size_t  need = hexDumpLen( len , indent ) ;
+
+    if ( need == 0 )
+        return 0 ;
+    if ( need > sizeof( stackBuf ) && ( buf = malloc( need ) ) == NULL )
+        return -1 ;
+
+    size_t n   = hexDump( buf , s , len , indent ) ;
+    size_t put = fwrite( buf , 1 , n , fp ) ;
+
+    if ( buf != stackBuf )
+        free( buf ) ;
+    return put == n ? (int) n : -1 ;
+}
+
+//***********************************************************************
+// Log Levels
+//***********************************************************************
+
+int  logThreshold = LOG_TRACE ;
+
+void setLogLevel( int level )
+{
+    if ( level < LOG_TRACE )
+        level = LOG_TRACE ;
+    if ( level > LOG_OFF )
+        level = LOG_OFF ;
+    logThreshold = level ;
+}
+
+int getLogLevel( void )
+{
+    return logThreshold ;
+}
+
+//-----------------------------------------------------------------------------
+// Let the dispatcher quiet all three parties at once
+// Anything unrecognized leaves every compiled-in level on
+
+void setLogLevelFromEnv( void )
+{
+    static const char *names[] = { "trace" , "debug" , "info" , "off" } ;
+    char *level = getenv( LOG_LEVEL_ENV ) ;
+
+    setLogLevel( LOG_TRACE ) ;
+    for ( int i = LOG_TRACE ; level != NULL && i <= LOG_OFF ; i++ )
+        if ( strcasecmp( level , names[ i ] ) == 0 )
+            setLogLevel( i ) ;
+}
+
+//***********************************************************************
+// Principal Key Database
+//***********************************************************************
+
+// FNV-1a over the ID and its NUL , then the MurmurHash3 finalizer so that
+// the low bits picking the home slot depend on every byte
+static uint64_t keyDB_hash( const char *id , size_t len )
+{
+    uint64_t h = 14695981039346656037ULL ;
+
+    for ( size_t i = 0 ; i < len ; i++ )
+        h = ( h ^ (uint8_t) id[ i ] ) * 1099511628211ULL ;
+
+    h ^= h >> 33 ;  h *= 0xFF51AFD7ED558CCDULL ;
+    h ^= h >> 33 ;  h *= 0xC4CEB9FE1A85EC53ULL ;
+    h ^= h >> 33 ;
+    return h ;
+}
+
+static uint32_t keyDB_tag( uint64_t h )
+{
+    return (uint32_t) ( h >> 32 ) | 1 ;       // never 0 , which marks an empty slot
+}
+
+static size_t keyDB_recordLen( size_t idLen )
+{
+    return ( KEYDB_RECORD_FIXED + idLen + 7 ) & ~(size_t) 7 ;
+}
+
+//-----------------------------------------------------------------------------
+int keyDB_write( const char *path , const char *const *ids , const myKey_t *keys , size_t n )
+{
+    char      tmpPath[ PATH_MAX ] ;
+    uint64_t  nSlots = 16 , recordsLen = 0 ;
+
+    if ( path == NULL || ( n > 0 && ( ids == NULL || keys == NULL ) ) )
+    {
+        fprintf( stderr , "keyDB_write: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    while ( nSlots < 2 * (uint64_t) n )
+        nSlots <<= 1 ;
+    for ( size_t i = 0 ; i < n ; i++ )
+    {
+        if ( ids[ i ] == NULL )
+        {
+            fprintf( stderr , "keyDB_write: NULL ID for principal %zu\n" , i ) ;
+            exit(-1) ;
+        }
+        recordsLen += keyDB_recordLen( strlen( ids[ i ] ) + 1 ) ;
+    }
+    if ( recordsLen / 8 > UINT32_MAX || nSlots > UINT32_MAX )
+    {
+        errno = EFBIG ;
+        return -1 ;
+    }
+
+    size_t  fileLen = KEYDB_HEADER_LEN + nSlots * KEYDB_SLOT_LEN + recordsLen ;
+    snprintf( tmpPath , sizeof( tmpPath ) , "%s.tmp.%d" , path , (int) getpid() ) ;
+
+    int fd = open( tmpPath , O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC , 0600 ) ;
+    if ( fd < 0 )
+        return -1 ;
+    if ( ftruncate( fd , fileLen ) != 0 )
+        goto fail ;
+
+    // ftruncate() leaves every slot zero , i.e. empty
+    uint8_t *map = mmap( NULL , fileLen , PROT_READ | PROT_WRITE , MAP_SHARED , fd , 0 ) ;
+    if ( map == MAP_FAILED )
+        goto fail ;
+
+    uint8_t  *slots   = map + KEYDB_HEADER_LEN ;
+    uint8_t  *records = slots + nSlots * KEYDB_SLOT_LEN ;
+    uint64_t  mask    = nSlots - 1 , off = 0 ;
+
+    memcpy( map , KEYDB_MAGIC , 4 ) ;
+    put32( map +  4 , KEYDB_VERSION ) ;
+    put64( map +  8 , nSlots ) ;
+    put64( map + 16 , n ) ;
+    put64( map + 24 , recordsLen ) ;
+
+    for ( size_t i = 0 ; i < n ; i++ )
+    {
+        size_t    idLen = strlen( ids[ i ] ) + 1 ;
+        uint64_t  h     = keyDB_hash( ids[ i ] , idLen ) ;
+        uint32_t  tag   = keyDB_tag( h ) ;
+        uint8_t  *slot ;
+
+        for ( uint64_t s = h & mask ; ; s = ( s + 1 ) & mask )
+        {
+            slot = slots + s * KEYDB_SLOT_LEN ;
+            if ( get32( slot ) == 0 )
+                break ;
+            if ( get32( slot ) == tag )
+            {
+                const uint8_t *other = records + (uint64_t) get32( slot + 4 ) * 8 ;
+                if ( get32( other + KEYSIZE ) == idLen && memcmp( other + KEYDB_RECORD_FIXED , ids[ i ] , idLen ) == 0 )
+                {
+                    munmap( map , fileLen ) ;
+                    errno = EEXIST ;
+                    goto fail ;
+                }
+            }
+        }
+
+        uint8_t *rec = records + off ;
+        memcpy( rec , &keys[ i ] , KEYSIZE ) ;
+        put32( rec + KEYSIZE , idLen ) ;
+        memcpy( rec + KEYDB_RECORD_FIXED , ids[ i ] , idLen ) ;
+
+        put32( slot     , tag ) ;
+        put32( slot + 4 , off / 8 ) ;
+        off += keyDB_recordLen( idLen ) ;
+    }
+
+    if ( munmap( map , fileLen ) != 0 || fsync( fd ) != 0 )
+        goto fail ;
+    int closed = close( fd ) ;
+    fd = -1 ;
+    if ( closed != 0 )
+        goto fail ;
+    if ( rename( tmpPath , path ) != 0 )
+    {
+        int e = errno ;
+        unlink( tmpPath ) ;
+        errno = e ;
+        return -1 ;
+    }
+    return 0 ;
+
+fail:
+    {
+        int e = errno ;
+        if ( fd >= 0 )
+            close( fd ) ;
+        unlink( tmpPath ) ;
+        errno = e ;
+    }
+    return -1 ;
+}
+
+//-----------------------------------------------------------------------------
+myKeyDB_t *keyDB_open( const char *path )
+{
+    struct stat  st ;
+
+    if ( path == NULL )
+    {
+        fprintf( stderr , "keyDB_open: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    int fd = open( path , O_RDONLY | O_CLOEXEC ) ;
+    if ( fd < 0 )
+        return NULL ;
+    if ( fstat( fd , &st ) != 0 || st.st_size < KEYDB_HEADER_LEN )
+    {
+        close( fd ) ;
+        return NULL ;
+    }
+
+    // The mapping outlives the descriptor , and the file it was made from
+    const uint8_t *map = mmap( NULL , st.st_size , PROT_READ , MAP_SHARED , fd , 0 ) ;
+    close( fd ) ;
+    if ( map == MAP_FAILED )
+        return NULL ;
+
+    uint64_t  nSlots     = get64( map +  8 ) ;
+    uint64_t  recordsLen = get64( map + 24 ) ;
+    if ( memcmp( map , KEYDB_MAGIC , 4 ) != 0 || get32( map + 4 ) != KEYDB_VERSION
+         || nSlots == 0 || ( nSlots & ( nSlots - 1 ) ) != 0 || nSlots > UINT32_MAX
+         || (uint64_t) st.st_size != KEYDB_HEADER_LEN + nSlots * KEYDB_SLOT_LEN + recordsLen )
+    {
+        munmap( (void *) map , st.st_size ) ;
+        return NULL ;
+    }
+
+    myKeyDB_t *db = malloc( sizeof( myKeyDB_t ) ) ;
+    if ( db == NULL )
+    {
+        munmap( (void *) map , st.st_size ) ;
+        return NULL ;
+    }
+
+    // Lookups land anywhere: read ahead nothing but the page asked for
+    madvise( (void *) map , st.st_size , MADV_RANDOM ) ;
+
+    db->map        = map ;
+    db->mapLen     = st.st_size ;
+    db->slots      = map + KEYDB_HEADER_LEN ;
+    db->records    = db->slots + nSlots * KEYDB_SLOT_LEN ;
+    db->mask       = nSlots - 1 ;
+    db->count      = get64( map + 16 ) ;
+    db->recordsLen = recordsLen ;
+    return db ;
+}
+
+void keyDB_close( myKeyDB_t *db )
+{
+    if ( db == NULL )
+        return ;
+    munmap( (void *) db->map , db->mapLen ) ;
+    free( db ) ;
+}
+
+//-----------------------------------------------------------------------------
+// Offsets come from the file , so each one is checked before it is followed
+
+const myKey_t *keyDB_lookup( const myKeyDB_t *db , const char *id )
+{
+    if ( db == NULL || id == NULL )
+    {
+        fprintf( stderr , "keyDB_lookup: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    size_t    idLen = strlen( id ) + 1 ;
+    uint64_t  h     = keyDB_hash( id , idLen ) ;
+    uint32_t  tag   = keyDB_tag( h ) ;
+
+    for ( uint64_t p = 0 , s = h & db->mask ; p <= db->mask ; p++ , s = ( s + 1 ) & db->mask )
+    {
+        const uint8_t *slot = db->slots + s * KEYDB_SLOT_LEN ;
+        uint32_t       t    = get32( slot ) ;
+
+        if ( t == 0 )
+            return NULL ;
+        if ( t != tag )
+            continue ;
+
+        uint64_t off = (uint64_t) get32( slot + 4 ) * 8 ;
+        if ( off + KEYDB_RECORD_FIXED + idLen > db->recordsLen )
+            continue ;
+
+        const uint8_t *rec = db->records + off ;
+        if ( get32( rec + KEYSIZE ) == idLen && memcmp( rec + KEYDB_RECORD_FIXED , id , idLen ) == 0 )
+            return (const myKey_t *) rec ;
+    }
+    return NULL ;
+}
+
+//***********************************************************************
+// Key Store
+//***********************************************************************
+
+// Fault in every page of a snapshot on the thread that maps it, so that the
+// first lookups after the swap do not take the page faults in its place
+static void keyStore_prefault( const myKeyDB_t *db )
+{
+#ifdef MADV_POPULATE_READ
+    if ( madvise( (void *) db->map , db->mapLen , MADV_POPULATE_READ ) == 0 )
+        return ;
+#endif
+    // Kernels before 5.14: read one byte of every page
+    volatile const uint8_t *p   = db->map ;
+    long                    pg  = sysconf( _SC_PAGESIZE ) ;
+    uint8_t                 sum = 0 ;
+
+    for ( size_t off = 0 ; off < db->mapLen ; off += pg )
+        sum += p[ off ] ;
+    (void) sum ;
+}
+
+//-----------------------------------------------------------------------------
+// A reader's slot holds 0 outside a read-side section, or the store epoch
+// it saw on entering. A writer that has swapped 'current' and then moved the
+// epoch to E waits for every slot to be 0 or at least E: any reader that
+// could have loaded the old snapshot entered before the swap, so its slot
+// held a smaller epoch ( all of these accesses are sequentially consistent )
+
+myKeyStore_t *keyStore_open( const char *path )
+{
+    if ( path == NULL )
+    {
+        fprintf( stderr , "keyStore_open: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    myKeyStore_t *ks   = calloc( 1 , sizeof( myKeyStore_t ) ) ;
+    myKeySnap_t  *snap = malloc( sizeof( myKeySnap_t ) ) ;
+    if ( ks == NULL || snap == NULL || ( ks->path = strdup( path ) ) == NULL
+         || ( snap->db = keyDB_open( path ) ) == NULL )
+    {
+        if ( ks != NULL )
+            free( ks->path ) ;
+        free( ks ) ;
+        free( snap ) ;
+        return NULL ;
+    }
+
+    keyStore_prefault( snap->db ) ;
+    snap->version = 1 ;
+    ks->current   = snap ;
+    ks->epoch     = 1 ;
+    pthread_mutex_init( &ks->reloading , NULL ) ;
+    return ks ;
+}
+
+void keyStore_close( myKeyStore_t *ks )
+{
+    if ( ks == NULL )
+        return ;
+    keyDB_close( ks->current->db ) ;
+    free( ks->current ) ;
+    pthread_mutex_destroy( &ks->reloading ) ;
+    free( ks->path ) ;
+    free( ks ) ;
+}
+
+int keyStore_reader( myKeyStore_t *ks )
+{
+    if ( ks == NULL )
+    {
+        fprintf( stderr , "keyStore_reader: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    unsigned r = __atomic_fetch_add( &ks->nReaders , 1 , __ATOMIC_SEQ_CST ) ;
+    if ( r >= KEYSTORE_READERS )
+    {
+        fprintf( stderr , "keyStore_reader: more than %d readers\n" , KEYSTORE_READERS ) ;
+        exit(-1) ;
+    }
+    return r ;
+}
+
+//-----------------------------------------------------------------------------
+const myKeySnap_t *keyStore_enter( myKeyStore_t *ks , int reader )
+{
+    uint64_t e = __atomic_load_n( &ks->epoch , __ATOMIC_SEQ_CST ) ;
+
+    __atomic_store_n( &ks->readers[ reader ].epoch , e , __ATOMIC_SEQ_CST ) ;
+    return __atomic_load_n( &ks->current , __ATOMIC_SEQ_CST ) ;
+}
+
+void keyStore_exit( myKeyStore_t *ks , int reader )
+{
+    __atomic_store_n( &ks->readers[ reader ].epoch , 0 , __ATOMIC_RELEASE ) ;
+}
+
+//-----------------------------------------------------------------------------
+uint64_t keyStore_reload( myKeyStore_t *ks )
+{
+    if ( ks == NULL )
+    {
+        fprintf( stderr , "keyStore_reload: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    // All the work of mapping, checking and faulting in the file happens
+    // before the swap
+    myKeySnap_t *snap = malloc( sizeof( myKeySnap_t ) ) ;
+    if ( snap == NULL || ( snap->db = keyDB_open( ks->path ) ) == NULL )
+    {
+        free( snap ) ;
+        return 0 ;
+    }
+    // With a single CPU the pass would only take that CPU from the readers,
+    // who fault in just the few pages their lookups touch
+    if ( sysconf( _SC_NPROCESSORS_ONLN ) > 1 )
+        keyStore_prefault( snap->db ) ;
+
+    pthread_mutex_lock( &ks->reloading ) ;
+
+    myKeySnap_t *old = ks->current ;
+    uint64_t     version = snap->version = old->version + 1 ;
+    __atomic_store_n( &ks->current , snap , __ATOMIC_SEQ_CST ) ;
+    uint64_t     grace = __atomic_add_fetch( &ks->epoch , 1 , __ATOMIC_SEQ_CST ) ;
+
+    // Readers that entered before the swap finish with the old snapshot
+    unsigned nReaders = __atomic_load_n( &ks->nReaders , __ATOMIC_SEQ_CST ) ;
+    for ( unsigned r = 0 ; r < nReaders && r < KEYSTORE_READERS ; r++ )
+        for ( ;; )
+        {
+            uint64_t e = __atomic_load_n( &ks->readers[ r ].epoch , __ATOMIC_SEQ_CST ) ;
+            if ( e == 0 || e >= grace )
+                break ;
+            nanosleep( &(struct timespec) { 0 , 100000 } , NULL ) ;
+        }
+
+    pthread_mutex_unlock( &ks->reloading ) ;
+
+    keyDB_close( old->db ) ;
+    free( old ) ;
+    return version ;
+}
+
+//***********************************************************************
+// KDC Server
+//***********************************************************************
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+
+typedef struct kdcConn {
+            int              fd ;
+            uint32_t         events ;     // what epoll is watching for
+            int              closing ;    // peer is done , or sent garbage
+            unsigned         inLen ;
+            uint8_t          in[ KDC_IN_BUF ] ;
+            uint8_t         *out ;        // L( MSG2 ) || MSG2 ... not written yet
+            size_t           outOff , outLen , outCap ;
+            struct kdcConn  *prev , *next ;
+        }  kdcConn_t ;
+
+// One complete MSG1 waiting for the next MSG2_newBatch()
+typedef struct {
+            kdcConn_t      *conn ;
+            const myKey_t  *Ka , *Kb ;
+            char            IDa[ KDC_ID_MAX ] , IDb[ KDC_ID_MAX ] ;
+            Nonce_t         Na ;
+        }  kdcRequest_t ;
+
+typedef struct {
+            FILE               *log ;
+            myKeyStore_t       *keys ;
+            int                 reader ;
+            const myKeySnap_t  *snap ;       // inside a wakeup only
+            uint64_t            version ;    // of the last snapshot served from
+            int             epfd ;
+            kdcConn_t      *conns ;
+            unsigned        nReq ;
+            kdcRequest_t    req[ KDC_BATCH_MAX ] ;
+            myKey_t         Ks [ KDC_BATCH_MAX ] ;
+            myMSG2Job_t     job[ KDC_BATCH_MAX ] ;
+            uint64_t        served ;
+        }  kdcServer_t ;
+
+static volatile sig_atomic_t  kdcStopping = 0 ;
+
+void kdcStop( void )
+{
+    kdcStopping = 1 ;
+}
+
+//-----------------------------------------------------------------------------
+static int kdcAddress( const char *path , struct sockaddr_un *addr )
+{
+    if ( path == NULL )
+    {
+        fprintf( stderr , "kdcListen: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    memset( addr , 0 , sizeof( *addr ) ) ;
+    addr->sun_family = AF_UNIX ;
+    if ( strlen( path ) >= sizeof( addr->sun_path ) )
+    {
+        errno = ENAMETOOLONG ;
+        return -1 ;
+    }
+    strcpy( addr->sun_path , path ) ;
+    return 0 ;
+}
+
+int kdcListen( const char *path )
+{
+    struct sockaddr_un  addr ;
+    struct stat         st ;
+
+    if ( kdcAddress( path , &addr ) < 0 )
+        return -1 ;
+
+    int fd = socket( AF_UNIX , SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC , 0 ) ;
+    if ( fd < 0 )
+        return -1 ;
+
+    // A socket file left behind by a KDC that did not exit cleanly
+    if ( lstat( path , &st ) == 0 && S_ISSOCK( st.st_mode ) )
+        unlink( path ) ;
+
+    if ( bind( fd , (struct sockaddr *) &addr , sizeof( addr ) ) < 0 || listen( fd , SOMAXCONN ) < 0 )
+    {
+        int e = errno ;
+        close( fd ) ;
+        errno = e ;
+        return -1 ;
+    }
+    return fd ;
+}
+
+int kdcConnect( const char *path )
+{
+    struct sockaddr_un  addr ;
+
+    if ( kdcAddress( path , &addr ) < 0 )
+        return -1 ;
+
+    int fd = socket( AF_UNIX , SOCK_STREAM | SOCK_CLOEXEC , 0 ) ;
+    if ( fd >= 0 && connect( fd , (struct sockaddr *) &addr , sizeof( addr ) ) < 0 )
+    {
+        int e = errno ;
+        close( fd ) ;
+        errno = e ;
+        return -1 ;
+    }
+    return fd ;
+}
+
+//-----------------------------------------------------------------------------
+// Write as much of c->out as the socket takes without blocking
+
+static void kdcFlush( kdcConn_t *c )
+{
+    while ( c->outOff < c->outLen )
+    {
+        ssize_t n = send( c->fd , c->out + c->outOff , c->outLen - c->outOff , MSG_NOSIGNAL ) ;
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue ;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                c->closing = 1 ;                // the client is gone; drop its replies
+                c->outOff  = c->outLen ;
+            }
+            break ;
+        }
+        c->outOff += n ;
+    }
+
+    if ( c->outOff == c->outLen )
+        c->outOff = c->outLen = 0 ;
+}
+
+static void kdcQueue( kdcConn_t *c , const void *data , size_t len )
+{
+    if ( c->outLen + len > c->outCap )
+    {
+        if ( c->outOff > 0 )
+        {
+            memmove( c->out , c->out + c->outOff , c->outLen - c->outOff ) ;
+            c->outLen -= c->outOff ;
+            c->outOff  = 0 ;
+        }
+        if ( c->outLen + len > c->outCap )
+        {
+            size_t   cap = c->outCap ? c->outCap : 4096 ;
+            while ( cap < c->outLen + len )
+                cap *= 2 ;
+            uint8_t *p = realloc( c->out , cap ) ;
+            if ( p == NULL )
+            {
+                fprintf( stderr , "kdcServe: reply buffer could not be allocated\n" ) ;
+                exit(-1) ;
+            }
+            c->out    = p ;
+            c->outCap = cap ;
+        }
+    }
+    memcpy( c->out + c->outLen , data , len ) ;
+    c->outLen += len ;
+}
+
+//-----------------------------------------------------------------------------
+// Build the MSG2s of every queued MSG1 in one batch and send them
+
+static void kdcAnswer( kdcServer_t *srv )
+{
+    unsigned n = srv->nReq ;
+
+    if ( n == 0 )
+        return ;
+    if ( RAND_bytes( (uint8_t *) srv->Ks , n * sizeof( myKey_t ) ) != 1 )
+        handleErrors( "kdcServe: RAND_bytes failed for the session keys" ) ;
+
+    for ( unsigned i = 0 ; i < n ; i++ )
+    {
+        kdcRequest_t *r = &srv->req[ i ] ;
+        srv->job[ i ] = (myMSG2Job_t) { r->Ka , r->Kb , &srv->Ks[ i ] , r->IDa , r->IDb , &r->Na , NULL , 0 } ;
+    }
+    MSG2_newBatch( srv->log != NULL && LOG_ON( LOG_DEBUG ) ? srv->log : NULL , srv->job , n ) ;
+
+    for ( unsigned i = 0 ; i < n ; i++ )
+    {
+        kdcConn_t *c = srv->req[ i ].conn ;
+
+        kdcQueue( c , &srv->job[ i ].lenMsg2 , LENSIZE ) ;
+        kdcQueue( c , srv->job[ i ].msg2 , srv->job[ i ].lenMsg2 ) ;
+        free( srv->job[ i ].msg2 ) ;
+    }
+    for ( unsigned i = 0 ; i < n ; i++ )
+        kdcFlush( srv->req[ i ].conn ) ;
+
+    srv->served += n ;
+    srv->nReq    = 0 ;
+}
+
+//-----------------------------------------------------------------------------
+// An ID field of a MSG1: 1 .. KDC_ID_MAX bytes , a C string of exactly that size
+
+static int kdcValidId( const uint8_t *id , unsigned len )
+{
+    return len > 0 && len <= KDC_ID_MAX && memchr( id , '\0' , len ) == id + len - 1 ;
+}
+
+//-----------------------------------------------------------------------------
+// Read what the client has sent and queue every MSG1 it completes
+// Nothing is ever waited for: a partial MSG1 stays in c->in until the rest arrives
+
+static void kdcRead( kdcServer_t *srv , kdcConn_t *c )
+{
+    if ( c->closing || c->outLen - c->outOff >= KDC_OUT_MAX )
+        return ;
+
+    ssize_t got = read( c->fd , c->in + c->inLen , KDC_IN_BUF - c->inLen ) ;
+    if ( got <= 0 )
+    {
+        // End of file: answer what was sent , then close
+        if ( got == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) )
+            c->closing = 1 ;
+        return ;
+    }
+    c->inLen += got ;
+
+    unsigned off = 0 ;
+    for ( ;; )
+    {
+        const uint8_t *p     = c->in + off ;
+        unsigned       avail = c->inLen - off , LenA , LenB ;
+
+        // MSG1 = L(IDa) || IDa || L(IDb) || IDb || Na
+        if ( avail < LENSIZE )
+            break ;
+        memcpy( &LenA , p , LENSIZE ) ;
+        if ( LenA == 0 || LenA > KDC_ID_MAX )
+            goto malformed ;
+        if ( avail < 2 * LENSIZE + LenA )
+            break ;
+        memcpy( &LenB , p + LENSIZE + LenA , LENSIZE ) ;
+        if ( LenB == 0 || LenB > KDC_ID_MAX )
+            goto malformed ;
+
+        unsigned LenMsg1 = 2 * LENSIZE + LenA + LenB + NONCELEN ;
+        if ( avail < LenMsg1 )
+            break ;
+
+        const uint8_t *IDa = p + LENSIZE , *IDb = p + 2 * LENSIZE + LenA ;
+        if ( ! kdcValidId( IDa , LenA ) || ! kdcValidId( IDb , LenB ) )
+            goto malformed ;
+
+        const myKey_t *Ka = keyDB_lookup( srv->snap->db , (const char *) IDa ) ;
+        const myKey_t *Kb = keyDB_lookup( srv->snap->db , (const char *) IDb ) ;
+        if ( Ka == NULL || Kb == NULL )
+            goto malformed ;
+
+        kdcRequest_t *r = &srv->req[ srv->nReq++ ] ;
+        r->conn = c ;
+        r->Ka   = Ka ;
+        r->Kb   = Kb ;
+        memcpy( r->IDa , IDa , LenA ) ;
+        memcpy( r->IDb , IDb , LenB ) ;
+        memcpy( r->Na  , IDb + LenB , NONCELEN ) ;
+        off += LenMsg1 ;
+
+        if ( srv->nReq == KDC_BATCH_MAX )
+            kdcAnswer( srv ) ;
+    }
+
+    memmove( c->in , c->in + off , c->inLen - off ) ;
+    c->inLen -= off ;
+    return ;
+
+malformed:
+    if ( srv->log != NULL && LOG_ON( LOG_DEBUG ) )
+        fprintf( srv->log , "KDC: malformed MSG1 , or unknown principal , on FD %d; closing it\n" , c->fd ) ;
+    c->inLen   = 0 ;
+    c->closing = 1 ;
+}
+
+//-----------------------------------------------------------------------------
+static void kdcAccept( kdcServer_t *srv , int listenFd )
+{
+    for ( ;; )
+    {
+        int fd = accept4( listenFd , NULL , NULL , SOCK_NONBLOCK | SOCK_CLOEXEC ) ;
+        if ( fd < 0 )
+        {
+            if ( errno == EINTR || errno == ECONNABORTED )
+                continue ;
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && srv->log != NULL )
+                fprintf( srv->log , "KDC: accept() failed: %s\n" , strerror( errno ) ) ;
+            return ;
+        }
+
+        kdcConn_t          *c  = calloc( 1 , sizeof( kdcConn_t ) ) ;
+        struct epoll_event  ev = { .events = EPOLLIN , .data.ptr = c } ;
+        if ( c == NULL || epoll_ctl( srv->epfd , EPOLL_CTL_ADD , fd , &ev ) < 0 )
+        {
+            if ( srv->log != NULL )
+                fprintf( srv->log , "KDC: could not take connection FD %d\n" , fd ) ;
+            close( fd ) ;
+            free( c ) ;
+            continue ;
+        }
+
+        c->fd     = fd ;
+        c->events = EPOLLIN ;
+        c->next   = srv->conns ;
+        if ( srv->conns != NULL )
+            srv->conns->prev = c ;
+        srv->conns = c ;
+
+        if ( srv->log != NULL && LOG_ON( LOG_DEBUG ) )
+            fprintf( srv->log , "KDC: new client on FD %d\n" , fd ) ;
+    }
+}
+
+static void kdcClose( kdcServer_t *srv , kdcConn_t *c )
+{
+    if ( srv->log != NULL && LOG_ON( LOG_DEBUG ) )
+        fprintf( srv->log , "KDC: client on FD %d is gone\n" , c->fd ) ;
+
+    epoll_ctl( srv->epfd , EPOLL_CTL_DEL , c->fd , NULL ) ;
+    close( c->fd ) ;
+
+    if ( c->prev != NULL )
+        c->prev->next = c->next ;
+    else
+        srv->conns = c->next ;
+    if ( c->next != NULL )
+        c->next->prev = c->prev ;
+
+    free( c->out ) ;
+    free( c ) ;
+}
+
+//-----------------------------------------------------------------------------
+// After a wakeup: close a finished client once its replies are out, or 
+// watch for whatever it is waiting on. Clients too far behind in reading 
+// their MSG2s are not read from until they catch up
+
+static void kdcSettle( kdcServer_t *srv , kdcConn_t *c )
+{
+    size_t pending = c->outLen - c->outOff ;
+
+    if ( c->closing && pending == 0 )
+    {
+        kdcClose( srv , c ) ;
+        return ;
+    }
+
+    uint32_t want = ( c->closing || pending >= KDC_OUT_MAX ? 0 : EPOLLIN ) | ( pending > 0 ? EPOLLOUT : 0 ) ;
+    if ( want != c->events )
+    {
+        struct epoll_event  ev = { .events = want , .data.ptr = c } ;
+        epoll_ctl( srv->epfd , EPOLL_CTL_MOD , c->fd , &ev ) ;
+        c->events = want ;
+    }
+}
+
+//-----------------------------------------------------------------------------
+uint64_t kdcServe( int listenFd , FILE *log , myKeyStore_t *keys , uint64_t maxHandshakes )
+{
+    if ( keys == NULL )
+    {
+        fprintf( stderr , "kdcServe: NULL pointer argument\n" ) ;
+        exit(-1) ;
+    }
+
+    kdcServer_t *srv = calloc( 1 , sizeof( kdcServer_t ) ) ;
+    if ( srv == NULL )
+    {
+        fprintf( stderr , "kdcServe: server state could not be allocated\n" ) ;
+        exit(-1) ;
+    }
+    srv->log    = log ;
+    srv->keys   = keys ;
+    srv->reader = keyStore_reader( keys ) ;
+
+    struct epoll_event  ev = { .events = EPOLLIN , .data.ptr = NULL } ;
+    srv->epfd = epoll_create1( EPOLL_CLOEXEC ) ;
+    if ( srv->epfd < 0 || epoll_ctl( srv->epfd , EPOLL_CTL_ADD , listenFd , &ev ) < 0 )
+    {
+        fprintf( stderr , "kdcServe: could not watch the listening socket: %s\n" , strerror( errno ) ) ;
+        exit(-1) ;
+    }
+
+    // SIGINT and SIGTERM only interrupt epoll_pwait(), never a half-built reply
+    // They are let through there even if the caller had them blocked already
+    sigset_t  stopSignals , oldMask , waitMask ;
+    sigemptyset( &stopSignals ) ;
+    sigaddset( &stopSignals , SIGINT ) ;
+    sigaddset( &stopSignals , SIGTERM ) ;
+    pthread_sigmask( SIG_BLOCK , &stopSignals , &oldMask ) ;
+    waitMask = oldMask ;
+    sigdelset( &waitMask , SIGINT ) ;
+    sigdelset( &waitMask , SIGTERM ) ;
+
+    struct epoll_event  events[ KDC_EVENTS ] ;
+    while ( ! kdcStopping && ( maxHandshakes == 0 || srv->served < maxHandshakes ) )
+    {
+        int n = epoll_pwait( srv->epfd , events , KDC_EVENTS , -1 , &waitMask ) ;
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+                continue ;
+            fprintf( stderr , "kdcServe: epoll_wait failed: %s\n" , strerror( errno ) ) ;
+            break ;
+        }
+
+        // Every MSG1 completed in this wakeup is looked up and answered
+        // on one snapshot; a reload never waits on more than one wakeup
+        srv->snap = keyStore_enter( keys , srv->reader ) ;
+        if ( srv->snap->version != srv->version )
+        {
+            if ( srv->version != 0 && log != NULL && LOG_ON( LOG_DEBUG ) )
+                fprintf( log , "KDC: now serving key database version %lu ( %lu principals )\n" ,
+                         (unsigned long) srv->snap->version , (unsigned long) srv->snap->db->count ) ;
+            srv->version = srv->snap->version ;
+        }
+
+        for ( int i = 0 ; i < n ; i++ )
+        {
+            kdcConn_t *c = events[ i ].data.ptr ;
+
+            if ( c == NULL )
+                kdcAccept( srv , listenFd ) ;
+            else
+            {
+                if ( events[ i ].events & EPOLLOUT )
+                    kdcFlush( c ) ;
+                if ( events[ i ].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+                    kdcRead( srv , c ) ;
+            }
+        }
+
+        // Everything that arrived in this wakeup shares one batch
+        kdcAnswer( srv ) ;
+        keyStore_exit( keys , srv->reader ) ;
+        srv->snap = NULL ;
+
+        for ( int i = 0 ; i < n ; i++ )
+            if ( events[ i ].data.ptr != NULL )
+                kdcSettle( srv , events[ i ].data.ptr ) ;
+    }
+
+    // Hand out what is ready without waiting on anyone , then hang up
+    while ( srv->conns != NULL )
+    {
+        kdcFlush( srv->conns ) ;
+        kdcClose( srv , srv->conns ) ;
+    }
+    close( srv->epfd ) ;
+    pthread_sigmask( SIG_SETMASK , &oldMask , NULL ) ;
+    kdcStopping = 0 ;
+
+    uint64_t served = srv->served ;
+    free( srv ) ;
+    return served ;
+}
@@ -55,6 +55,8 @@ unsigned   decrypt( uint8_t *pCipherText, unsigned cipherText_len,
 // PA-01
 //***********************************************************************
 
+// Both return the bytes written, or -1 ( errno EOVERFLOW ) once that count
+// does not fit in an int; the whole file is still processed
 int    encryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv );
 int    decryptFile( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv );
 
@@ -122,3 +124,772 @@ void     MSG5_receive( FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb ) ;
 
 void     fNonce( Nonce_t r , Nonce_t n ) ;
 
+
+//***********************************************************************
+// Key Handles:  expand a myKey_t once and reuse its cipher contexts
+//***********************************************************************
+
+typedef struct {
+            myKey_t           k ;         // copy of the key || IV this handle was built from
+            EVP_CIPHER       *cipher ;    // pre-fetched ALGORITHM object
+            EVP_CIPHER_CTX   *encCtx ,    // contexts initialized once with the key schedule
+                             *decCtx ;
+            EVP_CIPHER       *aead ;      // AEAD_ALGORITHM object and contexts, 
+            EVP_CIPHER_CTX   *aeadEncCtx ,//   created the first time the handle is used for AEAD
+                             *aeadDecCtx ;
+        }  myKeyHandle_t ;
+
+#define KEY_CACHE_SLOTS    8          // handles kept per myCryptoCtx_t
+
+myKeyHandle_t *keyHandle_new ( const uint8_t *key , const uint8_t *iv ) ;
+void           keyHandle_free( myKeyHandle_t *h ) ;
+
+unsigned       keyHandle_encrypt( myKeyHandle_t *h , uint8_t *pPlainText, unsigned plainText_len , 
+                                  uint8_t *pCipherText ) ;
+int            keyHandle_decrypt( myKeyHandle_t *h , uint8_t *pCipherText, unsigned cipherText_len , 
+                                  uint8_t *pDecryptedText ) ;     // -1 : wrong padding
+
+myKeyHandle_t *keyCache_get  ( const uint8_t *key , const uint8_t *iv ) ;
+void           keyCache_flush( void ) ;
+
+//***********************************************************************
+// Batch Encryption:  many independent CBC streams in one call
+//***********************************************************************
+
+// One independent encryption: the caller fills in everything except
+// cipherText_len, which is set by encryptBatch()
+// pCipherText must have room for plainText_len rounded up to the next 
+// full block ( i.e. plainText_len + INITVECTOR_LEN bytes is always enough )
+typedef struct {
+            uint8_t        *pPlainText ;
+            unsigned        plainText_len ;
+            const uint8_t  *key , *iv ;
+            uint8_t        *pCipherText ;
+            unsigned        cipherText_len ;
+        }  myCipherJob_t ;
+
+#define BATCH_LANES    4     // number of CBC streams interleaved per AES round
+
+void     encryptBatch( myCipherJob_t *jobs , unsigned nJobs ) ;
+
+// Arguments of one MSG2_new() call. *msg2 and lenMsg2 are set by MSG2_newBatch()
+typedef struct {
+            const myKey_t  *Ka , *Kb , *Ks ;
+            const char     *IDa , *IDb ;
+            Nonce_t        *Na ;
+            uint8_t        *msg2 ;
+            unsigned        lenMsg2 ;
+        }  myMSG2Job_t ;
+
+unsigned MSG2_newBatch( FILE *log , myMSG2Job_t *jobs , unsigned nJobs ) ;
+
+//***********************************************************************
+// AEAD:  AES-256-GCM for the protocol messages
+//***********************************************************************
+
+// One pass gives both confidentiality and integrity, with no padding.
+// Sealed message = Nonce || Cipher || Tag
+// The nonce is random per message: the IV in a myKey_t never changes, and a
+// repeated (key,nonce) pair breaks GCM completely
+#define AEAD_ALGORITHM     EVP_aes_256_gcm
+#define AEAD_NONCE_LEN     12
+#define AEAD_TAG_LEN       16
+#define AEAD_OVERHEAD      ( AEAD_NONCE_LEN + AEAD_TAG_LEN )
+
+typedef enum { MODE_CBC = 0 , MODE_GCM }  cipherMode_t ;
+
+// Mode used by MSG2 through MSG5. All three parties must agree on it
+void          setCipherMode( cipherMode_t mode ) ;
+cipherMode_t  getCipherMode( void ) ;
+void          setCipherModeFromEnv( void ) ;   // CIPHER_MODE=gcm selects MODE_GCM
+
+// Returns the size of the sealed message ( plainText_len + AEAD_OVERHEAD )
+unsigned   encryptAEAD( uint8_t *pPlainText, unsigned plainText_len, 
+                        const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText ) ;
+
+// Returns the size of the decrypted text, or -1 if the message is
+// malformed or its tag does not verify. Nothing is usable on failure
+int        decryptAEAD( uint8_t *pCipherText, unsigned cipherText_len, 
+                        const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText ) ;
+
+//***********************************************************************
+// Chunked Files:  encryptFile() / decryptFile() spread over worker threads
+//***********************************************************************
+
+// Container = Header || Chunk_0 || ... || Chunk_n-1 || L = 0 || n (8)
+//   Header  = "MYCF" || version || chunk length  ( 4-byte fields, network order )
+//   Chunk_i = L(cipher_i) || cipher_i , where cipher_i = Encr( K , IV_i , plain_i )
+// Every plaintext chunk except the last holds exactly the chunk length. The
+// end marker and chunk count tell a finished container from a truncated one
+// IV_i = AES-ECB( K , IV xor i ) , so chunks are independent of each other
+// and any worker can handle any chunk. encryptFile() / decryptFile() remain
+// the single-stream format
+#define CHUNKED_MAGIC        "MYCF"
+#define CHUNKED_VERSION      1
+#define CHUNKED_HEADER_LEN   12
+#define FILE_CHUNK_LEN       ( 64 * 1024 )
+
+// nThreads == 0 means one worker per online CPU
+// Return the number of bytes written to fd_out, or -1 on a malformed or
+// truncated container
+ssize_t  encryptFileChunked( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , unsigned nThreads ) ;
+ssize_t  decryptFileChunked( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , unsigned nThreads ) ;
+
+//***********************************************************************
+// Seekable Files:  chunked container with an index for random access
+//***********************************************************************
+
+// Same chunks as CHUNKED_VERSION, then
+//   L = 0  ||  Index  ||  Footer    ( the Footer carries the chunk count )
+//   Index  = one entry per chunk: offset of cipher_i (8) || L(cipher_i) (4) 
+//            || L(plain_i) (4) || IV_i (16)
+//   Footer = offset of Index (8) || number of chunks (8) || "MYCI" || 0 (4)
+// Byte N lives in chunk N / FILE_CHUNK_LEN, so a read only has to fetch and
+// decrypt the chunks it covers. decryptFileChunked() reads this format too
+// An index whose chunks are not full and back to back up to the last one
+// is rejected
+#define CHUNKED_VERSION_INDEXED   2
+#define CHUNK_INDEX_MAGIC         "MYCI"
+#define CHUNK_INDEX_ENTRY_LEN     32
+#define CHUNK_INDEX_FOOTER_LEN    24
+
+ssize_t  encryptFileSeekable( int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv , unsigned nThreads ) ;
+
+// Decrypt 'len' plaintext bytes starting at plaintext 'offset' of the seekable 
+// container open on 'fd' into 'out'. Only the chunks covering the range are read,
+// and their IVs come from the index, so only the key is needed
+// Returns the number of bytes produced ( short at end of file ), or -1 on error
+ssize_t  decryptRange( int fd , uint64_t offset , size_t len , const uint8_t *key , uint8_t *out ) ;
+
+//***********************************************************************
+// File I/O Engines:  how encryptFile(), decryptFile() and fileDigest() move data
+//***********************************************************************
+
+// IO_ENGINE_STREAM   read() / write() through 2 KB buffers, works on anything
+// IO_ENGINE_MMAP     map a regular input file and work straight from the mapping;
+//                    a regular output file opened O_RDWR is mapped too
+// IO_ENGINE_URING    encryptFile() / decryptFile() between two regular files keep
+//                    URING_DEPTH reads and writes in flight on an io_uring with
+//                    registered buffers, overlapping the disk with the cipher.
+//                    Falls back to a pread() / pwrite() loop where io_uring is 
+//                    unavailable. fileDigest() treats it like IO_ENGINE_MMAP
+// IO_ENGINE_AUTO     the fastest engine that applies to the descriptors at hand
+//                    ( currently IO_ENGINE_MMAP, which wins on a warm page cache )
+// Whatever the engine, pipes and other non-regular files use the stream path
+typedef enum { IO_ENGINE_AUTO = 0 , IO_ENGINE_STREAM , IO_ENGINE_MMAP , IO_ENGINE_URING }  ioEngine_t ;
+
+#define FILE_IO_SLICE   ( 1 << 22 )    // bytes handed to OpenSSL / write() at a time
+#define URING_DEPTH     8              // blocks in flight, each with its own buffers
+#define URING_BLOCK     ( 256 * 1024 ) // bytes per read; a multiple of the AES block
+
+void        setIOEngine( ioEngine_t engine ) ;
+ioEngine_t  getIOEngine( void ) ;
+
+//***********************************************************************
+// Thread-safe Contexts:  per-caller scratch buffers and key cache
+//***********************************************************************
+
+// Everything encrypt() ... MSG5_receive() used to keep in file-level statics
+// Each thread ( or each connection ) owns one, so calls on different contexts
+// never share state
+typedef struct {
+            uint8_t          plaintext  [ PLAINTEXT_LEN_MAX ] ,
+                             ciphertext [ CIPHER_LEN_MAX    ] ,
+                             decryptext [ DECRYPTED_LEN_MAX ] ,
+                             ciphertext2[ CIPHER_LEN_MAX    ] ;
+            myKeyHandle_t   *keyCache[ KEY_CACHE_SLOTS ] ;   // see keyCache_get()
+            unsigned         keyCacheNext ;
+        }  myCryptoCtx_t ;
+
+myCryptoCtx_t *myCryptoCtx_new ( void ) ;
+void           myCryptoCtx_free( myCryptoCtx_t *ctx ) ;
+
+// The calling thread's own context, allocated on first use and freed when the
+// thread exits. The original entry points below are wrappers around their
+// _r versions using this context, so they are now safe to call from any thread
+myCryptoCtx_t *myCryptoCtx_thread( void ) ;
+
+// Reentrant versions: same behavior as the function without the _r suffix,
+// but all scratch state comes from 'ctx', which must not be used by two 
+// threads at the same time
+// fileDigest(), getKeyFromFile(), MSG1_*(), MSG3_new(), 
+// fNonce(), keyHandle_*(), the chunked / seekable functions and decryptRange()
+// never had shared state and need no _r version. setCipherMode() and 
+// setIOEngine() stay process-wide; set them before starting any threads
+unsigned   encrypt_r( myCryptoCtx_t *ctx , uint8_t *pPlainText, unsigned plainText_len, 
+                      const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText ) ;
+int        decrypt_r( myCryptoCtx_t *ctx , uint8_t *pCipherText, unsigned cipherText_len, 
+                      const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText ) ;   // -1 : wrong padding
+int        encryptFile_r( myCryptoCtx_t *ctx , int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv ) ;
+int        decryptFile_r( myCryptoCtx_t *ctx , int fd_in, int fd_out, const uint8_t *key, const uint8_t *iv ) ;
+
+unsigned   MSG2_new_r( myCryptoCtx_t *ctx , FILE *log , uint8_t **msg2 , const myKey_t *Ka , const myKey_t *Kb , 
+                       const myKey_t *Ks , const char *IDa , const char *IDb , Nonce_t *Na ) ;
+void       MSG2_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Ka , myKey_t *Ks, char **IDb , 
+                           Nonce_t *Na , unsigned *lenTktCipher , uint8_t **tktCipher ) ;
+void       MSG3_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Kb , myKey_t *Ks , 
+                           char **IDa , Nonce_t *Na2 ) ;
+unsigned   MSG4_new_r( myCryptoCtx_t *ctx , FILE *log , uint8_t **msg4, const myKey_t *Ks , 
+                       Nonce_t *fNa2 , Nonce_t *Nb ) ;
+void       MSG4_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Ks , 
+                           Nonce_t *rcvd_fNa2 , Nonce_t *Nb ) ;
+unsigned   MSG5_new_r( myCryptoCtx_t *ctx , FILE *log , uint8_t **msg5, const myKey_t *Ks , Nonce_t *fNb ) ;
+void       MSG5_receive_r( myCryptoCtx_t *ctx , FILE *log , int fd , const myKey_t *Ks , Nonce_t *fNb ) ;
+
+myKeyHandle_t *keyCache_get_r  ( myCryptoCtx_t *ctx , const uint8_t *key , const uint8_t *iv ) ;
+void           keyCache_flush_r( myCryptoCtx_t *ctx ) ;
+
+void       encryptBatch_r ( myCryptoCtx_t *ctx , myCipherJob_t *jobs , unsigned nJobs ) ;
+unsigned   MSG2_newBatch_r( myCryptoCtx_t *ctx , FILE *log , myMSG2Job_t *jobs , unsigned nJobs ) ;
+
+unsigned   encryptAEAD_r( myCryptoCtx_t *ctx , uint8_t *pPlainText, unsigned plainText_len, 
+                          const uint8_t *key, const uint8_t *iv, uint8_t *pCipherText ) ;
+int        decryptAEAD_r( myCryptoCtx_t *ctx , uint8_t *pCipherText, unsigned cipherText_len, 
+                          const uint8_t *key, const uint8_t *iv, uint8_t *pDecryptedText ) ;
+
+//***********************************************************************
+// Fused Encrypt + Digest:  one pass over the file instead of two
+//***********************************************************************
+
+// Which side of the cipher the digest covers
+typedef enum { DIGEST_PLAINTEXT = 0 , DIGEST_CIPHERTEXT }  digestOf_t ;
+
+#define FUSED_BLOCK   ( 64 * 1024 )    // bytes ciphered then hashed while still in cache
+
+// encryptFile() and fileDigest() rolled into one: each block of 'fd_in' is
+// read once, encrypted to 'fd_out' and fed to SHA-256 on the 'which' side
+// The digest goes to 'digest' ( EVP_MAX_MD_SIZE bytes ) and its length to *digestLen
+// Returns the number of ciphertext bytes written
+ssize_t  encryptFileDigest( int fd_in , int fd_out , const uint8_t *key , const uint8_t *iv , 
+                            digestOf_t which , uint8_t *digest , unsigned *digestLen ) ;
+
+// The same for decryptFile(): DIGEST_PLAINTEXT now hashes what is written
+// Returns the number of plaintext bytes written, or -1 with *digestLen 0 if
+// the last block does not decrypt ( wrong key, tampered or truncated file ).
+// A mapped output is then left as it was; a streamed one holds the bytes
+// decrypted before that block
+ssize_t  decryptFileDigest( int fd_in , int fd_out , const uint8_t *key , const uint8_t *iv , 
+                            digestOf_t which , uint8_t *digest , unsigned *digestLen ) ;
+
+//***********************************************************************
+// Tree Digests:  SHA-256 Merkle tree over fixed chunks, hashed in parallel
+//***********************************************************************
+
+// Leaf i  = SHA-256( 0x00 || bytes [ i * TREE_CHUNK_LEN , (i+1) * TREE_CHUNK_LEN ) )
+// Node    = SHA-256( 0x01 || left || right ), an odd node out is carried up as is
+// An empty file has one leaf, the hash of the empty chunk
+#define TREE_CHUNK_LEN   ( 1 << 20 )
+
+typedef struct {
+            uint8_t    root[ SHA256_DIGEST_LENGTH ] ;
+            uint64_t   start ,       // file offset the first leaf starts at
+                       fileLen ;     // bytes covered by the leaves
+            size_t     nLeaves ;
+            uint8_t  (*leaves)[ SHA256_DIGEST_LENGTH ] ;
+        }  myTreeDigest_t ;
+
+// Hash what is left of 'fd_in' into 't', whose leaves are malloc'ed and must
+// be released with treeDigest_free(). A regular file is hashed by 'nThreads'
+// workers ( 0 means one per online CPU ); anything else, or a non-zero
+// 'fd_out' that wants a copy of the data as in fileDigest(), is read in order
+// Returns 0, or -1 if 'fd_in' could not be read
+int   fileDigestTree( int fd_in , int fd_out , unsigned nThreads , myTreeDigest_t *t ) ;
+void  treeDigest_free( myTreeDigest_t *t ) ;
+
+// Re-hash leaf 'i' from 'fd' ( read with pread(), so 'fd' must be seekable )
+// Returns 1 if it still matches, 0 if that chunk changed, -1 on error
+int   treeDigest_verifyChunk( int fd , const myTreeDigest_t *t , size_t i ) ;
+
+// What fileDigest() computes: plain SHA-256 of the stream ( the default ),
+// or the root of the tree above, hashed on all online CPUs
+typedef enum { DIGEST_MODE_SHA256 = 0 , DIGEST_MODE_TREE }  digestMode_t ;
+
+void          setDigestMode( digestMode_t mode ) ;
+digestMode_t  getDigestMode( void ) ;
+
+//***********************************************************************
+// Batch Digests:  SHA-256 of many files on a pool of workers
+//***********************************************************************
+
+// One file to hash. Set 'fd' to an open descriptor ( hashed from its current
+// offset, like fileDigest() ), or to -1 and 'path' to have the worker open it
+// The other fields are filled in by fileDigestBatch()
+typedef struct {
+            const char  *path ;
+            int          fd ;
+            uint8_t      digest[ SHA256_DIGEST_LENGTH ] ;
+            unsigned     digestLen ;    // 0 if the file could not be opened or read
+            uint64_t     bytes ;        // bytes read ( 0 on a digest cache hit )
+        }  myDigestJob_t ;
+
+typedef struct {
+            size_t     files , failed ;
+            uint64_t   bytes , elapsedNs ;
+            double     filesPerSec , mbPerSec ;
+        }  myDigestStats_t ;
+
+#define DIGEST_BATCH_CLAIM   16              // jobs a worker takes at a time
+#define DIGEST_BATCH_BUF     ( 256 * 1024 )  // files up to this size take one read()
+
+// Hash every job on 'nThreads' workers ( 0 means one per online CPU; more
+// than that helps when the files are not in the page cache ). Each worker
+// keeps one SHA-256 context for all its files. 'stats' may be NULL
+// Returns the number of jobs that failed
+size_t  fileDigestBatch( myDigestJob_t *jobs , size_t nJobs , unsigned nThreads , myDigestStats_t *stats ) ;
+
+//***********************************************************************
+// Resumable Digests:  SHA-256 state that survives restarts
+//***********************************************************************
+
+// A running SHA-256 plus the number of bytes already fed to it. Unlike an
+// EVP_MD_CTX, whose state OpenSSL keeps opaque, it can be written to disk
+typedef struct {
+            SHA256_CTX   sha ;
+            uint64_t     offset ;
+        }  myDigestState_t ;
+
+// Checkpoint file: "MYDS" , version , offset , the SHA-256 words , and the
+// first 8 bytes of a SHA-256 over all of that to catch torn or corrupt files
+// All integers are stored in network byte order
+#define DIGEST_STATE_MAGIC      "MYDS"
+#define DIGEST_STATE_VERSION    1
+#define DIGEST_STATE_WORDS      28                               // h[8] Nl Nh data[16] num md_len
+#define DIGEST_STATE_LEN        ( 16 + 4 * DIGEST_STATE_WORDS + 8 )
+#define DIGEST_CHECKPOINT_EVERY ( (uint64_t) 1 << 30 )            // bytes between automatic saves
+
+void  digestState_init( myDigestState_t *s ) ;
+
+// Save atomically ( written beside 'path', then renamed over it ) / load
+// digestState_load() returns -1 if the file is missing, truncated or corrupt
+int   digestState_save( const myDigestState_t *s , const char *path ) ;
+int   digestState_load( myDigestState_t *s , const char *path ) ;
+
+// Feed 'fd' from byte s->offset to end of file. A seekable 'fd' is read with
+// pread(), so an append-only file can be fed again later for just its new tail;
+// a pipe must already be positioned at s->offset. If 'checkpoint' is not NULL
+// the state is saved there every 'every' bytes ( 0: DIGEST_CHECKPOINT_EVERY )
+// and once more at the end
+// Returns the number of bytes fed by this call, or -1 on a read or save error
+int64_t  digestState_feed( myDigestState_t *s , int fd , const char *checkpoint , uint64_t every ) ;
+
+// The SHA-256 of everything fed so far. 's' itself is left untouched, so
+// feeding can go on afterwards. Returns the digest length
+unsigned digestState_digest( const myDigestState_t *s , uint8_t *digest ) ;
+
+// fileDigest() of all of 'fd_in' that picks up from 'checkpoint' if one exists
+// and keeps it up to date, so an interrupted run resumes where it stopped
+// Returns the digest length, or 0 on error
+size_t   fileDigestResume( int fd_in , const char *checkpoint , uint8_t *digest ) ;
+
+//***********************************************************************
+// Digest Cache:  skip re-hashing files that have not changed
+//***********************************************************************
+
+// A shared, memory-mapped table from ( dev , inode , size , mtime in ns ) to
+// the SHA-256 of the whole file ( the ctime must match too, since the mtime
+// can be set back by hand ). While one is open, fileDigest() ( with no
+// fd_out copy and in DIGEST_MODE_SHA256 ) and fileDigestBatch() answer from it
+// for a regular file read from offset 0, and record what they compute
+// Any number of processes may share the file: readers take no lock and retry
+// on a slot being rewritten, writers serialize on flock()
+// The file is in host byte order, like the dev / inode numbers it holds
+#define DIGEST_CACHE_MAGIC     "MYDC"
+#define DIGEST_CACHE_VERSION   1
+#define DIGEST_CACHE_SLOTS     ( 1 << 18 )   // default table size, a power of two
+#define DIGEST_CACHE_PROBE     8             // slots looked at per lookup
+
+// A file changed again within this long of its recorded times could carry
+// the same mtime with different contents, so it is not cached yet
+#define DIGEST_CACHE_RACY_NS   1000000000LL
+
+typedef struct {
+            uint64_t   hits , misses , stores ;
+        }  myDigestCacheStats_t ;
+
+// Open ( or create with 'nSlots' slots, 0 means DIGEST_CACHE_SLOTS ) the cache
+// at 'path' for this process. Returns 0, or -1 if it cannot be used
+int   digestCache_open( const char *path , size_t nSlots ) ;
+void  digestCache_close( void ) ;
+
+// Counters for this process and for the cache file over its lifetime
+// Either pointer may be NULL
+void  digestCache_stats( myDigestCacheStats_t *mine , myDigestCacheStats_t *all ) ;
+
+//***********************************************************************
+// RSA Key Cache:  parse each key file once per process
+//***********************************************************************
+
+// getRSAfromFile() now returns a key shared through this cache, keyed by path,
+// public / private, and the file's ( dev , inode , size , mtime , ctime ), so
+// an edited key file is parsed again. Each call takes a reference: release it
+// with RSA_free() as before, and never modify the returned key
+#define RSA_CACHE_SLOTS    16
+
+RSA   *rsaCache_get( const char *filename , int public ) ;
+void   rsaCache_flush( void ) ;
+
+// With the DER sidecar on, a miss on a public key loads "<filename>.der",
+// skipping the base64 and PEM layers, when that sidecar records the PEM
+// file's current ( dev , inode , size , mtime , ctime ). Otherwise it parses
+// the PEM file and writes the sidecar for next time ( mode 0600 ). Private
+// keys never get one. Off by default
+void   setRSAderSidecar( int on ) ;
+
+// Write 'rsa' in DER: SubjectPublicKeyInfo if 'public', else PKCS#1 RSAPrivateKey
+// Written beside 'derPath' and renamed over it. Returns 0, or -1 on error
+// A private key is written unencrypted, whatever protected its PEM file
+int    saveRSAasDER( RSA *rsa , int public , const char *derPath ) ;
+
+//***********************************************************************
+// Envelopes:  one bulk encryption, the file key wrapped for N recipients
+//***********************************************************************
+
+// "MYEV" , version , recipient count , header length  ( 4 bytes each )
+// then per recipient: SHA-256 of its public key in DER ( its key id ) ,
+// wrapped length ( 4 bytes ) , RSA-OAEP( file key || file IV )
+// The header is zero-padded to a multiple of ENVELOPE_HEADER_ALIGN so that
+// recipients can later be changed in place; the body that follows is plain
+// encryptFile() output under the random file key. Integers are in network byte order
+#define ENVELOPE_MAGIC          "MYEV"
+#define ENVELOPE_VERSION        1
+#define ENVELOPE_FIXED_LEN      16
+#define ENVELOPE_HEADER_ALIGN   4096
+#define ENVELOPE_RECIPIENTS_MAX 64
+
+// Encrypt 'fd_in' for every key in 'recipients' ( public keys, e.g. from 
+// getRSAfromFile( path , 1 ) ). Returns the bytes written, header included,
+// or -1 if a key cannot wrap the file key
+ssize_t  envelopeEncryptFile( int fd_in , int fd_out , RSA **recipients , unsigned nRecipients ) ;
+
+// Decrypt with the private key of any recipient. 'fd_in' may be a pipe
+// Returns the plaintext bytes written, or -1 if the header is malformed or
+// 'privKey' is not one of the recipients
+ssize_t  envelopeDecryptFile( int fd_in , int fd_out , RSA *privKey ) ;
+
+// Replace the recipient list of the envelope file 'path' without touching the
+// body: 'privKey' must unwrap the current file key, which is then wrapped
+// again for 'recipients'. The new header goes to the journal "<path>.rewrap"
+// ( fsync()ed ) before it overwrites the old one in place, then the journal
+// is removed
+// Returns 0, or -1 if 'privKey' is not a recipient, the new list does not
+// fit in the existing header, or an I/O error left a journal behind
+int      envelopeRewrap( const char *path , RSA *privKey , RSA **recipients , unsigned nRecipients ) ;
+
+// Finish a rewrap of 'path' that a crash interrupted, from its journal. Run
+// it before decrypting a file that may have been rewrapped at the time; 
+// envelopeRewrap() runs it first. Returns 0 ( also with no journal ), or -1
+int      envelopeRecover( const char *path ) ;
+
+//***********************************************************************
+// Handshake Benchmark:  "dispatcher -b K"
+//***********************************************************************
+
+// The dispatcher exports HANDSHAKES=K to all three parties; each then runs
+// one logged handshake followed by K more with their logs sent to /dev/null
+// ( or, under LOG_BINARY_TRACE, all K + 1 to the binary trace ).
+// Basim also acknowledges every MSG5 with one byte so that Amal can time it
+#define HANDSHAKES_ENV   "HANDSHAKES"
+#define HANDSHAKE_ACK    0x06
+
+// K from the environment, or 0 for the usual single exchange
+unsigned  handshakesFromEnv( void ) ;
+
+// Sort the 'n' latencies in 'ns' and print one line with their
+// p50 , p99 and p999 in microseconds
+void      latencyReport( FILE *out , const char *step , uint64_t *ns , unsigned n ) ;
+
+//***********************************************************************
+// Latency Statistics:  build with -DMYCRYPTO_STATS
+//***********************************************************************
+
+// encrypt(), decrypt(), every MSGn_new() / MSGn_receive() and the reads and
+// writes on the protocol pipes are timed with the TSC and counted in
+// per-thread histograms with power-of-two buckets. Recording one sample is
+// two rdtsc's and three increments on memory no other thread writes.
+// Without MYCRYPTO_STATS all of it compiles away
+typedef enum {
+            STAT_ENCRYPT = 0 ,  STAT_DECRYPT ,
+            STAT_MSG1_NEW ,     STAT_MSG1_RECEIVE ,
+            STAT_MSG2_NEW ,     STAT_MSG2_RECEIVE ,
+            STAT_MSG3_NEW ,     STAT_MSG3_RECEIVE ,
+            STAT_MSG4_NEW ,     STAT_MSG4_RECEIVE ,
+            STAT_MSG5_NEW ,     STAT_MSG5_RECEIVE ,
+            STAT_PIPE_READ ,    STAT_PIPE_WRITE ,
+            STAT_PROBES
+        }  statProbe_t ;
+
+#define STAT_BUCKETS   40    // bucket b holds samples of [ 2^(b-1) , 2^b ) ticks
+
+#ifdef MYCRYPTO_STATS
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t stats_now( void )  { return __rdtsc() ; }
+#else
+static inline uint64_t stats_now( void )
+{
+    struct timespec ts ;
+    clock_gettime( CLOCK_MONOTONIC , &ts ) ;
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec ;
+}
+#endif
+
+void     stats_record( statProbe_t probe , uint64_t ticks ) ;
+
+#define  STAT_BEGIN( t )            uint64_t t = stats_now()
+#define  STAT_END( probe , t )      stats_record( probe , stats_now() - ( t ) )
+
+// Truncate 'path' and append a dump of all threads' histograms to it at 
+// exit and on every SIGUSR1. The handler restarts interrupted reads and writes
+void     stats_install( const char *path ) ;
+
+// Write the histograms, summed over all threads, to 'fd'. Async-signal-safe
+void     stats_dump( int fd ) ;
+
+// read() and write() on a protocol pipe, timed
+ssize_t  statRead ( int fd , void *buf , size_t n ) ;
+ssize_t  statWrite( int fd , const void *buf , size_t n ) ;
+
+#else
+
+#define  STAT_BEGIN( t )
+#define  STAT_END( probe , t )
+#define  stats_install( path )       ( (void) 0 )
+#define  stats_dump( fd )            ( (void) 0 )
+#define  statRead( fd , buf , n )    read( fd , buf , n )
+#define  statWrite( fd , buf , n )   write( fd , buf , n )
+
+#endif
+
+//***********************************************************************
+// Asynchronous Logs
+//***********************************************************************
+
+// logOpen() is fopen( path , "w" ) for a log whose output is written by a
+// background thread. fprintf() and fflush() on it only copy the text into a
+// lock-free ring, and logDump() queues the raw bytes so that even the hex
+// formatting happens off the caller's thread; the writer batches everything
+// into large write()s. fclose() drains the ring first, and so does exit()
+// The file ends up byte-for-byte what the synchronous calls would produce
+#define LOG_RING_BYTES    ( 1 << 20 )    // per log; a power of two
+#define LOG_INLINE_MAX    ( 64 * 1024 )  // bigger records are queued by pointer
+#define LOG_ASYNC_MAX     8              // logs open at the same time
+
+FILE  *logOpen( const char *path ) ;
+
+// Drop-in for BIO_dump_indent_fp(): deferred on a logOpen() stream,
+// immediate on any other FILE
+int    logDump( FILE *fp , const void *s , int len , int indent ) ;
+
+// With LOG_BINARY_TRACE=1 in the environment logOpen( path ) writes a binary trace
+// to path.trace instead, with no formatting at all in the process:
+// "MYTR" , version ( 4 bytes ) , CLOCK_MONOTONIC at open ( 8 bytes ) , then
+// per fprintf()/fflush() chunk or logDump(): type ( 1 = text , 2 = hex dump ,
+// 3 = the n-th short text seen before ) , 0 , indent ( 2 bytes ) , length 
+// ( 4 bytes ) , time ( 8 bytes ) , then the raw bytes ( n for type 3 )
+// Integers are in network byte order
+// ( not "LOG_TRACE": that is the lowest log level, see LOG_LEVEL_ENV below )
+#define LOG_BINARY_TRACE_ENV  "LOG_BINARY_TRACE"
+#define TRACE_SUFFIX          ".trace"
+#define TRACE_MAGIC           "MYTR"
+#define TRACE_VERSION         1
+#define TRACE_HEADER_LEN      16
+#define TRACE_RECORD_LEN      16
+#define TRACE_PAYLOAD_MAX     ( 1u << 30 )
+#define TRACE_DICT_TEXT_MAX   1024      // longer text is always written out
+#define TRACE_DICT_ENTRIES    4096      // a power of two
+
+// Whether LOG_BINARY_TRACE asks for binary traces
+int    logTracing( void ) ;
+
+// Write the text log a trace stands for, byte-for-byte what logOpen() would
+// have written without LOG_BINARY_TRACE. 'timestamps' prefixes every record
+// with its time since the log was opened. Returns the number of records, or
+// -1 if the trace is malformed or truncated
+long   traceRender( FILE *in , FILE *out , int timestamps ) ;
+
+//***********************************************************************
+// Hex Dumps:  BIO_dump_indent_fp() output without BIO
+//***********************************************************************
+
+// The same "%*s%04x - " offset , hex bytes with a '-' after the eighth , and
+// printable-ASCII layout as OpenSSL's BIO_dump_indent_fp(), byte for byte
+// ( indent is clamped to 0 .. 64 and narrows the rows beyond 6 , as there ).
+// Full 16-byte rows are formatted with SSSE3 , two at a time with AVX2 ,
+// when the CPU has them
+
+// Exact length of the dump of 'len' bytes
+size_t  hexDumpLen( int len , int indent ) ;
+
+// Format into 'out' , which must hold hexDumpLen( len , indent ) bytes
+// ( no NUL is added ). Returns the number of bytes written
+size_t  hexDump( char *out , const void *s , int len , int indent ) ;
+
+// Drop-in for BIO_dump_indent_fp(): returns the bytes written, or -1
+int     hexDump_fp( FILE *fp , const void *s , int len , int indent ) ;
+
+//***********************************************************************
+// Log Levels:  build with -DLOG_LEVEL=LOG_DEBUG , LOG_INFO or LOG_OFF
+//***********************************************************************
+
+// Each line the MSG functions and the three parties log has a level:
+//   LOG_TRACE   the raw bytes of every message , as built or as received
+//   LOG_DEBUG   keys , nonces and the decoded fields of each message
+//   LOG_INFO    banners and one line per protocol step
+// Errors are always logged. Levels below LOG_LEVEL compile to nothing ,
+// arguments included; those left are checked against a runtime threshold.
+// The default build with the default threshold logs everything
+#define LOG_TRACE    0
+#define LOG_DEBUG    1
+#define LOG_INFO     2
+#define LOG_OFF      3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL    LOG_TRACE
+#endif
+
+#define LOG_LEVEL_ENV   "LOG_LEVEL"
+
+extern int  logThreshold ;      // use setLogLevel()
+
+#define LOG_ON( lvl )            ( (lvl) >= LOG_LEVEL && (lvl) >= logThreshold )
+#define LOGF( lvl , fp , ... )   do { if ( LOG_ON( lvl ) ) fprintf( fp , __VA_ARGS__ ) ; } while ( 0 )
+#define LOG_FLUSH( fp )          do { if ( LOG_ON( LOG_INFO ) ) fflush( fp ) ; } while ( 0 )
+
+void  setLogLevel( int level ) ;
+int   getLogLevel( void ) ;
+void  setLogLevelFromEnv( void ) ;   // LOG_LEVEL=trace , debug , info or off
+
+//***********************************************************************
+// Principal Key Database:  ID string -> master key , memory-mapped
+//***********************************************************************
+
+// One file holds every principal's myKey_t, found by ID in constant time.
+// It is never parsed. keyDB_open() maps it read-only, so a cold start costs
+// one mmap() whatever the size, and each lookup touches one 8-byte slot and
+// then the record it points to:
+// "MYKD" , version ( 4 bytes ) , slots ( 8 ) , principals ( 8 ) ,
+// record bytes ( 8 ) , then the slots and the records. A slot is 
+// hash tag ( 4 bytes , 0 when empty ) , record offset / 8 ( 4 ). It sits in
+// an open-addressing table of a power-of-two size, at most half full, with
+// linear probing. A record is myKey_t , L( ID ) ( 4 bytes ) , ID with its
+// NUL , padded to 8 bytes
+// Integers are in network byte order
+#define KEYDB_MAGIC          "MYKD"
+#define KEYDB_VERSION        1
+#define KEYDB_HEADER_LEN     32
+#define KEYDB_SLOT_LEN       8
+#define KEYDB_RECORD_FIXED   ( KEYSIZE + 4 )
+#define KEYDB_PATH           "kdc/principals.db"
+
+typedef struct {
+            const uint8_t  *map ;
+            size_t          mapLen ;
+            const uint8_t  *slots , *records ;
+            uint64_t        mask ,          // slots - 1
+                            count ,         // principals
+                            recordsLen ;
+        }  myKeyDB_t ;
+
+// Write the 'n' principals ids[ i ] -> keys[ i ] to a new database at 'path'
+// It is built beside it and renamed into place, so anyone with the old one
+// open keeps a consistent view. Returns 0, or -1 with errno set
+// ( EEXIST for an ID given twice )
+int             keyDB_write ( const char *path , const char *const *ids , const myKey_t *keys , size_t n ) ;
+
+// Map the database at 'path'. Returns NULL if it is missing or malformed
+myKeyDB_t      *keyDB_open  ( const char *path ) ;
+void            keyDB_close ( myKeyDB_t *db ) ;
+
+// The key of principal 'id' , pointing into the mapping , or NULL
+const myKey_t  *keyDB_lookup( const myKeyDB_t *db , const char *id ) ;
+
+//***********************************************************************
+// Key Store:  versioned key-database snapshots , swapped in the RCU style
+//***********************************************************************
+
+#include <pthread.h>
+
+// The database a long-running KDC serves from, reloadable while it runs.
+// Readers never lock: keyStore_enter() publishes the epoch the reader is
+// in and returns the current snapshot, which stays mapped until that reader
+// calls keyStore_exit(). keyStore_reload() maps the file again ( and, when
+// there is more than one CPU, faults all of it in on the calling thread ),
+// swaps the new snapshot in with one atomic store and waits for every reader
+// that may still hold the old one ( the grace period ) before unmapping it.
+// Lookups that start after the swap see the new keys. A handshake that began
+// on the old snapshot finishes on it
+#define KEYSTORE_READERS   64              // threads that may call keyStore_enter()
+
+typedef struct {
+            myKeyDB_t  *db ;
+            uint64_t    version ;          // 1 for the first map , +1 per reload
+        }  myKeySnap_t ;
+
+typedef struct {
+            myKeySnap_t      *current ;
+            uint64_t          epoch ;
+            unsigned          nReaders ;
+            pthread_mutex_t   reloading ;      // one writer at a time; readers never take it
+            char             *path ;
+            struct { uint64_t epoch ; uint8_t pad[ 56 ] ; }  readers[ KEYSTORE_READERS ] ;
+        }  myKeyStore_t ;
+
+// Map the database at 'path' as version 1. NULL if it is missing or malformed
+myKeyStore_t       *keyStore_open   ( const char *path ) ;
+void                keyStore_close  ( myKeyStore_t *ks ) ;     // once no reader is left
+
+// A reader slot for the calling thread , passed to enter / exit
+int                 keyStore_reader ( myKeyStore_t *ks ) ;
+
+// The current snapshot , valid until keyStore_exit() from the same reader.
+// Read-side sections do not nest
+const myKeySnap_t  *keyStore_enter  ( myKeyStore_t *ks , int reader ) ;
+void                keyStore_exit   ( myKeyStore_t *ks , int reader ) ;
+
+// Map the file again and publish it. Returns the new version, or 0 leaving
+// the current snapshot in place when the file is missing or malformed.
+// Blocks only the caller, for one grace period
+uint64_t            keyStore_reload ( myKeyStore_t *ks ) ;
+
+//***********************************************************************
+// KDC Server:  "kdc -s <socket>" , many Amals over one epoll loop
+//***********************************************************************
+
+// A long-running KDC on a Unix-domain stream socket. Each connection may
+// send any number of MSG1s ( the same bytes as on the pipe ) and gets back
+// L( MSG2 ) || MSG2 for each, in order, exactly as the single-shot KDC
+// writes it. Sockets are non-blocking: MSG1s are parsed from per-connection
+// buffers as bytes arrive, the ones that are complete after each epoll_wait()
+// are answered with one MSG2_newBatch(), and a fresh random Ks is drawn for
+// every handshake. Ka and Kb are looked up by IDa and IDb in the current
+// snapshot of a key store, which may be reloaded from another thread while
+// the KDC serves; a MSG1 naming a principal it does not hold is treated as
+// malformed
+#define KDC_SOCKET_PATH   "kdc/kdc.sock"
+#define KDC_ID_MAX        256                // longest IDa / IDb , NUL included
+#define KDC_MSG1_MAX      ( 2 * LENSIZE + 2 * KDC_ID_MAX + NONCELEN )
+#define KDC_IN_BUF        4096               // bytes read per connection per wakeup
+#define KDC_OUT_MAX       ( 256 * 1024 )     // stop reading a client this far behind
+#define KDC_EVENTS        64                 // epoll events per wakeup
+#define KDC_BATCH_MAX     64                 // MSG1s per MSG2_newBatch()
+
+// Bind and listen on 'path' ( replacing a stale socket file ). Returns the
+// non-blocking listening socket, or -1 with errno set
+int       kdcListen( const char *path ) ;
+
+// Connect a client to the KDC at 'path'; a blocking socket, or -1
+int       kdcConnect( const char *path ) ;
+
+// Serve 'listenFd' until kdcStop() or, when 'maxHandshakes' > 0, until at
+// least that many MSG2s are sent. Connections, malformed MSG1s and each new
+// key-database version are logged at LOG_DEBUG , errors always; 'log' may
+// be NULL. Returns the MSG2s sent
+uint64_t  kdcServe( int listenFd , FILE *log , myKeyStore_t *keys , uint64_t maxHandshakes ) ;
+
+// Make kdcServe() return after its current wakeup. Async-signal-safe:
+// SIGINT and SIGTERM are only delivered while kdcServe() waits in epoll,
+// so a server that calls it from their handler should block them before
+// starting any thread, or another thread may take them
+void      kdcStop( void ) ;
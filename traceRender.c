@@ -0,0 +1,58 @@
+/*-------------------------------------------------------------------------------
+
+FILE:   traceRender.c
+
+Turn a binary trace written by logOpen() under LOG_BINARY_TRACE=1 back into the 
+text log, e.g.
+    ./traceRender amal/logAmal.txt.trace amal/logAmal.txt
+    ./traceRender -t kdc/logKDC.txt.trace          ( with timestamps , to stdout )
+-------------------------------------------------------------------------------*/
+
+#include "myCrypto.h"
+
+//--------------------------------------------------------------------------
+int main( int argc , char *argv[] )
+{
+    int  timestamps = 0 , arg = 1 ;
+
+    if ( argc > 1 && strcmp( argv[1] , "-t" ) == 0 )
+    {
+        timestamps = 1 ;
+        arg++ ;
+    }
+
+    if ( argc - arg < 1 || argc - arg > 2 )
+    {
+        fprintf( stderr , "Usage: %s [ -t ] <trace> [ <text log> ]\n" , argv[0] ) ;
+        exit(-1) ;
+    }
+
+    FILE *in = fopen( argv[ arg ] , "r" ) ;
+    if ( in == NULL )
+    {
+        perror( argv[ arg ] ) ;
+        exit(-1) ;
+    }
+
+    FILE *out = argc - arg == 2 ? fopen( argv[ arg + 1 ] , "w" ) : stdout ;
+    if ( out == NULL )
+    {
+        perror( argv[ arg + 1 ] ) ;
+        exit(-1) ;
+    }
+
+    long n = traceRender( in , out , timestamps ) ;
+    if ( n < 0 )
+    {
+        fprintf( stderr , "%s: malformed or truncated trace\n" , argv[ arg ] ) ;
+        exit(-1) ;
+    }
+
+    fclose( in ) ;
+    if ( fclose( out ) != 0 )
+    {
+        perror( "traceRender" ) ;
+        exit(-1) ;
+    }
+    return 0 ;
+}